@@ -28,6 +28,7 @@
 #include <stdlib.h>
 #include <compiler.h>
 #include <kernel/thread.h>
+#include <kernel/debug.h>
 #include <lib/minip.h>
 #include <lib/tftp.h>
 #include <lib/cksum.h>
@@ -215,6 +216,44 @@ static int echo_server(void *arg)
     }
 }
 
+#if WITH_KERNEL_EVLOG
+/* hand the binary kernel event log to anyone who connects, see tools/kevlog2json.py */
+#define KEVLOG_PORT 5555
+
+static ssize_t kevlog_write(void *socket, const void *buf, size_t len)
+{
+    return tcp_write(socket, buf, len);
+}
+
+static int kevlog_server(void *arg)
+{
+    status_t err;
+    tcp_socket_t *listen_socket;
+
+    err = tcp_open_listen(&listen_socket, KEVLOG_PORT);
+    if (err < 0) {
+        TRACEF("error opening kevlog listen socket\n");
+        return -1;
+    }
+
+    for (;;) {
+        tcp_socket_t *accept_socket;
+
+        err = tcp_accept(listen_socket, &accept_socket);
+        if (err < 0) {
+            TRACEF("error accepting socket, retrying\n");
+            continue;
+        }
+
+        /* exports are short, serve them one at a time */
+        err = kernel_evlog_export(&kevlog_write, accept_socket);
+        if (err < 0)
+            TRACEF("error %d exporting event log\n", err);
+        tcp_close(accept_socket);
+    }
+}
+#endif
+
 static void inetsrv_init(const struct app_descriptor *app)
 {
 }
@@ -228,6 +267,9 @@ static void inetsrv_entry(const struct app_descriptor *app, void *args)
     thread_detach_and_resume(thread_create("chargen", &chargen_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
     thread_detach_and_resume(thread_create("discard", &discard_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
     thread_detach_and_resume(thread_create("echo", &echo_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+#if WITH_KERNEL_EVLOG
+    thread_detach_and_resume(thread_create("kevlog", &kevlog_server, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+#endif
     tftp_server_init(NULL);
 }
 
@@ -21,6 +21,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <sys/types.h>
+#include <assert.h>
 #include <stdio.h>
 #include <rand.h>
 #include <err.h>
@@ -31,6 +32,7 @@
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/timer.h>
 #include <platform.h>
 
 const size_t BUFSIZE = (1024*1024);
@@ -153,6 +155,150 @@ __NO_INLINE static void bench_memcpy(void)
     free(buf);
 }
 
+/* sizes and (src, dst) misalignments swept by the string routine benchmarks */
+static const size_t bench_string_sizes[] = { 8, 16, 32, 64, 128, 256, 512, 1024, 4096, 16384, 65536 };
+static const uint bench_string_aligns[][2] = { { 0, 0 }, { 1, 0 }, { 0, 3 }, { 5, 11 } };
+#define BENCH_STRING_MAX 65536
+#define BENCH_STRING_BYTES (4*1024*1024)
+
+static volatile int bench_string_sink;
+
+/* run op(dst, src, len) over each size and alignment, roughly the same number of bytes each time */
+#define bench_string_sweep(name, op) \
+__NO_INLINE static void bench_##name##_sweep(void) \
+{ \
+    uint8_t *buf = malloc(BENCH_STRING_MAX * 2 + 64); \
+    if (!buf) { \
+        printf("failed to allocate buffer\n"); \
+        return; \
+    } \
+    memset(buf, 0x55, BENCH_STRING_MAX * 2 + 64); \
+ \
+    for (uint s = 0; s < countof(bench_string_sizes); s++) { \
+        size_t len = bench_string_sizes[s]; \
+        uint iter = MAX(16U, BENCH_STRING_BYTES / len); \
+ \
+        for (uint a = 0; a < countof(bench_string_aligns); a++) { \
+            __UNUSED uint8_t *src = buf + bench_string_aligns[a][0]; \
+            __UNUSED uint8_t *dst = buf + BENCH_STRING_MAX + 32 + bench_string_aligns[a][1]; \
+            int sink = 0; \
+ \
+            uint count = arch_cycle_count(); \
+            for (uint i = 0; i < iter; i++) { \
+                sink += (int)(uintptr_t)op; \
+            } \
+            count = arch_cycle_count() - count; \
+            bench_string_sink = sink; \
+ \
+            printf(#name " %6zu bytes, src +%u dst +%u: %f cycles/call, %f bytes/cycle\n", \
+                   len, bench_string_aligns[a][0], bench_string_aligns[a][1], \
+                   count / (float)iter, (len * (float)iter) / count); \
+        } \
+    } \
+ \
+    free(buf); \
+}
+
+bench_string_sweep(memcpy, memcpy(dst, src, len))
+/* overlapping by a few bytes, so memmove has to copy backwards */
+bench_string_sweep(memmove, memmove(src + 8, src, len))
+bench_string_sweep(memcmp, memcmp(dst, src, len))
+
+__NO_INLINE static void bench_mutex(void)
+{
+    mutex_t m;
+    mutex_init(&m);
+
+    const uint iter = 100000;
+
+    uint count = arch_cycle_count();
+    for (uint i = 0; i < iter; i++) {
+        mutex_acquire(&m);
+        mutex_release(&m);
+    }
+    count = arch_cycle_count() - count;
+
+    printf("took %u cycles to acquire and release an uncontended mutex %u times, %f cycles/iteration\n",
+           count, iter, count / (float)iter);
+
+    mutex_destroy(&m);
+}
+
+static enum handler_return bench_timer_callback(struct timer *t, lk_time_t now, void *arg)
+{
+    return INT_NO_RESCHEDULE;
+}
+
+__NO_INLINE static void bench_timers(void)
+{
+    const uint count = 10000;
+
+    timer_t *timers = malloc(sizeof(timer_t) * count);
+    if (!timers) {
+        printf("failed to allocate timers\n");
+        return;
+    }
+
+    for (uint i = 0; i < count; i++)
+        timer_initialize(&timers[i]);
+
+    /* spread the deadlines out so they land at every level of the timer queue */
+    uint cycles = arch_cycle_count();
+    for (uint i = 0; i < count; i++)
+        timer_set_oneshot(&timers[i], 1000 + i * 37, bench_timer_callback, NULL);
+    cycles = arch_cycle_count() - cycles;
+
+    printf("took %u cycles to arm %u timers, %f cycles/timer\n",
+           cycles, count, cycles / (float)count);
+
+    cycles = arch_cycle_count();
+    for (uint i = 0; i < count; i++)
+        timer_cancel(&timers[i]);
+    cycles = arch_cycle_count() - cycles;
+
+    printf("took %u cycles to cancel %u timers, %f cycles/timer\n",
+           cycles, count, cycles / (float)count);
+
+    free(timers);
+}
+
+#define HEAP_BENCH_SLOTS 16
+
+/* churn small allocations the way pktbufs, port buffers and the fs layer do */
+static int bench_heap_thread(void *arg)
+{
+    struct scaling_thread *t = arg;
+    uint32_t seed = t->index + 1;
+    uint8_t *ptr[HEAP_BENCH_SLOTS] = { 0 };
+
+    while (!*t->done) {
+        seed = seed * 1664525 + 1013904223;
+        uint index = (seed >> 8) % HEAP_BENCH_SLOTS;
+
+        if (ptr[index]) {
+            /* make sure nobody else scribbled on our block while we held it */
+            ASSERT(ptr[index][0] == (uint8_t)index);
+            free(ptr[index]);
+            t->count++;
+        }
+        ptr[index] = malloc(8 + (seed >> 16) % 248);
+        ASSERT(ptr[index]);
+        ptr[index][0] = index;
+        t->count++;
+    }
+
+    for (uint i = 0; i < HEAP_BENCH_SLOTS; i++)
+        free(ptr[i]);
+
+    return 0;
+}
+
+/* run the small allocation churn on 1..N cpus at once and report the total rate */
+__NO_INLINE static void bench_heap_scaling(void)
+{
+    scaling_bench("heap", "allocs+frees", 1, &bench_heap_thread);
+}
+
 #if ARCH_ARM
 __NO_INLINE static void arm_bench_cset_stm(void)
 {
@@ -253,12 +399,20 @@ void benchmarks(void)
     bench_memset();
     bench_memcpy();
 
+    bench_memcpy_sweep();
+    bench_memmove_sweep();
+    bench_memcmp_sweep();
+
     bench_cset_uint8_t();
     bench_cset_uint16_t();
     bench_cset_uint32_t();
     bench_cset_uint64_t();
     bench_cset_wide();
 
+    bench_mutex();
+    bench_timers();
+    bench_heap_scaling();
+
 #if ARCH_ARM
     arm_bench_cset_stm();
 
@@ -6,25 +6,155 @@
 #include <lib/heap.h>
 #include <rand.h>
 #include <stdlib.h>
-
-#define ASSERT_EQ(a, b)                                            \
-    do {                                                           \
-        int _a = (a);                                              \
-        int _b = (b);                                              \
-        if (_a != _b) {                                            \
-            panic("%d != %d (%s:%d)\n", a, b, __FILE__, __LINE__); \
-        }                                                          \
+#include <string.h>
+#include <platform.h>
+#include <kernel/thread.h>
+
+#define ASSERT_EQ(a, b)                                              \
+    do {                                                             \
+        int _a = (a);                                                \
+        int _b = (b);                                                \
+        if (_a != _b) {                                              \
+            panic("%d != %d (%s:%d)\n", _a, _b, __FILE__, __LINE__); \
+        }                                                            \
     } while (0);
 
-#define ASSERT_LEQ(a, b)                                               \
-    do {                                                               \
-        int _a = (a);                                                  \
-        int _b = (b);                                                  \
-        if (_a > _b) {                                                 \
-            panic("%d not <= %d (%s:%d)\n", a, b, __FILE__, __LINE__); \
-        }                                                              \
+#define ASSERT_LEQ(a, b)                                                 \
+    do {                                                                 \
+        int _a = (a);                                                    \
+        int _b = (b);                                                    \
+        if (_a > _b) {                                                   \
+            panic("%d not <= %d (%s:%d)\n", _a, _b, __FILE__, __LINE__); \
+        }                                                                \
     } while (0);
 
+static void cbuf_reservation_tests(bool spsc)
+{
+    cbuf_t cbuf;
+    iovec_t regions[2];
+
+    printf("running %s reservation tests...\n", spsc ? "spsc" : "locked");
+
+    if (spsc)
+        cbuf_initialize_spsc(&cbuf, 16, NULL);
+    else
+        cbuf_initialize(&cbuf, 16);
+
+    // move the indices near the end so the regions wrap
+    ASSERT_EQ(12, cbuf_write(&cbuf, "xxxxxxxxxxxx", 12, false));
+    ASSERT_EQ(12, cbuf_consume(&cbuf, 12));
+
+    ASSERT_EQ(15, cbuf_reserve(&cbuf, regions));
+    ASSERT_EQ(4, regions[0].iov_len);
+    ASSERT_EQ(11, regions[1].iov_len);
+    memcpy(regions[0].iov_base, "abcd", 4);
+    memcpy(regions[1].iov_base, "ef", 2);
+    ASSERT_EQ(6, cbuf_commit(&cbuf, 6, false));
+    ASSERT_EQ(9, cbuf_space_avail(&cbuf));
+
+    ASSERT_EQ(6, cbuf_peek(&cbuf, regions));
+    ASSERT_EQ(4, regions[0].iov_len);
+    ASSERT_EQ(2, regions[1].iov_len);
+    ASSERT_EQ(0, memcmp(regions[0].iov_base, "abcd", 4));
+    ASSERT_EQ(0, memcmp(regions[1].iov_base, "ef", 2));
+
+    // consume part of it in place, read the rest
+    ASSERT_EQ(3, cbuf_consume(&cbuf, 3));
+    char buf[8];
+    ASSERT_EQ(3, cbuf_read(&cbuf, buf, sizeof(buf), false));
+    ASSERT_EQ(0, memcmp(buf, "def", 3));
+    ASSERT_EQ(0, cbuf_peek(&cbuf, regions));
+
+    free(cbuf.buf);
+}
+
+#define THROUGHPUT_BYTES (16 * 1024 * 1024)
+
+/* the byte at each offset of the stream, differing between neighbouring 256 byte runs
+ * so lost, repeated or reordered data shows up */
+static inline uint8_t throughput_byte(size_t offset)
+{
+    return offset + (offset >> 8) + (offset >> 16);
+}
+
+static void throughput_check(const void *data, size_t len, size_t offset)
+{
+    const uint8_t *p = data;
+
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] != throughput_byte(offset + i)) {
+            panic("cbuf stream byte %zu is 0x%x, expected 0x%x\n",
+                  offset + i, p[i], throughput_byte(offset + i));
+        }
+    }
+}
+
+static int cbuf_throughput_writer(void *arg)
+{
+    cbuf_t *cbuf = arg;
+    static uint8_t buf[512];
+    size_t sent = 0;
+
+    while (sent < THROUGHPUT_BYTES) {
+        size_t len = MIN(sizeof(buf), THROUGHPUT_BYTES - sent);
+        for (size_t i = 0; i < len; i++)
+            buf[i] = throughput_byte(sent + i);
+
+        len = cbuf_write(cbuf, buf, len, false);
+        if (len == 0)
+            thread_yield();
+        sent += len;
+    }
+
+    return 0;
+}
+
+static void cbuf_throughput_test(bool spsc, bool zero_copy)
+{
+    cbuf_t cbuf;
+    static char buf[512];
+
+    if (spsc)
+        cbuf_initialize_spsc(&cbuf, 4096, NULL);
+    else
+        cbuf_initialize(&cbuf, 4096);
+
+    thread_t *t = thread_create("cbuf writer", &cbuf_throughput_writer, &cbuf, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+
+    lk_bigtime_t time = current_time_hires();
+    thread_resume(t);
+
+    size_t received = 0;
+    while (received < THROUGHPUT_BYTES) {
+        if (zero_copy) {
+            iovec_t regions[2];
+            size_t len = cbuf_peek(&cbuf, regions);
+            if (len == 0) {
+                cbuf_read(&cbuf, buf, 1, true);
+                throughput_check(buf, 1, received);
+                received++;
+                continue;
+            }
+            throughput_check(regions[0].iov_base, regions[0].iov_len, received);
+            throughput_check(regions[1].iov_base, regions[1].iov_len, received + regions[0].iov_len);
+            received += cbuf_consume(&cbuf, len);
+        } else {
+            size_t len = cbuf_read(&cbuf, buf, sizeof(buf), true);
+            throughput_check(buf, len, received);
+            received += len;
+        }
+    }
+
+    time = current_time_hires() - time;
+    thread_join(t, NULL, INFINITE_TIME);
+
+    printf("%s %s: %u bytes in %llu usecs (%llu bytes/sec)\n",
+           spsc ? "spsc  " : "locked", zero_copy ? "peek/consume" : "read        ",
+           THROUGHPUT_BYTES, time, time ? (uint64_t)THROUGHPUT_BYTES * 1000000 / time : 0);
+
+    free(cbuf.buf);
+}
+
 int cbuf_tests(int argc, const cmd_args *argv)
 {
     cbuf_t cbuf;
@@ -110,6 +240,15 @@ int cbuf_tests(int argc, const cmd_args *argv)
 
     free(cbuf.buf);
 
+    cbuf_reservation_tests(false);
+    cbuf_reservation_tests(true);
+
+    printf("running throughput tests...\n");
+    cbuf_throughput_test(false, false);
+    cbuf_throughput_test(false, true);
+    cbuf_throughput_test(true, false);
+    cbuf_throughput_test(true, true);
+
     printf("cbuf tests passed\n");
 
     return NO_ERROR;
@@ -23,6 +23,8 @@
 #ifndef __APP_TESTS_H
 #define __APP_TESTS_H
 
+#include <arch/ops.h>
+#include <kernel/thread.h>
 #include <lib/console.h>
 
 int cbuf_tests(int argc, const cmd_args *argv);
@@ -35,5 +37,18 @@ void clock_tests(void);
 void printf_tests(void);
 void printf_tests_float(void);
 
+/* per thread state of a scaling_bench run */
+struct scaling_thread {
+    uint index;
+    volatile bool *done;
+    ulong count;
+} __CPU_ALIGN;
+
+/* Run body on 1..N of the active cpus at once, threads_per_cpu threads pinned
+ * to each, and report the total rate. body is passed its struct scaling_thread,
+ * adds each operation to count and returns once *done is set a second later.
+ */
+void scaling_bench(const char *name, const char *what, uint threads_per_cpu, thread_start_routine body);
+
 #endif
 
@@ -13,6 +13,7 @@ MODULE_SRCS += \
     $(LOCAL_DIR)/float_test_vec.c \
     $(LOCAL_DIR)/mem_tests.c \
     $(LOCAL_DIR)/printf_tests.c \
+    $(LOCAL_DIR)/scaling.c \
     $(LOCAL_DIR)/tests.c \
     $(LOCAL_DIR)/thread_tests.c \
     $(LOCAL_DIR)/port_tests.c \
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <debug.h>
+#include <stdio.h>
+#include <app/tests.h>
+#include <kernel/thread.h>
+#include <kernel/mp.h>
+#include <platform.h>
+
+#define SCALING_MAX_THREADS_PER_CPU 2
+
+static volatile bool scaling_done;
+static struct scaling_thread scaling_threads[SMP_MAX_CPUS * SCALING_MAX_THREADS_PER_CPU];
+
+void scaling_bench(const char *name, const char *what, uint threads_per_cpu, thread_start_routine body)
+{
+    DEBUG_ASSERT(threads_per_cpu > 0 && threads_per_cpu <= SCALING_MAX_THREADS_PER_CPU);
+
+    uint cpus[SMP_MAX_CPUS];
+    uint cpu_count = 0;
+    thread_t *threads[SMP_MAX_CPUS * SCALING_MAX_THREADS_PER_CPU];
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (mp_is_cpu_active(i))
+            cpus[cpu_count++] = i;
+    }
+
+    printf("testing %s scaling across %u cpus:", name, cpu_count);
+    for (uint i = 0; i < cpu_count; i++)
+        printf(" %u", cpus[i]);
+    printf("\n");
+
+    for (uint n = 1; n <= cpu_count; n++) {
+        uint thread_count = n * threads_per_cpu;
+
+        scaling_done = false;
+
+        for (uint i = 0; i < thread_count; i++) {
+            scaling_threads[i].index = i;
+            scaling_threads[i].done = &scaling_done;
+            scaling_threads[i].count = 0;
+            threads[i] = thread_create(name, body, &scaling_threads[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+            thread_set_pinned_cpu(threads[i], cpus[i / threads_per_cpu]);
+        }
+
+        lk_bigtime_t t = current_time_hires();
+        for (uint i = 0; i < thread_count; i++)
+            thread_resume(threads[i]);
+
+        thread_sleep(1000);
+        scaling_done = true;
+        t = current_time_hires() - t;
+
+        ulong total = 0;
+        for (uint i = 0; i < thread_count; i++) {
+            thread_join(threads[i], NULL, INFINITE_TIME);
+            total += scaling_threads[i].count;
+        }
+
+        printf("%u cpus: %lu %s in %llu usecs, %llu per second\n",
+               n, total, what, t, (uint64_t)total * 1000000 / t);
+    }
+}
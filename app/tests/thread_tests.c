@@ -399,6 +399,48 @@ void context_switch_test(void)
     thread_sleep(100);
 }
 
+static int sched_scaling_tester(void *arg)
+{
+    struct scaling_thread *t = arg;
+
+    while (!*t->done) {
+        thread_yield();
+        t->count++;
+    }
+
+    return 0;
+}
+
+/* run a pair of threads yielding to each other on each of 1..N cpus and report
+ * the total context switch rate, which should scale with the number of cpus */
+static void sched_scaling_test(void)
+{
+    scaling_bench("scheduler", "context switches", 2, &sched_scaling_tester);
+}
+
+static int mutex_scaling_tester(void *arg)
+{
+    struct scaling_thread *t = arg;
+    mutex_t m;
+
+    mutex_init(&m);
+    while (!*t->done) {
+        mutex_acquire(&m);
+        t->count++;
+        mutex_release(&m);
+    }
+    mutex_destroy(&m);
+
+    return 0;
+}
+
+/* hammer one independent mutex per cpu from 1..N cpus and report the total
+ * acquire rate, which should scale since unrelated mutexes share no locks */
+static void mutex_scaling_test(void)
+{
+    scaling_bench("mutex", "mutex acquires", 1, &mutex_scaling_tester);
+}
+
 static volatile int atomic;
 static volatile int atomic_count;
 
@@ -627,6 +669,8 @@ int thread_tests(void)
 
     thread_sleep(200);
     context_switch_test();
+    sched_scaling_test();
+    mutex_scaling_test();
 
     preempt_test();
 
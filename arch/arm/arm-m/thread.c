@@ -120,8 +120,8 @@ static void initial_thread_func(void)
     dump_thread(_current_thread);
 #endif
 
-    /* release the thread lock that was implicitly held across the reschedule */
-    spin_unlock(&thread_lock);
+    /* release the run queue lock that was implicitly held across the reschedule */
+    thread_context_switch_finish();
     arch_enable_ints();
 
     ret = _current_thread->entry(_current_thread->arg);
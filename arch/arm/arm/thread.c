@@ -50,8 +50,8 @@ static void initial_thread_func(void)
 //  dprintf("initial_thread_func: thread %p calling %p with arg %p\n", current_thread, current_thread->entry, current_thread->arg);
 //  dump_thread(current_thread);
 
-    /* release the thread lock that was implicitly held across the reschedule */
-    spin_unlock(&thread_lock);
+    /* release the run queue lock that was implicitly held across the reschedule */
+    thread_context_switch_finish();
     arch_enable_ints();
 
     thread_t *ct = get_current_thread();
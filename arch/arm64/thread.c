@@ -60,8 +60,8 @@ static void initial_thread_func(void)
 
     LTRACEF("initial_thread_func: thread %p calling %p with arg %p\n", current_thread, current_thread->entry, current_thread->arg);
 
-    /* release the thread lock that was implicitly held across the reschedule */
-    spin_unlock(&thread_lock);
+    /* release the run queue lock that was implicitly held across the reschedule */
+    thread_context_switch_finish();
     arch_enable_ints();
 
     ret = current_thread->entry(current_thread->arg);
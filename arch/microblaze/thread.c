@@ -42,8 +42,8 @@ static void initial_thread_func(void)
     dump_thread(ct);
 #endif
 
-    /* release the thread lock that was implicitly held across the reschedule */
-    spin_unlock(&thread_lock);
+    /* release the run queue lock that was implicitly held across the reschedule */
+    thread_context_switch_finish();
     arch_enable_ints();
 
     int ret = ct->entry(ct->arg);
@@ -28,5 +28,6 @@
 
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) __NONNULL();
 
+/* synchronous transfer, returns the number of bytes transferred or an error */
 ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write) __NONNULL();
 
@@ -26,11 +26,13 @@
 #include <assert.h>
 #include <trace.h>
 #include <compiler.h>
-#include <list.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <err.h>
+#include <arch/ops.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
-#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
 #include <lib/bio.h>
 
@@ -46,6 +48,15 @@ struct virtio_blk_config {
         uint8_t sectors;
     } geometry;
     uint32_t blk_size;
+    struct virtio_blk_topology {
+        uint8_t physical_block_exp;
+        uint8_t alignment_offset;
+        uint16_t min_io_size;
+        uint32_t opt_io_size;
+    } topology;
+    uint8_t writeback;
+    uint8_t unused0;
+    uint16_t num_queues;
 } __PACKED;
 
 struct virtio_blk_req {
@@ -64,6 +75,7 @@ struct virtio_blk_req {
 #define VIRTIO_BLK_F_FLUSH    (1<<9)
 #define VIRTIO_BLK_F_TOPOLOGY (1<<10)
 #define VIRTIO_BLK_F_CONFIG_WCE (1<<11)
+#define VIRTIO_BLK_F_MQ       (1<<12)
 
 #define VIRTIO_BLK_T_IN         0
 #define VIRTIO_BLK_T_OUT        1
@@ -73,57 +85,82 @@ struct virtio_blk_req {
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
-static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
-static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count);
-static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count);
+/* descriptors per virtio ring and requests in flight per queue */
+#define VIRTIO_BLK_RING_SIZE    256
+#define VIRTIO_BLK_QUEUE_DEPTH  64
+
+/* data segments per request. Transfers up to MAX_XFER always fit, whatever
+ * the physical layout of the buffer. */
+#define VIRTIO_BLK_MAX_SEGS     60
+#define VIRTIO_BLK_MAX_XFER     ((VIRTIO_BLK_MAX_SEGS - 1) * PAGE_SIZE)
+
+/* the part of a request the device reads and writes. Aligned to its size so
+ * it never crosses a page and can be addressed physically as a unit. The
+ * indirect table doubles as scratch space for the segment list when
+ * indirect descriptors are not in use. */
+struct virtio_blk_dma {
+    struct vring_desc indirect[VIRTIO_BLK_MAX_SEGS + 2];
+    struct virtio_blk_req hdr;
+    uint8_t status;
+} __ALIGNED(1024);
+
+STATIC_ASSERT(sizeof(struct virtio_blk_dma) == 1024);
+
+struct virtio_blk_txn {
+    struct virtio_blk_txn *next_free;
+
+    bio_request_t *req;
+    size_t len;
+
+    struct virtio_blk_dma *dma;
+    paddr_t dma_phys;
+};
+
+struct virtio_blk_queue {
+    spin_lock_t lock;
+    uint ring;
+
+    /* signaled as requests complete, for submitters waiting on a txn or descriptors */
+    event_t space_event;
+
+    struct virtio_blk_txn txn[VIRTIO_BLK_QUEUE_DEPTH];
+    struct virtio_blk_txn *free_txn;
+
+    /* completion table, in flight txns keyed by the head of their descriptor chain */
+    struct virtio_blk_txn *inflight[VIRTIO_BLK_RING_SIZE];
+};
 
 struct virtio_block_dev {
     struct virtio_device *dev;
 
-    mutex_t lock;
-    event_t io_event;
-
     /* bio block device */
     bdev_t bdev;
 
-    /* one blk_req structure for io, not crossing a page boundary */
-    struct virtio_blk_req *blk_req;
-    paddr_t blk_req_phys;
+    /* negotiated VIRTIO_RING_F_INDIRECT_DESC */
+    bool indirect;
 
-    /* one uint8_t response word */
-    uint8_t blk_response;
-    paddr_t blk_response_phys;
+    /* one queue per virtio ring, requests go to the submitting cpu's queue */
+    uint queue_count;
+    struct virtio_blk_queue *queue;
 };
 
+static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
+static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count);
+static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count);
+static status_t virtio_bdev_submit(struct bdev *bdev, bio_request_t *req);
+
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
 {
     LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
 
     /* allocate a new block device */
-    struct virtio_block_dev *bdev = malloc(sizeof(struct virtio_block_dev));
+    struct virtio_block_dev *bdev = calloc(1, sizeof(struct virtio_block_dev));
     if (!bdev)
         return ERR_NO_MEMORY;
 
-    mutex_init(&bdev->lock);
-    event_init(&bdev->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
-
     bdev->dev = dev;
     dev->priv = bdev;
 
-    bdev->blk_req = memalign(sizeof(struct virtio_blk_req), sizeof(struct virtio_blk_req));
-#if WITH_KERNEL_VM
-    bdev->blk_req_phys = vaddr_to_paddr(bdev->blk_req);
-#else
-    bdev->blk_freq_phys = (uint64_t)(uintptr_t)bdev->blk_req;
-#endif
-    LTRACEF("blk_req structure at %p (0x%lx phys)\n", bdev->blk_req, bdev->blk_req_phys);
-
-#if WITH_KERNEL_VM
-    bdev->blk_response_phys = vaddr_to_paddr(&bdev->blk_response);
-#else
-    bdev->blk_response_phys = (uint64_t)(uintptr_t)&bdev->blk_response;
-#endif
-
     /* make sure the device is reset */
     virtio_reset_device(dev);
 
@@ -137,10 +174,52 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     /* ack and set the driver status bit */
     virtio_status_acknowledge_driver(dev);
 
-    // XXX check features bits and ack/nak them
+    /* take the features we make use of */
+    uint32_t features = host_features & (VIRTIO_BLK_F_MQ | (1u << VIRTIO_RING_F_INDIRECT_DESC));
+    virtio_set_guest_features(dev, features);
+
+    bdev->indirect = !!(features & (1u << VIRTIO_RING_F_INDIRECT_DESC));
+    bdev->queue_count = 1;
+    if (features & VIRTIO_BLK_F_MQ) {
+        bdev->queue_count = MIN(MAX(config->num_queues, 1), MIN(SMP_MAX_CPUS, MAX_VIRTIO_RINGS));
+    }
+    LTRACEF("features 0x%x, %u queues\n", features, bdev->queue_count);
 
-    /* allocate a virtio ring */
-    virtio_alloc_ring(dev, 0, 256);
+    /* allocate the queues and their per request dma memory */
+    bdev->queue = calloc(bdev->queue_count, sizeof(struct virtio_blk_queue));
+    struct virtio_blk_dma *dma = memalign(sizeof(struct virtio_blk_dma),
+                                          bdev->queue_count * VIRTIO_BLK_QUEUE_DEPTH * sizeof(struct virtio_blk_dma));
+    status_t err = ERR_NO_MEMORY;
+    uint q = 0;
+    if (!bdev->queue || !dma)
+        goto err;
+
+    struct virtio_blk_dma *next_dma = dma;
+    for (q = 0; q < bdev->queue_count; q++) {
+        struct virtio_blk_queue *queue = &bdev->queue[q];
+
+        queue->lock = SPIN_LOCK_INITIAL_VALUE;
+        queue->ring = q;
+        event_init(&queue->space_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+        for (uint i = 0; i < VIRTIO_BLK_QUEUE_DEPTH; i++) {
+            struct virtio_blk_txn *txn = &queue->txn[i];
+
+            txn->dma = next_dma++;
+#if WITH_KERNEL_VM
+            txn->dma_phys = vaddr_to_paddr(txn->dma);
+#else
+            txn->dma_phys = (paddr_t)(uintptr_t)txn->dma;
+#endif
+            txn->next_free = queue->free_txn;
+            queue->free_txn = txn;
+        }
+
+        /* allocate a virtio ring */
+        err = virtio_alloc_ring(dev, q, VIRTIO_BLK_RING_SIZE);
+        if (err < 0)
+            goto err;
+    }
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_block_irq_driver_callback;
@@ -159,21 +238,46 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     /* override our block device hooks */
     bdev->bdev.read_block = &virtio_bdev_read_block;
     bdev->bdev.write_block = &virtio_bdev_write_block;
+    bdev->bdev.submit = &virtio_bdev_submit;
 
     bio_register_device(&bdev->bdev);
 
-    printf("found virtio block device of size %lld\n", config->capacity * config->blk_size);
+    printf("found virtio block device of size %lld, %u queue%s%s\n",
+           config->capacity * config->blk_size, bdev->queue_count,
+           (bdev->queue_count > 1) ? "s" : "", bdev->indirect ? ", indirect descriptors" : "");
 
     return NO_ERROR;
+
+err:
+    /* stop the device and give back the rings set up before the failure */
+    virtio_reset_device(dev);
+    while (q-- > 0)
+        virtio_free_ring(dev, q);
+    free(dma);
+    free(bdev->queue);
+    free(bdev);
+    dev->priv = NULL;
+    return err;
 }
 
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e)
 {
     struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+    struct virtio_blk_queue *queue = &bdev->queue[ring];
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
-    /* parse our descriptor chain, add back to the free queue */
+    DEBUG_ASSERT(ring < bdev->queue_count);
+    DEBUG_ASSERT(e->id < VIRTIO_BLK_RING_SIZE);
+
+    spin_lock(&queue->lock);
+
+    struct virtio_blk_txn *txn = queue->inflight[e->id];
+    DEBUG_ASSERT(txn);
+    queue->inflight[e->id] = NULL;
+
+    /* parse our descriptor chain, add back to the free queue. An indirect
+     * request only holds its head descriptor. */
     uint16_t i = e->id;
     for (;;) {
         int next;
@@ -195,119 +299,219 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
         i = next;
     }
 
-    /* signal our event */
-    event_signal(&bdev->io_event, false);
+    bio_request_t *req = txn->req;
+    ssize_t result = (txn->dma->status == VIRTIO_BLK_S_OK) ? (ssize_t)txn->len : ERR_IO;
+    LTRACEF("status 0x%hhx\n", txn->dma->status);
+
+    txn->req = NULL;
+    txn->next_free = queue->free_txn;
+    queue->free_txn = txn;
+
+    spin_unlock(&queue->lock);
+
+    /* wake up anyone waiting for a txn or descriptors */
+    event_signal(&queue->space_event, false);
+
+    bio_complete_request(req, result);
 
     return INT_RESCHEDULE;
 }
 
-ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
+/* translate a buffer into physically contiguous segments, returns the count */
+static uint virtio_block_build_segs(struct vring_desc *segs, void *buf, size_t len, bool write)
 {
-    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+    /* mark buffer as write-only if its a block read */
+    uint16_t flags = write ? 0 : VRING_DESC_F_WRITE;
 
-    uint16_t i;
-    struct vring_desc *desc;
-    paddr_t pa;
+    DEBUG_ASSERT(len <= VIRTIO_BLK_MAX_XFER);
+
+#if WITH_KERNEL_VM
     vaddr_t va = (vaddr_t)buf;
+    uint count = 0;
 
-    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+    while (len > 0) {
+        size_t len_tohandle = MIN(len, PAGE_SIZE - (va & (PAGE_SIZE - 1)));
+        paddr_t pa = vaddr_to_paddr((void *)va);
+
+        /* extend the last segment if the new page is contiguous to it */
+        if (count > 0 && segs[count - 1].addr + segs[count - 1].len == pa) {
+            segs[count - 1].len += len_tohandle;
+        } else {
+            DEBUG_ASSERT(count < VIRTIO_BLK_MAX_SEGS);
+            segs[count].addr = (uint64_t)pa;
+            segs[count].len = len_tohandle;
+            segs[count].flags = flags;
+            count++;
+        }
+
+        va += len_tohandle;
+        len -= len_tohandle;
+    }
+
+    return count;
+#else
+    segs[0].addr = (uint64_t)(uintptr_t)buf;
+    segs[0].len = len;
+    segs[0].flags = flags;
+
+    return 1;
+#endif
+}
+
+static struct virtio_blk_txn *virtio_block_alloc_txn(struct virtio_blk_queue *queue)
+{
+    for (;;) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&queue->lock, state);
+
+        struct virtio_blk_txn *txn = queue->free_txn;
+        if (txn)
+            queue->free_txn = txn->next_free;
+
+        spin_unlock_irqrestore(&queue->lock, state);
+
+        if (txn)
+            return txn;
 
-    mutex_acquire(&bdev->lock);
+        event_wait(&queue->space_event);
+    }
+}
+
+/* start a transfer of at most VIRTIO_BLK_MAX_XFER bytes, completing req from the irq handler */
+static void virtio_block_queue_txn(struct virtio_block_dev *bdev, bio_request_t *req,
+                                   void *buf, uint64_t sector, size_t len, bool write)
+{
+    struct virtio_device *vdev = bdev->dev;
+    struct virtio_blk_queue *queue = &bdev->queue[arch_curr_cpu_num() % bdev->queue_count];
+    uint ring = queue->ring;
 
-    /* set up the request */
-    bdev->blk_req->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    bdev->blk_req->ioprio = 0;
-    bdev->blk_req->sector = offset / 512;
-    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
-            bdev->blk_req->type, bdev->blk_req->ioprio, bdev->blk_req->sector);
+    LTRACEF("dev %p, ring %u, buf %p, sector %llu, len %zu\n", vdev, ring, buf, sector, len);
 
-    /* put together a transfer */
-    desc = virtio_alloc_desc_chain(dev, 0, 3, &i);
-    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
+    DEBUG_ASSERT(len > 0);
+
+    /* reserve a txn and fill in its header and segment list outside of the lock */
+    struct virtio_blk_txn *txn = virtio_block_alloc_txn(queue);
+    struct virtio_blk_dma *dma = txn->dma;
+
+    txn->req = req;
+    txn->len = len;
+
+    dma->hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    dma->hdr.ioprio = 0;
+    dma->hdr.sector = sector;
+    dma->status = 0xff;
+
+    struct vring_desc *segs = &dma->indirect[1];
+    uint seg_count = virtio_block_build_segs(segs, buf, len, write);
+    uint desc_count = bdev->indirect ? 1 : seg_count + 2;
 
     // XXX not cache safe.
     // At the moment only tested on arm qemu, which doesn't emulate cache.
 
-    /* set up the descriptor pointing to the head */
-    desc->addr = bdev->blk_req_phys;
-    desc->len = sizeof(struct virtio_blk_req);
-    desc->flags |= VRING_DESC_F_NEXT;
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&queue->lock, state);
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-#if WITH_KERNEL_VM
-    /* translate the first buffer */
-    pa = vaddr_to_paddr((void *)va);
-    desc->addr = (uint64_t)pa;
-    /* desc->len is filled in below */
-#else
-    desc->addr = (uint64_t)(uintptr_t)buf;
-    desc->len = len;
-#endif
-    desc->flags |= write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-    desc->flags |= VRING_DESC_F_NEXT;
+    /* wait for enough descriptors, only an issue for direct chains */
+    while (vdev->ring[ring].free_count < desc_count) {
+        spin_unlock_irqrestore(&queue->lock, state);
+        event_wait(&queue->space_event);
+        spin_lock_irqsave(&queue->lock, state);
+    }
 
-#if WITH_KERNEL_VM
-    /* see if we need to add more descriptors due to scatter gather */
-    paddr_t next_pa = PAGE_ALIGN(pa + 1);
-    desc->len = MIN(next_pa - pa, len);
-    LTRACEF("first descriptor va 0x%lx desc->addr 0x%llx desc->len %u\n", va, desc->addr, desc->len);
-    len -= desc->len;
-    while (len > 0) {
-        /* amount of source buffer handled by this iteration of the loop */
-        size_t len_tohandle = MIN(len, PAGE_SIZE);
-
-        /* translate the next page in the buffer */
-        va = PAGE_ALIGN(va + 1);
-        pa = vaddr_to_paddr((void *)va);
-        LTRACEF("va now 0x%lx, pa 0x%lx, next_pa 0x%lx, remaining len %zu\n", va, pa, next_pa, len);
-
-        /* is the new translated physical address contiguous to the last one? */
-        if (next_pa == pa) {
-            LTRACEF("extending last one by %zu bytes\n", len_tohandle);
-            desc->len += len_tohandle;
-        } else {
-            uint16_t next_i = virtio_alloc_desc(dev, 0);
-            struct vring_desc *next_desc = virtio_desc_index_to_desc(dev, 0, next_i);
-            DEBUG_ASSERT(next_desc);
+    uint16_t head;
+    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, ring, desc_count, &head);
+    DEBUG_ASSERT(desc);
+
+    if (bdev->indirect) {
+        /* header, data segments and status in one table, the ring only sees its head */
+        struct vring_desc *table = dma->indirect;
+        uint table_count = seg_count + 2;
 
-            LTRACEF("doesn't extend, need new desc, allocated desc %i (%p)\n", next_i, next_desc);
+        table[0].addr = txn->dma_phys + offsetof(struct virtio_blk_dma, hdr);
+        table[0].len = sizeof(struct virtio_blk_req);
+        table[0].flags = 0;
 
-            /* fill this descriptor in and put it after the last one but before the response descriptor */
-            next_desc->addr = (uint64_t)pa;
-            next_desc->len = len_tohandle;
-            next_desc->flags = write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-            next_desc->flags |= VRING_DESC_F_NEXT;
-            next_desc->next = desc->next;
-            desc->next = next_i;
+        table[table_count - 1].addr = txn->dma_phys + offsetof(struct virtio_blk_dma, status);
+        table[table_count - 1].len = 1;
+        table[table_count - 1].flags = VRING_DESC_F_WRITE;
 
-            desc = next_desc;
+        for (uint i = 0; i < table_count - 1; i++) {
+            table[i].flags |= VRING_DESC_F_NEXT;
+            table[i].next = i + 1;
         }
-        len -= len_tohandle;
-        next_pa += PAGE_SIZE;
+
+        desc->addr = txn->dma_phys + offsetof(struct virtio_blk_dma, indirect);
+        desc->len = table_count * sizeof(struct vring_desc);
+        desc->flags = VRING_DESC_F_INDIRECT;
+    } else {
+        /* set up the descriptor pointing to the head */
+        desc->addr = txn->dma_phys + offsetof(struct virtio_blk_dma, hdr);
+        desc->len = sizeof(struct virtio_blk_req);
+        desc->flags |= VRING_DESC_F_NEXT;
+
+        /* one descriptor per data segment */
+        for (uint i = 0; i < seg_count; i++) {
+            desc = virtio_desc_index_to_desc(vdev, ring, desc->next);
+            desc->addr = segs[i].addr;
+            desc->len = segs[i].len;
+            desc->flags |= segs[i].flags | VRING_DESC_F_NEXT;
+        }
+
+        /* set up the descriptor pointing to the response */
+        desc = virtio_desc_index_to_desc(vdev, ring, desc->next);
+        desc->addr = txn->dma_phys + offsetof(struct virtio_blk_dma, status);
+        desc->len = 1;
+        desc->flags = VRING_DESC_F_WRITE;
     }
-#endif
 
-    /* set up the descriptor pointing to the response */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-    desc->addr = bdev->blk_response_phys;
-    desc->len = 1;
-    desc->flags = VRING_DESC_F_WRITE;
+    DEBUG_ASSERT(queue->inflight[head] == NULL);
+    queue->inflight[head] = txn;
 
     /* submit the transfer */
-    virtio_submit_chain(dev, 0, i);
+    virtio_submit_chain(vdev, ring, head);
 
     /* kick it off */
-    virtio_kick(dev, 0);
+    virtio_kick(vdev, ring);
+
+    spin_unlock_irqrestore(&queue->lock, state);
+}
 
-    /* wait for the transfer to complete */
-    event_wait(&bdev->io_event);
+ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
+{
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+
+    event_t done;
+    event_init(&done, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    /* issue it in pieces small enough to fit in a single request */
+    ssize_t total = 0;
+    while (len > 0) {
+        size_t xfer = MIN(len, VIRTIO_BLK_MAX_XFER);
+        bio_request_t req = {
+            .buf = buf,
+            .event = &done,
+        };
+
+        virtio_block_queue_txn(bdev, &req, buf, offset / 512, xfer, write);
+
+        /* wait for the transfer to complete */
+        event_wait(&done);
+        if (req.result < 0) {
+            total = req.result;
+            break;
+        }
 
-    LTRACEF("status 0x%hhx\n", bdev->blk_response);
+        buf = (uint8_t *)buf + xfer;
+        offset += xfer;
+        len -= xfer;
+        total += xfer;
+    }
 
-    mutex_release(&bdev->lock);
+    event_destroy(&done);
 
-    return len;
+    return total;
 }
 
 static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
@@ -316,12 +520,8 @@ static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block
 
     LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
 
-    if (virtio_block_read_write(dev->dev, buf, (off_t)block * dev->bdev.block_size,
-                                count * dev->bdev.block_size, false) == 0) {
-        return count * dev->bdev.block_size;
-    } else {
-        return ERR_IO;
-    }
+    return virtio_block_read_write(dev->dev, buf, (off_t)block * dev->bdev.block_size,
+                                   count * dev->bdev.block_size, false);
 }
 
 static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
@@ -330,11 +530,28 @@ static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_
 
     LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
 
-    if (virtio_block_read_write(dev->dev, (void *)buf, (off_t)block * dev->bdev.block_size,
-                                count * dev->bdev.block_size, true) == 0) {
-        return count * dev->bdev.block_size;
-    } else {
-        return ERR_IO;
-    }
+    return virtio_block_read_write(dev->dev, (void *)buf, (off_t)block * dev->bdev.block_size,
+                                   count * dev->bdev.block_size, true);
 }
 
+static status_t virtio_bdev_submit(struct bdev *bdev, bio_request_t *req)
+{
+    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+
+    LTRACEF("dev %p, req %p, op %u, block 0x%x, count %u\n", bdev, req, req->op, req->block, req->count);
+
+    off_t offset = (off_t)req->block * dev->bdev.block_size;
+    size_t len = req->count * dev->bdev.block_size;
+    bool write = (req->op == BIO_OP_WRITE);
+
+    if (len > VIRTIO_BLK_MAX_XFER) {
+        /* may not fit in a single request, split it up and wait for it here */
+        bio_complete_request(req, virtio_block_read_write(dev->dev, req->buf, offset, len, write));
+        return NO_ERROR;
+    }
+
+    /* completes from the irq handler */
+    virtio_block_queue_txn(dev, req, req->buf, offset / 512, len, write);
+
+    return NO_ERROR;
+}
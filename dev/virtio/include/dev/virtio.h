@@ -59,8 +59,13 @@ void virtio_reset_device(struct virtio_device *dev);
 void virtio_status_acknowledge_driver(struct virtio_device *dev);
 void virtio_status_driver_ok(struct virtio_device *dev);
 
+/* ack the subset of the host's feature bits (word 0) the driver supports */
+void virtio_set_guest_features(struct virtio_device *dev, uint32_t features);
+
 /* api used by devices to interact with the virtio bus */
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len) __NONNULL();
+/* detach a ring from the device and free it, for unwinding a failed init */
+void virtio_free_ring(struct virtio_device *dev, uint index) __NONNULL();
 
 /* add a descriptor at index desc_index to the free list on ring_index */
 void virtio_free_desc(struct virtio_device *dev, uint ring_index, uint16_t desc_index);
@@ -51,9 +51,15 @@ struct virtio_net_hdr {
     uint16_t gso_size;
     uint16_t csum_start;
     uint16_t csum_offset;
-    uint16_t num_buffers; // unused in tx
+    uint16_t num_buffers; // only there with VIRTIO_NET_F_MRG_RXBUF, unused in tx
 } __PACKED;
 
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM         (1<<0)
+#define VIRTIO_NET_HDR_F_DATA_VALID         (1<<1)
+
+#define VIRTIO_NET_HDR_GSO_NONE             0
+#define VIRTIO_NET_HDR_GSO_TCPV4            1
+
 #define VIRTIO_NET_F_CSUM                   (1<<0)
 #define VIRTIO_NET_F_GUEST_CSUM             (1<<1)
 #define VIRTIO_NET_F_CTRL_GUEST_OFFLOADS    (1<<2)
@@ -79,9 +85,14 @@ struct virtio_net_hdr {
 #define VIRTIO_NET_S_LINK_UP                (1<<0)
 #define VIRTIO_NET_S_ANNOUNCE               (1<<1)
 
-#define TX_RING_SIZE 16
+#define TX_RING_SIZE 64
 #define RX_RING_SIZE 16
 
+/* multi part packets with more parts than this are copied into one buffer to send */
+#define TX_MAX_PKT_PARTS 4
+/* the most parts we let the stack build a packet for the device to segment out of */
+#define TX_TSO_MAX_PKT_PARTS 16
+
 #define RING_RX 0
 #define RING_TX 1
 
@@ -93,6 +104,10 @@ struct virtio_net_dev {
 
     struct virtio_net_config *config;
 
+    uint32_t features;
+    size_t hdr_len;
+    uint rx_skip; /* buffers left of a packet being dropped */
+
     spin_lock_t lock;
     event_t rx_event;
 
@@ -160,9 +175,21 @@ status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features)
     /* ack and set the driver status bit */
     virtio_status_acknowledge_driver(dev);
 
-    // XXX check features bits and ack/nak them
     dump_feature_bits(host_features);
 
+    /* take the features we make use of. The device can't segment what it can't checksum. */
+    uint32_t features = host_features & (VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM |
+                                         VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_MAC);
+    if (features & VIRTIO_NET_F_CSUM)
+        features |= host_features & VIRTIO_NET_F_HOST_TSO4;
+    virtio_set_guest_features(dev, features);
+    ndev->features = features;
+
+    /* the header only has num_buffers if rx buffers can be merged */
+    ndev->hdr_len = sizeof(struct virtio_net_hdr);
+    if (!(features & VIRTIO_NET_F_MRG_RXBUF))
+        ndev->hdr_len -= sizeof(uint16_t);
+
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_net_irq_driver_callback;
 
@@ -185,6 +212,14 @@ status_t virtio_net_start(void)
 
     the_ndev->started = true;
 
+    /* let the stack leave checksums and segmentation to the device */
+    uint32_t offloads = 0;
+    if (the_ndev->features & VIRTIO_NET_F_CSUM)
+        offloads |= MINIP_TX_OFFLOAD_CSUM;
+    if (the_ndev->features & VIRTIO_NET_F_HOST_TSO4)
+        offloads |= MINIP_TX_OFFLOAD_TSO4;
+    minip_set_tx_offloads(offloads, TX_TSO_MAX_PKT_PARTS);
+
     /* start the rx worker thread */
     thread_resume(thread_create("virtio_net_rx", &virtio_net_rx_worker, (void *)the_ndev, HIGH_PRIORITY, DEFAULT_STACK_SIZE));
 
@@ -208,52 +243,78 @@ static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t
 
     DEBUG_ASSERT(ndev);
 
-    p = pktbuf_alloc();
+    /* one descriptor for the header and one for each part of the packet */
+    uint count = 1;
+    for (pktbuf_t *q = p2; q; q = q->next)
+        count++;
+
+    /* the stack may be sending with a socket locked, so drop the packet rather than wait */
+    p = pktbuf_alloc_nowait();
     if (!p)
         return ERR_NO_MEMORY;
 
     /* point our header to the base of the first pktbuf */
-    struct virtio_net_hdr *hdr = pktbuf_append(p, sizeof(struct virtio_net_hdr) - 2);
+    struct virtio_net_hdr *hdr = pktbuf_append(p, ndev->hdr_len);
     memset(hdr, 0, p->dlen);
 
+    /* pass on what the stack left for the device to do, csum_start is kept relative to the buffer */
+    if (p2->flags & PKTBUF_FLAG_CKSUM_PARTIAL) {
+        hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr->csum_start = p2->csum_start - pktbuf_avail_head(p2);
+        hdr->csum_offset = p2->csum_offset;
+    }
+    if (p2->flags & PKTBUF_FLAG_TSO) {
+        hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr->gso_size = p2->gso_size;
+        /* the headers end with the tcp header, its length is in the top of byte 12 */
+        hdr->hdr_len = hdr->csum_start + (p2->data[hdr->csum_start + 12] >> 4) * 4;
+    }
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&ndev->lock, state);
 
-    /* only queue if we have enough tx descriptors */
-    if (ndev->tx_pending_count + 2 > TX_RING_SIZE)
-        goto nodesc;
-
-    /* allocate a chain of descriptors for our transfer */
-    struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_TX, 2, &i);
+    /* only queue if we have enough tx descriptors, then allocate a chain of them for our transfer */
+    struct vring_desc *desc = NULL;
+    if (ndev->tx_pending_count + count <= TX_RING_SIZE)
+        desc = virtio_alloc_desc_chain(vdev, RING_TX, count, &i);
     if (!desc) {
         spin_unlock_irqrestore(&ndev->lock, state);
 
-nodesc:
         TRACEF("out of virtio tx descriptors, tx_pending_count %u\n", ndev->tx_pending_count);
         pktbuf_free(p, true);
 
         return ERR_NO_MEMORY;
     }
 
-    ndev->tx_pending_count += 2;
+    ndev->tx_pending_count += count;
 
     /* save a pointer to our pktbufs for the irq handler to free */
-    LTRACEF("saving pointer to pkt in index %u and %u\n", i, desc->next);
+    LTRACEF("saving pointer to pkt in index %u\n", i);
     DEBUG_ASSERT(ndev->pending_tx_packet[i] == NULL);
-    DEBUG_ASSERT(ndev->pending_tx_packet[desc->next] == NULL);
     ndev->pending_tx_packet[i] = p;
-    ndev->pending_tx_packet[desc->next] = p2;
 
     /* set up the descriptor pointing to the header */
     desc->addr = pktbuf_data_phys(p);
     desc->len = p->dlen;
     desc->flags |= VRING_DESC_F_NEXT;
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(vdev, RING_TX, desc->next);
-    desc->addr = pktbuf_data_phys(p2);
-    desc->len = p2->dlen;
-    desc->flags = 0;
+    /* set up a descriptor pointing to each part of the packet. The parts are
+     * split up so the irq handler can free them one descriptor at a time. */
+    while (p2) {
+        pktbuf_t *next = p2->next;
+        uint16_t index = desc->next;
+
+        DEBUG_ASSERT(ndev->pending_tx_packet[index] == NULL);
+        ndev->pending_tx_packet[index] = p2;
+        p2->next = NULL;
+
+        desc = virtio_desc_index_to_desc(vdev, RING_TX, index);
+        desc->addr = pktbuf_data_phys(p2);
+        desc->len = p2->dlen;
+        desc->flags = next ? VRING_DESC_F_NEXT : 0;
+
+        p2 = next;
+    }
 
     /* submit the transfer */
     virtio_submit_chain(vdev, RING_TX, i);
@@ -300,9 +361,10 @@ static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p)
     /* point our header to the base of the pktbuf */
     p->data = p->buffer;
     struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)p->data;
-    memset(hdr, 0, sizeof(struct virtio_net_hdr) - 2);
+    memset(hdr, 0, ndev->hdr_len);
 
-    p->dlen = sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS;
+    p->dlen = ndev->hdr_len + VIRTIO_NET_MSS;
+    p->flags &= ~(PKTBUF_FLAG_CKSUM_IP_GOOD | PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD);
 
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&ndev->lock, state);
@@ -364,7 +426,7 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
             LTRACEF("rx pktbuf %p filled\n", p);
 
             /* trim the pktbuf according to the written length in the used element descriptor */
-            if (e->len > (sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS)) {
+            if (e->len > ndev->hdr_len + VIRTIO_NET_MSS) {
                 TRACEF("bad used len on RX %u\n", e->len);
                 p->dlen = 0;
             } else {
@@ -421,10 +483,24 @@ static int virtio_net_rx_worker(void *arg)
             LTRACEF("got packet len %u\n", p->dlen);
 
             /* process our packet */
-            struct virtio_net_hdr *hdr = pktbuf_consume(p, sizeof(struct virtio_net_hdr) - 2);
-            if (hdr) {
-                /* call up into the stack */
-                minip_rx_driver_callback(p);
+            struct virtio_net_hdr *hdr;
+            if (ndev->rx_skip > 0) {
+                /* the rest of a packet we dropped */
+                ndev->rx_skip--;
+            } else if ((hdr = pktbuf_consume(p, ndev->hdr_len)) != NULL) {
+                if ((ndev->features & VIRTIO_NET_F_MRG_RXBUF) && hdr->num_buffers > 1) {
+                    /* a buffer holds any packet we said we take, so it shouldn't be merged */
+                    TRACEF("dropping packet merged across %u rx buffers\n", hdr->num_buffers);
+                    ndev->rx_skip = hdr->num_buffers - 1;
+                } else {
+                    /* a packet from another guest on the host can arrive with its checksum never
+                     * filled in, the host vouches for it as it does for the ones it checked */
+                    if (hdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM | VIRTIO_NET_HDR_F_DATA_VALID))
+                        p->flags |= PKTBUF_FLAG_CKSUM_TCP_GOOD | PKTBUF_FLAG_CKSUM_UDP_GOOD;
+
+                    /* call up into the stack */
+                    minip_rx_driver_callback(p);
+                }
             }
 
             /* requeue the pktbuf in the rx queue */
@@ -455,11 +531,17 @@ status_t virtio_net_send_minip_pkt(pktbuf_t *p)
 
     DEBUG_ASSERT(p && p->dlen);
 
-    if ((p->flags & PKTBUF_FLAG_EOF) == 0) {
-        /* can't handle multi part packets yet */
-        PANIC_UNIMPLEMENTED;
-
-        return ERR_NOT_IMPLEMENTED;
+    /* multi part packets go out as a descriptor per part, unless
+     * there are too many parts to fit in the ring */
+    uint count = 0;
+    for (pktbuf_t *q = p; q; q = q->next)
+        count++;
+    if (count > ((p->flags & PKTBUF_FLAG_TSO) ? TX_TSO_MAX_PKT_PARTS : TX_MAX_PKT_PARTS)) {
+        status_t err = pktbuf_linearize(p);
+        if (err < 0) {
+            pktbuf_free(p, true);
+            return err;
+        }
     }
 
     /* hand the pktbuf off to the nic, it owns the pktbuf from now on out unless it fails */
@@ -391,6 +391,29 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
     return NO_ERROR;
 }
 
+void virtio_free_ring(struct virtio_device *dev, uint index)
+{
+    LTRACEF("dev %p, index %u\n", dev, index);
+
+    DEBUG_ASSERT(index < MAX_VIRTIO_RINGS);
+
+    if (!(dev->active_rings_bitmap & (1 << index)))
+        return;
+
+    /* take it away from the device before freeing it */
+    dev->mmio_config->queue_sel = index;
+    dev->mmio_config->queue_pfn = 0;
+    dev->active_rings_bitmap &= ~(1 << index);
+
+    struct vring *ring = &dev->ring[index];
+#if WITH_KERNEL_VM
+    vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ring->desc);
+#else
+    free(ring->desc);
+#endif
+    memset(ring, 0, sizeof(*ring));
+}
+
 void virtio_reset_device(struct virtio_device *dev)
 {
     dev->mmio_config->status = 0;
@@ -401,6 +424,12 @@ void virtio_status_acknowledge_driver(struct virtio_device *dev)
     dev->mmio_config->status |= VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
 }
 
+void virtio_set_guest_features(struct virtio_device *dev, uint32_t features)
+{
+    dev->mmio_config->guest_features_sel = 0;
+    dev->mmio_config->guest_features = features;
+}
+
 void virtio_status_driver_ok(struct virtio_device *dev)
 {
     dev->mmio_config->status |= VIRTIO_STATUS_DRIVER_OK;
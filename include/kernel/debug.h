@@ -32,17 +32,65 @@ __BEGIN_CDECLS;
 /* kernel event log */
 #if WITH_KERNEL_EVLOG
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include <lib/evlog.h>
 
+/* length of each per cpu ring, in words. each record is 4 words */
 #ifndef KERNEL_EVLOG_LEN
 #define KERNEL_EVLOG_LEN 1024
 #endif
 
 void kernel_evlog_init(void);
 
-void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1);
+/* record an event into the current cpu's ring, only called when logging is enabled */
+void kernel_evlog_record(uintptr_t id, uintptr_t arg0, uintptr_t arg1);
+
+extern volatile bool kernel_evlog_enable;
+
+static inline void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1)
+{
+    if (unlikely(kernel_evlog_enable))
+        kernel_evlog_record(id, arg0, arg1);
+}
+
 void kernel_evlog_dump(void);
 
+/*
+ * Binary export of the event log, all fields in the kernel's native byte order:
+ *
+ *   struct kernel_evlog_export_header
+ *   struct kernel_evlog_export_thread[thread_count]
+ *   records of 4 words of word_size bytes each, up to the end of the stream:
+ *     [0] timestamp in microseconds
+ *     [1] (cpu << 16) | event id
+ *     [2] arg0
+ *     [3] arg1
+ *
+ * Records are grouped by cpu, oldest first within each cpu.
+ */
+#define KERNEL_EVLOG_EXPORT_MAGIC   0x4c56454b /* 'KEVL' */
+#define KERNEL_EVLOG_EXPORT_VERSION 1
+
+struct kernel_evlog_export_header {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t word_size;
+    uint8_t cpu_count;
+    uint32_t thread_count;
+};
+
+struct kernel_evlog_export_thread {
+    uint64_t thread;
+    char name[32];
+};
+
+/* called with successive chunks of the export, returns < 0 to abort */
+typedef ssize_t (*kernel_evlog_write_cb)(void *arg, const void *buf, size_t len);
+
+status_t kernel_evlog_export(kernel_evlog_write_cb write, void *arg);
+
 #else // !WITH_KERNEL_EVLOG
 
 /* do nothing versions */
@@ -60,6 +108,10 @@ enum {
     KERNEL_EVLOG_TIMER_CALL,
     KERNEL_EVLOG_IRQ_ENTER,
     KERNEL_EVLOG_IRQ_EXIT,
+    KERNEL_EVLOG_MUTEX_WAIT,
+    KERNEL_EVLOG_MUTEX_ACQUIRE,
+    KERNEL_EVLOG_BIO_SUBMIT,
+    KERNEL_EVLOG_BIO_COMPLETE,
 };
 
 #define KEVLOG_THREAD_SWITCH(from, to) kernel_evlog_add(KERNEL_EVLOG_CONTEXT_SWITCH, (uintptr_t)from, (uintptr_t)to)
@@ -68,6 +120,10 @@ enum {
 #define KEVLOG_TIMER_CALL(ptr, arg) kernel_evlog_add(KERNEL_EVLOG_TIMER_CALL, (uintptr_t)ptr, (uintptr_t)arg)
 #define KEVLOG_IRQ_ENTER(irqn) kernel_evlog_add(KERNEL_EVLOG_IRQ_ENTER, (uintptr_t)irqn, 0)
 #define KEVLOG_IRQ_EXIT(irqn) kernel_evlog_add(KERNEL_EVLOG_IRQ_EXIT, (uintptr_t)irqn, 0)
+#define KEVLOG_MUTEX_WAIT(m, holder) kernel_evlog_add(KERNEL_EVLOG_MUTEX_WAIT, (uintptr_t)m, (uintptr_t)holder)
+#define KEVLOG_MUTEX_ACQUIRE(m, err) kernel_evlog_add(KERNEL_EVLOG_MUTEX_ACQUIRE, (uintptr_t)m, (uintptr_t)err)
+#define KEVLOG_BIO_SUBMIT(req, block) kernel_evlog_add(KERNEL_EVLOG_BIO_SUBMIT, (uintptr_t)req, (uintptr_t)block)
+#define KEVLOG_BIO_COMPLETE(req, result) kernel_evlog_add(KERNEL_EVLOG_BIO_COMPLETE, (uintptr_t)req, (uintptr_t)result)
 
 __END_CDECLS;
 
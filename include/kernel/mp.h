@@ -57,9 +57,9 @@ enum handler_return mp_mbx_reschedule_irq(void);
 struct mp_state {
     volatile mp_cpu_mask_t active_cpus;
 
-    /* only safely accessible with thread lock held */
-    mp_cpu_mask_t idle_cpus;
-    mp_cpu_mask_t realtime_cpus;
+    /* each cpu only updates its own bits, atomically, and only when they change */
+    volatile mp_cpu_mask_t idle_cpus;
+    volatile mp_cpu_mask_t realtime_cpus;
 };
 
 extern struct mp_state mp;
@@ -74,15 +74,16 @@ static inline int mp_is_cpu_idle(uint cpu)
     return mp.idle_cpus & (1 << cpu);
 }
 
-/* must be called with the thread lock held */
 static inline void mp_set_cpu_idle(uint cpu)
 {
-    mp.idle_cpus |= 1UL << cpu;
+    if (!(mp.idle_cpus & (1U << cpu)))
+        atomic_or((volatile int *)&mp.idle_cpus, 1U << cpu);
 }
 
 static inline void mp_set_cpu_busy(uint cpu)
 {
-    mp.idle_cpus &= ~(1UL << cpu);
+    if (mp.idle_cpus & (1U << cpu))
+        atomic_and((volatile int *)&mp.idle_cpus, ~(1U << cpu));
 }
 
 static inline mp_cpu_mask_t mp_get_idle_mask(void)
@@ -92,12 +93,14 @@ static inline mp_cpu_mask_t mp_get_idle_mask(void)
 
 static inline void mp_set_cpu_realtime(uint cpu)
 {
-    mp.realtime_cpus |= 1UL << cpu;
+    if (!(mp.realtime_cpus & (1U << cpu)))
+        atomic_or((volatile int *)&mp.realtime_cpus, 1U << cpu);
 }
 
 static inline void mp_set_cpu_non_realtime(uint cpu)
 {
-    mp.realtime_cpus &= ~(1UL << cpu);
+    if (mp.realtime_cpus & (1U << cpu))
+        atomic_and((volatile int *)&mp.realtime_cpus, ~(1U << cpu));
 }
 
 static inline mp_cpu_mask_t mp_get_realtime_mask(void)
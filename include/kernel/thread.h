@@ -92,7 +92,8 @@ typedef struct thread {
     int remaining_quantum;
     unsigned int flags;
 #if WITH_SMP
-    int curr_cpu;
+    int curr_cpu; /* cpu running the thread, cleared once switched out */
+    int last_cpu; /* cpu the thread last ran on */
     int pinned_cpu; /* only run on pinned_cpu if >= 0 */
 #endif
 #if WITH_KERNEL_VM
@@ -126,13 +127,17 @@ typedef struct thread {
 
 #if WITH_SMP
 #define thread_curr_cpu(t) ((t)->curr_cpu)
+#define thread_last_cpu(t) ((t)->last_cpu)
 #define thread_pinned_cpu(t) ((t)->pinned_cpu)
 #define thread_set_curr_cpu(t,c) ((t)->curr_cpu = (c))
+#define thread_set_last_cpu(t,c) ((t)->last_cpu = (c))
 #define thread_set_pinned_cpu(t, c) ((t)->pinned_cpu = (c))
 #else
 #define thread_curr_cpu(t) (0)
+#define thread_last_cpu(t) (0)
 #define thread_pinned_cpu(t) (-1)
 #define thread_set_curr_cpu(t,c) do {} while(0)
+#define thread_set_last_cpu(t,c) do {} while(0)
 #define thread_set_pinned_cpu(t, c) do {} while(0)
 #endif
 
@@ -174,6 +179,7 @@ status_t thread_set_real_time(thread_t *t);
 void dump_thread(thread_t *t);
 void arch_dump_thread(thread_t *t);
 void dump_all_threads(void);
+void thread_for_each(void (*cb)(thread_t *t, void *arg), void *arg);
 
 /* scheduler routines */
 void thread_yield(void); /* give up the cpu voluntarily */
@@ -192,7 +198,10 @@ enum handler_return thread_timer_tick(void);
 thread_t *get_current_thread(void);
 void set_current_thread(thread_t *);
 
-/* scheduler lock */
+/* called by the arch layer on the first run of a new thread */
+void thread_context_switch_finish(void);
+
+/* thread lock, protects the thread list and wait queues */
 extern spin_lock_t thread_lock;
 
 #define THREAD_LOCK(state) spin_lock_saved_state_t state; spin_lock_irqsave(&thread_lock, state)
@@ -237,6 +246,7 @@ struct thread_stats {
 
 #if WITH_SMP
     ulong reschedule_ipis;
+    ulong steals; /* threads taken from another cpu's run queue */
 #endif
 };
 
@@ -42,6 +42,7 @@ typedef struct timer {
 
     lk_time_t scheduled_time;
     lk_time_t periodic_time;
+    lk_time_t slack;
 
     timer_callback callback;
     void *arg;
@@ -53,6 +54,7 @@ typedef struct timer {
     .node = LIST_INITIAL_CLEARED_VALUE, \
     .scheduled_time = 0, \
     .periodic_time = 0, \
+    .slack = 0, \
     .callback = NULL, \
     .arg = NULL, \
 }
@@ -61,10 +63,14 @@ typedef struct timer {
  * - Timer callbacks occur from interrupt context
  * - Timers may be programmed or canceled from interrupt or thread context
  * - Timers may be canceled or reprogrammed from within their callback
+ * - Canceling a timer waits for its callback if it is running on another cpu
  * - Timers currently are dispatched from a 10ms periodic tick
+ * - A timer with slack may fire up to that many ms late, letting nearby
+ *   timers share a tick
 */
 void timer_initialize(timer_t *);
 void timer_set_oneshot(timer_t *, lk_time_t delay, timer_callback, void *arg);
+void timer_set_oneshot_slack(timer_t *, lk_time_t delay, lk_time_t slack, timer_callback, void *arg);
 void timer_set_periodic(timer_t *, lk_time_t period, timer_callback, void *arg);
 void timer_cancel(timer_t *);
 
@@ -52,6 +52,7 @@
 #include <stdlib.h>
 #include <arch.h>
 #include <arch/mmu.h>
+#include <kernel/mutex.h>
 
 __BEGIN_CDECLS
 
@@ -83,10 +84,13 @@ typedef struct vm_page {
     struct list_node node;
 
     uint flags : 8;
-    uint ref : 24;
+    uint order : 5; /* size of the free buddy block this page heads, if any */
+    uint arena : 3; /* index of the owning arena */
+    uint ref : 16;
 } vm_page_t;
 
 #define VM_PAGE_FLAG_NONFREE  (0x1)
+#define VM_PAGE_FLAG_BUDDY    (0x2) /* internal to the pmm: head of a free block */
 
 /* kernel address space */
 #ifndef KERNEL_ASPACE_BASE
@@ -119,6 +123,12 @@ static inline bool is_user_address(vaddr_t va)
 }
 
 /* physical allocator */
+
+/* free pages are kept in power of two sized, naturally aligned blocks of up to
+ * 2^PMM_MAX_ORDER pages */
+#define PMM_MAX_ORDER 10
+#define PMM_MAX_ARENAS 8
+
 typedef struct pmm_arena {
     struct list_node node;
     const char *name;
@@ -132,7 +142,7 @@ typedef struct pmm_arena {
     size_t free_count;
 
     struct vm_page *page_array;
-    struct list_node free_list;
+    struct list_node free_list[PMM_MAX_ORDER + 1];
 } pmm_arena_t;
 
 #define PMM_ARENA_FLAG_KMAP (0x1) /* this arena is already mapped and useful for kallocs */
@@ -201,7 +211,12 @@ typedef struct vmm_aspace {
     vaddr_t base;
     size_t  size;
 
+    /* protects the regions and mappings of this address space */
+    mutex_t lock;
+
+    /* regions sorted by base, both as a list and as a balanced tree */
     struct list_node region_list;
+    struct vmm_region *region_tree;
 
     arch_aspace_t arch_aspace;
 } vmm_aspace_t;
@@ -218,6 +233,14 @@ typedef struct vmm_region {
     vaddr_t base;
     size_t  size;
 
+    /* aspace region tree linkage. max_gap is the largest free range in front
+     * of any region in this subtree, used to skip over full parts of the aspace */
+    struct vmm_region *parent;
+    struct vmm_region *left;
+    struct vmm_region *right;
+    int height;
+    size_t max_gap;
+
     struct list_node page_list;
 } vmm_region_t;
 
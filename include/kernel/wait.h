@@ -29,6 +29,7 @@
 #include <arch/defines.h>
 #include <arch/ops.h>
 #include <arch/thread.h>
+#include <kernel/spinlock.h>
 
 __BEGIN_CDECLS;
 
@@ -37,6 +38,7 @@ __BEGIN_CDECLS;
 
 typedef struct wait_queue {
     int magic;
+    spin_lock_t lock;
     struct list_node list;
     int count;
 } wait_queue_t;
@@ -44,12 +46,24 @@ typedef struct wait_queue {
 #define WAIT_QUEUE_INITIAL_VALUE(q) \
 { \
     .magic = WAIT_QUEUE_MAGIC, \
+    .lock = SPIN_LOCK_INITIAL_VALUE, \
     .list = LIST_INITIAL_VALUE((q).list), \
     .count = 0 \
 }
 
+/*
+ * Each wait queue is protected by its own spinlock, which by convention also
+ * protects the state of the object embedding it (mutex, event, etc). Lock ordering
+ * is thread_lock, then a wait queue lock, then the scheduler's run queue locks.
+ * Only one wait queue lock may be held at a time.
+ */
+#define WAIT_QUEUE_LOCK(wait, state) spin_lock_saved_state_t state; spin_lock_irqsave(&(wait)->lock, state)
+#define WAIT_QUEUE_UNLOCK(wait, state) spin_unlock_irqrestore(&(wait)->lock, state)
+/* restore interrupts after wait_queue_block() returned ERR_OBJECT_DESTROYED without the lock */
+#define WAIT_QUEUE_RESTORE(state) arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS)
+
 /* wait queue primitive */
-/* NOTE: must be inside critical section when using these */
+/* NOTE: the wait queue's lock must be held when using these */
 void wait_queue_init(wait_queue_t *wait);
 
 /*
@@ -64,6 +78,8 @@ void wait_queue_destroy(wait_queue_t *, bool reschedule);
  * return status is whatever the caller of wait_queue_wake_*() specifies.
  * a timeout other than INFINITE_TIME will set abort after the specified time
  * and return ERR_TIMED_OUT. a timeout of 0 will immediately return.
+ * the wait queue's lock is released while blocked and reacquired before returning,
+ * except when returning ERR_OBJECT_DESTROYED, since the queue may already be gone.
  */
 status_t wait_queue_block(wait_queue_t *, lk_time_t timeout);
 
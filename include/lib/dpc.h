@@ -23,14 +23,50 @@
 #ifndef __KERNEL_DPC_H
 #define __KERNEL_DPC_H
 
+#include <compiler.h>
 #include <list.h>
 #include <sys/types.h>
 
+__BEGIN_CDECLS;
+
 typedef void (*dpc_callback)(void *arg);
 
 #define DPC_FLAG_NORESCHED 0x1
 
+/* A deferred procedure call, embedded in the caller's structure so queueing
+ * it never allocates. Run by a per cpu worker thread at DPC_PRIORITY.
+ */
+typedef struct dpc {
+    struct list_node node;
+
+    dpc_callback cb;
+    void *arg;
+
+    volatile int queued;
+} dpc_t;
+
+#define DPC_INITIAL_VALUE(_cb, _arg) \
+{ \
+    .node = LIST_INITIAL_CLEARED_VALUE, \
+    .cb = _cb, \
+    .arg = _arg, \
+    .queued = 0, \
+}
+
+void dpc_initialize(dpc_t *dpc, dpc_callback cb, void *arg);
+
+/* Queue a dpc on the current cpu, or on a specific one. Safe to call from
+ * interrupt context with DPC_FLAG_NORESCHED. Returns ERR_ALREADY_EXISTS if the
+ * dpc is still pending, otherwise it may be queued again from its own callback.
+ * The dpc must stay valid until its callback has been entered.
+ */
+status_t dpc_queue_entry(dpc_t *dpc, uint flags);
+status_t dpc_queue_entry_on(dpc_t *dpc, uint cpu, uint flags);
+
+/* allocating variant, queues cb on the current cpu */
 status_t dpc_queue(dpc_callback, void *arg, uint flags);
 
+__END_CDECLS;
+
 #endif
 
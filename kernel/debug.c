@@ -171,27 +171,142 @@ static int cmd_threadload(int argc, const cmd_args *argv)
 #if WITH_KERNEL_EVLOG
 
 #include <lib/evlog.h>
+#include <kernel/spinlock.h>
+#include <stdlib.h>
+#include <string.h>
 
-static evlog_t kernel_evlog;
+/*
+ * One ring per cpu. A ring is only written by its own cpu with interrupts
+ * disabled, so recording an event needs no locks or atomics.
+ */
+static evlog_t kernel_evlog[SMP_MAX_CPUS];
 volatile bool kernel_evlog_enable;
 
+#if WITH_SMP
+#define KEVLOG_BARRIER() smp_mb()
+#else
+#define KEVLOG_BARRIER() CF
+#endif
+
 void kernel_evlog_init(void)
 {
-    evlog_init(&kernel_evlog, KERNEL_EVLOG_LEN, 4);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        evlog_init(&kernel_evlog[i], KERNEL_EVLOG_LEN, 4);
 
     kernel_evlog_enable = true;
 }
 
-void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1)
+void kernel_evlog_record(uintptr_t id, uintptr_t arg0, uintptr_t arg1)
+{
+    spin_lock_saved_state_t state;
+
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    uint cpu = arch_curr_cpu_num();
+    evlog_t *e = &kernel_evlog[cpu];
+    if (likely(e->items)) {
+        uint index = evlog_bump_head(e);
+
+        /* the id word is written last so a reader can skip a record caught half written */
+        e->items[index+1] = KERNEL_EVLOG_NULL;
+        KEVLOG_BARRIER();
+        e->items[index] = (uintptr_t)current_time_hires();
+        e->items[index+2] = arg0;
+        e->items[index+3] = arg1;
+        KEVLOG_BARRIER();
+        e->items[index+1] = (cpu << 16) | id;
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+struct kernel_evlog_threads {
+    struct kernel_evlog_export_thread *table;
+    uint count;
+    uint max;
+};
+
+static void kernel_evlog_thread_cb(thread_t *t, void *_arg)
 {
-    if (kernel_evlog_enable) {
-        uint index = evlog_bump_head(&kernel_evlog);
+    struct kernel_evlog_threads *threads = _arg;
+
+    if (threads->count < threads->max) {
+        struct kernel_evlog_export_thread *entry = &threads->table[threads->count];
 
-        kernel_evlog.items[index] = (uintptr_t)current_time_hires();
-        kernel_evlog.items[index+1] = (arch_curr_cpu_num() << 16) | id;
-        kernel_evlog.items[index+2] = arg0;
-        kernel_evlog.items[index+3] = arg1;
+        entry->thread = (uintptr_t)t;
+        strlcpy(entry->name, t->name, sizeof(entry->name));
     }
+    threads->count++;
+}
+
+/* records are batched up before being handed to the write callback */
+#define EXPORT_BATCH 32
+
+status_t kernel_evlog_export(kernel_evlog_write_cb write, void *arg)
+{
+    struct kernel_evlog_threads threads = { 0 };
+    status_t err = NO_ERROR;
+
+    /* size the thread table, leaving some room for threads created in the meantime */
+    thread_for_each(&kernel_evlog_thread_cb, &threads);
+    threads.max = threads.count + 16;
+    threads.count = 0;
+    threads.table = calloc(threads.max, sizeof(*threads.table));
+    if (!threads.table)
+        return ERR_NO_MEMORY;
+    thread_for_each(&kernel_evlog_thread_cb, &threads);
+    threads.count = MIN(threads.count, threads.max);
+
+    /* stop logging while the rings are walked so they hold still */
+    bool was_enabled = kernel_evlog_enable;
+    kernel_evlog_enable = false;
+    KEVLOG_BARRIER();
+
+    struct kernel_evlog_export_header header = {
+        .magic = KERNEL_EVLOG_EXPORT_MAGIC,
+        .version = KERNEL_EVLOG_EXPORT_VERSION,
+        .word_size = sizeof(uintptr_t),
+        .cpu_count = SMP_MAX_CPUS,
+        .thread_count = threads.count,
+    };
+
+    if (write(arg, &header, sizeof(header)) < 0 ||
+            write(arg, threads.table, threads.count * sizeof(*threads.table)) < 0) {
+        err = ERR_IO;
+        goto done;
+    }
+
+    uintptr_t batch[EXPORT_BATCH * 4];
+    uint batched = 0;
+    for (uint i = 0; i < SMP_MAX_CPUS && err == NO_ERROR; i++) {
+        evlog_t *e = &kernel_evlog[i];
+        if (!e->items)
+            continue;
+
+        /* walk from the oldest record, the one the head is about to overwrite */
+        uint len = 1U << e->len_pow2;
+        for (uint n = 0, index = e->head; n < len; n += e->unitsize, index = (index + e->unitsize) & (len - 1)) {
+            if (e->items[index+1] == KERNEL_EVLOG_NULL)
+                continue;
+
+            memcpy(&batch[batched * 4], &e->items[index], 4 * sizeof(uintptr_t));
+            if (++batched == EXPORT_BATCH) {
+                if (write(arg, batch, sizeof(batch)) < 0) {
+                    err = ERR_IO;
+                    break;
+                }
+                batched = 0;
+            }
+        }
+    }
+    if (err == NO_ERROR && batched > 0 && write(arg, batch, batched * 4 * sizeof(uintptr_t)) < 0)
+        err = ERR_IO;
+
+done:
+    kernel_evlog_enable = was_enabled;
+    free(threads.table);
+
+    return err;
 }
 
 #if WITH_LIB_CONSOLE
@@ -199,6 +314,9 @@ void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1)
 static void kevdump_cb(const uintptr_t *i)
 {
     switch (i[1] & 0xffff) {
+        case KERNEL_EVLOG_NULL:
+            /* unused or partially written slot */
+            break;
         case KERNEL_EVLOG_CONTEXT_SWITCH:
             printf("%lu.%lu: context switch from %p to %p\n", i[0], i[1] >> 16, (void *)i[2], (void *)i[3]);
             break;
@@ -217,6 +335,18 @@ static void kevdump_cb(const uintptr_t *i)
         case KERNEL_EVLOG_IRQ_EXIT:
             printf("%lu.%lu: irq exit  %lu\n", i[0], i[1] >> 16, i[2]);
             break;
+        case KERNEL_EVLOG_MUTEX_WAIT:
+            printf("%lu.%lu: mutex %p wait, holder %p\n", i[0], i[1] >> 16, (void *)i[2], (void *)i[3]);
+            break;
+        case KERNEL_EVLOG_MUTEX_ACQUIRE:
+            printf("%lu.%lu: mutex %p acquired after wait, err %ld\n", i[0], i[1] >> 16, (void *)i[2], (long)i[3]);
+            break;
+        case KERNEL_EVLOG_BIO_SUBMIT:
+            printf("%lu.%lu: bio submit %p, block %lu\n", i[0], i[1] >> 16, (void *)i[2], i[3]);
+            break;
+        case KERNEL_EVLOG_BIO_COMPLETE:
+            printf("%lu.%lu: bio complete %p, result %ld\n", i[0], i[1] >> 16, (void *)i[2], (long)i[3]);
+            break;
         default:
             printf("%lu: unknown id 0x%lx 0x%lx 0x%lx\n", i[0], i[1], i[2], i[3]);
     }
@@ -224,15 +354,69 @@ static void kevdump_cb(const uintptr_t *i)
 
 void kernel_evlog_dump(void)
 {
+    bool was_enabled = kernel_evlog_enable;
     kernel_evlog_enable = false;
-    evlog_dump(&kernel_evlog, &kevdump_cb);
-    kernel_evlog_enable = true;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (kernel_evlog[i].items)
+            evlog_dump(&kernel_evlog[i], &kevdump_cb);
+    }
+    kernel_evlog_enable = was_enabled;
+}
+
+/* hex encode the binary export onto the console, for capture by tools/kevlog2json.py */
+struct kevlog_hex_state {
+    uint8_t line[32];
+    size_t pos;
+};
+
+static void kevlog_hex_flush(struct kevlog_hex_state *hex)
+{
+    for (size_t i = 0; i < hex->pos; i++)
+        printf("%02x", hex->line[i]);
+    printf("\n");
+    hex->pos = 0;
+}
+
+static ssize_t kevlog_hex_write(void *arg, const void *buf, size_t len)
+{
+    struct kevlog_hex_state *hex = arg;
+    const uint8_t *ptr = buf;
+
+    for (size_t i = 0; i < len; i++) {
+        hex->line[hex->pos++] = ptr[i];
+        if (hex->pos == sizeof(hex->line))
+            kevlog_hex_flush(hex);
+    }
+
+    return len;
 }
 
 static int cmd_kevlog(int argc, const cmd_args *argv)
 {
-    printf("kernel event log:\n");
-    kernel_evlog_dump();
+    if (argc < 2) {
+        printf("kernel event log:\n");
+        kernel_evlog_dump();
+    } else if (!strcmp(argv[1].str, "enable")) {
+        kernel_evlog_enable = true;
+    } else if (!strcmp(argv[1].str, "disable")) {
+        kernel_evlog_enable = false;
+    } else if (!strcmp(argv[1].str, "export")) {
+        struct kevlog_hex_state hex = { .pos = 0 };
+
+        printf("KEVLOG BEGIN\n");
+        status_t err = kernel_evlog_export(&kevlog_hex_write, &hex);
+        if (hex.pos > 0)
+            kevlog_hex_flush(&hex);
+        printf("KEVLOG END\n");
+        if (err < 0)
+            printf("error %d exporting event log\n", err);
+    } else {
+        printf("usage:\n");
+        printf("%s                  : dump the event log\n", argv[0].str);
+        printf("%s enable|disable   : start or stop logging\n", argv[0].str);
+        printf("%s export           : hex dump the binary export for tools/kevlog2json.py\n", argv[0].str);
+        return ERR_INVALID_ARGS;
+    }
 
     return NO_ERROR;
 }
@@ -71,14 +71,14 @@ void event_destroy(event_t *e)
 {
     DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&e->wait, state);
 
     e->magic = 0;
     e->signaled = false;
     e->flags = 0;
     wait_queue_destroy(&e->wait, true);
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&e->wait, state);
 }
 
 /**
@@ -102,7 +102,7 @@ status_t event_wait_timeout(event_t *e, lk_time_t timeout)
 
     DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&e->wait, state);
 
     if (e->signaled) {
         /* signaled, we're going to fall through */
@@ -113,9 +113,13 @@ status_t event_wait_timeout(event_t *e, lk_time_t timeout)
     } else {
         /* unsignaled, block here */
         ret = wait_queue_block(&e->wait, timeout);
+        if (ret == ERR_OBJECT_DESTROYED) {
+            WAIT_QUEUE_RESTORE(state);
+            return ret;
+        }
     }
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&e->wait, state);
 
     return ret;
 }
@@ -141,7 +145,7 @@ status_t event_signal(event_t *e, bool reschedule)
 {
     DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&e->wait, state);
 
     if (!e->signaled) {
         if (e->flags & EVENT_FLAG_AUTOUNSIGNAL) {
@@ -161,7 +165,7 @@ status_t event_signal(event_t *e, bool reschedule)
         }
     }
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&e->wait, state);
 
     return NO_ERROR;
 }
@@ -35,6 +35,57 @@
 #include <assert.h>
 #include <err.h>
 #include <kernel/thread.h>
+#include <kernel/debug.h>
+
+/*
+ * m->count is the number of threads holding or waiting for the mutex. An uncontended
+ * acquire or release moves it between 0 and 1 with a compare and swap without taking
+ * any lock. Anything else goes through the wait queue's lock, which serializes it
+ * against blocking and waking.
+ */
+
+/* on SMP, how many times to poll a mutex whose holder is running before blocking */
+#define MUTEX_SPIN_COUNT 1000
+
+static inline bool mutex_try_acquire_fast(mutex_t *m)
+{
+    if (atomic_cmpxchg(&m->count, 0, 1) != 0)
+        return false;
+#if WITH_SMP
+    smp_mb();
+#endif
+    return true;
+}
+
+static inline bool mutex_try_release_fast(mutex_t *m)
+{
+#if WITH_SMP
+    smp_mb();
+#endif
+    return atomic_cmpxchg(&m->count, 1, 0) == 1;
+}
+
+#if WITH_SMP
+/*
+ * Poll for a bounded time while the holder is running on another cpu, on the theory
+ * that it will release the mutex sooner than a block and wakeup would complete.
+ */
+static bool mutex_spin(mutex_t *m)
+{
+    for (uint i = 0; i < MUTEX_SPIN_COUNT; i++) {
+        thread_t *holder = *(thread_t * volatile *)&m->holder;
+
+        /* give up if the holder is not running, it may be a while */
+        if (holder && *(volatile enum thread_state *)&holder->state != THREAD_RUNNING)
+            return false;
+
+        if (*(volatile int *)&m->count == 0 && mutex_try_acquire_fast(m))
+            return true;
+    }
+
+    return false;
+}
+#endif
 
 /**
  * @brief  Initialize a mutex_t
@@ -60,11 +111,11 @@ void mutex_destroy(mutex_t *m)
               get_current_thread(), get_current_thread()->name, m, m->holder, m->holder->name);
 #endif
 
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&m->wait, state);
     m->magic = 0;
     m->count = 0;
     wait_queue_destroy(&m->wait, true);
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&m->wait, state);
 }
 
 /**
@@ -87,10 +138,24 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
               get_current_thread(), get_current_thread()->name, m);
 #endif
 
-    THREAD_LOCK(state);
+    if (likely(mutex_try_acquire_fast(m))) {
+        m->holder = get_current_thread();
+        return NO_ERROR;
+    }
+
+#if WITH_SMP
+    if (timeout != 0 && mutex_spin(m)) {
+        m->holder = get_current_thread();
+        return NO_ERROR;
+    }
+#endif
+
+    KEVLOG_MUTEX_WAIT(m, m->holder);
+
+    WAIT_QUEUE_LOCK(&m->wait, state);
 
     status_t ret = NO_ERROR;
-    if (unlikely(++m->count > 1)) {
+    if (unlikely(atomic_add(&m->count, 1) + 1 > 1)) {
         ret = wait_queue_block(&m->wait, timeout);
         if (unlikely(ret < NO_ERROR)) {
             /* if the acquisition timed out, back out the acquire and exit */
@@ -100,7 +165,12 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
                  * but before we got scheduled again which makes messing with the
                  * count variable dangerous.
                  */
-                m->count--;
+                atomic_add(&m->count, -1);
+            } else if (ret == ERR_OBJECT_DESTROYED) {
+                /* the lock was not reacquired, the mutex may be gone already */
+                WAIT_QUEUE_RESTORE(state);
+                KEVLOG_MUTEX_ACQUIRE(m, ret);
+                return ret;
             }
             /* if there was a general error, it may have been destroyed out from
              * underneath us, so just exit (which is really an invalid state anyway)
@@ -112,7 +182,8 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
     m->holder = get_current_thread();
 
 err:
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&m->wait, state);
+    KEVLOG_MUTEX_ACQUIRE(m, ret);
     return ret;
 }
 
@@ -130,16 +201,19 @@ status_t mutex_release(mutex_t *m)
     }
 #endif
 
-    THREAD_LOCK(state);
-
     m->holder = 0;
 
-    if (unlikely(--m->count >= 1)) {
+    if (likely(mutex_try_release_fast(m)))
+        return NO_ERROR;
+
+    WAIT_QUEUE_LOCK(&m->wait, state);
+
+    if (unlikely(atomic_add(&m->count, -1) - 1 >= 1)) {
         /* release a thread */
         wait_queue_wake_one(&m->wait, true, NO_ERROR);
     }
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&m->wait, state);
     return NO_ERROR;
 }
 
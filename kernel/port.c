@@ -90,6 +90,13 @@ typedef struct {
 
 static struct list_node write_port_list;
 
+// protects the write port list and the state of all ports. the wait queue
+// locks nest inside of it.
+static spin_lock_t port_lock = SPIN_LOCK_INITIAL_VALUE;
+
+#define PORT_LOCK(state) spin_lock_saved_state_t state; spin_lock_irqsave(&port_lock, state)
+#define PORT_UNLOCK(state) spin_unlock_irqrestore(&port_lock, state)
+
 
 static port_buf_t *make_buf(bool big)
 {
@@ -132,6 +139,43 @@ static status_t buf_read(port_buf_t *buf, port_result_t *pr)
     return NO_ERROR;
 }
 
+// block on a port's wait queue, dropping the port lock while blocked. the wait
+// queue lock is taken first so a wakeup in between cannot be missed.
+static status_t port_wait_block(wait_queue_t *wait, lk_time_t timeout)
+{
+    spin_lock(&wait->lock);
+    spin_unlock(&port_lock);
+
+    status_t ret = wait_queue_block(wait, timeout);
+    if (ret != ERR_OBJECT_DESTROYED)
+        spin_unlock(&wait->lock);
+
+    spin_lock(&port_lock);
+    return ret;
+}
+
+static int port_wait_wake_one(wait_queue_t *wait, status_t wait_queue_error)
+{
+    spin_lock(&wait->lock);
+    int ret = wait_queue_wake_one(wait, false, wait_queue_error);
+    spin_unlock(&wait->lock);
+    return ret;
+}
+
+static void port_wait_wake_all(wait_queue_t *wait, status_t wait_queue_error)
+{
+    spin_lock(&wait->lock);
+    wait_queue_wake_all(wait, false, wait_queue_error);
+    spin_unlock(&wait->lock);
+}
+
+static void port_wait_destroy(wait_queue_t *wait)
+{
+    spin_lock(&wait->lock);
+    wait_queue_destroy(wait, false);
+    spin_unlock(&wait->lock);
+}
+
 // must be called before any use of ports.
 void port_init(void)
 {
@@ -154,13 +198,13 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port)
 
     // lookup for existing port, return that if found.
     write_port_t *wp = NULL;
-    THREAD_LOCK(state1);
+    PORT_LOCK(state1);
     list_for_every_entry(&write_port_list, wp, write_port_t, node) {
         if (strcmp(wp->name, name) == 0) {
             // can't return closed ports.
             if (wp->magic == WRITEPORT_MAGIC_X)
                 wp = NULL;
-            THREAD_UNLOCK(state1);
+            PORT_UNLOCK(state1);
             if (wp) {
                 *port = (void *) wp;
                 return ERR_ALREADY_EXISTS;
@@ -169,7 +213,7 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port)
             }
         }
     }
-    THREAD_UNLOCK(state1);
+    PORT_UNLOCK(state1);
 
     // not found, create the write port and the circular buffer.
     wp = calloc(1, sizeof(write_port_t));
@@ -189,9 +233,9 @@ status_t port_create(const char *name, port_mode_t mode, port_t *port)
 
     // todo: race condtion! a port with the same name could have been created
     // by another thread at is point.
-    THREAD_LOCK(state2);
+    PORT_LOCK(state2);
     list_add_tail(&write_port_list, &wp->node);
-    THREAD_UNLOCK(state2);
+    PORT_UNLOCK(state2);
 
     *port = (void *)wp;
     return NO_ERROR;
@@ -223,7 +267,7 @@ status_t port_open(const char *name, void *ctx, port_t *port)
     // find the named write port and associate it with read port.
     status_t rc = ERR_NOT_FOUND;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     write_port_t *wp = NULL;
     list_for_every_entry(&write_port_list, wp, write_port_t, node) {
         if (strcmp(wp->name, name) == 0) {
@@ -254,7 +298,7 @@ status_t port_open(const char *name, void *ctx, port_t *port)
             break;
         }
     }
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     if (buf)
         free(buf);
@@ -290,7 +334,7 @@ status_t port_group(port_t *ports, size_t count, port_t *group)
 
     status_t rc = NO_ERROR;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     for (size_t ix = 0; ix != count; ix++) {
         read_port_t *rp = (read_port_t *)ports[ix];
         if ((rp->magic != READPORT_MAGIC) || rp->gport) {
@@ -306,7 +350,7 @@ status_t port_group(port_t *ports, size_t count, port_t *group)
         rp->gport = pg;
         list_add_tail(&pg->rp_list, &rp->g_node);
     }
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     if (rc == NO_ERROR) {
         *group = (port_t *)pg;
@@ -331,7 +375,7 @@ status_t port_group_add(port_t group, port_t port)
         return ERR_BAD_HANDLE;
 
     status_t rc = NO_ERROR;
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
 
     if (list_length(&pg->rp_list) == MAX_PORT_GROUP_COUNT) {
         rc = ERR_TOO_BIG;
@@ -342,11 +386,11 @@ status_t port_group_add(port_t group, port_t port)
         // If the new read port being added has messages available, try to wake
         // any readers that might be present.
         if (!buf_is_empty(rp->buf)) {
-            wait_queue_wake_one(&pg->wait, false, NO_ERROR);
+            port_wait_wake_one(&pg->wait, NO_ERROR);
         }
     }
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     return rc;
 }
@@ -365,7 +409,7 @@ status_t port_group_remove(port_t group, port_t port)
     if (rp->magic != READPORT_MAGIC || rp->gport != pg)
         return ERR_BAD_HANDLE;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
 
     bool found = false;
     read_port_t *current_rp;
@@ -375,12 +419,14 @@ status_t port_group_remove(port_t group, port_t port)
         }
     }
 
-    if (!found)
+    if (!found) {
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
+    }
 
     list_delete(&rp->g_node);
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     return NO_ERROR;
 }
@@ -391,10 +437,10 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count)
         return ERR_INVALID_ARGS;
 
     write_port_t *wp = (write_port_t *)port;
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (wp->magic != WRITEPORT_MAGIC_W) {
         // wrong port type.
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
     }
 
@@ -417,17 +463,17 @@ status_t port_write(port_t port, const port_packet_t *pk, size_t count)
 
             int awaken = 0;
             if (rp->gport) {
-                awaken = wait_queue_wake_one(&rp->gport->wait, false, NO_ERROR);
+                awaken = port_wait_wake_one(&rp->gport->wait, NO_ERROR);
             }
             if (!awaken) {
-                awaken = wait_queue_wake_one(&rp->wait, false, NO_ERROR);
+                awaken = port_wait_wake_one(&rp->wait, NO_ERROR);
             }
 
             awake_count += awaken;
         }
     }
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
 #if RESCHEDULE_POLICY
     if (awake_count)
@@ -449,7 +495,7 @@ static inline status_t read_no_lock(read_port_t *rp, lk_time_t timeout, port_res
     if (!timeout)
         return ERR_TIMED_OUT;
 
-    status_t wr = wait_queue_block(&rp->wait, timeout);
+    status_t wr = port_wait_block(&rp->wait, timeout);
     if (wr != NO_ERROR)
         return wr;
     // recursive tail call is usually optimized away with a goto.
@@ -464,7 +510,7 @@ status_t port_read(port_t port, lk_time_t timeout, port_result_t *result)
     status_t rc = ERR_GENERIC;
     read_port_t *rp = (read_port_t *)port;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (rp->magic == READPORT_MAGIC) {
         // dealing with a single port.
         rc = read_no_lock(rp, timeout, result);
@@ -480,7 +526,7 @@ status_t port_read(port_t port, lk_time_t timeout, port_result_t *result)
                     goto read_exit;
             }
             // no data, block on the group waitqueue.
-            rc = wait_queue_block(&pg->wait, timeout);
+            rc = port_wait_block(&pg->wait, timeout);
         } while (rc == NO_ERROR);
     } else {
         // wrong port type.
@@ -488,7 +534,7 @@ status_t port_read(port_t port, lk_time_t timeout, port_result_t *result)
     }
 
 read_exit:
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
     return rc;
 }
 
@@ -500,10 +546,10 @@ status_t port_destroy(port_t port)
     write_port_t *wp = (write_port_t *) port;
     port_buf_t *buf = NULL;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (wp->magic != WRITEPORT_MAGIC_X) {
         // wrong port type.
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
     }
     // remove self from global named ports list.
@@ -517,9 +563,9 @@ status_t port_destroy(port_t port)
         read_port_t *rp;
         list_for_every_entry(&wp->rp_list, rp, read_port_t, w_node) {
             // wake the read and group ports.
-            wait_queue_wake_all(&rp->wait, false, ERR_CANCELLED);
+            port_wait_wake_all(&rp->wait, ERR_CANCELLED);
             if (rp->gport) {
-                wait_queue_wake_all(&rp->gport->wait, false, ERR_CANCELLED);
+                port_wait_wake_all(&rp->gport->wait, ERR_CANCELLED);
             }
             // remove self from reader ports.
             rp->wport = NULL;
@@ -527,7 +573,7 @@ status_t port_destroy(port_t port)
     }
 
     wp->magic = 0;
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     free(buf);
     free(wp);
@@ -542,7 +588,7 @@ status_t port_close(port_t port)
     read_port_t *rp = (read_port_t *) port;
     port_buf_t *buf = NULL;
 
-    THREAD_LOCK(state);
+    PORT_LOCK(state);
     if (rp->magic == READPORT_MAGIC) {
         // dealing with a read port.
         if (rp->wport) {
@@ -560,14 +606,14 @@ status_t port_close(port_t port)
             list_delete(&rp->g_node);
         }
         // wake up waiters, the return code is ERR_OBJECT_DESTROYED.
-        wait_queue_destroy(&rp->wait, true);
+        port_wait_destroy(&rp->wait);
         rp->magic = 0;
 
     } else if (rp->magic == PORTGROUP_MAGIC) {
         // dealing with a port group.
         port_group_t *pg = (port_group_t *) port;
         // wake up waiters.
-        wait_queue_destroy(&pg->wait, true);
+        port_wait_destroy(&pg->wait);
         // remove self from reader ports.
         rp = NULL;
         list_for_every_entry(&pg->rp_list, rp, read_port_t, g_node) {
@@ -580,15 +626,15 @@ status_t port_close(port_t port)
         write_port_t *wp = (write_port_t *) port;
         // mark it as closed. Now it can be read but not written to.
         wp->magic = WRITEPORT_MAGIC_X;
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return NO_ERROR;
 
     } else {
-        THREAD_UNLOCK(state);
+        PORT_UNLOCK(state);
         return ERR_BAD_HANDLE;
     }
 
-    THREAD_UNLOCK(state);
+    PORT_UNLOCK(state);
 
     free(buf);
     free(port);
@@ -26,17 +26,17 @@ void sem_init(semaphore_t *sem, unsigned int value)
 
 void sem_destroy(semaphore_t *sem)
 {
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&sem->wait, state);
     sem->count = 0;
     wait_queue_destroy(&sem->wait, true);
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&sem->wait, state);
 }
 
 int sem_post(semaphore_t *sem, bool resched)
 {
     int ret = 0;
 
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&sem->wait, state);
 
     /*
      * If the count is or was negative then a thread is waiting for a resource, otherwise
@@ -45,7 +45,7 @@ int sem_post(semaphore_t *sem, bool resched)
     if (unlikely(++sem->count <= 0))
         ret = wait_queue_wake_one(&sem->wait, resched, NO_ERROR);
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&sem->wait, state);
 
     return ret;
 }
@@ -53,47 +53,55 @@ int sem_post(semaphore_t *sem, bool resched)
 status_t sem_wait(semaphore_t *sem)
 {
     status_t ret = NO_ERROR;
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&sem->wait, state);
 
     /*
      * If there are no resources available then we need to
      * sit in the wait queue until sem_post adds some.
      */
-    if (unlikely(--sem->count < 0))
+    if (unlikely(--sem->count < 0)) {
         ret = wait_queue_block(&sem->wait, INFINITE_TIME);
+        if (ret == ERR_OBJECT_DESTROYED) {
+            WAIT_QUEUE_RESTORE(state);
+            return ret;
+        }
+    }
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&sem->wait, state);
     return ret;
 }
 
 status_t sem_trywait(semaphore_t *sem)
 {
     status_t ret = NO_ERROR;
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&sem->wait, state);
 
     if (unlikely(sem->count <= 0))
         ret = ERR_NOT_READY;
     else
         sem->count--;
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&sem->wait, state);
     return ret;
 }
 
 status_t sem_timedwait(semaphore_t *sem, lk_time_t timeout)
 {
     status_t ret = NO_ERROR;
-    THREAD_LOCK(state);
+    WAIT_QUEUE_LOCK(&sem->wait, state);
 
     if (unlikely(--sem->count < 0)) {
         ret = wait_queue_block(&sem->wait, timeout);
         if (ret < NO_ERROR) {
             if (ret == ERR_TIMED_OUT) {
                 sem->count++;
+            } else if (ret == ERR_OBJECT_DESTROYED) {
+                WAIT_QUEUE_RESTORE(state);
+                return ret;
             }
         }
     }
 
-    THREAD_UNLOCK(state);
+    WAIT_QUEUE_UNLOCK(&sem->wait, state);
     return ret;
 }
@@ -45,6 +45,7 @@
 #include <platform.h>
 #include <target.h>
 #include <lib/heap.h>
+#include <lib/slab.h>
 #if WITH_KERNEL_VM
 #include <kernel/vm.h>
 #endif
@@ -61,15 +62,39 @@ struct thread_stats thread_stats[SMP_MAX_CPUS];
 /* global thread list */
 static struct list_node thread_list;
 
-/* master thread spinlock */
+/* thread structures allocated by thread_create */
+static slab_cache_t *thread_cache;
+
+/* detached threads that have exited, waiting to be switched out before their structure is freed */
+static struct list_node dead_thread_list = LIST_INITIAL_VALUE(dead_thread_list);
+
+/* master thread spinlock, protects the thread list and thread state outside of wait queues */
 spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/*
+ * per cpu run queues
+ *
+ * Each cpu schedules out of its own set of priority queues, protected by the
+ * run queue's lock. The local run queue lock is held across a context switch
+ * and released by the thread being switched to. Lock ordering is thread_lock,
+ * then a wait queue's lock, then any run queue lock. A cpu only ever holds its own run queue lock,
+ * except briefly when queuing a thread on another cpu or, with a trylock,
+ * when stealing work while idle.
+ */
+struct run_queue {
+    spin_lock_t lock;
+    uint32_t bitmap;
+#if WITH_SMP
+    /* the outgoing thread of a context switch in progress on this cpu */
+    thread_t *prev_thread;
+#endif
+    struct list_node queue[NUM_PRIORITIES];
+} __CPU_ALIGN;
+
+static struct run_queue run_queues[SMP_MAX_CPUS];
 
 /* make sure the bitmap is large enough to cover our number of priorities */
-STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue_bitmap) * 8);
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queues[0].bitmap) * 8);
 
 /* the idle thread(s) (statically allocated) */
 #if WITH_SMP
@@ -85,33 +110,149 @@ static void thread_resched(void);
 static void idle_thread_routine(void) __NO_RETURN;
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-/* preemption timer */
+/* preemption timer, only armed while a regular thread has to share its cpu */
 static timer_t preempt_timer[SMP_MAX_CPUS];
+static bool preempt_timer_armed[SMP_MAX_CPUS];
+
+static void thread_update_preempt_timer(uint cpu, thread_t *current_thread);
 #endif
 
 /* run queue manipulation */
-static void insert_in_run_queue_head(thread_t *t)
+static void insert_in_run_queue_head(struct run_queue *rq, thread_t *t)
 {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
     DEBUG_ASSERT(!list_in_list(&t->queue_node));
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&rq->lock));
 
-    list_add_head(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    list_add_head(&rq->queue[t->priority], &t->queue_node);
+    rq->bitmap |= (1U<<t->priority);
 }
 
-static void insert_in_run_queue_tail(thread_t *t)
+static void insert_in_run_queue_tail(struct run_queue *rq, thread_t *t)
 {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_READY);
     DEBUG_ASSERT(!list_in_list(&t->queue_node));
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&rq->lock));
 
-    list_add_tail(&run_queue[t->priority], &t->queue_node);
-    run_queue_bitmap |= (1<<t->priority);
+    list_add_tail(&rq->queue[t->priority], &t->queue_node);
+    rq->bitmap |= (1U<<t->priority);
+}
+
+/* lock the local run queue. interrupts are disabled first so we cannot migrate. */
+static struct run_queue *run_queue_lock_irqsave(spin_lock_saved_state_t *state)
+{
+    arch_interrupt_save(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct run_queue *rq = &run_queues[arch_curr_cpu_num()];
+    spin_lock(&rq->lock);
+
+    return rq;
+}
+
+/* unlock the local run queue, which may belong to a different cpu than the one
+ * that was locked if the thread was switched out and migrated in between */
+static void run_queue_unlock_irqrestore(spin_lock_saved_state_t state)
+{
+    spin_unlock(&run_queues[arch_curr_cpu_num()].lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+#if WITH_SMP
+/* wait for a thread that was just switched out on another cpu to have its context saved */
+static void thread_wait_for_switch_out(thread_t *t)
+{
+    while (*(volatile int *)&t->curr_cpu >= 0)
+        ;
+    smp_mb();
+}
+
+/* pick a cpu to run a thread that just became ready */
+static uint thread_select_cpu(thread_t *t, bool local)
+{
+    uint curr_cpu = arch_curr_cpu_num();
+
+    if (t->pinned_cpu >= 0)
+        return t->pinned_cpu;
+    if (local)
+        return curr_cpu;
+
+    /* prefer an idle cpu, starting with the one it last ran on */
+    mp_cpu_mask_t idle = mp_get_idle_mask() & mp.active_cpus;
+    if (idle) {
+        if (t->last_cpu >= 0 && (idle & (1U << t->last_cpu)))
+            return t->last_cpu;
+        if (idle & (1U << curr_cpu))
+            return curr_cpu;
+        return __builtin_ctz(idle);
+    }
+
+    /* otherwise queue it locally, idle cpus will steal it if it waits too long */
+    return curr_cpu;
+}
+#endif
+
+/*
+ * Queue a thread that just became ready on a run queue, kicking the target cpu if
+ * it is not the local one. If local is set the thread is queued on the local cpu
+ * unless it is pinned elsewhere. Interrupts must be disabled and the caller must
+ * not hold any run queue lock.
+ */
+static void thread_make_runnable(thread_t *t, bool local)
+{
+    DEBUG_ASSERT(t->state == THREAD_READY);
+    DEBUG_ASSERT(arch_ints_disabled());
+
+#if WITH_SMP
+    thread_wait_for_switch_out(t);
+    uint cpu = thread_select_cpu(t, local);
+#else
+    uint cpu = 0;
+#endif
+    struct run_queue *rq = &run_queues[cpu];
+
+    spin_lock(&rq->lock);
+    insert_in_run_queue_head(rq, t);
+    spin_unlock(&rq->lock);
+
+    if (cpu != arch_curr_cpu_num()) {
+        /* the target rechecks its preemption timer when it reschedules */
+        mp_reschedule(1U << cpu, 0);
+    }
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    else {
+        /* the current thread may have been running alone without a tick */
+        thread_update_preempt_timer(cpu, get_current_thread());
+    }
+#endif
+}
+
+/* free the structures of detached threads that have finished exiting */
+static void thread_reap_dead(void)
+{
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    thread_t *t, *temp;
+
+    if (list_is_empty(&dead_thread_list))
+        return;
+
+    THREAD_LOCK(state);
+    list_for_every_entry_safe(&dead_thread_list, t, temp, thread_t, thread_list_node) {
+#if WITH_SMP
+        /* still switching out on another cpu */
+        if (thread_curr_cpu(t) >= 0)
+            continue;
+#endif
+        list_delete(&t->thread_list_node);
+        list_add_tail(&list, &t->thread_list_node);
+    }
+    THREAD_UNLOCK(state);
+
+    while ((t = list_remove_head_type(&list, thread_t, thread_list_node)))
+        slab_free(thread_cache, t);
 }
 
 static void init_thread_struct(thread_t *t, const char *name)
@@ -153,8 +294,10 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 {
     unsigned int flags = 0;
 
+    thread_reap_dead();
+
     if (!t) {
-        t = malloc(sizeof(thread_t));
+        t = slab_alloc(thread_cache);
         if (!t)
             return NULL;
         flags |= THREAD_FLAG_FREE_STRUCT;
@@ -169,6 +312,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     t->blocking_wait_queue = NULL;
     t->wait_queue_block_ret = NO_ERROR;
     thread_set_curr_cpu(t, -1);
+    thread_set_last_cpu(t, -1);
 
     t->retcode = 0;
     wait_queue_init(&t->retcode_wait_queue);
@@ -186,7 +330,7 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
         t->stack = malloc(stack_size);
         if (!t->stack) {
             if (flags & THREAD_FLAG_FREE_STRUCT)
-                free(t);
+                slab_free(thread_cache, t);
             return NULL;
         }
         flags |= THREAD_FLAG_FREE_STACK;
@@ -247,13 +391,13 @@ status_t thread_set_real_time(thread_t *t)
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
 
     THREAD_LOCK(state);
+    t->flags |= THREAD_FLAG_REAL_TIME;
 #if PLATFORM_HAS_DYNAMIC_TIMER
     if (t == get_current_thread()) {
-        /* if we're currently running, cancel the preemption timer. */
-        timer_cancel(&preempt_timer[arch_curr_cpu_num()]);
+        /* if we're currently running, we no longer need the preemption timer. */
+        thread_update_preempt_timer(arch_curr_cpu_num(), t);
     }
 #endif
-    t->flags |= THREAD_FLAG_REAL_TIME;
     THREAD_UNLOCK(state);
 
     return NO_ERROR;
@@ -294,13 +438,11 @@ status_t thread_resume(thread_t *t)
     THREAD_LOCK(state);
     if (t->state == THREAD_SUSPENDED) {
         t->state = THREAD_READY;
-        insert_in_run_queue_head(t);
+        thread_make_runnable(t, false);
         if (!ints_disabled) /* HACK, don't resced into bootstrap thread before idle thread is set up */
             resched = true;
     }
 
-    mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
-
     THREAD_UNLOCK(state);
 
     if (resched)
@@ -332,7 +474,13 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout)
 
     /* wait for the thread to die */
     if (t->state != THREAD_DEATH) {
+        /* take the wait queue lock before dropping the thread lock so thread_exit()
+         * cannot signal in between */
+        spin_lock(&t->retcode_wait_queue.lock);
+        spin_unlock(&thread_lock);
         status_t err = wait_queue_block(&t->retcode_wait_queue, timeout);
+        spin_unlock(&t->retcode_wait_queue.lock);
+        spin_lock(&thread_lock);
         if (err < 0) {
             THREAD_UNLOCK(state);
             return err;
@@ -344,10 +492,19 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout)
     DEBUG_ASSERT(t->blocking_wait_queue == NULL);
     DEBUG_ASSERT(!list_in_list(&t->queue_node));
 
+#if WITH_SMP
+    /* the thread may still be switching out on another cpu, don't free its stack from under it */
+    thread_wait_for_switch_out(t);
+#endif
+
     /* save the return code */
     if (retcode)
         *retcode = t->retcode;
 
+    spin_lock(&t->retcode_wait_queue.lock);
+    wait_queue_destroy(&t->retcode_wait_queue, false);
+    spin_unlock(&t->retcode_wait_queue.lock);
+
     /* remove it from the master thread list */
     list_delete(&t->thread_list_node);
 
@@ -361,7 +518,7 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout)
         free(t->stack);
 
     if (t->flags & THREAD_FLAG_FREE_STRUCT)
-        free(t);
+        slab_free(thread_cache, t);
 
     return NO_ERROR;
 }
@@ -374,7 +531,9 @@ status_t thread_detach(thread_t *t)
 
     /* if another thread is blocked inside thread_join() on this thread,
      * wake them up with a specific return code */
+    spin_lock(&t->retcode_wait_queue.lock);
     wait_queue_wake_all(&t->retcode_wait_queue, false, ERR_THREAD_DETACHED);
+    spin_unlock(&t->retcode_wait_queue.lock);
 
     /* if it's already dead, then just do what join would have and exit */
     if (t->state == THREAD_DEATH) {
@@ -427,14 +586,19 @@ void thread_exit(int retcode)
             current_thread->flags &= ~THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
         }
 
+        /* we're still running on the structure, let a later thread_create() free it */
         if (current_thread->flags & THREAD_FLAG_FREE_STRUCT)
-            heap_delayed_free(current_thread);
+            list_add_tail(&dead_thread_list, &current_thread->thread_list_node);
     } else {
         /* signal if anyone is waiting */
+        spin_lock(&current_thread->retcode_wait_queue.lock);
         wait_queue_wake_all(&current_thread->retcode_wait_queue, false, 0);
+        spin_unlock(&current_thread->retcode_wait_queue.lock);
     }
 
-    /* reschedule */
+    /* reschedule, trading the thread lock for the local run queue lock */
+    spin_lock(&run_queues[arch_curr_cpu_num()].lock);
+    spin_unlock(&thread_lock);
     thread_resched();
 
     panic("somehow fell through thread_exit()\n");
@@ -446,33 +610,111 @@ static void idle_thread_routine(void)
         arch_idle();
 }
 
-static thread_t *get_top_thread(int cpu)
+/* pull the highest priority thread that can run on cpu off of a run queue */
+static thread_t *run_queue_dequeue(struct run_queue *rq, uint cpu)
 {
     thread_t *newthread;
-    uint32_t local_run_queue_bitmap = run_queue_bitmap;
+    uint32_t local_run_queue_bitmap = rq->bitmap;
+
+    DEBUG_ASSERT(spin_lock_held(&rq->lock));
 
     while (local_run_queue_bitmap) {
         /* find the first (remaining) queue with a thread in it */
-        uint next_queue = sizeof(run_queue_bitmap) * 8 - 1 - __builtin_clz(local_run_queue_bitmap);
+        uint next_queue = sizeof(rq->bitmap) * 8 - 1 - __builtin_clz(local_run_queue_bitmap);
 
-        list_for_every_entry(&run_queue[next_queue], newthread, thread_t, queue_node) {
+        list_for_every_entry(&rq->queue[next_queue], newthread, thread_t, queue_node) {
 #if WITH_SMP
-            if (newthread->pinned_cpu < 0 || newthread->pinned_cpu == cpu)
+            /* skip threads pinned elsewhere and the thread still running on another cpu,
+             * which only happens when stealing from a cpu that is queuing its current thread */
+            if ((newthread->pinned_cpu < 0 || newthread->pinned_cpu == (int)cpu) &&
+                    (newthread->curr_cpu < 0 || newthread->curr_cpu == (int)cpu))
 #endif
             {
                 list_delete(&newthread->queue_node);
 
-                if (list_is_empty(&run_queue[next_queue]))
-                    run_queue_bitmap &= ~(1<<next_queue);
+                if (list_is_empty(&rq->queue[next_queue]))
+                    rq->bitmap &= ~(1U<<next_queue);
 
                 return newthread;
             }
         }
 
-        local_run_queue_bitmap &= ~(1<<next_queue);
+        local_run_queue_bitmap &= ~(1U<<next_queue);
     }
+
+    return NULL;
+}
+
+#if WITH_SMP
+/* look for a ready thread on another cpu's run queue */
+static thread_t *steal_thread(uint cpu)
+{
+    for (uint i = 1; i < SMP_MAX_CPUS; i++) {
+        uint victim = (cpu + i) % SMP_MAX_CPUS;
+        struct run_queue *rq = &run_queues[victim];
+
+        /* peek without the lock first, and never spin on a busy run queue */
+        if (rq->bitmap == 0 || !mp_is_cpu_active(victim))
+            continue;
+        if (spin_trylock(&rq->lock) != 0)
+            continue;
+
+        thread_t *t = run_queue_dequeue(rq, cpu);
+        spin_unlock(&rq->lock);
+
+        if (t) {
+            THREAD_STATS_INC(steals);
+            return t;
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+static thread_t *get_top_thread(uint cpu)
+{
+    thread_t *newthread = run_queue_dequeue(&run_queues[cpu], cpu);
+
+#if WITH_SMP
+    /* nothing to do locally, try to take some work from another cpu */
+    if (!newthread)
+        newthread = steal_thread(cpu);
+#endif
+
     /* no threads to run, select the idle thread for this cpu */
-    return idle_thread(cpu);
+    if (!newthread)
+        newthread = idle_thread(cpu);
+
+    return newthread;
+}
+
+/* complete the context switch that brought the current thread onto this cpu */
+static void thread_finish_switch(void)
+{
+#if WITH_SMP
+    struct run_queue *rq = &run_queues[arch_curr_cpu_num()];
+    thread_t *prev = rq->prev_thread;
+
+    /* the outgoing thread's context is saved, other cpus may now run it */
+    DEBUG_ASSERT(prev);
+    rq->prev_thread = NULL;
+    smp_mb();
+    thread_set_curr_cpu(prev, -1);
+#endif
+}
+
+/**
+ * @brief  Complete the first context switch into a new thread
+ *
+ * Called by the arch layer the first time a thread runs, in place of returning
+ * through thread_resched(). Releases the run queue lock that was implicitly held
+ * across the reschedule. Interrupts remain disabled.
+ */
+void thread_context_switch_finish(void)
+{
+    thread_finish_switch();
+    spin_unlock(&run_queues[arch_curr_cpu_num()].lock);
 }
 
 /**
@@ -482,6 +724,9 @@ static thread_t *get_top_thread(int cpu)
  * state and queues it needs to be in. This routine simply picks the next thread and
  * switches to it.
  *
+ * Must be called with the local run queue lock held. It is still held on return,
+ * though it may be a different cpu's run queue if the thread migrated.
+ *
  * This is probably not the function you're looking for. See
  * thread_yield() instead.
  */
@@ -494,7 +739,7 @@ void thread_resched(void)
     uint cpu = arch_curr_cpu_num();
 
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&run_queues[cpu].lock));
     DEBUG_ASSERT(current_thread->state != THREAD_RUNNING);
 
     THREAD_STATS_INC(reschedules);
@@ -507,6 +752,10 @@ void thread_resched(void)
 
     oldthread = current_thread;
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    thread_update_preempt_timer(cpu, newthread);
+#endif
+
     if (newthread == oldthread)
         return;
 
@@ -515,11 +764,14 @@ void thread_resched(void)
         newthread->remaining_quantum = 5; // XXX make this smarter
     }
 
-    /* mark the cpu ownership of the threads */
-    thread_set_curr_cpu(oldthread, -1);
+    /* mark the cpu ownership of the new thread. the old thread keeps its cpu until
+     * the switch completes, so other cpus will not try to run it in the meantime */
     thread_set_curr_cpu(newthread, cpu);
+    thread_set_last_cpu(newthread, cpu);
 
 #if WITH_SMP
+    run_queues[cpu].prev_thread = oldthread;
+
     if (thread_is_idle(newthread)) {
         mp_set_cpu_idle(cpu);
     } else {
@@ -547,28 +799,6 @@ void thread_resched(void)
 
     KEVLOG_THREAD_SWITCH(oldthread, newthread);
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    if (thread_is_real_time_or_idle(newthread)) {
-        if (!thread_is_real_time_or_idle(oldthread)) {
-            /* if we're switching from a non real time to a real time, cancel
-             * the preemption timer. */
-#if DEBUG_THREAD_CONTEXT_SWITCH
-            dprintf(ALWAYS, "arch_context_switch: stop preempt, cpu %d, old %p (%s), new %p (%s)\n",
-                    cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-            timer_cancel(&preempt_timer[cpu]);
-        }
-    } else if (thread_is_real_time_or_idle(oldthread)) {
-        /* if we're switching from a real time (or idle thread) to a regular one,
-         * set up a periodic timer to run our preemption tick. */
-#if DEBUG_THREAD_CONTEXT_SWITCH
-        dprintf(ALWAYS, "arch_context_switch: start preempt, cpu %d, old %p (%s), new %p (%s)\n",
-                cpu, oldthread, oldthread->name, newthread, newthread->name);
-#endif
-        timer_set_periodic(&preempt_timer[cpu], 10, (timer_callback)thread_timer_tick, NULL);
-    }
-#endif
-
     /* set some optional target debug leds */
     target_set_debug_led(0, !thread_is_idle(newthread));
 
@@ -612,6 +842,9 @@ void thread_resched(void)
 
     /* do the low level context switch */
     arch_context_switch(oldthread, newthread);
+
+    /* we're back, possibly on another cpu. finish the switch that got us here */
+    thread_finish_switch();
 }
 
 /**
@@ -630,7 +863,8 @@ void thread_yield(void)
     DEBUG_ASSERT(current_thread->magic == THREAD_MAGIC);
     DEBUG_ASSERT(current_thread->state == THREAD_RUNNING);
 
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    struct run_queue *rq = run_queue_lock_irqsave(&state);
 
     THREAD_STATS_INC(yields);
 
@@ -638,11 +872,11 @@ void thread_yield(void)
     current_thread->state = THREAD_READY;
     current_thread->remaining_quantum = 0;
     if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
-        insert_in_run_queue_tail(current_thread);
+        insert_in_run_queue_tail(rq, current_thread);
     }
     thread_resched();
 
-    THREAD_UNLOCK(state);
+    run_queue_unlock_irqrestore(state);
 }
 
 /**
@@ -674,19 +908,47 @@ void thread_preempt(void)
 
     KEVLOG_THREAD_PREEMPT(current_thread);
 
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    struct run_queue *rq = run_queue_lock_irqsave(&state);
 
     /* we are being preempted, so we get to go back into the front of the run queue if we have quantum left */
     current_thread->state = THREAD_READY;
     if (likely(!thread_is_idle(current_thread))) { /* idle thread doesn't go in the run queue */
         if (current_thread->remaining_quantum > 0)
-            insert_in_run_queue_head(current_thread);
+            insert_in_run_queue_head(rq, current_thread);
         else
-            insert_in_run_queue_tail(current_thread); /* if we're out of quantum, go to the tail of the queue */
+            insert_in_run_queue_tail(rq, current_thread); /* if we're out of quantum, go to the tail of the queue */
     }
     thread_resched();
 
-    THREAD_UNLOCK(state);
+    run_queue_unlock_irqrestore(state);
+}
+
+/*
+ * Reschedule while holding some other lock, such as the thread lock. The lock is
+ * traded for the local run queue lock across the switch and reacquired on return.
+ */
+static void thread_resched_unlocked(spin_lock_t *lock)
+{
+    spin_lock(&run_queues[arch_curr_cpu_num()].lock);
+    spin_unlock(lock);
+
+    thread_resched();
+
+    spin_unlock(&run_queues[arch_curr_cpu_num()].lock);
+    spin_lock(lock);
+}
+
+/* put the current thread back on the head of the local run queue ahead of a reschedule */
+static void thread_requeue_current(void)
+{
+    thread_t *current_thread = get_current_thread();
+    struct run_queue *rq = &run_queues[arch_curr_cpu_num()];
+
+    spin_lock(&rq->lock);
+    current_thread->state = THREAD_READY;
+    insert_in_run_queue_head(rq, current_thread);
+    spin_unlock(&rq->lock);
 }
 
 /**
@@ -698,6 +960,8 @@ void thread_preempt(void)
  * You probably don't want to call this function directly; it's meant to be called
  * from other modules, such as mutex, which will presumably set the thread's
  * state to blocked and add it to some queue or another.
+ *
+ * The thread lock must be held. It is released while the thread is blocked.
  */
 void thread_block(void)
 {
@@ -709,7 +973,7 @@ void thread_block(void)
     DEBUG_ASSERT(!thread_is_idle(current_thread));
 
     /* we are blocking on something. the blocking code should have already stuck us on a queue */
-    thread_resched();
+    thread_resched_unlocked(&thread_lock);
 }
 
 void thread_unblock(thread_t *t, bool resched)
@@ -719,11 +983,14 @@ void thread_unblock(thread_t *t, bool resched)
     DEBUG_ASSERT(spin_lock_held(&thread_lock));
     DEBUG_ASSERT(!thread_is_idle(t));
 
+    /* if we're going to reschedule, queue up behind the newly unblocked thread */
+    if (resched)
+        thread_requeue_current();
+
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
-    mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+    thread_make_runnable(t, resched);
     if (resched)
-        thread_resched();
+        thread_resched_unlocked(&thread_lock);
 }
 
 enum handler_return thread_timer_tick(void)
@@ -741,6 +1008,39 @@ enum handler_return thread_timer_tick(void)
     }
 }
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/*
+ * Run the preemption tick only while the thread on this cpu has something to share
+ * it with. A regular thread with an empty run queue behind it, a real time thread
+ * or the idle thread runs tickless until another thread is queued here.
+ *
+ * Must be called on the given cpu with interrupts disabled. The run queue bitmap is
+ * read without its lock: remote cpus kick us when they queue a thread here, and a
+ * stale bit only costs a spurious tick.
+ */
+static void thread_update_preempt_timer(uint cpu, thread_t *current_thread)
+{
+    DEBUG_ASSERT(arch_ints_disabled());
+    DEBUG_ASSERT(cpu == arch_curr_cpu_num());
+
+    bool needed = !thread_is_real_time_or_idle(current_thread) && run_queues[cpu].bitmap != 0;
+
+    if (needed == preempt_timer_armed[cpu])
+        return;
+
+#if DEBUG_THREAD_CONTEXT_SWITCH
+    dprintf(ALWAYS, "preempt timer: %s, cpu %u, thread %p (%s)\n",
+            needed ? "start" : "stop", cpu, current_thread, current_thread->name);
+#endif
+
+    if (needed)
+        timer_set_periodic(&preempt_timer[cpu], 10, (timer_callback)thread_timer_tick, NULL);
+    else
+        timer_cancel(&preempt_timer[cpu]);
+    preempt_timer_armed[cpu] = needed;
+}
+#endif
+
 /* timer callback to wake up a sleeping thread */
 static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, void *arg)
 {
@@ -749,12 +1049,9 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(t->state == THREAD_SLEEPING);
 
-    THREAD_LOCK(state);
-
+    /* nothing else touches a sleeping thread, so only its new run queue needs locking */
     t->state = THREAD_READY;
-    insert_in_run_queue_head(t);
-
-    THREAD_UNLOCK(state);
+    thread_make_runnable(t, false);
 
     return INT_RESCHEDULE;
 }
@@ -781,11 +1078,12 @@ void thread_sleep(lk_time_t delay)
 
     timer_initialize(&timer);
 
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    run_queue_lock_irqsave(&state);
     timer_set_oneshot(&timer, delay, thread_sleep_handler, (void *)current_thread);
     current_thread->state = THREAD_SLEEPING;
     thread_resched();
-    THREAD_UNLOCK(state);
+    run_queue_unlock_irqrestore(state);
 }
 
 /**
@@ -800,8 +1098,11 @@ void thread_init_early(void)
     DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
     /* initialize the run queues */
-    for (i=0; i < NUM_PRIORITIES; i++)
-        list_initialize(&run_queue[i]);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        spin_lock_init(&run_queues[cpu].lock);
+        for (i=0; i < NUM_PRIORITIES; i++)
+            list_initialize(&run_queues[cpu].queue[i]);
+    }
 
     /* initialize the thread list */
     list_initialize(&thread_list);
@@ -815,6 +1116,7 @@ void thread_init_early(void)
     t->state = THREAD_RUNNING;
     t->flags = THREAD_FLAG_DETACHED;
     thread_set_curr_cpu(t, 0);
+    thread_set_last_cpu(t, 0);
     thread_set_pinned_cpu(t, 0);
     wait_queue_init(&t->retcode_wait_queue);
     list_add_head(&thread_list, &t->thread_list_node);
@@ -828,6 +1130,9 @@ void thread_init_early(void)
  */
 void thread_init(void)
 {
+    thread_cache = slab_cache_create("thread", sizeof(thread_t), __alignof(thread_t), NULL);
+    ASSERT(thread_cache);
+
 #if PLATFORM_HAS_DYNAMIC_TIMER
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
         timer_initialize(&preempt_timer[i]);
@@ -853,7 +1158,8 @@ void thread_set_priority(int priority)
 {
     thread_t *current_thread = get_current_thread();
 
-    THREAD_LOCK(state);
+    spin_lock_saved_state_t state;
+    struct run_queue *rq = run_queue_lock_irqsave(&state);
 
     if (priority <= IDLE_PRIORITY)
         priority = IDLE_PRIORITY + 1;
@@ -862,10 +1168,10 @@ void thread_set_priority(int priority)
     current_thread->priority = priority;
 
     current_thread->state = THREAD_READY;
-    insert_in_run_queue_head(current_thread);
+    insert_in_run_queue_head(rq, current_thread);
     thread_resched();
 
-    THREAD_UNLOCK(state);
+    run_queue_unlock_irqrestore(state);
 }
 
 /**
@@ -924,6 +1230,7 @@ void thread_secondary_cpu_init_early(void)
     t->state = THREAD_RUNNING;
     t->flags = THREAD_FLAG_DETACHED | THREAD_FLAG_IDLE;
     thread_set_curr_cpu(t, cpu);
+    thread_set_last_cpu(t, cpu);
     thread_set_pinned_cpu(t, cpu);
     wait_queue_init(&t->retcode_wait_queue);
 
@@ -1043,6 +1350,23 @@ void dump_all_threads(void)
     THREAD_UNLOCK(state);
 }
 
+/**
+ * @brief  Call a function on every thread in the system
+ *
+ * The callback is run with the thread lock held and interrupts disabled,
+ * so it must not block or take other locks.
+ */
+void thread_for_each(void (*cb)(thread_t *t, void *arg), void *arg)
+{
+    thread_t *t;
+
+    THREAD_LOCK(state);
+    list_for_every_entry(&thread_list, t, thread_t, thread_list_node) {
+        cb(t, arg);
+    }
+    THREAD_UNLOCK(state);
+}
+
 /** @} */
 
 
@@ -1055,20 +1379,45 @@ void wait_queue_init(wait_queue_t *wait)
     *wait = (wait_queue_t)WAIT_QUEUE_INITIAL_VALUE(*wait);
 }
 
+/*
+ * Serializes timeout handlers looking up the wait queue of the thread they are timing
+ * out against wait_queue_destroy(), so a queue isn't freed out from under them.
+ */
+static spin_lock_t wait_queue_timeout_lock = SPIN_LOCK_INITIAL_VALUE;
+
 static enum handler_return wait_queue_timeout_handler(timer_t *timer, lk_time_t now, void *arg)
 {
     thread_t *thread = (thread_t *)arg;
+    enum handler_return ret = INT_NO_RESCHEDULE;
 
     DEBUG_ASSERT(thread->magic == THREAD_MAGIC);
 
-    spin_lock(&thread_lock);
+    /* the thread may be woken up concurrently, so look up its wait queue under the
+     * timeout lock and back off if the queue is busy, since the lock ordering is the
+     * other way around in wait_queue_destroy() */
+    for (;;) {
+        spin_lock(&wait_queue_timeout_lock);
 
-    enum handler_return ret = INT_NO_RESCHEDULE;
-    if (thread_unblock_from_wait_queue(thread, ERR_TIMED_OUT) >= NO_ERROR) {
-        ret = INT_RESCHEDULE;
-    }
+        wait_queue_t *wait = thread->blocking_wait_queue;
+        if (!wait) {
+            spin_unlock(&wait_queue_timeout_lock);
+            break;
+        }
 
-    spin_unlock(&thread_lock);
+        if (spin_trylock(&wait->lock) == 0) {
+            spin_unlock(&wait_queue_timeout_lock);
+
+            if (thread->blocking_wait_queue == wait &&
+                    thread_unblock_from_wait_queue(thread, ERR_TIMED_OUT) >= NO_ERROR) {
+                ret = INT_RESCHEDULE;
+            }
+
+            spin_unlock(&wait->lock);
+            break;
+        }
+
+        spin_unlock(&wait_queue_timeout_lock);
+    }
 
     return ret;
 }
@@ -1088,6 +1437,9 @@ static enum handler_return wait_queue_timeout_handler(timer_t *timer, lk_time_t
  * waits indefinitely.  Otherwise, this function returns with
  * ERR_TIMED_OUT at the end of the timeout period.
  *
+ * The wait queue's lock must be held. It is released while blocked and
+ * reacquired before returning, unless the queue was destroyed.
+ *
  * @return ERR_TIMED_OUT on timeout, else returns the return
  * value specified when the queue was woken by wait_queue_wake_one().
  */
@@ -1100,7 +1452,7 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(current_thread->state == THREAD_RUNNING);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&wait->lock));
 
     if (timeout == 0)
         return ERR_TIMED_OUT;
@@ -1117,14 +1469,28 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
         timer_set_oneshot(&timer, timeout, wait_queue_timeout_handler, (void *)current_thread);
     }
 
+    /* trade the wait queue lock for the local run queue lock across the switch */
+    spin_lock(&run_queues[arch_curr_cpu_num()].lock);
+    spin_unlock(&wait->lock);
+
     thread_resched();
 
-    /* we don't really know if the timer fired or not, so it's better safe to try to cancel it */
+    spin_unlock(&run_queues[arch_curr_cpu_num()].lock);
+
+    /* we don't really know if the timer fired or not, so it's better safe to try to cancel it.
+     * this also waits for the timeout handler if it is running on another cpu, so it has to
+     * happen before taking the wait queue lock again. */
     if (timeout != INFINITE_TIME) {
         timer_cancel(&timer);
     }
 
-    return current_thread->wait_queue_block_ret;
+    status_t ret = current_thread->wait_queue_block_ret;
+
+    /* the queue may have been freed right after being destroyed */
+    if (ret != ERR_OBJECT_DESTROYED)
+        spin_lock(&wait->lock);
+
+    return ret;
 }
 
 /**
@@ -1146,11 +1512,9 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
     thread_t *t;
     int ret = 0;
 
-    thread_t *current_thread = get_current_thread();
-
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&wait->lock));
 
     t = list_remove_head_type(&wait->list, thread_t, queue_node);
     if (t) {
@@ -1165,13 +1529,11 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
          * before the current one, but the current one doesn't get unnecessarilly punished.
          */
         if (reschedule) {
-            current_thread->state = THREAD_READY;
-            insert_in_run_queue_head(current_thread);
+            thread_requeue_current();
         }
-        insert_in_run_queue_head(t);
-        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+        thread_make_runnable(t, reschedule);
         if (reschedule) {
-            thread_resched();
+            thread_resched_unlocked(&wait->lock);
         }
         ret = 1;
 
@@ -1200,19 +1562,16 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
     thread_t *t;
     int ret = 0;
 
-    thread_t *current_thread = get_current_thread();
-
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&wait->lock));
 
     if (reschedule && wait->count > 0) {
         /* if we're instructed to reschedule, stick the current thread on the head
          * of the run queue first, so that the newly awakened threads get a chance to run
          * before the current one, but the current one doesn't get unnecessarilly punished.
          */
-        current_thread->state = THREAD_READY;
-        insert_in_run_queue_head(current_thread);
+        thread_requeue_current();
     }
 
     /* pop all the threads off the wait queue into the run queue */
@@ -1223,17 +1582,14 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
         t->wait_queue_block_ret = wait_queue_error;
         t->blocking_wait_queue = NULL;
 
-        insert_in_run_queue_head(t);
+        thread_make_runnable(t, false);
         ret++;
     }
 
     DEBUG_ASSERT(wait->count == 0);
 
-    if (ret > 0) {
-        mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
-        if (reschedule) {
-            thread_resched();
-        }
+    if (ret > 0 && reschedule) {
+        thread_resched_unlocked(&wait->lock);
     }
 
     return ret;
@@ -1248,9 +1604,14 @@ void wait_queue_destroy(wait_queue_t *wait, bool reschedule)
 {
     DEBUG_ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
+    DEBUG_ASSERT(spin_lock_held(&wait->lock));
 
     wait_queue_wake_all(wait, reschedule, ERR_OBJECT_DESTROYED);
+
+    /* flush out any timeout handler that looked up this queue before the wake */
+    spin_lock(&wait_queue_timeout_lock);
+    spin_unlock(&wait_queue_timeout_lock);
+
     wait->magic = 0;
 }
 
@@ -1258,7 +1619,8 @@ void wait_queue_destroy(wait_queue_t *wait, bool reschedule)
  * @brief  Wake a specific thread in a wait queue
  *
  * This function extracts a specific thread from a wait queue, wakes it, and
- * puts it at the head of the run queue.
+ * puts it at the head of the run queue. The lock of the wait queue the
+ * thread is blocked on must be held.
  *
  * @param t  The thread to wake
  * @param wait_queue_error  The return value which the new thread will receive
@@ -1270,12 +1632,12 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
 {
     DEBUG_ASSERT(t->magic == THREAD_MAGIC);
     DEBUG_ASSERT(arch_ints_disabled());
-    DEBUG_ASSERT(spin_lock_held(&thread_lock));
 
     if (t->state != THREAD_BLOCKED)
         return ERR_NOT_BLOCKED;
 
     DEBUG_ASSERT(t->blocking_wait_queue != NULL);
+    DEBUG_ASSERT(spin_lock_held(&t->blocking_wait_queue->lock));
     DEBUG_ASSERT(t->blocking_wait_queue->magic == WAIT_QUEUE_MAGIC);
     DEBUG_ASSERT(list_in_list(&t->queue_node));
 
@@ -1284,8 +1646,7 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
     t->blocking_wait_queue = NULL;
     t->state = THREAD_READY;
     t->wait_queue_block_ret = wait_queue_error;
-    insert_in_run_queue_head(t);
-    mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+    thread_make_runnable(t, false);
 
     return NO_ERROR;
 }
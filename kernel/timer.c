@@ -38,6 +38,7 @@
 #include <trace.h>
 #include <assert.h>
 #include <list.h>
+#include <stdlib.h>
 #include <kernel/thread.h>
 #include <kernel/timer.h>
 #include <kernel/debug.h>
@@ -47,12 +48,40 @@
 
 #define LOCAL_TRACE 0
 
+/*
+ * Each cpu keeps its timers in a hierarchical timing wheel. Level 0 has a slot per
+ * millisecond for the next TIMER_WHEEL_SLOTS ms, and each level above covers
+ * TIMER_WHEEL_SLOTS times the span of the one below it. A timer is filed in the
+ * lowest level that covers its deadline, and each time a level completes a lap the
+ * next slot of the level above is cascaded down, so arming and canceling are O(1)
+ * and each timer is moved at most once per level. Timers further out than the
+ * whole wheel sit at its far edge and are re-filed as it turns.
+ */
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1U << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_RANGE (1U << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS))
+
 spin_lock_t timer_lock;
 
 struct timer_state {
-    struct list_node timer_queue;
+    /* the next tick the wheel has yet to process */
+    lk_time_t wheel_time;
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* when the hardware timer is programmed to go off, if it is */
+    bool event_armed;
+    lk_time_t event_time;
+#endif
+    /* the timer whose callback is currently running on this cpu, if any */
+    timer_t *running;
+    /* a bit per non-empty slot, per level */
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    struct list_node wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
 } __CPU_ALIGN;
 
+STATIC_ASSERT(TIMER_WHEEL_SLOTS <= sizeof(uint64_t) * 8);
+
 static struct timer_state timers[SMP_MAX_CPUS];
 
 static enum handler_return timer_tick(void *arg, lk_time_t now);
@@ -65,30 +94,167 @@ void timer_initialize(timer_t *timer)
     *timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
-static void insert_timer_in_queue(uint cpu, timer_t *timer)
+static bool timer_wheel_is_empty(struct timer_state *ts)
 {
-    timer_t *entry;
+    for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (ts->occupied[level])
+            return false;
+    }
+    return true;
+}
+
+static void insert_timer_in_wheel(uint cpu, timer_t *timer)
+{
+    struct timer_state *ts = &timers[cpu];
 
     DEBUG_ASSERT(arch_ints_disabled());
 
     LTRACEF("timer %p, cpu %u, scheduled %u, periodic %u\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
 
-    list_for_every_entry(&timers[cpu].timer_queue, entry, timer_t, node) {
-        if (TIME_GT(entry->scheduled_time, timer->scheduled_time)) {
-            list_add_before(&entry->node, &timer->node);
+    /* timers already due go in the slot about to be processed */
+    lk_time_t expires = timer->scheduled_time;
+    if (TIME_LT(expires, ts->wheel_time))
+        expires = ts->wheel_time;
+
+    lk_time_t delta = expires - ts->wheel_time;
+    if (delta >= TIMER_WHEEL_RANGE) {
+        delta = TIMER_WHEEL_RANGE - 1;
+        expires = ts->wheel_time + delta;
+    }
+
+    uint level = 0;
+    while (delta >= (1U << ((level + 1) * TIMER_WHEEL_BITS)))
+        level++;
+
+    uint slot = (expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+    list_add_tail(&ts->wheel[level][slot], &timer->node);
+    ts->occupied[level] |= 1ULL << slot;
+}
+
+static timer_t *timer_wheel_remove_head(struct timer_state *ts, uint level, uint slot)
+{
+    timer_t *timer = list_remove_head_type(&ts->wheel[level][slot], timer_t, node);
+
+    if (list_is_empty(&ts->wheel[level][slot]))
+        ts->occupied[level] &= ~(1ULL << slot);
+
+    return timer;
+}
+
+static void remove_timer_from_wheel(timer_t *timer)
+{
+    /* if it is the only timer in its slot, both neighbors are the slot's list head */
+    struct list_node *head = timer->node.next;
+    bool last = (head == timer->node.prev);
+
+    list_delete(&timer->node);
+    if (!last)
+        return;
+
+    /* find the slot from the address of its list head and mark it empty */
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct list_node *first = &timers[cpu].wheel[0][0];
+        if (head >= first && head < first + TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS) {
+            uint i = head - first;
+            timers[cpu].occupied[i / TIMER_WHEEL_SLOTS] &= ~(1ULL << (i % TIMER_WHEEL_SLOTS));
             return;
         }
     }
 
-    /* walked off the end of the list */
-    list_add_tail(&timers[cpu].timer_queue, &timer->node);
+    panic("timer %p not in a timer wheel\n", timer);
 }
 
-static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_callback callback, void *arg)
+/* move the timers in the current slot of a level down to where they now belong */
+static void timer_wheel_cascade(uint cpu, uint level)
+{
+    struct timer_state *ts = &timers[cpu];
+    uint slot = (ts->wheel_time >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+    timer_t *timer;
+
+    while ((timer = timer_wheel_remove_head(ts, level, slot)))
+        insert_timer_in_wheel(cpu, timer);
+}
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* find the next tick at which the wheel has a timer to fire or a slot to cascade */
+static bool timer_wheel_next_event(struct timer_state *ts, lk_time_t *next)
+{
+    bool found = false;
+
+    for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t occupied = ts->occupied[level];
+        if (!occupied)
+            continue;
+
+        /* the first tick at or after the wheel's time that this level turns on */
+        uint shift = level * TIMER_WHEEL_BITS;
+        lk_time_t base = ROUNDUP(ts->wheel_time, 1U << shift);
+        uint index = (base >> shift) & TIMER_WHEEL_MASK;
+
+        /* rotate so the slot for that tick is bit 0 and find the first one in use */
+        if (index)
+            occupied = (occupied >> index) | (occupied << (TIMER_WHEEL_SLOTS - index));
+        lk_time_t t = base + ((lk_time_t)__builtin_ctzll(occupied) << shift);
+
+        if (!found || TIME_LT(t, *next))
+            *next = t;
+        found = true;
+    }
+
+    return found;
+}
+
+/* program the local hardware timer for the wheel's next event, if it moved */
+static void timer_update_hw(struct timer_state *ts)
+{
+    lk_time_t next;
+
+    if (!timer_wheel_next_event(ts, &next)) {
+        if (ts->event_armed) {
+            LTRACEF("clearing old hw timer, nothing in the queue\n");
+            platform_stop_timer();
+            ts->event_armed = false;
+        }
+        return;
+    }
+
+    if (ts->event_armed && ts->event_time == next)
+        return;
+
+    lk_time_t now = current_time();
+    lk_time_t delay = TIME_LT(next, now) ? 0 : next - now;
+
+    LTRACEF("setting new timer for %u msecs\n", (uint)delay);
+    platform_set_oneshot_timer(timer_tick, NULL, delay);
+    ts->event_armed = true;
+    ts->event_time = next;
+}
+#endif
+
+/*
+ * Pick the deadline within [deadline, deadline + slack] with the most trailing
+ * zero bits, so timers with overlapping windows tend to land in the same slot and
+ * are dispatched by the same tick.
+ */
+static lk_time_t timer_apply_slack(lk_time_t deadline, lk_time_t slack)
+{
+    lk_time_t limit = deadline + slack;
+
+    if (slack == 0 || limit < deadline)
+        return deadline;
+
+    /* keep the bits above the highest one that differs and round the rest down */
+    lk_time_t mask = (1U << (31 - __builtin_clz(deadline ^ limit))) - 1;
+
+    return limit & ~mask;
+}
+
+static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, lk_time_t slack,
+                      timer_callback callback, void *arg)
 {
     lk_time_t now;
 
-    LTRACEF("timer %p, delay %u, period %u, callback %p, arg %p\n", timer, delay, period, callback, arg);
+    LTRACEF("timer %p, delay %u, period %u, slack %u, callback %p, arg %p\n", timer, delay, period, slack, callback, arg);
 
     DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
@@ -97,8 +263,9 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
     }
 
     now = current_time();
-    timer->scheduled_time = now + delay;
+    timer->scheduled_time = timer_apply_slack(now + delay, slack);
     timer->periodic_time = period;
+    timer->slack = slack;
     timer->callback = callback;
     timer->arg = arg;
 
@@ -108,14 +275,17 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
     spin_lock_irqsave(&timer_lock, state);
 
     uint cpu = arch_curr_cpu_num();
-    insert_timer_in_queue(cpu, timer);
+    struct timer_state *ts = &timers[cpu];
+
+    /* an empty wheel can skip straight to the present instead of turning through
+     * the idle time, unless we're inside this cpu's timer tick */
+    if (!ts->running && timer_wheel_is_empty(ts))
+        ts->wheel_time = now;
+
+    insert_timer_in_wheel(cpu, timer);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    if (list_peek_head_type(&timers[cpu].timer_queue, timer_t, node) == timer) {
-        /* we just modified the head of the timer queue */
-        LTRACEF("setting new timer for %u msecs\n", delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    timer_update_hw(ts);
 #endif
 
     spin_unlock_irqrestore(&timer_lock, state);
@@ -139,7 +309,27 @@ void timer_set_oneshot(timer_t *timer, lk_time_t delay, timer_callback callback,
 {
     if (delay == 0)
         delay = 1;
-    timer_set(timer, delay, 0, callback, arg);
+    timer_set(timer, delay, 0, 0, callback, arg);
+}
+
+/**
+ * @brief  Set up a timer that executes once, within a window
+ *
+ * Like timer_set_oneshot(), but the callback may be deferred by up to slack ms
+ * past the delay. The timer core uses the window to coalesce nearby expirations
+ * onto a single tick, which saves interrupts on tickless platforms.
+ *
+ * @param  timer The timer to use
+ * @param  delay The minimum delay, in ms, before the timer is executed
+ * @param  slack How much later than delay, in ms, the timer may be executed
+ * @param  callback  The function to call when the timer expires
+ * @param  arg  The argument to pass to the callback
+ */
+void timer_set_oneshot_slack(timer_t *timer, lk_time_t delay, lk_time_t slack, timer_callback callback, void *arg)
+{
+    if (delay == 0)
+        delay = 1;
+    timer_set(timer, delay, 0, slack, callback, arg);
 }
 
 /**
@@ -160,11 +350,15 @@ void timer_set_periodic(timer_t *timer, lk_time_t period, timer_callback callbac
 {
     if (period == 0)
         period = 1;
-    timer_set(timer, period, period, callback, arg);
+    timer_set(timer, period, period, 0, callback, arg);
 }
 
 /**
  * @brief  Cancel a pending timer
+ *
+ * If the timer's callback is running on another cpu, wait for it to complete,
+ * so the timer may be freed once this returns. Must not be called while holding
+ * a lock that the callback takes.
  */
 void timer_cancel(timer_t *timer)
 {
@@ -173,14 +367,8 @@ void timer_cancel(timer_t *timer)
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&timer_lock, state);
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-    uint cpu = arch_curr_cpu_num();
-
-    timer_t *oldhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-#endif
-
     if (list_in_list(&timer->node))
-        list_delete(&timer->node);
+        remove_timer_from_wheel(timer);
 
     /* to keep it from being reinserted into the queue if called from
      * periodic timer callback.
@@ -190,26 +378,22 @@ void timer_cancel(timer_t *timer)
     timer->arg = NULL;
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-    /* see if we've just modified the head of the timer queue */
-    timer_t *newhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (newhead == NULL) {
-        LTRACEF("clearing old hw timer, nothing in the queue\n");
-        platform_stop_timer();
-    } else if (newhead != oldhead) {
-        lk_time_t delay;
-        lk_time_t now = current_time();
-
-        if (TIME_LT(newhead->scheduled_time, now))
-            delay = 0;
-        else
-            delay = newhead->scheduled_time - now;
-
-        LTRACEF("setting new timer to %u\n", (uint) delay);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    /* see if we've just moved the next event on this cpu */
+    timer_update_hw(&timers[arch_curr_cpu_num()]);
 #endif
 
     spin_unlock_irqrestore(&timer_lock, state);
+
+#if WITH_SMP
+    uint curr_cpu = arch_curr_cpu_num();
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (i == curr_cpu)
+            continue;
+        while (*(timer_t * volatile *)&timers[i].running == timer)
+            ;
+    }
+    smp_mb();
+#endif
 }
 
 /* called at interrupt time to process any pending timers */
@@ -224,64 +408,81 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 //  KEVLOG_TIMER_TICK(); // enable only if necessary
 
     uint cpu = arch_curr_cpu_num();
+    struct timer_state *ts = &timers[cpu];
 
     LTRACEF("cpu %u now %u, sp %p\n", cpu, now, __GET_FRAME());
 
     spin_lock(&timer_lock);
 
-    for (;;) {
-        /* see if there's an event to process */
-        timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-        if (likely(timer == 0))
-            break;
-        LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
-        if (likely(TIME_LT(now, timer->scheduled_time)))
-            break;
+#if PLATFORM_HAS_DYNAMIC_TIMER
+    /* the one shot that got us here is spent */
+    ts->event_armed = false;
+#endif
 
-        /* process it */
-        LTRACEF("timer %p\n", timer);
-        DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
-        list_delete(&timer->node);
+    /* turn the wheel up to the present */
+    while (TIME_LTE(ts->wheel_time, now)) {
+        lk_time_t tick = ts->wheel_time;
+        uint slot = tick & TIMER_WHEEL_MASK;
+
+        /* at the start of each lap of a level, cascade the next slot of the level above */
+        if (slot == 0) {
+            for (uint level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+                timer_wheel_cascade(cpu, level);
+                if (((tick >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK) != 0)
+                    break;
+            }
+        }
 
-        /* we pulled it off the list, release the list lock to handle it */
-        spin_unlock(&timer_lock);
+        /* fire everything due this tick */
+        while ((timer = timer_wheel_remove_head(ts, 0, slot))) {
+            LTRACEF("next item on timer queue %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
+            DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
+            ts->running = timer;
 
-        LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
+            /* we pulled it off the list, release the list lock to handle it */
+            spin_unlock(&timer_lock);
 
-        THREAD_STATS_INC(timers);
+            LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
 
-        bool periodic = timer->periodic_time > 0;
+            THREAD_STATS_INC(timers);
 
-        LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
-        KEVLOG_TIMER_CALL(timer->callback, timer->arg);
-        if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
-            ret = INT_RESCHEDULE;
+            bool periodic = timer->periodic_time > 0;
 
-        /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
-        spin_lock(&timer_lock);
+            LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
+            KEVLOG_TIMER_CALL(timer->callback, timer->arg);
+            if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
+                ret = INT_RESCHEDULE;
 
-        /* if it was a periodic timer and it hasn't been requeued
-         * by the callback put it back in the list
-         */
-        if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
-            LTRACEF("periodic timer, period %u\n", timer->periodic_time);
-            timer->scheduled_time = now + timer->periodic_time;
-            insert_timer_in_queue(cpu, timer);
+            /* it may have been requeued or periodic, grab the lock so we can safely inspect it */
+            spin_lock(&timer_lock);
+#if WITH_SMP
+            /* make the callback's effects visible before letting timer_cancel() return */
+            smp_mb();
+#endif
+            ts->running = NULL;
+
+            /* if it was a periodic timer and it hasn't been requeued
+             * by the callback put it back in the list
+             */
+            if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
+                LTRACEF("periodic timer, period %u\n", timer->periodic_time);
+                timer->scheduled_time = timer_apply_slack(now + timer->periodic_time, timer->slack);
+                insert_timer_in_wheel(cpu, timer);
+            }
         }
+
+        /* skip ahead to the next slot in use on this lap, or the start of the next lap */
+        lk_time_t next = (tick | TIMER_WHEEL_MASK) + 1;
+        uint64_t later = (slot == TIMER_WHEEL_MASK) ? 0 : ts->occupied[0] & (~0ULL << (slot + 1));
+        if (later)
+            next = (tick & ~TIMER_WHEEL_MASK) + __builtin_ctzll(later);
+
+        ts->wheel_time = TIME_GT(next, now) ? now + 1 : next;
     }
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
     /* reset the timer to the next event */
-    timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-    if (timer) {
-        /* has to be the case or it would have fired already */
-        DEBUG_ASSERT(TIME_GT(timer->scheduled_time, now));
-
-        lk_time_t delay = timer->scheduled_time - now;
-
-        LTRACEF("setting new timer for %u msecs for event %p\n", (uint)delay, timer);
-        platform_set_oneshot_timer(timer_tick, NULL, delay);
-    }
+    timer_update_hw(ts);
 
     /* we're done manipulating the timer queue */
     spin_unlock(&timer_lock);
@@ -302,7 +503,10 @@ void timer_init(void)
 {
     timer_lock = SPIN_LOCK_INITIAL_VALUE;
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-        list_initialize(&timers[i].timer_queue);
+        for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            for (uint slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+                list_initialize(&timers[i].wheel[level][slot]);
+        }
     }
 #if !PLATFORM_HAS_DYNAMIC_TIMER
     /* register for a periodic timer tick */
@@ -32,18 +32,28 @@
 #include <pow2.h>
 #include <lib/console.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <arch/ops.h>
 
 #define LOCAL_TRACE 0
 
 static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
 static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
 
-#define PAGE_BELONGS_TO_ARENA(page, arena) \
-    (((uintptr_t)(page) >= (uintptr_t)(arena)->page_array) && \
-     ((uintptr_t)(page) < ((uintptr_t)(arena)->page_array + (arena)->size / PAGE_SIZE * sizeof(vm_page_t))))
+/* arenas indexed by vm_page_t.arena, so a page can find its owner without a search */
+static pmm_arena_t *arenas[PMM_MAX_ARENAS];
+static uint arena_count;
 
-#define PAGE_ADDRESS_FROM_ARENA(page, arena) \
-    (paddr_t)(((uintptr_t)page - (uintptr_t)(arena)->page_array) / sizeof(vm_page_t)) * PAGE_SIZE + (arena)->base;
+/* per cpu cache of single kmap pages. Only touched by the owning cpu with
+ * interrupts disabled, so the single page paths never take the pmm lock.
+ */
+#define PCP_MAX_PAGES 32
+#define PCP_BATCH 16
+
+static struct pmm_pcp {
+    struct list_node pages;
+    uint count;
+} pcp[SMP_MAX_CPUS];
 
 #define ADDRESS_IN_ARENA(address, arena) \
     ((address) >= (arena)->base && (address) <= (arena)->base + (arena)->size - 1)
@@ -53,22 +63,31 @@ static inline bool page_is_free(const vm_page_t *page)
     return !(page->flags & VM_PAGE_FLAG_NONFREE);
 }
 
+static inline size_t arena_page_count(const pmm_arena_t *a)
+{
+    return a->size / PAGE_SIZE;
+}
+
+/* physical page number of the page at index in the arena */
+static inline paddr_t arena_pfn(const pmm_arena_t *a, size_t index)
+{
+    return a->base / PAGE_SIZE + index;
+}
+
 paddr_t vm_page_to_paddr(const vm_page_t *page)
 {
-    pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        if (PAGE_BELONGS_TO_ARENA(page, a)) {
-            return PAGE_ADDRESS_FROM_ARENA(page, a);
-        }
-    }
-    return -1;
+    pmm_arena_t *a = arenas[page->arena];
+    if (!a || page < a->page_array || page >= a->page_array + arena_page_count(a))
+        return -1;
+
+    return a->base + (page - a->page_array) * PAGE_SIZE;
 }
 
 vm_page_t *paddr_to_vm_page(paddr_t addr)
 {
-    pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        if (addr >= a->base && addr <= a->base + a->size - 1) {
+    for (uint i = 0; i < arena_count; i++) {
+        pmm_arena_t *a = arenas[i];
+        if (ADDRESS_IN_ARENA(addr, a)) {
             size_t index = (addr - a->base) / PAGE_SIZE;
             return &a->page_array[index];
         }
@@ -76,6 +95,290 @@ vm_page_t *paddr_to_vm_page(paddr_t addr)
     return NULL;
 }
 
+/* buddy allocator. Every free page belongs to exactly one block of 2^order pages,
+ * aligned to its size in physical page numbers. The first page of each block is
+ * tagged VM_PAGE_FLAG_BUDDY, holds the order and sits on free_list[order].
+ * Pages inside a block other than the head carry no state.
+ */
+static void buddy_add_block(pmm_arena_t *a, size_t index, uint order)
+{
+    vm_page_t *page = &a->page_array[index];
+
+    DEBUG_ASSERT(page_is_free(page));
+    DEBUG_ASSERT(!(page->flags & VM_PAGE_FLAG_BUDDY));
+
+    page->flags |= VM_PAGE_FLAG_BUDDY;
+    page->order = order;
+    list_add_head(&a->free_list[order], &page->node);
+    a->free_count += 1UL << order;
+}
+
+static void buddy_remove_block(pmm_arena_t *a, vm_page_t *page)
+{
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_BUDDY);
+
+    list_delete(&page->node);
+    page->flags &= ~VM_PAGE_FLAG_BUDDY;
+    a->free_count -= 1UL << page->order;
+}
+
+/* free a block, coalescing it with its buddy for as long as the buddy is free as well */
+static void buddy_free_block(pmm_arena_t *a, size_t index, uint order)
+{
+    paddr_t base_pfn = arena_pfn(a, 0);
+    size_t page_count = arena_page_count(a);
+
+    while (order < PMM_MAX_ORDER) {
+        paddr_t buddy_pfn = arena_pfn(a, index) ^ (1UL << order);
+        if (buddy_pfn < base_pfn || buddy_pfn - base_pfn + (1UL << order) > page_count)
+            break;
+
+        vm_page_t *buddy = &a->page_array[buddy_pfn - base_pfn];
+        if (!(buddy->flags & VM_PAGE_FLAG_BUDDY) || buddy->order != order)
+            break;
+
+        buddy_remove_block(a, buddy);
+        index = MIN(index, buddy_pfn - base_pfn);
+        order++;
+    }
+
+    buddy_add_block(a, index, order);
+}
+
+/* free the pages [index, end) as the largest aligned blocks that fit */
+static void buddy_free_range(pmm_arena_t *a, size_t index, size_t end)
+{
+    while (index < end) {
+        paddr_t pfn = arena_pfn(a, index);
+        uint order = 0;
+        while (order < PMM_MAX_ORDER && (pfn & (1UL << order)) == 0 &&
+                index + (2UL << order) <= end)
+            order++;
+
+        buddy_free_block(a, index, order);
+        index += 1UL << order;
+    }
+}
+
+/* remove a block of 2^order pages, splitting a larger one if needed.
+ * Returns the index of the first page or -1 if nothing large enough is free.
+ */
+static ssize_t buddy_alloc_block(pmm_arena_t *a, uint order)
+{
+    uint o;
+    for (o = order; o <= PMM_MAX_ORDER; o++) {
+        if (!list_is_empty(&a->free_list[o]))
+            break;
+    }
+    if (o > PMM_MAX_ORDER)
+        return -1;
+
+    vm_page_t *page = list_peek_head_type(&a->free_list[o], vm_page_t, node);
+    buddy_remove_block(a, page);
+
+    /* hand back the upper halves until we're down to the requested size */
+    size_t index = page - a->page_array;
+    while (o > order) {
+        o--;
+        buddy_add_block(a, index + (1UL << o), o);
+    }
+
+    return index;
+}
+
+/* remove one specific free page from whichever block holds it */
+static void buddy_take_page(pmm_arena_t *a, size_t index)
+{
+    paddr_t pfn = arena_pfn(a, index);
+    paddr_t base_pfn = arena_pfn(a, 0);
+
+    DEBUG_ASSERT(page_is_free(&a->page_array[index]));
+
+    for (uint o = 0; o <= PMM_MAX_ORDER; o++) {
+        paddr_t head_pfn = pfn & ~((1UL << o) - 1);
+        if (head_pfn < base_pfn)
+            break;
+
+        vm_page_t *head = &a->page_array[head_pfn - base_pfn];
+        if (!(head->flags & VM_PAGE_FLAG_BUDDY) || head->order < o)
+            continue;
+
+        /* split the block in halves, freeing the half that doesn't hold the page */
+        size_t start = head_pfn - base_pfn;
+        uint order = head->order;
+        buddy_remove_block(a, head);
+        while (order > 0) {
+            order--;
+            size_t half = 1UL << order;
+            if (index < start + half) {
+                buddy_add_block(a, start + half, order);
+            } else {
+                buddy_add_block(a, start, order);
+                start += half;
+            }
+        }
+        return;
+    }
+
+    panic("pmm: free page %zu in arena '%s' is not in any block\n", index, a->name);
+}
+
+static void buddy_free_page(vm_page_t *page)
+{
+    pmm_arena_t *a = arenas[page->arena];
+
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
+
+    page->flags &= ~VM_PAGE_FLAG_NONFREE;
+    buddy_free_block(a, page - a->page_array, 0);
+}
+
+/* mark count pages starting at index as allocated, optionally appending them to list */
+static void arena_mark_allocated(pmm_arena_t *a, size_t index, size_t count, struct list_node *list)
+{
+    for (size_t i = index; i < index + count; i++) {
+        vm_page_t *p = &a->page_array[i];
+
+        DEBUG_ASSERT(page_is_free(p));
+        DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_BUDDY));
+
+        p->flags |= VM_PAGE_FLAG_NONFREE;
+        if (list)
+            list_add_tail(list, &p->node);
+    }
+}
+
+static vm_page_t *pcp_refill(void);
+
+/* grab a page from the local cache, refilling it from the arenas if it's empty */
+static vm_page_t *pcp_alloc(void)
+{
+    if (unlikely(arena_count == 0))
+        return NULL;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pmm_pcp *c = &pcp[arch_curr_cpu_num()];
+    vm_page_t *page = list_remove_head_type(&c->pages, vm_page_t, node);
+    if (page)
+        c->count--;
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (!page)
+        page = pcp_refill();
+
+    return page;
+}
+
+static vm_page_t *pcp_refill(void)
+{
+    struct list_node batch = LIST_INITIAL_VALUE(batch);
+    uint count = 0;
+
+    mutex_acquire(&lock);
+
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (!(a->flags & PMM_ARENA_FLAG_KMAP))
+            continue;
+
+        while (count < PCP_BATCH) {
+            ssize_t index = buddy_alloc_block(a, 0);
+            if (index < 0)
+                break;
+
+            arena_mark_allocated(a, index, 1, &batch);
+            count++;
+        }
+        if (count == PCP_BATCH)
+            break;
+    }
+
+    mutex_release(&lock);
+
+    vm_page_t *page = list_remove_head_type(&batch, vm_page_t, node);
+    if (!page)
+        return NULL;
+
+    /* we may have migrated while holding the mutex, stash the rest on whichever cpu we're on now */
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pmm_pcp *c = &pcp[arch_curr_cpu_num()];
+    vm_page_t *p;
+    while (c->count < PCP_MAX_PAGES && (p = list_remove_head_type(&batch, vm_page_t, node))) {
+        list_add_head(&c->pages, &p->node);
+        c->count++;
+    }
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    /* the cache filled up underneath us, give back what's left */
+    if (!list_is_empty(&batch)) {
+        mutex_acquire(&lock);
+        while ((p = list_remove_head_type(&batch, vm_page_t, node)))
+            buddy_free_page(p);
+        mutex_release(&lock);
+    }
+
+    return page;
+}
+
+/* stash a freed page in the local cache. If the cache is full, a batch of the
+ * coldest pages is moved to spill for the caller to return to the arenas.
+ */
+static void pcp_free(vm_page_t *page, struct list_node *spill)
+{
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pmm_pcp *c = &pcp[arch_curr_cpu_num()];
+    if (c->count == PCP_MAX_PAGES) {
+        for (uint i = 0; i < PCP_BATCH; i++) {
+            vm_page_t *p = list_remove_tail_type(&c->pages, vm_page_t, node);
+            list_add_tail(spill, &p->node);
+        }
+        c->count -= PCP_BATCH;
+    }
+
+    list_add_head(&c->pages, &page->node);
+    c->count++;
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* return everything in the local cache to the arenas. Returns the number of pages freed. */
+static uint pcp_drain(void)
+{
+    if (unlikely(arena_count == 0))
+        return 0;
+
+    struct list_node pages = LIST_INITIAL_VALUE(pages);
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pmm_pcp *c = &pcp[arch_curr_cpu_num()];
+    uint count = c->count;
+    vm_page_t *p;
+    while ((p = list_remove_head_type(&c->pages, vm_page_t, node)))
+        list_add_tail(&pages, &p->node);
+    c->count = 0;
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    if (count > 0) {
+        mutex_acquire(&lock);
+        while ((p = list_remove_head_type(&pages, vm_page_t, node)))
+            buddy_free_page(p);
+        mutex_release(&lock);
+    }
+
+    return count;
+}
+
 status_t pmm_add_arena(pmm_arena_t *arena)
 {
     LTRACEF("arena %p name '%s' base 0x%lx size 0x%zx\n", arena, arena->name, arena->base, arena->size);
@@ -84,6 +387,16 @@ status_t pmm_add_arena(pmm_arena_t *arena)
     DEBUG_ASSERT(IS_PAGE_ALIGNED(arena->size));
     DEBUG_ASSERT(arena->size > 0);
 
+    if (arena_count == PMM_MAX_ARENAS) {
+        TRACEF("too many arenas, dropping '%s'\n", arena->name);
+        return ERR_NO_RESOURCES;
+    }
+
+    if (arena_count == 0) {
+        for (uint i = 0; i < SMP_MAX_CPUS; i++)
+            list_initialize(&pcp[i].pages);
+    }
+
     /* walk the arena list and add arena based on priority order */
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
@@ -100,23 +413,23 @@ done_add:
 
     /* zero out some of the structure */
     arena->free_count = 0;
-    list_initialize(&arena->free_list);
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++)
+        list_initialize(&arena->free_list[i]);
 
     /* allocate an array of pages to back this one */
-    size_t page_count = arena->size / PAGE_SIZE;
+    size_t page_count = arena_page_count(arena);
     arena->page_array = boot_alloc_mem(page_count * sizeof(vm_page_t));
 
     /* initialize all of the pages */
     memset(arena->page_array, 0, page_count * sizeof(vm_page_t));
 
-    /* add them to the free list */
-    for (size_t i = 0; i < page_count; i++) {
-        vm_page_t *p = &arena->page_array[i];
+    uint index = arena_count++;
+    arenas[index] = arena;
+    for (size_t i = 0; i < page_count; i++)
+        arena->page_array[i].arena = index;
 
-        list_add_tail(&arena->free_list, &p->node);
-
-        arena->free_count++;
-    }
+    /* carve the arena into free blocks */
+    buddy_free_range(arena, 0, page_count);
 
     return NO_ERROR;
 }
@@ -132,26 +445,35 @@ size_t pmm_alloc_pages(uint count, struct list_node *list)
     if (count == 0)
         return 0;
 
+    if (count == 1) {
+        vm_page_t *page = pcp_alloc();
+        if (page) {
+            list_add_tail(list, &page->node);
+            return 1;
+        }
+    }
+
     mutex_acquire(&lock);
 
-    /* walk the arenas in order, allocating as many pages as we can from each */
+    /* walk the arenas in order, allocating as many pages as we can from each,
+     * taking the largest blocks that fit in what's left of the request */
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
         while (allocated < count) {
-            vm_page_t *page = list_remove_head_type(&a->free_list, vm_page_t, node);
-            if (!page)
-                goto done;
-
-            a->free_count--;
-
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
+            uint order = MIN(log2_uint(count - allocated), PMM_MAX_ORDER);
+            ssize_t index;
+            while ((index = buddy_alloc_block(a, order)) < 0 && order > 0)
+                order--;
+            if (index < 0)
+                break;
 
-            allocated++;
+            arena_mark_allocated(a, index, 1UL << order, list);
+            allocated += 1U << order;
         }
+        if (allocated == count)
+            break;
     }
 
-done:
     mutex_release(&lock);
     return allocated;
 }
@@ -176,7 +498,7 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
         while (allocated < count && ADDRESS_IN_ARENA(address, a)) {
             size_t index = (address - a->base) / PAGE_SIZE;
 
-            DEBUG_ASSERT(index < a->size / PAGE_SIZE);
+            DEBUG_ASSERT(index < arena_page_count(a));
 
             vm_page_t *page = &a->page_array[index];
             if (page->flags & VM_PAGE_FLAG_NONFREE) {
@@ -184,13 +506,9 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
                 break;
             }
 
-            DEBUG_ASSERT(list_in_list(&page->node));
+            buddy_take_page(a, index);
+            arena_mark_allocated(a, index, 1, list);
 
-            list_delete(&page->node);
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            list_add_tail(list, &page->node);
-
-            a->free_count--;
             allocated++;
             address += PAGE_SIZE;
         }
@@ -209,29 +527,41 @@ size_t pmm_free(struct list_node *list)
 
     DEBUG_ASSERT(list);
 
-    mutex_acquire(&lock);
-
+    struct list_node spill = LIST_INITIAL_VALUE(spill);
     uint count = 0;
-    while (!list_is_empty(list)) {
-        vm_page_t *page = list_remove_head_type(list, vm_page_t, node);
 
-        DEBUG_ASSERT(!list_in_list(&page->node));
-        DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
+    /* a lone kmap page goes to the local cache, larger frees go straight back
+     * to the arenas so they can coalesce */
+    if (list->next != list && list->next->next == list) {
+        vm_page_t *page = list_peek_head_type(list, vm_page_t, node);
 
-        /* see which arena this page belongs to and add it */
-        pmm_arena_t *a;
-        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-            if (PAGE_BELONGS_TO_ARENA(page, a)) {
-                page->flags &= ~VM_PAGE_FLAG_NONFREE;
+        DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
 
-                list_add_head(&a->free_list, &page->node);
-                a->free_count++;
-                count++;
-                break;
-            }
+        if (arenas[page->arena]->flags & PMM_ARENA_FLAG_KMAP) {
+            list_delete(&page->node);
+            pcp_free(page, &spill);
+            count++;
+            if (list_is_empty(&spill))
+                return count;
         }
     }
 
+    mutex_acquire(&lock);
+
+    vm_page_t *page;
+    while ((page = list_remove_head_type(list, vm_page_t, node))) {
+        DEBUG_ASSERT(!list_in_list(&page->node));
+        DEBUG_ASSERT(page->arena < arena_count);
+
+        buddy_free_page(page);
+        count++;
+    }
+
+    /* pages pushed out of the cache don't count towards what the caller freed */
+    while ((page = list_remove_head_type(&spill, vm_page_t, node))) {
+        buddy_free_page(page);
+    }
+
     mutex_release(&lock);
     return count;
 }
@@ -251,8 +581,15 @@ void *pmm_alloc_kpages(uint count, struct list_node *list)
 {
     LTRACEF("count %u\n", count);
 
-    // XXX do fast path for single page
-
+    /* fast path for single pages out of the per cpu cache */
+    if (count == 1) {
+        vm_page_t *page = pcp_alloc();
+        if (page) {
+            if (list)
+                list_add_tail(list, &page->node);
+            return paddr_to_kvaddr(vm_page_to_paddr(page));
+        }
+    }
 
     paddr_t pa;
     size_t alloc_count = pmm_alloc_contiguous(count, PAGE_SIZE_SHIFT, &pa, list);
@@ -284,6 +621,51 @@ size_t pmm_free_kpages(void *_ptr, uint count)
     return pmm_free(&list);
 }
 
+/* linear search for a free, aligned run of pages. Used for runs larger than the
+ * biggest buddy block, or when no aligned block is free but a run straddling
+ * blocks is. Returns the index of the run or -1.
+ */
+static ssize_t arena_find_run(pmm_arena_t *a, uint count, uint8_t alignment_log2)
+{
+    /* walk the list starting at alignment boundaries.
+     * calculate the starting offset into this arena, based on the
+     * base address of the arena to handle the case where the arena
+     * is not aligned on the same boundary requested.
+     */
+    paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
+    if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+        return -1;
+
+    uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
+    uint start = aligned_offset;
+    LTRACEF("starting search at aligned offset %u\n", start);
+    LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
+
+retry:
+    /* search while we're still within the arena and have a chance of finding a slot
+       (start + count < end of arena) */
+    while ((start < arena_page_count(a)) &&
+            ((start + count) <= arena_page_count(a))) {
+        vm_page_t *p = &a->page_array[start];
+        for (uint i = 0; i < count; i++) {
+            if (p->flags & VM_PAGE_FLAG_NONFREE) {
+                /* this run is broken, break out of the inner loop.
+                 * start over at the next alignment boundary
+                 */
+                start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
+                goto retry;
+            }
+            p++;
+        }
+
+        /* we found a run */
+        LTRACEF("found run from pn %u to %u\n", start, start + count);
+        return start;
+    }
+
+    return -1;
+}
+
 size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list)
 {
     LTRACEF("count %u, align %u\n", count, alignment_log2);
@@ -293,88 +675,82 @@ size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, str
     if (alignment_log2 < PAGE_SIZE_SHIFT)
         alignment_log2 = PAGE_SIZE_SHIFT;
 
+    /* the smallest buddy block that covers both the size and the alignment */
+    uint order = PMM_MAX_ORDER + 1;
+    if (count <= (1U << PMM_MAX_ORDER))
+        order = MAX(log2_uint(round_up_pow2_u32(count)), (uint)(alignment_log2 - PAGE_SIZE_SHIFT));
+
+    bool drained = false;
+
+retry:
     mutex_acquire(&lock);
 
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
         // XXX make this a flag to only search kmap?
-        if (a->flags & PMM_ARENA_FLAG_KMAP) {
-            /* walk the list starting at alignment boundaries.
-             * calculate the starting offset into this arena, based on the
-             * base address of the arena to handle the case where the arena
-             * is not aligned on the same boundary requested.
-             */
-            paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
-            if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+        if (!(a->flags & PMM_ARENA_FLAG_KMAP))
+            continue;
+
+        ssize_t index = -1;
+        if (order <= PMM_MAX_ORDER) {
+            index = buddy_alloc_block(a, order);
+            if (index >= 0) {
+                /* give back the tail of the block past what was asked for */
+                buddy_free_range(a, index + count, index + (1UL << order));
+            }
+        }
+
+        if (index < 0) {
+            index = arena_find_run(a, count, alignment_log2);
+            if (index < 0)
                 continue;
 
-            uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
-            uint start = aligned_offset;
-            LTRACEF("starting search at aligned offset %u\n", start);
-            LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
+            for (uint i = 0; i < count; i++)
+                buddy_take_page(a, index + i);
+        }
 
-retry:
-            /* search while we're still within the arena and have a chance of finding a slot
-               (start + count < end of arena) */
-            while ((start < a->size / PAGE_SIZE) &&
-                    ((start + count) <= a->size / PAGE_SIZE)) {
-                vm_page_t *p = &a->page_array[start];
-                for (uint i = 0; i < count; i++) {
-                    if (p->flags & VM_PAGE_FLAG_NONFREE) {
-                        /* this run is broken, break out of the inner loop.
-                         * start over at the next alignment boundary
-                         */
-                        start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
-                        goto retry;
-                    }
-                    p++;
-                }
-
-                /* we found a run */
-                LTRACEF("found run from pn %u to %u\n", start, start + count);
-
-                /* remove the pages from the run out of the free list */
-                for (uint i = start; i < start + count; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
-
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    a->free_count--;
-
-                    if (list)
-                        list_add_tail(list, &p->node);
-                }
-
-                if (pa)
-                    *pa = a->base + start * PAGE_SIZE;
-
-                mutex_release(&lock);
+        arena_mark_allocated(a, index, count, list);
 
-                return count;
-            }
-        }
+        if (pa)
+            *pa = a->base + index * PAGE_SIZE;
+
+        mutex_release(&lock);
+
+        return count;
     }
 
     mutex_release(&lock);
 
+    /* pages parked in the local cache may be what's breaking up a run */
+    if (!drained && pcp_drain() > 0) {
+        drained = true;
+        goto retry;
+    }
+
     LTRACEF("couldn't find run\n");
     return 0;
 }
 
+
 static void dump_page(const vm_page_t *page)
 {
     printf("page %p: address 0x%lx flags 0x%x\n", page, vm_page_to_paddr(page), page->flags);
 }
 
-static void dump_arena(const pmm_arena_t *arena, bool dump_pages)
+static void dump_arena(pmm_arena_t *arena, bool dump_pages)
 {
     printf("arena %p: name '%s' base 0x%lx size 0x%zx priority %u flags 0x%x\n",
            arena, arena->name, arena->base, arena->size, arena->priority, arena->flags);
     printf("\tpage_array %p, free_count %zu\n",
            arena->page_array, arena->free_count);
 
+    /* number of free blocks of each order */
+    printf("\tfree blocks:");
+    for (uint i = 0; i <= PMM_MAX_ORDER; i++) {
+        printf(" %zu", list_length(&arena->free_list[i]));
+    }
+    printf("\n");
+
     /* dump all of the pages */
     if (dump_pages) {
         for (size_t i = 0; i < arena->size / PAGE_SIZE; i++) {
@@ -427,6 +803,11 @@ usage:
         list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
             dump_arena(a, false);
         }
+        printf("per cpu cached pages:");
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            printf(" %u", pcp[i].count);
+        }
+        printf("\n");
     } else if (!strcmp(argv[1].str, "alloc")) {
         if (argc < 3) goto notenoughargs;
 
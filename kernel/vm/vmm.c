@@ -25,14 +25,17 @@
 #include <err.h>
 #include <string.h>
 #include <lib/console.h>
+#include <lib/slab.h>
 #include <kernel/vm.h>
 #include <kernel/mutex.h>
 #include "vm_priv.h"
 
 #define LOCAL_TRACE 0
 
+/* vmm_lock protects the aspace list, each aspace's own lock protects its regions */
 static struct list_node aspace_list = LIST_INITIAL_VALUE(aspace_list);
 static mutex_t vmm_lock = MUTEX_INITIAL_VALUE(vmm_lock);
+static slab_cache_t *region_cache;
 
 vmm_aspace_t _kernel_aspace;
 
@@ -46,7 +49,9 @@ void vmm_init_preheap(void)
     _kernel_aspace.base = KERNEL_ASPACE_BASE;
     _kernel_aspace.size = KERNEL_ASPACE_SIZE;
     _kernel_aspace.flags = VMM_ASPACE_FLAG_KERNEL;
+    mutex_init(&_kernel_aspace.lock);
     list_initialize(&_kernel_aspace.region_list);
+    _kernel_aspace.region_tree = NULL;
 
     arch_mmu_init_aspace(&_kernel_aspace.arch_aspace, KERNEL_ASPACE_BASE, KERNEL_ASPACE_SIZE, ARCH_ASPACE_FLAG_KERNEL);
 
@@ -55,6 +60,8 @@ void vmm_init_preheap(void)
 
 void vmm_init(void)
 {
+    region_cache = slab_cache_create("vmm_region", sizeof(vmm_region_t), __alignof(vmm_region_t), NULL);
+    ASSERT(region_cache);
 }
 
 static inline bool is_inside_aspace(const vmm_aspace_t *aspace, vaddr_t vaddr)
@@ -112,10 +119,12 @@ static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t
 {
     DEBUG_ASSERT(name);
 
-    vmm_region_t *r = calloc(1, sizeof(vmm_region_t));
+    vmm_region_t *r = slab_alloc(region_cache);
     if (!r)
         return NULL;
 
+    memset(r, 0, sizeof(*r));
+
     strlcpy(r->name, name, sizeof(r->name));
     r->base = base;
     r->size = size;
@@ -126,7 +135,164 @@ static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t
     return r;
 }
 
-/* add a region to the appropriate spot in the address space list,
+/*
+ * Regions are kept both in a sorted list, for cheap neighbour access and
+ * iteration, and in an AVL tree keyed by base address for lookups. Each tree
+ * node tracks the largest gap in front of any region in its subtree, so a
+ * first fit search only descends into subtrees that have room.
+ */
+static inline int region_height(const vmm_region_t *r)
+{
+    return r ? r->height : 0;
+}
+
+static inline size_t region_max_gap(const vmm_region_t *r)
+{
+    return r ? r->max_gap : 0;
+}
+
+/* size of the unused space between a region and the one before it */
+static size_t region_gap_before(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *prev = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    vaddr_t gap_beg = prev ? prev->base + prev->size : aspace->base;
+
+    return r->base - gap_beg;
+}
+
+static void region_tree_update(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    r->height = MAX(region_height(r->left), region_height(r->right)) + 1;
+    r->max_gap = MAX(region_gap_before(aspace, r),
+                     MAX(region_max_gap(r->left), region_max_gap(r->right)));
+}
+
+/* point whatever referenced old (its parent or the root) at new */
+static void region_tree_replace(vmm_aspace_t *aspace, vmm_region_t *parent,
+                                vmm_region_t *old, vmm_region_t *new)
+{
+    if (!parent)
+        aspace->region_tree = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+
+    if (new)
+        new->parent = parent;
+}
+
+static vmm_region_t *region_tree_rotate_left(vmm_aspace_t *aspace, vmm_region_t *x)
+{
+    vmm_region_t *y = x->right;
+
+    region_tree_replace(aspace, x->parent, x, y);
+    x->right = y->left;
+    if (x->right)
+        x->right->parent = x;
+    y->left = x;
+    x->parent = y;
+
+    region_tree_update(aspace, x);
+    region_tree_update(aspace, y);
+    return y;
+}
+
+static vmm_region_t *region_tree_rotate_right(vmm_aspace_t *aspace, vmm_region_t *x)
+{
+    vmm_region_t *y = x->left;
+
+    region_tree_replace(aspace, x->parent, x, y);
+    x->left = y->right;
+    if (x->left)
+        x->left->parent = x;
+    y->right = x;
+    x->parent = y;
+
+    region_tree_update(aspace, x);
+    region_tree_update(aspace, y);
+    return y;
+}
+
+/* recompute the augmented data from r up to the root, rebalancing along the way */
+static void region_tree_fixup(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    while (r) {
+        region_tree_update(aspace, r);
+
+        int balance = region_height(r->left) - region_height(r->right);
+        if (balance > 1) {
+            if (region_height(r->left->left) < region_height(r->left->right))
+                region_tree_rotate_left(aspace, r->left);
+            r = region_tree_rotate_right(aspace, r);
+        } else if (balance < -1) {
+            if (region_height(r->right->right) < region_height(r->right->left))
+                region_tree_rotate_right(aspace, r->right);
+            r = region_tree_rotate_left(aspace, r);
+        }
+
+        r = r->parent;
+    }
+}
+
+/* link a region into the aspace after prev (NULL for the head of the list) */
+static void region_insert(vmm_aspace_t *aspace, vmm_region_t *r, vmm_region_t *prev)
+{
+    list_add_after(prev ? &prev->node : &aspace->region_list, &r->node);
+
+    vmm_region_t **link = &aspace->region_tree;
+    vmm_region_t *parent = NULL;
+    while (*link) {
+        parent = *link;
+        link = (r->base < parent->base) ? &parent->left : &parent->right;
+    }
+
+    r->parent = parent;
+    r->left = r->right = NULL;
+    *link = r;
+    region_tree_fixup(aspace, r);
+
+    /* the region after us now has a smaller gap in front of it */
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    if (next)
+        region_tree_fixup(aspace, next);
+}
+
+static void region_remove(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    list_delete(&r->node);
+
+    vmm_region_t *fix;
+    if (r->left && r->right) {
+        /* replace r with its in order successor */
+        vmm_region_t *s = r->right;
+        while (s->left)
+            s = s->left;
+
+        if (s->parent != r) {
+            fix = s->parent;
+            region_tree_replace(aspace, s->parent, s, s->right);
+            s->right = r->right;
+            s->right->parent = s;
+        } else {
+            fix = s;
+        }
+
+        region_tree_replace(aspace, r->parent, r, s);
+        s->left = r->left;
+        s->left->parent = s;
+    } else {
+        fix = r->parent;
+        region_tree_replace(aspace, r->parent, r, r->left ? r->left : r->right);
+    }
+
+    region_tree_fixup(aspace, fix);
+    if (next)
+        region_tree_fixup(aspace, next);
+}
+
+/* add a region to the appropriate spot in the address space,
  * testing to see if there's a space */
 static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
 {
@@ -144,31 +310,32 @@ static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
 
     vaddr_t r_end = r->base + r->size - 1;
 
-    /* does it fit in front */
-    vmm_region_t *last;
-    last = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
-    if (!last || r_end < last->base) {
-        /* empty list or not empty and fits before the first element */
-        list_add_head(&aspace->region_list, &r->node);
-        return NO_ERROR;
+    /* find the last region that starts at or below the new one */
+    vmm_region_t *prev = NULL;
+    vmm_region_t *n = aspace->region_tree;
+    while (n) {
+        if (n->base <= r->base) {
+            prev = n;
+            n = n->right;
+        } else {
+            n = n->left;
+        }
     }
 
-    /* walk the list, finding the right spot to put it */
-    list_for_every_entry(&aspace->region_list, last, vmm_region_t, node) {
-        /* does it go after last? */
-        if (r->base > last->base + last->size - 1) {
-            /* get the next element in the list */
-            vmm_region_t *next = list_next_type(&aspace->region_list, &last->node, vmm_region_t, node);
-            if (!next || (r_end < next->base)) {
-                /* end of the list or next exists and it goes between them */
-                list_add_after(&last->node, &r->node);
-                return NO_ERROR;
-            }
-        }
+    vmm_region_t *next;
+    if (prev)
+        next = list_next_type(&aspace->region_list, &prev->node, vmm_region_t, node);
+    else
+        next = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
+
+    /* it has to fit between the two */
+    if ((prev && r->base <= prev->base + prev->size - 1) || (next && r_end >= next->base)) {
+        LTRACEF("couldn't find spot\n");
+        return ERR_NO_MEMORY;
     }
 
-    LTRACEF("couldn't find spot\n");
-    return ERR_NO_MEMORY;
+    region_insert(aspace, r, prev);
+    return NO_ERROR;
 }
 
 /*
@@ -231,8 +398,29 @@ not_found:
     return true; /* not_found: stop search */
 }
 
+/* first fit search of the gaps in front of the regions in a subtree, in address order */
+static bool find_spot_in_tree(vmm_aspace_t *aspace, vmm_region_t *r, size_t size, vaddr_t align,
+                              uint arch_mmu_flags, vaddr_t *spot, vmm_region_t **prev)
+{
+    if (!r || r->max_gap < size)
+        return false;
+
+    if (find_spot_in_tree(aspace, r->left, size, align, arch_mmu_flags, spot, prev))
+        return true;
+
+    if (region_gap_before(aspace, r) >= size) {
+        vmm_region_t *p = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+        if (check_gap(aspace, p, r, spot, align, size, arch_mmu_flags)) {
+            *prev = p;
+            return true;
+        }
+    }
+
+    return find_spot_in_tree(aspace, r->right, size, align, arch_mmu_flags, spot, prev);
+}
+
 static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
-                          uint arch_mmu_flags, struct list_node **before)
+                          uint arch_mmu_flags, vmm_region_t **before)
 {
     DEBUG_ASSERT(aspace);
     DEBUG_ASSERT(size > 0 && IS_PAGE_ALIGNED(size));
@@ -246,26 +434,21 @@ static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
     vaddr_t spot;
     vmm_region_t *r = NULL;
 
-    /* try to pick spot at the beginning of address space */
-    if (check_gap(aspace, NULL,
-                  list_peek_head_type(&aspace->region_list, vmm_region_t, node),
-                  &spot, align, size, arch_mmu_flags))
+    /* try the gaps in front of each region */
+    if (find_spot_in_tree(aspace, aspace->region_tree, size, align, arch_mmu_flags, &spot, &r))
         goto done;
 
-    /* search the middle of the list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if (check_gap(aspace, r,
-                      list_next_type(&aspace->region_list, &r->node, vmm_region_t, node),
-                      &spot, align, size, arch_mmu_flags))
-            goto done;
-    }
+    /* try the space past the last region */
+    r = list_peek_tail_type(&aspace->region_list, vmm_region_t, node);
+    if (check_gap(aspace, r, NULL, &spot, align, size, arch_mmu_flags))
+        goto done;
 
     /* couldn't find anything */
     return -1;
 
 done:
     if (before)
-        *before = r ? &r->node : &aspace->region_list;
+        *before = r;
     return spot;
 }
 
@@ -284,28 +467,26 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
         /* stick it in the list, checking to see if it fits */
         if (add_region_to_aspace(aspace, r) < 0) {
             /* didn't fit */
-            free(r);
+            slab_free(region_cache, r);
             return NULL;
         }
     } else {
         /* allocate a virtual slot for it */
-        struct list_node *before = NULL;
+        vmm_region_t *before = NULL;
 
         vaddr = alloc_spot(aspace, size, align_pow2, arch_mmu_flags, &before);
         LTRACEF("alloc_spot returns 0x%lx, before %p\n", vaddr, before);
 
         if (vaddr == (vaddr_t)-1) {
             LTRACEF("failed to find spot\n");
-            free(r);
+            slab_free(region_cache, r);
             return NULL;
         }
 
-        DEBUG_ASSERT(before != NULL);
-
         r->base = (vaddr_t)vaddr;
 
-        /* add it to the region list */
-        list_add_after(before, &r->node);
+        /* add it to the region list and tree */
+        region_insert(aspace, r, before);
     }
 
     return r;
@@ -335,7 +516,7 @@ status_t vmm_reserve_space(vmm_aspace_t *aspace, const char *name, size_t size,
     /* trim the size */
     size = trim_to_aspace(aspace, vaddr, size);
 
-    mutex_acquire(&vmm_lock);
+    mutex_acquire(&aspace->lock);
 
     /* lookup how it's already mapped */
     uint arch_mmu_flags = 0;
@@ -345,7 +526,7 @@ status_t vmm_reserve_space(vmm_aspace_t *aspace, const char *name, size_t size,
     vmm_region_t *r = alloc_region(aspace, name, size, vaddr, 0,
                                    VMM_FLAG_VALLOC_SPECIFIC, VMM_REGION_FLAG_RESERVED, arch_mmu_flags);
 
-    mutex_release(&vmm_lock);
+    mutex_release(&aspace->lock);
     return r ? NO_ERROR : ERR_NO_MEMORY;
 }
 
@@ -382,7 +563,7 @@ status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
         vaddr = (vaddr_t)*ptr;
     }
 
-    mutex_acquire(&vmm_lock);
+    mutex_acquire(&aspace->lock);
 
     /* allocate a region and put it in the aspace list */
     vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_log2, vmm_flags,
@@ -403,7 +584,7 @@ status_t vmm_alloc_physical(vmm_aspace_t *aspace, const char *name, size_t size,
     ret = NO_ERROR;
 
 err_alloc_region:
-    mutex_release(&vmm_lock);
+    mutex_release(&aspace->lock);
     return ret;
 }
 
@@ -449,7 +630,7 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
         goto err;
     }
 
-    mutex_acquire(&vmm_lock);
+    mutex_acquire(&aspace->lock);
 
     /* allocate a region and put it in the aspace list */
     vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
@@ -472,11 +653,11 @@ status_t vmm_alloc_contiguous(vmm_aspace_t *aspace, const char *name, size_t siz
         list_add_tail(&r->page_list, &p->node);
     }
 
-    mutex_release(&vmm_lock);
+    mutex_release(&aspace->lock);
     return NO_ERROR;
 
 err1:
-    mutex_release(&vmm_lock);
+    mutex_release(&aspace->lock);
     pmm_free(&page_list);
 err:
     return err;
@@ -526,7 +707,7 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
         goto err;
     }
 
-    mutex_acquire(&vmm_lock);
+    mutex_acquire(&aspace->lock);
 
     /* allocate a region and put it in the aspace list */
     vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
@@ -559,11 +740,11 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
         va += PAGE_SIZE;
     }
 
-    mutex_release(&vmm_lock);
+    mutex_release(&aspace->lock);
     return NO_ERROR;
 
 err1:
-    mutex_release(&vmm_lock);
+    mutex_release(&aspace->lock);
     pmm_free(&page_list);
 err:
     return err;
@@ -578,9 +759,14 @@ static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
     if (!aspace)
         return NULL;
 
-    /* search the region list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if ((vaddr >= r->base) && (vaddr <= r->base + r->size - 1))
+    /* search the region tree */
+    r = aspace->region_tree;
+    while (r) {
+        if (vaddr < r->base)
+            r = r->left;
+        else if (vaddr > r->base + r->size - 1)
+            r = r->right;
+        else
             return r;
     }
 
@@ -589,27 +775,30 @@ static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
 
 status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr)
 {
-    mutex_acquire(&vmm_lock);
+    if (!aspace)
+        return ERR_INVALID_ARGS;
+
+    mutex_acquire(&aspace->lock);
 
     vmm_region_t *r = vmm_find_region (aspace, vaddr);
     if (!r) {
-        mutex_release(&vmm_lock);
+        mutex_release(&aspace->lock);
         return ERR_NOT_FOUND;
     }
 
     /* remove it from aspace */
-    list_delete(&r->node);
+    region_remove(aspace, r);
 
     /* unmap it */
     arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
 
-    mutex_release(&vmm_lock);
+    mutex_release(&aspace->lock);
 
     /* return physical pages if any */
     pmm_free(&r->page_list);
 
     /* free it */
-    free(r);
+    slab_free(region_cache, r);
 
     return NO_ERROR;
 }
@@ -646,7 +835,9 @@ status_t vmm_create_aspace(vmm_aspace_t **_aspace, const char *name, uint flags)
     }
 
     list_clear_node(&aspace->node);
+    mutex_init(&aspace->lock);
     list_initialize(&aspace->region_list);
+    aspace->region_tree = NULL;
 
     mutex_acquire(&vmm_lock);
     list_add_head(&aspace_list, &aspace->node);
@@ -666,10 +857,14 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
         return ERR_INVALID_ARGS;
     }
     list_delete(&aspace->node);
+    mutex_release(&vmm_lock);
 
-    /* free all of the regions */
+    /* free all of the regions. The whole tree goes at once, so only the list needs unlinking */
     struct list_node region_list = LIST_INITIAL_VALUE(region_list);
 
+    mutex_acquire(&aspace->lock);
+    aspace->region_tree = NULL;
+
     vmm_region_t *r;
     while ((r = list_remove_head_type(&aspace->region_list, vmm_region_t, node))) {
         /* add it to our tempoary list */
@@ -678,15 +873,15 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
         /* unmap it */
         arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
     }
-    mutex_release(&vmm_lock);
+    mutex_release(&aspace->lock);
 
-    /* without the vmm lock held, free all of the pmm pages and the structure */
+    /* without the aspace lock held, free all of the pmm pages and the structure */
     while ((r = list_remove_head_type(&region_list, vmm_region_t, node))) {
         /* return physical pages if any */
         pmm_free(&r->page_list);
 
         /* free it */
-        free(r);
+        slab_free(region_cache, r);
     }
 
     /* make sure the current thread does not map the aspace */
@@ -702,6 +897,7 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
     arch_mmu_destroy_aspace(&aspace->arch_aspace);
 
     /* free the aspace */
+    mutex_destroy(&aspace->lock);
     free(aspace);
 
     return NO_ERROR;
@@ -709,7 +905,7 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
 
 void vmm_context_switch(vmm_aspace_t *oldspace, vmm_aspace_t *newaspace)
 {
-    DEBUG_ASSERT(thread_lock_held());
+    DEBUG_ASSERT(arch_ints_disabled());
 
     arch_mmu_context_switch(newaspace ? &newaspace->arch_aspace : NULL);
 }
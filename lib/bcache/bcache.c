@@ -27,67 +27,148 @@
 #include <sys/types.h>
 #include <debug.h>
 #include <trace.h>
+#include <err.h>
+#include <pow2.h>
+#include <platform.h>
+#include <arch/defines.h>
+#include <arch/ops.h>
+#include <kernel/mutex.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
+#include <lib/slab.h>
 
 #define LOCAL_TRACE 0
 
+/* blocks are spread over up to this many independently locked shards,
+ * but a shard is never made smaller than BCACHE_MIN_SHARD_BLOCKS */
+#define BCACHE_MAX_SHARDS 8
+#define BCACHE_MIN_SHARD_BLOCKS 16
+
+#define BCACHE_WRITEBACK_INTERVAL 1000 /* msecs between background flushes */
+#define BCACHE_WRITEBACK_BATCH 16 /* max adjacent blocks merged into one write */
+
 struct bcache_block {
-    struct list_node node;
+    struct list_node node;      /* on the shard's lru or free list */
+    struct list_node hash_node; /* on a hash chain while it holds a valid block */
     bnum_t blocknum;
     int ref_count;
     bool is_dirty;
+    bool in_writeback;          /* contents copied out by the writeback path, write in flight */
     void *ptr;
 };
 
-struct bcache_stats {
-    uint32_t hits;
-    uint32_t depth;
-    uint32_t misses;
-    uint32_t reads;
-    uint32_t writes;
+struct bcache_shard {
+    mutex_t lock;
+
+    struct list_node free_list;
+    struct list_node lru_list;
+
+    struct list_node *hash;
+    uint hash_mask;
+
+    struct bcache_stats stats;
 };
 
 struct bcache {
     bdev_t *dev;
     size_t block_size;
     int count;
-    struct bcache_stats stats;
 
-    struct list_node free_list;
-    struct list_node lru_list;
+    uint shard_count;
+    struct bcache_shard shards[BCACHE_MAX_SHARDS];
 
     struct bcache_block *blocks;
+    slab_cache_t *block_cache;
+
+    /* writeback state, serialized by flush_lock */
+    mutex_t flush_lock;
+    bnum_t *flush_list;
+    void *flush_buf;
+    struct bcache_stats wb_stats;
+
+    volatile int dirty_count;
+    thread_t *writeback_thread;
+    event_t writeback_event;
+    volatile bool exiting;
 };
 
+static inline uint32_t bcache_hash(bnum_t blocknum)
+{
+    return blocknum * 0x9e3779b1U;
+}
+
+static inline struct bcache_shard *block_shard(struct bcache *cache, bnum_t blocknum)
+{
+    return &cache->shards[(bcache_hash(blocknum) >> 16) % cache->shard_count];
+}
+
+/* log2 buckets of microseconds */
+static void hist_add(uint32_t *hist, lk_bigtime_t usecs)
+{
+    uint bucket = (usecs > 0) ? log2_uint(MIN(usecs, (lk_bigtime_t)UINT32_MAX)) + 1 : 0;
+    hist[MIN(bucket, BCACHE_HIST_BUCKETS - 1)]++;
+}
+
+static int bcache_writeback_thread(void *arg);
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count)
 {
     struct bcache *cache;
 
-    cache = malloc(sizeof(struct bcache));
+    cache = calloc(1, sizeof(struct bcache));
 
     cache->dev = dev;
     cache->block_size = block_size;
     cache->count = block_count;
-    memset(&cache->stats, 0, sizeof(cache->stats));
 
-    list_initialize(&cache->free_list);
-    list_initialize(&cache->lru_list);
+    cache->shard_count = MAX(1, MIN(BCACHE_MAX_SHARDS, block_count / BCACHE_MIN_SHARD_BLOCKS));
+
+    /* size each shard's hash table to about one block per chain */
+    uint buckets = round_up_pow2_u32(MAX(1, block_count / cache->shard_count));
+    for (uint i = 0; i < cache->shard_count; i++) {
+        struct bcache_shard *shard = &cache->shards[i];
+
+        mutex_init(&shard->lock);
+        list_initialize(&shard->free_list);
+        list_initialize(&shard->lru_list);
+
+        shard->hash = malloc(sizeof(struct list_node) * buckets);
+        shard->hash_mask = buckets - 1;
+        for (uint j = 0; j < buckets; j++)
+            list_initialize(&shard->hash[j]);
+    }
+
+    /* block buffers come from their own slab cache, cache line aligned for the device */
+    cache->block_cache = slab_cache_create("bcache", block_size, CACHE_LINE, NULL);
 
     cache->blocks = malloc(sizeof(struct bcache_block) * block_count);
     int i;
     for (i=0; i < block_count; i++) {
         cache->blocks[i].ref_count = 0;
         cache->blocks[i].is_dirty = false;
-        cache->blocks[i].ptr = malloc(block_size);
-        // add to the free list
-        list_add_head(&cache->free_list, &cache->blocks[i].node);
+        cache->blocks[i].in_writeback = false;
+        cache->blocks[i].ptr = slab_alloc(cache->block_cache);
+        list_clear_node(&cache->blocks[i].hash_node);
+        // add to a shard's free list
+        list_add_head(&cache->shards[i % cache->shard_count].free_list, &cache->blocks[i].node);
     }
 
+    mutex_init(&cache->flush_lock);
+    cache->flush_list = malloc(sizeof(bnum_t) * block_count);
+    cache->flush_buf = memalign(CACHE_LINE, block_size * BCACHE_WRITEBACK_BATCH);
+
+    event_init(&cache->writeback_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    cache->writeback_thread = thread_create("bcache writeback", &bcache_writeback_thread, cache,
+                                            LOW_PRIORITY, DEFAULT_STACK_SIZE);
+    thread_resume(cache->writeback_thread);
+
     return (bcache_t)cache;
 }
 
-static int flush_block(struct bcache *cache, struct bcache_block *block)
+/* write a single block back in place. Called with the shard lock held. */
+static int flush_block(struct bcache *cache, struct bcache_shard *shard, struct bcache_block *block)
 {
     int rc;
 
@@ -98,7 +179,8 @@ static int flush_block(struct bcache *cache, struct bcache_block *block)
         goto exit;
 
     block->is_dirty = false;
-    cache->stats.writes++;
+    atomic_add(&cache->dirty_count, -1);
+    shard->stats.writes++;
     rc = 0;
 exit:
     return (rc);
@@ -109,6 +191,11 @@ void bcache_destroy(bcache_t _cache)
     struct bcache *cache = _cache;
     int i;
 
+    cache->exiting = true;
+    event_signal(&cache->writeback_event, true);
+    thread_join(cache->writeback_thread, NULL, INFINITE_TIME);
+    event_destroy(&cache->writeback_event);
+
     for (i=0; i < cache->count; i++) {
         DEBUG_ASSERT(cache->blocks[i].ref_count == 0);
 
@@ -116,99 +203,157 @@ void bcache_destroy(bcache_t _cache)
             printf("warning: freeing dirty block %u\n",
                    cache->blocks[i].blocknum);
 
-        free(cache->blocks[i].ptr);
+        slab_free(cache->block_cache, cache->blocks[i].ptr);
     }
 
+    for (uint j = 0; j < cache->shard_count; j++) {
+        mutex_destroy(&cache->shards[j].lock);
+        free(cache->shards[j].hash);
+    }
+
+    mutex_destroy(&cache->flush_lock);
+    free(cache->flush_list);
+    free(cache->flush_buf);
+
+    slab_cache_destroy(cache->block_cache);
+    free(cache->blocks);
     free(cache);
 }
 
+/* look a block up in its shard's hash. Called with the shard lock held. */
+static struct bcache_block *lookup_block(struct bcache_shard *shard, bnum_t blocknum, uint32_t *depth)
+{
+    struct bcache_block *block;
+
+    list_for_every_entry(&shard->hash[bcache_hash(blocknum) & shard->hash_mask], block,
+                         struct bcache_block, hash_node) {
+        if (depth)
+            (*depth)++;
+        if (block->blocknum == blocknum)
+            return block;
+    }
+
+    return NULL;
+}
+
 /* find a block if it's already present */
-static struct bcache_block *find_block(struct bcache *cache, uint blocknum)
+static struct bcache_block *find_block(struct bcache_shard *shard, uint blocknum)
 {
     uint32_t depth = 0;
     struct bcache_block *block;
 
     LTRACEF("num %u\n", blocknum);
 
-    block = NULL;
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
-        depth++;
-
-        if (block->blocknum == blocknum) {
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            cache->stats.hits++;
-            cache->stats.depth += depth;
-            return block;
-        }
+    block = lookup_block(shard, blocknum, &depth);
+    if (block) {
+        list_delete(&block->node);
+        list_add_tail(&shard->lru_list, &block->node);
+        shard->stats.hits++;
+        shard->stats.depth += depth;
+        return block;
     }
 
-    cache->stats.misses++;
+    shard->stats.misses++;
     return NULL;
 }
 
-/* allocate a new block */
-static struct bcache_block *alloc_block(struct bcache *cache)
+/* allocate a new block for blocknum, evicting an old one if needed. Called with the shard lock held. */
+static struct bcache_block *alloc_block(struct bcache *cache, struct bcache_shard *shard, uint blocknum)
 {
-    int err;
     struct bcache_block *block;
 
     /* pop one off the free list if it's present */
-    block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
+    block = list_remove_head_type(&shard->free_list, struct bcache_block, node);
     if (block) {
         block->ref_count = 0;
-        list_add_tail(&cache->lru_list, &block->node);
+        list_add_tail(&shard->lru_list, &block->node);
         LTRACEF("found block %p on free list\n", block);
-        return block;
+        goto found;
     }
 
-    /* walk the lru, looking for a free block */
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
+    lk_bigtime_t t = current_time_hires();
+
+    /* walk the lru from the cold end. Take the first idle clean block, so
+     * eviction normally never waits on a write. */
+    struct bcache_block *victim = NULL;
+    struct bcache_block *dirty = NULL;
+    list_for_every_entry(&shard->lru_list, block, struct bcache_block, node) {
         LTRACEF("looking at %p, num %u\n", block, block->blocknum);
-        if (block->ref_count == 0) {
-            if (block->is_dirty) {
-                err = flush_block(cache, block);
-                if (err)
-                    return NULL;
-            }
-
-            // add it to the tail of the lru
-            list_delete(&block->node);
-            list_add_tail(&cache->lru_list, &block->node);
-            return block;
+        if (block->ref_count > 0 || block->in_writeback)
+            continue;
+
+        if (!block->is_dirty) {
+            victim = block;
+            break;
         }
+        if (!dirty)
+            dirty = block;
     }
 
-    return NULL;
+    if (!victim && dirty) {
+        /* everything is dirty, write the coldest one out inline and get the
+         * writeback thread going on the rest */
+        event_signal(&cache->writeback_event, false);
+        if (flush_block(cache, shard, dirty) < 0)
+            return NULL;
+
+        shard->stats.eviction_flushes++;
+        victim = dirty;
+    }
+
+    if (!victim)
+        return NULL;
+
+    block = victim;
+    list_delete(&block->hash_node);
+
+    // add it to the tail of the lru
+    list_delete(&block->node);
+    list_add_tail(&shard->lru_list, &block->node);
+
+    shard->stats.evictions++;
+    hist_add(shard->stats.eviction_hist, current_time_hires() - t);
+
+found:
+    block->blocknum = blocknum;
+    list_add_head(&shard->hash[bcache_hash(blocknum) & shard->hash_mask], &block->hash_node);
+    return block;
+}
+
+/* drop a block that couldn't be filled. Called with the shard lock held. */
+static void free_block(struct bcache_shard *shard, struct bcache_block *block)
+{
+    list_delete(&block->hash_node);
+    list_delete(&block->node);
+    list_add_tail(&shard->free_list, &block->node);
 }
 
-static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blocknum)
+static struct bcache_block *find_or_fill_block(struct bcache *cache, struct bcache_shard *shard, uint blocknum)
 {
     int err;
 
     LTRACEF("block %u\n", blocknum);
 
     /* see if it's already in the cache */
-    struct bcache_block *block = find_block(cache, blocknum);
+    struct bcache_block *block = find_block(shard, blocknum);
     if (block == NULL) {
         LTRACEF("wasn't allocated\n");
 
         /* allocate a new block and fill it */
-        block = alloc_block(cache);
-        DEBUG_ASSERT(block);
+        block = alloc_block(cache, shard, blocknum);
+        if (!block)
+            return NULL;
 
         LTRACEF("wasn't allocated, new block %p\n", block);
 
-        block->blocknum = blocknum;
         err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
         if (err < 0) {
             /* free the block, return an error */
-            list_add_tail(&cache->free_list, &block->node);
+            free_block(shard, block);
             return NULL;
         }
 
-        cache->stats.reads++;
+        shard->stats.reads++;
     }
 
     DEBUG_ASSERT(block->blocknum == blocknum);
@@ -219,47 +364,63 @@ static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blockn
 int bcache_read_block(bcache_t _cache, void *buf, uint blocknum)
 {
     struct bcache *cache = _cache;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
+    int err = 0;
 
     LTRACEF("buf %p, blocknum %u\n", buf, blocknum);
 
-    struct bcache_block *block = find_or_fill_block(cache, blocknum);
+    mutex_acquire(&shard->lock);
+
+    struct bcache_block *block = find_or_fill_block(cache, shard, blocknum);
     if (block == NULL) {
         /* error */
-        return -1;
+        err = -1;
+        goto exit;
     }
 
     memcpy(buf, block->ptr, cache->block_size);
-    return 0;
+exit:
+    mutex_release(&shard->lock);
+    return err;
 }
 
 int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum)
 {
     struct bcache *cache = _cache;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
+    int err = 0;
 
     LTRACEF("ptr %p, blocknum %u\n", ptr, blocknum);
 
     DEBUG_ASSERT(ptr);
 
-    struct bcache_block *block = find_or_fill_block(cache, blocknum);
+    mutex_acquire(&shard->lock);
+
+    struct bcache_block *block = find_or_fill_block(cache, shard, blocknum);
     if (block == NULL) {
         /* error */
-        return -1;
+        err = -1;
+        goto exit;
     }
 
     /* increment the ref count to keep it from being freed */
     block->ref_count++;
     *ptr = block->ptr;
-
-    return 0;
+exit:
+    mutex_release(&shard->lock);
+    return err;
 }
 
 int bcache_put_block(bcache_t _cache, uint blocknum)
 {
     struct bcache *cache = _cache;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
 
     LTRACEF("blocknum %u\n", blocknum);
 
-    struct bcache_block *block = find_block(cache, blocknum);
+    mutex_acquire(&shard->lock);
+
+    struct bcache_block *block = find_block(shard, blocknum);
 
     /* be pretty hard on the caller for now */
     DEBUG_ASSERT(block);
@@ -267,24 +428,40 @@ int bcache_put_block(bcache_t _cache, uint blocknum)
 
     block->ref_count--;
 
+    mutex_release(&shard->lock);
     return 0;
 }
 
+/* note a newly dirtied block, kicking the writeback thread once half the cache is dirty */
+static void block_dirtied(struct bcache *cache, struct bcache_block *block)
+{
+    if (block->is_dirty)
+        return;
+
+    block->is_dirty = true;
+    if (atomic_add(&cache->dirty_count, 1) + 1 > cache->count / 2)
+        event_signal(&cache->writeback_event, false);
+}
+
 int bcache_mark_block_dirty(bcache_t priv, uint blocknum)
 {
     int err;
     struct bcache *cache = priv;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
     struct bcache_block *block;
 
-    block = find_block(cache, blocknum);
+    mutex_acquire(&shard->lock);
+
+    block = find_block(shard, blocknum);
     if (!block) {
         err = -1;
         goto exit;
     }
 
-    block->is_dirty = true;
+    block_dirtied(cache, block);
     err = 0;
 exit:
+    mutex_release(&shard->lock);
     return (err);
 }
 
@@ -292,59 +469,225 @@ int bcache_zero_block(bcache_t priv, uint blocknum)
 {
     int err;
     struct bcache *cache = priv;
+    struct bcache_shard *shard = block_shard(cache, blocknum);
     struct bcache_block *block;
 
-    block = find_block(cache, blocknum);
+    mutex_acquire(&shard->lock);
+
+    block = find_block(shard, blocknum);
     if (!block) {
-        block = alloc_block(cache);
+        block = alloc_block(cache, shard, blocknum);
         if (!block) {
             err = -1;
             goto exit;
         }
-
-        block->blocknum = blocknum;
     }
 
     memset(block->ptr, 0, cache->block_size);
-    block->is_dirty = true;
+    block_dirtied(cache, block);
     err = 0;
 exit:
+    mutex_release(&shard->lock);
     return (err);
 }
 
+static int compare_bnum(const void *a, const void *b)
+{
+    bnum_t x = *(const bnum_t *)a;
+    bnum_t y = *(const bnum_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* copy a dirty block into the writeback buffer and mark it in flight */
+static bool writeback_claim(struct bcache *cache, bnum_t blocknum, void *buf)
+{
+    struct bcache_shard *shard = block_shard(cache, blocknum);
+    bool claimed = false;
+
+    mutex_acquire(&shard->lock);
+
+    struct bcache_block *block = lookup_block(shard, blocknum, NULL);
+    if (block && block->is_dirty && !block->in_writeback) {
+        memcpy(buf, block->ptr, cache->block_size);
+        block->is_dirty = false;
+        block->in_writeback = true;
+        atomic_add(&cache->dirty_count, -1);
+        claimed = true;
+    }
+
+    mutex_release(&shard->lock);
+    return claimed;
+}
+
+static void writeback_complete(struct bcache *cache, bnum_t blocknum, bool failed)
+{
+    struct bcache_shard *shard = block_shard(cache, blocknum);
+
+    mutex_acquire(&shard->lock);
+
+    /* in flight blocks can't be evicted, so it has to still be here */
+    struct bcache_block *block = lookup_block(shard, blocknum, NULL);
+    DEBUG_ASSERT(block && block->in_writeback);
+
+    block->in_writeback = false;
+    if (failed)
+        block_dirtied(cache, block);
+
+    mutex_release(&shard->lock);
+}
+
+/* write back every dirty block in [start, end], merging runs of adjacent blocks */
+static int flush_range(struct bcache *cache, bnum_t start, bnum_t end)
+{
+    int err = 0;
+
+    mutex_acquire(&cache->flush_lock);
+
+    /* snapshot the dirty blocks in range from every shard */
+    uint n = 0;
+    for (uint s = 0; s < cache->shard_count; s++) {
+        struct bcache_shard *shard = &cache->shards[s];
+        struct bcache_block *block;
+
+        mutex_acquire(&shard->lock);
+        list_for_every_entry(&shard->lru_list, block, struct bcache_block, node) {
+            if (block->is_dirty && block->blocknum >= start && block->blocknum <= end)
+                cache->flush_list[n++] = block->blocknum;
+        }
+        mutex_release(&shard->lock);
+    }
+
+    qsort(cache->flush_list, n, sizeof(bnum_t), &compare_bnum);
+
+    for (uint i = 0; i < n; ) {
+        /* gather a run of consecutive blocks into the bounce buffer. Anything
+         * cleaned or evicted since the snapshot ends the run. */
+        bnum_t first = cache->flush_list[i];
+        uint run = 0;
+        while (i < n && run < BCACHE_WRITEBACK_BATCH && cache->flush_list[i] == first + run) {
+            if (!writeback_claim(cache, cache->flush_list[i],
+                                 (uint8_t *)cache->flush_buf + run * cache->block_size))
+                break;
+            run++;
+            i++;
+        }
+        if (run == 0) {
+            i++;
+            continue;
+        }
+
+        lk_bigtime_t t = current_time_hires();
+
+        ssize_t rc;
+        if (cache->block_size == cache->dev->block_size) {
+            rc = bio_write_block(cache->dev, cache->flush_buf, first, run);
+        } else {
+            rc = bio_write(cache->dev, cache->flush_buf,
+                           (off_t)first * cache->block_size, run * cache->block_size);
+        }
+
+        hist_add(cache->wb_stats.writeback_hist, current_time_hires() - t);
+        cache->wb_stats.writebacks++;
+        cache->wb_stats.writes += run;
+
+        if (rc < 0)
+            err = rc;
+
+        for (uint j = 0; j < run; j++)
+            writeback_complete(cache, first + j, rc < 0);
+    }
+
+    mutex_release(&cache->flush_lock);
+    return err;
+}
+
+static int bcache_writeback_thread(void *arg)
+{
+    struct bcache *cache = arg;
+
+    while (!cache->exiting) {
+        event_wait_timeout(&cache->writeback_event, BCACHE_WRITEBACK_INTERVAL);
+
+        if (cache->dirty_count > 0 && !cache->exiting)
+            flush_range(cache, 0, UINT32_MAX);
+    }
+
+    return 0;
+}
+
+int bcache_flush_range(bcache_t priv, uint blocknum, uint count)
+{
+    struct bcache *cache = priv;
+
+    if (count == 0)
+        return 0;
+
+    bnum_t end = blocknum + count - 1;
+    if (end < blocknum)
+        end = UINT32_MAX;
+
+    return flush_range(cache, blocknum, end);
+}
+
 int bcache_flush(bcache_t priv)
 {
-    int err;
     struct bcache *cache = priv;
-    struct bcache_block *block;
 
-    list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-        if (block->is_dirty) {
-            err = flush_block(cache, block);
-            if (err)
-                goto exit;
-        }
+    return flush_range(cache, 0, UINT32_MAX);
+}
+
+void bcache_get_stats(bcache_t priv, struct bcache_stats *stats)
+{
+    struct bcache *cache = priv;
+
+    /* the totals of every shard plus the writeback path */
+    *stats = cache->wb_stats;
+    for (uint s = 0; s < cache->shard_count; s++) {
+        const struct bcache_stats *ss = &cache->shards[s].stats;
+
+        stats->hits += ss->hits;
+        stats->depth += ss->depth;
+        stats->misses += ss->misses;
+        stats->reads += ss->reads;
+        stats->writes += ss->writes;
+        stats->evictions += ss->evictions;
+        stats->eviction_flushes += ss->eviction_flushes;
+        for (uint i = 0; i < BCACHE_HIST_BUCKETS; i++)
+            stats->eviction_hist[i] += ss->eviction_hist[i];
     }
+}
 
-    err = 0;
-exit:
-    return (err);
+static void dump_hist(const char *name, const uint32_t *hist)
+{
+    printf("\t%s latency (usecs):", name);
+    for (uint i = 0; i < BCACHE_HIST_BUCKETS; i++) {
+        if (hist[i])
+            printf(" <%u:%u", 1U << i, hist[i]);
+    }
+    printf("\n");
 }
 
 void bcache_dump(bcache_t priv, const char *name)
 {
     uint32_t finds;
-    struct bcache *cache = priv;
+    struct bcache_stats stats;
+
+    bcache_get_stats(priv, &stats);
 
-    finds = cache->stats.hits + cache->stats.misses;
+    finds = stats.hits + stats.misses;
 
     printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u writes=%u\n",
            name,
-           cache->stats.hits,
-           finds ? (cache->stats.hits * 100) / finds : 0,
-           cache->stats.hits ? cache->stats.depth / cache->stats.hits : 0,
-           cache->stats.misses,
-           finds ? (cache->stats.misses * 100) / finds : 0,
-           cache->stats.reads,
-           cache->stats.writes);
+           stats.hits,
+           finds ? (stats.hits * 100) / finds : 0,
+           stats.hits ? stats.depth / stats.hits : 0,
+           stats.misses,
+           finds ? (stats.misses * 100) / finds : 0,
+           stats.reads,
+           stats.writes);
+    printf("\tevictions=%u (%u written inline) writebacks=%u\n",
+           stats.evictions, stats.eviction_flushes, stats.writebacks);
+    dump_hist("eviction", stats.eviction_hist);
+    dump_hist("writeback", stats.writeback_hist);
 }
@@ -26,6 +26,24 @@
 
 typedef void *bcache_t;
 
+#define BCACHE_HIST_BUCKETS 16
+
+struct bcache_stats {
+    uint32_t hits;
+    uint32_t depth;
+    uint32_t misses;
+    uint32_t reads;
+    uint32_t writes;
+
+    uint32_t evictions;
+    uint32_t eviction_flushes;  /* evictions that had to write a dirty block inline */
+    uint32_t writebacks;        /* background or explicit flush writes, each up to a batch of blocks */
+
+    /* log2 latency buckets in microseconds, bucket i counts times below 2^i */
+    uint32_t eviction_hist[BCACHE_HIST_BUCKETS];
+    uint32_t writeback_hist[BCACHE_HIST_BUCKETS];
+};
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count);
 void bcache_destroy(bcache_t);
 
@@ -35,3 +53,13 @@ int bcache_read_block(bcache_t, void *, uint block);
 int bcache_get_block(bcache_t, void **, uint block);
 int bcache_put_block(bcache_t, uint block);
 
+int bcache_mark_block_dirty(bcache_t, uint block);
+int bcache_zero_block(bcache_t, uint block);
+
+// write back dirty blocks. Dirty blocks are also written back periodically by a
+// background thread, merging adjacent blocks into single writes.
+int bcache_flush(bcache_t);
+int bcache_flush_range(bcache_t, uint block, uint count);
+
+void bcache_get_stats(bcache_t, struct bcache_stats *);
+void bcache_dump(bcache_t, const char *name);
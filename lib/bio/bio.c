@@ -21,6 +21,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <stdlib.h>
+#include <stdio.h>
 #include <debug.h>
 #include <trace.h>
 #include <err.h>
@@ -30,10 +31,57 @@
 #include <pow2.h>
 #include <lib/bio.h>
 #include <kernel/mutex.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/debug.h>
 #include <lk/init.h>
 
 #define LOCAL_TRACE 0
 
+/* largest transfer a request queue will build by merging adjacent requests */
+#define BIO_QUEUE_MERGE_MAX (64 * 1024)
+/* transfers a request queue keeps in flight to a driver with a submit hook */
+#define BIO_QUEUE_DEPTH 8
+
+struct bio_queue;
+
+/* one transfer from the queue to the driver, carrying a batch of merged requests */
+struct bio_queue_slot {
+    struct list_node node; /* on the queue's free list while idle */
+    struct bio_queue *q;
+    bio_request_t req;
+    struct list_node batch;
+    volatile bool busy;    /* issued and not completed, req holds its range */
+    void *bounce;
+};
+
+struct bio_queue {
+    mutex_t lock;
+
+    /* pending requests, sorted by block except where that would reorder overlapping requests */
+    struct list_node pending;
+
+    /* block just past the last transfer, the elevator sweeps upwards from here */
+    bnum_t head;
+
+    event_t work;
+    thread_t *thread;
+    volatile bool exiting;
+
+    /* idle slots, taken by the queue thread and given back as transfers complete,
+     * possibly in interrupt context */
+    spin_lock_t slot_lock;
+    struct list_node free_slots;
+    uint busy_slots;
+    struct bio_queue_slot slots[BIO_QUEUE_DEPTH];
+
+    void *bounce;
+    size_t bounce_size;
+};
+
+static void bio_queue_destroy(bdev_t *dev);
+
 static struct {
     struct list_node list;
     mutex_t lock;
@@ -315,6 +363,9 @@ static void bdev_dec_ref(bdev_t *dev)
 
         TRACEF("last ref, removing (%s)\n", dev->name);
 
+        if (dev->queue)
+            bio_queue_destroy(dev);
+
         // call the close hook if it exists
         if (dev->close)
             dev->close(dev);
@@ -394,6 +445,147 @@ ssize_t bio_read(bdev_t *dev, void *buf, off_t offset, size_t len)
     return dev->read(dev, buf, offset, len);
 }
 
+static void bio_issue_done(bio_request_t *req, void *arg);
+static void bio_queue_done(bio_request_t *req, void *arg);
+
+void bio_complete_request(bio_request_t *req, ssize_t result)
+{
+    LTRACEF("req %p, result %ld\n", req, (long)result);
+
+    /* requests are traced once, as they pass through bio_submit. The ones bio_issue
+     * and the request queue make to carry them to the driver aren't. */
+    if (req->callback != bio_issue_done && req->callback != bio_queue_done)
+        KEVLOG_BIO_COMPLETE(req, result);
+
+    /* the callback is allowed to recycle the request */
+    event_t *event = req->event;
+
+    req->result = result;
+    if (req->callback)
+        req->callback(req, req->callback_arg);
+    if (event)
+        event_signal(event, false);
+}
+
+static void bio_issue_done(bio_request_t *req, void *arg)
+{
+    event_signal((event_t *)arg, false);
+}
+
+/* hand a transfer straight to the driver and wait for it to finish. The caller
+ * has a request that was traced on its way in, so none of this is. */
+static ssize_t bio_issue(bdev_t *dev, uint op, void *buf, bnum_t block, uint count)
+{
+    if (dev->submit) {
+        event_t done;
+        bio_request_t req = {
+            .dev = dev,
+            .op = op,
+            .buf = buf,
+            .block = block,
+            .count = count,
+            .callback = bio_issue_done,
+            .callback_arg = &done,
+        };
+
+        event_init(&done, false, 0);
+        ssize_t err = dev->submit(dev, &req);
+        if (err >= 0) {
+            event_wait(&done);
+            err = req.result;
+        }
+        event_destroy(&done);
+
+        return err;
+    }
+
+    if (op == BIO_OP_READ)
+        return dev->read_block(dev, buf, block, count);
+    else
+        return dev->write_block(dev, buf, block, count);
+}
+
+static status_t bio_queue_submit(struct bio_queue *q, bio_request_t *req)
+{
+    mutex_acquire(&q->lock);
+
+    if (q->exiting) {
+        mutex_release(&q->lock);
+        return ERR_CHANNEL_CLOSED;
+    }
+
+    /* insert after the last request that starts at or below this one, or that it overlaps */
+    struct list_node *pos = &q->pending;
+    bio_request_t *r;
+    list_for_every_entry(&q->pending, r, bio_request_t, node) {
+        if (r->block <= req->block || bio_does_overlap(r->block, r->count, req->block, req->count))
+            pos = &r->node;
+    }
+    list_add_after(pos, &req->node);
+
+    mutex_release(&q->lock);
+
+    /* let the submitter queue up more before the worker runs */
+    event_signal(&q->work, false);
+
+    return NO_ERROR;
+}
+
+status_t bio_submit(bio_request_t *req)
+{
+    bdev_t *dev = req->dev;
+
+    LTRACEF("dev '%s', req %p, op %u, buf %p, block %u, count %u\n",
+            dev->name, req, req->op, req->buf, req->block, req->count);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(req->buf);
+
+    if (req->op != BIO_OP_READ && req->op != BIO_OP_WRITE)
+        return ERR_INVALID_ARGS;
+
+    KEVLOG_BIO_SUBMIT(req, req->block);
+
+    /* range check */
+    req->count = bio_trim_block_range(dev, req->block, req->count);
+    if (req->count == 0) {
+        bio_complete_request(req, 0);
+        return NO_ERROR;
+    }
+
+    if (dev->queue)
+        return bio_queue_submit(dev->queue, req);
+    if (dev->submit)
+        return dev->submit(dev, req);
+
+    /* no queue or native async support, run it inline */
+    bio_complete_request(req, bio_issue(dev, req->op, req->buf, req->block, req->count));
+    return NO_ERROR;
+}
+
+static ssize_t bio_sync_request(bdev_t *dev, uint op, void *buf, bnum_t block, uint count)
+{
+    event_t done;
+    bio_request_t req = {
+        .dev = dev,
+        .op = op,
+        .buf = buf,
+        .block = block,
+        .count = count,
+        .event = &done,
+    };
+
+    event_init(&done, false, 0);
+    ssize_t err = bio_submit(&req);
+    if (err >= 0) {
+        event_wait(&done);
+        err = req.result;
+    }
+    event_destroy(&done);
+
+    return err;
+}
+
 ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count)
 {
     LTRACEF("dev '%s', buf %p, block %d, count %u\n", dev->name, buf, block, count);
@@ -401,12 +593,7 @@ ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count)
     DEBUG_ASSERT(dev && dev->ref > 0);
     DEBUG_ASSERT(buf);
 
-    /* range check */
-    count = bio_trim_block_range(dev, block, count);
-    if (count == 0)
-        return 0;
-
-    return dev->read_block(dev, buf, block, count);
+    return bio_sync_request(dev, BIO_OP_READ, buf, block, count);
 }
 
 ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len)
@@ -431,12 +618,7 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count)
     DEBUG_ASSERT(dev && dev->ref > 0);
     DEBUG_ASSERT(buf);
 
-    /* range check */
-    count = bio_trim_block_range(dev, block, count);
-    if (count == 0)
-        return 0;
-
-    return dev->write_block(dev, buf, block, count);
+    return bio_sync_request(dev, BIO_OP_WRITE, (void *)buf, block, count);
 }
 
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len)
@@ -538,6 +720,286 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->write_block = bio_default_write_block;
     dev->erase = bio_default_erase;
     dev->close = NULL;
+    dev->submit = NULL;
+    dev->queue = NULL;
+}
+
+/* a request can't be issued ahead of an earlier queued request it overlaps, or
+ * while a transfer it overlaps is still in flight */
+static bool bio_queue_is_blocked(struct bio_queue *q, bio_request_t *req)
+{
+    for (uint i = 0; i < BIO_QUEUE_DEPTH; i++) {
+        struct bio_queue_slot *slot = &q->slots[i];
+        if (slot->busy && bio_does_overlap(slot->req.block, slot->req.count, req->block, req->count))
+            return true;
+    }
+
+    bio_request_t *r;
+    list_for_every_entry(&q->pending, r, bio_request_t, node) {
+        if (r == req)
+            return false;
+        if (bio_does_overlap(r->block, r->count, req->block, req->count))
+            return true;
+    }
+
+    return false;
+}
+
+/* pull the next request off the queue along with any that continue it.
+ * Returns false if nothing in the queue can be issued yet. */
+static bool bio_queue_next_batch(bdev_t *dev, struct bio_queue *q, struct list_node *batch)
+{
+    mutex_acquire(&q->lock);
+
+    /* one way elevator: the first request at or past the head, else wrap to the lowest */
+    bio_request_t *r;
+    bio_request_t *first = NULL;
+    bio_request_t *lowest = NULL;
+    list_for_every_entry(&q->pending, r, bio_request_t, node) {
+        if (bio_queue_is_blocked(q, r))
+            continue;
+        if (r->block >= q->head) {
+            first = r;
+            break;
+        }
+        if (!lowest)
+            lowest = r;
+    }
+    if (!first)
+        first = lowest;
+    if (!first) {
+        mutex_release(&q->lock);
+        return false;
+    }
+
+    size_t bytes = 0;
+    bnum_t end = first->block;
+    r = first;
+    for (;;) {
+        bio_request_t *next = list_next_type(&q->pending, &r->node, bio_request_t, node);
+
+        list_delete(&r->node);
+        list_add_tail(batch, &r->node);
+        bytes += r->count * dev->block_size;
+        end += r->count;
+
+        if (!next || next->op != first->op || next->block != end ||
+                bytes + next->count * dev->block_size > q->bounce_size ||
+                bio_queue_is_blocked(q, next))
+            break;
+
+        r = next;
+    }
+
+    q->head = end;
+
+    mutex_release(&q->lock);
+    return true;
+}
+
+/* take an idle slot, or NULL if BIO_QUEUE_DEPTH transfers are already in flight */
+static struct bio_queue_slot *bio_queue_get_slot(struct bio_queue *q)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->slot_lock, state);
+
+    struct bio_queue_slot *slot = list_remove_head_type(&q->free_slots, struct bio_queue_slot, node);
+    if (slot)
+        q->busy_slots++;
+
+    spin_unlock_irqrestore(&q->slot_lock, state);
+    return slot;
+}
+
+/* give a slot back and wake the queue thread to issue more. The thread can exit and free
+ * the queue as soon as it sees the slot back, so it is woken before the lock is dropped. */
+static void bio_queue_put_slot(struct bio_queue *q, struct bio_queue_slot *slot)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->slot_lock, state);
+
+    slot->busy = false;
+    list_add_head(&q->free_slots, &slot->node);
+    q->busy_slots--;
+    event_signal(&q->work, false);
+
+    spin_unlock_irqrestore(&q->slot_lock, state);
+}
+
+static bool bio_queue_is_idle(struct bio_queue *q)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->slot_lock, state);
+    bool idle = q->busy_slots == 0;
+    spin_unlock_irqrestore(&q->slot_lock, state);
+
+    return idle;
+}
+
+/* completion of a slot's transfer, hand each merged request its share of it */
+static void bio_queue_done(bio_request_t *req, void *arg)
+{
+    struct bio_queue_slot *slot = arg;
+    bdev_t *dev = req->dev;
+    ssize_t err = req->result;
+
+    size_t offset = 0;
+    bio_request_t *r;
+    while ((r = list_remove_head_type(&slot->batch, bio_request_t, node))) {
+        size_t len = r->count * dev->block_size;
+        ssize_t result = err;
+        if (err >= 0)
+            result = ((size_t)err > offset) ? (ssize_t)MIN(len, err - offset) : 0;
+
+        if (req->buf == slot->bounce && r->op == BIO_OP_READ && result > 0)
+            memcpy(r->buf, (uint8_t *)slot->bounce + offset, result);
+
+        offset += len;
+        bio_complete_request(r, result);
+    }
+
+    bio_queue_put_slot(slot->q, slot);
+}
+
+/* start a slot's batch on its way to the driver without waiting for it. Drivers without a
+ * submit hook are synchronous, so for them it has finished by the time this returns. */
+static void bio_queue_issue(bdev_t *dev, struct bio_queue_slot *slot)
+{
+    bio_request_t *first = list_peek_head_type(&slot->batch, bio_request_t, node);
+    bio_request_t *last = list_peek_tail_type(&slot->batch, bio_request_t, node);
+
+    slot->req = (bio_request_t) {
+        .dev = dev,
+        .op = first->op,
+        .block = first->block,
+        .count = last->block + last->count - first->block,
+        .callback = bio_queue_done,
+        .callback_arg = slot,
+    };
+
+    if (first == last) {
+        /* nothing merged, transfer straight to or from the caller's buffer */
+        slot->req.buf = first->buf;
+    } else {
+        slot->req.buf = slot->bounce;
+
+        if (first->op == BIO_OP_WRITE) {
+            size_t offset = 0;
+            bio_request_t *r;
+            list_for_every_entry(&slot->batch, r, bio_request_t, node) {
+                memcpy((uint8_t *)slot->bounce + offset, r->buf, r->count * dev->block_size);
+                offset += r->count * dev->block_size;
+            }
+        }
+    }
+
+    /* later requests it overlaps wait for it from here on */
+    slot->busy = true;
+
+    if (dev->submit) {
+        status_t err = dev->submit(dev, &slot->req);
+        if (err < 0)
+            bio_complete_request(&slot->req, err);
+    } else {
+        bio_complete_request(&slot->req,
+                             bio_issue(dev, slot->req.op, slot->req.buf, slot->req.block, slot->req.count));
+    }
+}
+
+static int bio_queue_thread(void *arg)
+{
+    bdev_t *dev = arg;
+    struct bio_queue *q = dev->queue;
+
+    for (;;) {
+        event_wait(&q->work);
+
+        /* keep up to BIO_QUEUE_DEPTH batches in flight, completions wake us for more */
+        struct bio_queue_slot *slot;
+        while ((slot = bio_queue_get_slot(q)) != NULL) {
+            if (!bio_queue_next_batch(dev, q, &slot->batch)) {
+                bio_queue_put_slot(q, slot);
+                break;
+            }
+            bio_queue_issue(dev, slot);
+        }
+
+        /* nothing is added once exiting is set, so the queue is drained once it's empty
+         * and the last transfer is back */
+        if (q->exiting && list_is_empty(&q->pending) && bio_queue_is_idle(q))
+            break;
+    }
+
+    return 0;
+}
+
+status_t bio_queue_create(bdev_t *dev)
+{
+    DEBUG_ASSERT(dev);
+
+    if (dev->queue)
+        return ERR_ALREADY_EXISTS;
+
+    struct bio_queue *q = calloc(1, sizeof(struct bio_queue));
+    if (!q)
+        return ERR_NO_MEMORY;
+
+    q->bounce_size = MAX(BIO_QUEUE_MERGE_MAX, dev->block_size);
+    q->bounce = memalign(CACHE_LINE, BIO_QUEUE_DEPTH * q->bounce_size);
+    if (!q->bounce) {
+        free(q);
+        return ERR_NO_MEMORY;
+    }
+
+    mutex_init(&q->lock);
+    list_initialize(&q->pending);
+    event_init(&q->work, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    spin_lock_init(&q->slot_lock);
+    list_initialize(&q->free_slots);
+    for (uint i = 0; i < BIO_QUEUE_DEPTH; i++) {
+        struct bio_queue_slot *slot = &q->slots[i];
+        slot->q = q;
+        list_initialize(&slot->batch);
+        slot->bounce = (uint8_t *)q->bounce + i * q->bounce_size;
+        list_add_tail(&q->free_slots, &slot->node);
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "bio queue %s", dev->name);
+    q->thread = thread_create(name, &bio_queue_thread, dev, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!q->thread) {
+        event_destroy(&q->work);
+        mutex_destroy(&q->lock);
+        free(q->bounce);
+        free(q);
+        return ERR_NO_MEMORY;
+    }
+
+    dev->queue = q;
+    thread_resume(q->thread);
+
+    return NO_ERROR;
+}
+
+static void bio_queue_destroy(bdev_t *dev)
+{
+    struct bio_queue *q = dev->queue;
+
+    /* the worker drains whatever is still pending before it exits */
+    mutex_acquire(&q->lock);
+    q->exiting = true;
+    mutex_release(&q->lock);
+
+    event_signal(&q->work, true);
+    thread_join(q->thread, NULL, INFINITE_TIME);
+
+    dev->queue = NULL;
+
+    event_destroy(&q->work);
+    mutex_destroy(&q->lock);
+    free(q->bounce);
+    free(q);
 }
 
 void bio_register_device(bdev_t *dev)
@@ -574,8 +1036,9 @@ void bio_dump_devices(void)
     mutex_acquire(&bdevs.lock);
     list_for_every_entry(&bdevs.list, entry, bdev_t, node) {
 
-        printf("\t%s, size %lld, bsize %zd, ref %d",
-               entry->name, entry->total_size, entry->block_size, entry->ref);
+        printf("\t%s, size %lld, bsize %zd, ref %d%s",
+               entry->name, entry->total_size, entry->block_size, entry->ref,
+               entry->queue ? ", queued" : "");
 
         if (!entry->geometry_count || !entry->geometry) {
             printf(" (no erase geometry)\n");
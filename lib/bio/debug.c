@@ -31,6 +31,7 @@
 #include <lib/partition.h>
 #include <platform.h>
 #include <kernel/thread.h>
+#include <kernel/semaphore.h>
 
 #if WITH_LIB_CKSUM
 #include <lib/cksum.h>
@@ -45,6 +46,7 @@
 #if LK_DEBUGLEVEL > 0
 static int cmd_bio(int argc, const cmd_args *argv);
 static int bio_test_device(bdev_t *device);
+static int bio_bench_device(bdev_t *device, uint op, uint ios, size_t xfer_size);
 
 STATIC_COMMAND_START
 STATIC_COMMAND("bio", "block io debug commands", &cmd_bio)
@@ -66,6 +68,8 @@ usage:
         printf("%s ioctl <device> <request> <arg>\n", argv[0].str);
         printf("%s remove <device>\n", argv[0].str);
         printf("%s test <device>\n", argv[0].str);
+        printf("%s queue <device>\n", argv[0].str);
+        printf("%s bench <device> [read|write] [ios per depth] [transfer size]\n", argv[0].str);
 #if WITH_LIB_PARTITION
         printf("%s partscan <device> [offset]\n", argv[0].str);
 #endif
@@ -223,6 +227,36 @@ usage:
         bio_close(dev);
 
         rc = err;
+    } else if (!strcmp(argv[1].str, "queue")) {
+        if (argc < 3) goto notenoughargs;
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        rc = bio_queue_create(dev);
+        printf("bio_queue_create returns %d\n", rc);
+
+        bio_close(dev);
+    } else if (!strcmp(argv[1].str, "bench")) {
+        if (argc < 3) goto notenoughargs;
+
+        uint op = BIO_OP_READ;
+        if (argc > 3 && !strcmp(argv[3].str, "write"))
+            op = BIO_OP_WRITE;
+        uint ios = (argc > 4) ? argv[4].u : 1024;
+        size_t xfer_size = (argc > 5) ? argv[5].u : 4096;
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        rc = bio_bench_device(dev, op, ios, xfer_size);
+        bio_close(dev);
 #if WITH_LIB_PARTITION
     } else if (!strcmp(argv[1].str, "partscan")) {
         if (argc < 3) goto notenoughargs;
@@ -289,6 +323,139 @@ usage:
 
 #endif
 
+#define BIO_BENCH_MAX_DEPTH 32
+
+struct bio_bench_slot {
+    bio_request_t req;
+    semaphore_t *sem;
+    volatile bool done;
+};
+
+static void bio_bench_callback(bio_request_t *req, void *arg)
+{
+    struct bio_bench_slot *slot = arg;
+
+    slot->done = true;
+    sem_post(slot->sem, false);
+}
+
+/* run ios random transfers keeping depth requests in flight, returns elapsed usecs or error */
+static int64_t bio_bench_run(bdev_t *device, uint op, uint depth, uint ios, uint xfer_blocks,
+                             uint8_t *buf, struct bio_bench_slot *slots)
+{
+    semaphore_t sem;
+    sem_init(&sem, 0);
+
+    bnum_t span = device->block_count / xfer_blocks;
+    uint issued = 0;
+    uint completed = 0;
+    int64_t err = 0;
+
+    lk_bigtime_t start = current_time_hires();
+
+    for (uint i = 0; i < depth; i++) {
+        struct bio_bench_slot *slot = &slots[i];
+
+        slot->sem = &sem;
+        slot->done = true;
+        sem_post(&sem, false);
+    }
+
+    while (completed < ios) {
+        sem_wait(&sem);
+
+        for (uint i = 0; i < depth; i++) {
+            struct bio_bench_slot *slot = &slots[i];
+            if (!slot->done)
+                continue;
+
+            /* retire the previous request in this slot, if any, and start another */
+            if (slot->req.dev) {
+                if (slot->req.result != (ssize_t)(xfer_blocks * device->block_size) && err == 0) {
+                    err = (slot->req.result < 0) ? slot->req.result : ERR_IO;
+                    ios = issued; /* stop issuing, wait for the rest */
+                }
+                completed++;
+            }
+            slot->done = false;
+
+            if (issued == ios) {
+                slot->req.dev = NULL;
+                continue;
+            }
+
+            slot->req = (bio_request_t) {
+                .dev = device,
+                .op = op,
+                .buf = buf + i * xfer_blocks * device->block_size,
+                .block = (rand() % span) * xfer_blocks,
+                .count = xfer_blocks,
+                .callback = bio_bench_callback,
+                .callback_arg = slot,
+            };
+            issued++;
+
+            status_t serr = bio_submit(&slot->req);
+            if (serr < 0) {
+                err = serr;
+                completed++;
+                ios = issued;
+                slot->req.dev = NULL;
+            }
+            break;
+        }
+    }
+
+    lk_bigtime_t elapsed = current_time_hires() - start;
+
+    sem_destroy(&sem);
+
+    return (err < 0) ? err : (int64_t)elapsed;
+}
+
+static int bio_bench_device(bdev_t *device, uint op, uint ios, size_t xfer_size)
+{
+    uint xfer_blocks = MAX(1, xfer_size / device->block_size);
+    if (xfer_blocks > device->block_count) {
+        printf("device too small\n");
+        return ERR_INVALID_ARGS;
+    }
+
+    uint8_t *buf = memalign(DMA_ALIGNMENT, BIO_BENCH_MAX_DEPTH * xfer_blocks * device->block_size);
+    struct bio_bench_slot *slots = calloc(BIO_BENCH_MAX_DEPTH, sizeof(struct bio_bench_slot));
+    if (!buf || !slots) {
+        free(buf);
+        free(slots);
+        return ERR_NO_MEMORY;
+    }
+
+    printf("%s %u random %zu byte %ss per queue depth%s\n", device->name, ios,
+           xfer_blocks * device->block_size, (op == BIO_OP_READ) ? "read" : "write",
+           device->queue ? " (queued)" : "");
+
+    int rc = NO_ERROR;
+    for (uint depth = 1; depth <= BIO_BENCH_MAX_DEPTH; depth *= 2) {
+        memset(slots, 0, BIO_BENCH_MAX_DEPTH * sizeof(struct bio_bench_slot));
+
+        int64_t usecs = bio_bench_run(device, op, depth, ios, xfer_blocks, buf, slots);
+        if (usecs < 0) {
+            printf("qd %2u: error %d\n", depth, (int)usecs);
+            rc = usecs;
+            break;
+        }
+        usecs = MAX(usecs, 1);
+
+        uint64_t iops = (uint64_t)ios * 1000000 / usecs;
+        uint64_t kbps = (uint64_t)ios * xfer_blocks * device->block_size * 1000000 / 1024 / usecs;
+        printf("qd %2u: %6llu iops, %4llu.%02llu MB/s\n", depth, iops,
+               kbps / 1024, (kbps % 1024) * 100 / 1024);
+    }
+
+    free(buf);
+    free(slots);
+    return rc;
+}
+
 // Returns the number of blocks that do not match the reference pattern.
 static bool is_valid_block(bdev_t *device, bnum_t block_num, uint8_t *pattern,
                            size_t pattern_length)
@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <list.h>
+#include <kernel/event.h>
 
 __BEGIN_CDECLS;
 
@@ -41,6 +42,38 @@ typedef struct bio_erase_geometry_info {
     size_t erase_shift;
 } bio_erase_geometry_info_t;
 
+struct bdev;
+struct bio_queue;
+
+/* asynchronous block request */
+typedef struct bio_request bio_request_t;
+typedef void (*bio_callback_t)(bio_request_t *req, void *arg);
+
+enum bio_op {
+    BIO_OP_READ = 0,
+    BIO_OP_WRITE,
+};
+
+struct bio_request {
+    struct list_node node; /* owned by the device or queue while the request is in flight */
+
+    struct bdev *dev;
+    uint op;
+    void *buf;
+    bnum_t block;
+    uint count;
+
+    /* bytes transferred or error, valid at completion */
+    ssize_t result;
+
+    /* completion notification, both optional. The callback may run on any
+     * thread, or in interrupt context for devices with a native submit hook.
+     * The request may be reused or freed once the callback is entered. */
+    bio_callback_t callback;
+    void *callback_arg;
+    event_t *event;
+};
+
 typedef struct bdev {
     struct list_node node;
     volatile int ref;
@@ -68,6 +101,12 @@ typedef struct bdev {
     ssize_t (*erase)(struct bdev *, off_t offset, size_t len);
     int (*ioctl)(struct bdev *, int request, void *argp);
     void (*close)(struct bdev *);
+
+    /* optional native async hook, completes the request with bio_complete_request */
+    status_t (*submit)(struct bdev *, bio_request_t *req);
+
+    /* optional request queue, see bio_queue_create */
+    struct bio_queue *queue;
 } bdev_t;
 
 /* user api */
@@ -80,6 +119,23 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count);
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len);
 int bio_ioctl(bdev_t *dev, int request, void *argp);
 
+/* async api. The request is trimmed to the device and completed through its
+ * callback and/or event, possibly before bio_submit returns. If bio_submit
+ * returns an error the request was not started and won't be completed.
+ * bio_read_block and bio_write_block are synchronous wrappers around it.
+ */
+status_t bio_submit(bio_request_t *req);
+
+/* called by drivers implementing the submit hook */
+void bio_complete_request(bio_request_t *req, ssize_t result);
+
+/* Put a request queue in front of a device. Requests are sorted by block and
+ * adjacent ones with the same direction are merged into a single transfer
+ * before being issued to the driver by a per device thread. Drivers with a
+ * submit hook get several of those transfers in flight at once.
+ */
+status_t bio_queue_create(bdev_t *dev);
+
 /* register a block device */
 void bio_register_device(bdev_t *dev);
 void bio_unregister_device(bdev_t *dev);
@@ -29,12 +29,40 @@
 #include <lib/cbuf.h>
 #include <kernel/event.h>
 #include <kernel/spinlock.h>
+#include <kernel/thread.h>
 
 #define LOCAL_TRACE 0
 
 #define INC_POINTER(cbuf, ptr, inc) \
     modpow2(((ptr) + (inc)), (cbuf)->len_pow2)
 
+/*
+ * The head is only moved by the writer and the tail only by the reader. Each
+ * side publishes its own index with a release store and picks up the other
+ * side's with an acquire load, so in spsc mode the data copied into the buffer
+ * is visible before the index that covers it. In the default mode the same
+ * accesses are simply done under the spinlock.
+ */
+#define LOAD_ACQUIRE(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+static inline bool cbuf_is_spsc(cbuf_t *cbuf)
+{
+    return cbuf->flags & CBUF_FLAG_SPSC;
+}
+
+static inline void cbuf_lock(cbuf_t *cbuf, spin_lock_saved_state_t *state)
+{
+    if (!cbuf_is_spsc(cbuf))
+        spin_lock_irqsave(&cbuf->lock, *state);
+}
+
+static inline void cbuf_unlock(cbuf_t *cbuf, spin_lock_saved_state_t *state)
+{
+    if (!cbuf_is_spsc(cbuf))
+        spin_unlock_irqrestore(&cbuf->lock, *state);
+}
+
 void cbuf_initialize(cbuf_t *cbuf, size_t len)
 {
     cbuf_initialize_etc(cbuf, len, malloc(len));
@@ -49,76 +77,138 @@ void cbuf_initialize_etc(cbuf_t *cbuf, size_t len, void *buf)
     cbuf->head = 0;
     cbuf->tail = 0;
     cbuf->len_pow2 = log2_uint(len);
+    cbuf->flags = 0;
     cbuf->buf = buf;
     event_init(&cbuf->event, false, 0);
     spin_lock_init(&cbuf->lock);
+    cbuf->reader_waiting = 0;
 
     LTRACEF("len %zd, len_pow2 %u\n", len, cbuf->len_pow2);
 }
 
+void cbuf_initialize_spsc(cbuf_t *cbuf, size_t len, void *buf)
+{
+    cbuf_initialize_etc(cbuf, len, buf ? buf : malloc(len));
+
+    /* the reader rearms the wakeup each time it blocks, so let a signal be used up */
+    cbuf->flags = CBUF_FLAG_SPSC;
+    event_destroy(&cbuf->event);
+    event_init(&cbuf->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+}
+
 size_t cbuf_space_avail(cbuf_t *cbuf)
 {
-    uint consumed = modpow2((uint)(cbuf->head - cbuf->tail), cbuf->len_pow2);
+    uint consumed = modpow2((uint)(LOAD_ACQUIRE(&cbuf->head) - LOAD_ACQUIRE(&cbuf->tail)), cbuf->len_pow2);
     return valpow2(cbuf->len_pow2) - consumed - 1;
 }
 
 size_t cbuf_space_used(cbuf_t *cbuf)
 {
-    return modpow2((uint)(cbuf->head - cbuf->tail), cbuf->len_pow2);
+    return modpow2((uint)(LOAD_ACQUIRE(&cbuf->head) - LOAD_ACQUIRE(&cbuf->tail)), cbuf->len_pow2);
 }
 
-size_t cbuf_write(cbuf_t *cbuf, const void *_buf, size_t len, bool canreschedule)
+/* describe len bytes of the ring starting at pos as up to two contiguous regions */
+static void cbuf_regions(cbuf_t *cbuf, uint pos, size_t len, iovec_t *regions)
 {
-    const char *buf = (const char *)_buf;
+    size_t sz = cbuf_size(cbuf);
 
-    LTRACEF("len %zd\n", len);
+    DEBUG_ASSERT(pos < sz);
+    DEBUG_ASSERT(len < sz);
 
-    DEBUG_ASSERT(cbuf);
-    DEBUG_ASSERT(len < valpow2(cbuf->len_pow2));
+    regions[0].iov_base = len ? (cbuf->buf + pos) : NULL;
+    if (len + pos > sz) {
+        regions[0].iov_len  = sz - pos;
+        regions[1].iov_base = cbuf->buf;
+        regions[1].iov_len  = len - regions[0].iov_len;
+    } else {
+        regions[0].iov_len  = len;
+        regions[1].iov_base = NULL;
+        regions[1].iov_len  = 0;
+    }
+}
 
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&cbuf->lock, state);
-
-    size_t write_len;
-    size_t pos = 0;
-
-    while (pos < len && cbuf_space_avail(cbuf) > 0) {
-        if (cbuf->head >= cbuf->tail) {
-            if (cbuf->tail == 0) {
-                // Special case - if tail is at position 0, we can't write all
-                // the way to the end of the buffer. Otherwise, head ends up at
-                // 0, head == tail, and buffer is considered "empty" again.
-                write_len =
-                    MIN(valpow2(cbuf->len_pow2) - cbuf->head - 1, len - pos);
-            } else {
-                // Write to the end of the buffer.
-                write_len =
-                    MIN(valpow2(cbuf->len_pow2) - cbuf->head, len - pos);
-            }
-        } else {
-            // Write from head to tail-1.
-            write_len = MIN(cbuf->tail - cbuf->head - 1, len - pos);
-        }
+/* wake up a reader blocked in spsc mode, if there is one */
+static void cbuf_wake_reader(cbuf_t *cbuf, bool reschedule)
+{
+    /* order the head update before looking at the flag, pairs with cbuf_wait_spsc */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cbuf->reader_waiting, __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&cbuf->reader_waiting, 0, __ATOMIC_ACQ_REL)) {
+        event_signal(&cbuf->event, reschedule);
+    }
+}
+
+static void cbuf_wait_spsc(cbuf_t *cbuf)
+{
+    while (cbuf_space_used(cbuf) == 0) {
+        __atomic_store_n(&cbuf->reader_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-        // if it's full, abort and return how much we've written
-        if (write_len == 0) {
+        /* the writer may have missed the flag, check once more before sleeping */
+        if (cbuf_space_used(cbuf) != 0) {
+            __atomic_store_n(&cbuf->reader_waiting, 0, __ATOMIC_RELAXED);
             break;
         }
 
-        if (NULL == buf) {
-            memset(cbuf->buf + cbuf->head, 0, write_len);
-        } else {
-            memcpy(cbuf->buf + cbuf->head, buf + pos, write_len);
-        }
+        event_wait(&cbuf->event);
+    }
+}
 
-        cbuf->head = INC_POINTER(cbuf, cbuf->head, write_len);
-        pos += write_len;
+/* how cbuf_produce fills in the space it publishes */
+enum cbuf_fill {
+    CBUF_FILL_COPY,
+    CBUF_FILL_ZERO,
+    CBUF_FILL_NONE, /* already written in place */
+};
+
+static size_t cbuf_produce(cbuf_t *cbuf, const char *buf, size_t len, enum cbuf_fill fill, bool reschedule)
+{
+    spin_lock_saved_state_t state = 0;
+    cbuf_lock(cbuf, &state);
+
+    uint head = cbuf->head;
+    uint used = modpow2((uint)(head - LOAD_ACQUIRE(&cbuf->tail)), cbuf->len_pow2);
+
+    // one byte is always left free, otherwise head == tail and the buffer
+    // can't be told apart from an empty one
+    len = MIN(len, valpow2(cbuf->len_pow2) - used - 1);
+
+    if (fill != CBUF_FILL_NONE) {
+        iovec_t regions[2];
+        cbuf_regions(cbuf, head, len, regions);
+
+        size_t pos = 0;
+        for (uint i = 0; i < 2 && regions[i].iov_len > 0; i++) {
+            if (fill == CBUF_FILL_ZERO)
+                memset(regions[i].iov_base, 0, regions[i].iov_len);
+            else
+                memcpy(regions[i].iov_base, buf + pos, regions[i].iov_len);
+            pos += regions[i].iov_len;
+        }
     }
 
-    if (cbuf->head != cbuf->tail)
-        event_signal(&cbuf->event, false);
+    STORE_RELEASE(&cbuf->head, INC_POINTER(cbuf, head, len));
+
+    // only signal on the transition from empty, the reader unsignals when it drains it
+    if (!cbuf_is_spsc(cbuf) && used == 0 && len > 0)
+        event_signal(&cbuf->event, reschedule);
+
+    cbuf_unlock(cbuf, &state);
+
+    if (cbuf_is_spsc(cbuf) && len > 0)
+        cbuf_wake_reader(cbuf, reschedule);
+
+    return len;
+}
+
+size_t cbuf_write(cbuf_t *cbuf, const void *buf, size_t len, bool canreschedule)
+{
+    LTRACEF("len %zd\n", len);
 
-    spin_unlock_irqrestore(&cbuf->lock, state);
+    DEBUG_ASSERT(cbuf);
+    DEBUG_ASSERT(len < valpow2(cbuf->len_pow2));
+
+    size_t pos = cbuf_produce(cbuf, buf, len, buf ? CBUF_FILL_COPY : CBUF_FILL_ZERO, false);
 
     // XXX convert to only rescheduling if
     if (canreschedule)
@@ -127,6 +217,33 @@ size_t cbuf_write(cbuf_t *cbuf, const void *_buf, size_t len, bool canreschedule
     return pos;
 }
 
+size_t cbuf_reserve(cbuf_t *cbuf, iovec_t *regions)
+{
+    DEBUG_ASSERT(cbuf && regions);
+
+    spin_lock_saved_state_t state = 0;
+    cbuf_lock(cbuf, &state);
+
+    size_t ret = cbuf_space_avail(cbuf);
+    cbuf_regions(cbuf, cbuf->head, ret, regions);
+
+    cbuf_unlock(cbuf, &state);
+    return ret;
+}
+
+size_t cbuf_commit(cbuf_t *cbuf, size_t len, bool canreschedule)
+{
+    DEBUG_ASSERT(cbuf);
+    DEBUG_ASSERT(len <= cbuf_space_avail(cbuf));
+
+    size_t ret = cbuf_produce(cbuf, NULL, len, CBUF_FILL_NONE, false);
+
+    if (canreschedule)
+        thread_preempt();
+
+    return ret;
+}
+
 size_t cbuf_read(cbuf_t *cbuf, void *_buf, size_t buflen, bool block)
 {
     char *buf = (char *)_buf;
@@ -136,48 +253,39 @@ size_t cbuf_read(cbuf_t *cbuf, void *_buf, size_t buflen, bool block)
 retry:
     // block on the cbuf outside of the lock, which may
     // unblock us early and we'll have to double check below
-    if (block)
-        event_wait(&cbuf->event);
+    if (block) {
+        if (cbuf_is_spsc(cbuf))
+            cbuf_wait_spsc(cbuf);
+        else
+            event_wait(&cbuf->event);
+    }
 
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&cbuf->lock, state);
+    spin_lock_saved_state_t state = 0;
+    cbuf_lock(cbuf, &state);
 
     // see if there's data available
-    size_t ret = 0;
-    if (cbuf->tail != cbuf->head) {
-        size_t pos = 0;
-
-        // loop until we've read everything we need
-        // at most this will make two passes to deal with wraparound
-        while (pos < buflen && cbuf->tail != cbuf->head) {
-            size_t read_len;
-            if (cbuf->head > cbuf->tail) {
-                // simple case where there is no wraparound
-                read_len = MIN(cbuf->head - cbuf->tail, buflen - pos);
-            } else {
-                // read to the end of buffer in this pass
-                read_len = MIN(valpow2(cbuf->len_pow2) - cbuf->tail, buflen - pos);
-            }
-
-            // Only perform the copy if a buf was supplied
-            if (NULL != buf) {
-                memcpy(buf + pos, cbuf->buf + cbuf->tail, read_len);
-            }
-
-            cbuf->tail = INC_POINTER(cbuf, cbuf->tail, read_len);
-            pos += read_len;
-        }
+    uint tail = cbuf->tail;
+    size_t used = modpow2((uint)(LOAD_ACQUIRE(&cbuf->head) - tail), cbuf->len_pow2);
+    size_t ret = MIN(used, buflen);
+
+    // Only perform the copy if a buf was supplied
+    if (ret > 0 && NULL != buf) {
+        iovec_t regions[2];
+        cbuf_regions(cbuf, tail, ret, regions);
+
+        memcpy(buf, regions[0].iov_base, regions[0].iov_len);
+        if (regions[1].iov_len > 0)
+            memcpy(buf + regions[0].iov_len, regions[1].iov_base, regions[1].iov_len);
+    }
 
-        if (cbuf->tail == cbuf->head) {
-            DEBUG_ASSERT(pos > 0);
-            // we've emptied the buffer, unsignal the event
-            event_unsignal(&cbuf->event);
-        }
+    STORE_RELEASE(&cbuf->tail, INC_POINTER(cbuf, tail, ret));
 
-        ret = pos;
+    if (!cbuf_is_spsc(cbuf) && ret > 0 && ret == used) {
+        // we've emptied the buffer, unsignal the event
+        event_unsignal(&cbuf->event);
     }
 
-    spin_unlock_irqrestore(&cbuf->lock, state);
+    cbuf_unlock(cbuf, &state);
 
     // we apparently blocked but raced with another thread and found no data, retry
     if (block && ret == 0)
@@ -190,51 +298,28 @@ size_t cbuf_peek(cbuf_t *cbuf, iovec_t *regions)
 {
     DEBUG_ASSERT(cbuf && regions);
 
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&cbuf->lock, state);
+    spin_lock_saved_state_t state = 0;
+    cbuf_lock(cbuf, &state);
 
     size_t ret = cbuf_space_used(cbuf);
-    size_t sz  = cbuf_size(cbuf);
+    cbuf_regions(cbuf, cbuf->tail, ret, regions);
 
-    DEBUG_ASSERT(cbuf->tail < sz);
-    DEBUG_ASSERT(ret <= sz);
+    cbuf_unlock(cbuf, &state);
+    return ret;
+}
 
-    regions[0].iov_base = ret ? (cbuf->buf + cbuf->tail) : NULL;
-    if (ret + cbuf->tail > sz) {
-        regions[0].iov_len  = sz - cbuf->tail;
-        regions[1].iov_base = cbuf->buf;
-        regions[1].iov_len  = ret - regions[0].iov_len;
-    } else {
-        regions[0].iov_len  = ret;
-        regions[1].iov_base = NULL;
-        regions[1].iov_len  = 0;
-    }
+size_t cbuf_consume(cbuf_t *cbuf, size_t len)
+{
+    DEBUG_ASSERT(len <= cbuf_space_used(cbuf));
 
-    spin_unlock_irqrestore(&cbuf->lock, state);
-    return ret;
+    return cbuf_read(cbuf, NULL, len, false);
 }
 
 size_t cbuf_write_char(cbuf_t *cbuf, char c, bool canreschedule)
 {
     DEBUG_ASSERT(cbuf);
 
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&cbuf->lock, state);
-
-    size_t ret = 0;
-    if (cbuf_space_avail(cbuf) > 0) {
-        cbuf->buf[cbuf->head] = c;
-
-        cbuf->head = INC_POINTER(cbuf, cbuf->head, 1);
-        ret = 1;
-
-        if (cbuf->head != cbuf->tail)
-            event_signal(&cbuf->event, canreschedule);
-    }
-
-    spin_unlock_irqrestore(&cbuf->lock, state);
-
-    return ret;
+    return cbuf_produce(cbuf, &c, 1, CBUF_FILL_COPY, canreschedule);
 }
 
 size_t cbuf_read_char(cbuf_t *cbuf, char *c, bool block)
@@ -242,32 +327,5 @@ size_t cbuf_read_char(cbuf_t *cbuf, char *c, bool block)
     DEBUG_ASSERT(cbuf);
     DEBUG_ASSERT(c);
 
-retry:
-    if (block)
-        event_wait(&cbuf->event);
-
-    spin_lock_saved_state_t state;
-    spin_lock_irqsave(&cbuf->lock, state);
-
-    // see if there's data available
-    size_t ret = 0;
-    if (cbuf->tail != cbuf->head) {
-
-        *c = cbuf->buf[cbuf->tail];
-        cbuf->tail = INC_POINTER(cbuf, cbuf->tail, 1);
-
-        if (cbuf->tail == cbuf->head) {
-            // we've emptied the buffer, unsignal the event
-            event_unsignal(&cbuf->event);
-        }
-
-        ret = 1;
-    }
-
-    spin_unlock_irqrestore(&cbuf->lock, state);
-
-    if (block && ret == 0)
-        goto retry;
-
-    return ret;
+    return cbuf_read(cbuf, c, 1, block);
 }
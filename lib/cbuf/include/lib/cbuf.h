@@ -34,11 +34,16 @@ typedef struct cbuf {
     uint head;
     uint tail;
     uint len_pow2;
+    uint flags;
     char *buf;
     event_t event;
     spin_lock_t lock;
+    int reader_waiting;
 } cbuf_t;
 
+/* one writer and one reader, no lock is taken (see cbuf_initialize_spsc) */
+#define CBUF_FLAG_SPSC (1U << 0)
+
 /**
  * cbuf_initialize
  *
@@ -63,6 +68,22 @@ void cbuf_initialize(cbuf_t *cbuf, size_t len);
  */
 void cbuf_initialize_etc(cbuf_t *cbuf, size_t len, void *buf);
 
+/**
+ * cbuf_initialize_spsc
+ *
+ * Initialize a cbuf for use by exactly one writer and one reader at a time.
+ * The head and tail are handed between the two sides with acquire/release
+ * atomics instead of the spinlock, and the reader is only signaled when it
+ * is actually blocked waiting for data.  Callers on the same side must
+ * serialize among themselves, cbuf_reset() counts as a read.
+ *
+ * @param[in] cbuf A pointer to the cbuf structure to allocate.
+ * @param[in] len The size of the buffer, in bytes.  Must be a power of two.
+ * @param[in] buf A pointer to the memory to be used for internal storage, or
+ * NULL to have one allocated.
+ */
+void cbuf_initialize_spsc(cbuf_t *cbuf, size_t len, void *buf);
+
 /**
  * cbuf_read
  *
@@ -95,6 +116,49 @@ size_t cbuf_read(cbuf_t *cbuf, void *buf, size_t buflen, bool block);
  */
 size_t cbuf_peek(cbuf_t *cbuf, iovec_t *regions);
 
+/**
+ * cbuf_consume
+ *
+ * Release bytes previously returned by cbuf_peek once the caller is done
+ * with them in place.
+ *
+ * @param[in] cbuf The cbuf instance to consume from.
+ * @param[in] len The number of bytes to release, no more than cbuf_peek
+ * returned.
+ *
+ * @return The number of bytes released.
+ */
+size_t cbuf_consume(cbuf_t *cbuf, size_t len);
+
+/**
+ * cbuf_reserve
+ *
+ * The write side counterpart of cbuf_peek.  Fills out a pair of iovec
+ * structures describing the (up to) two contiguous free regions the caller
+ * may fill in place before publishing them with cbuf_commit.
+ *
+ * @param[in] cbuf The cbuf instance to write to.
+ * @param[out] regions A pointer to two iovec structures.
+ *
+ * @return The number of bytes of free space described by the regions.
+ */
+size_t cbuf_reserve(cbuf_t *cbuf, iovec_t *regions);
+
+/**
+ * cbuf_commit
+ *
+ * Publish len bytes written in place into the regions returned by
+ * cbuf_reserve, waking up a blocked reader.
+ *
+ * @param[in] cbuf The cbuf instance to write to.
+ * @param[in] len The number of bytes to publish, no more than cbuf_reserve
+ * returned.
+ * @param[in] canreschedule As for cbuf_write.
+ *
+ * @return The number of bytes published.
+ */
+size_t cbuf_commit(cbuf_t *cbuf, size_t len, bool canreschedule);
+
 /**
  * cbuf_write
  *
@@ -21,62 +21,127 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <debug.h>
+#include <assert.h>
 #include <stddef.h>
 #include <list.h>
 #include <malloc.h>
 #include <err.h>
+#include <stdio.h>
+#include <arch/ops.h>
 #include <lib/dpc.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/mp.h>
 #include <lk/init.h>
 
-struct dpc {
-    struct list_node node;
+/* one queue and worker thread per cpu */
+struct dpc_queue {
+    spin_lock_t lock;
+    struct list_node list;
+    event_t event;
+    thread_t *thread;
+};
+
+static struct dpc_queue dpc_queues[SMP_MAX_CPUS];
 
+/* backing store for dpc_queue callers */
+struct dpc_alloc {
+    dpc_t dpc;
     dpc_callback cb;
     void *arg;
 };
 
-static struct list_node dpc_list = LIST_INITIAL_VALUE(dpc_list);
-static event_t dpc_event;
+void dpc_initialize(dpc_t *dpc, dpc_callback cb, void *arg)
+{
+    *dpc = (dpc_t)DPC_INITIAL_VALUE(cb, arg);
+}
+
+status_t dpc_queue_entry_on(dpc_t *dpc, uint cpu, uint flags)
+{
+    DEBUG_ASSERT(dpc);
+    DEBUG_ASSERT(dpc->cb);
+    DEBUG_ASSERT(cpu < SMP_MAX_CPUS);
+
+    /* claim the dpc, it's only ever on one queue at a time */
+    if (atomic_swap(&dpc->queued, 1) != 0)
+        return ERR_ALREADY_EXISTS;
 
-static int dpc_thread_routine(void *arg);
+    /* a cpu that hasn't come up yet wouldn't run it */
+    if (cpu >= SMP_MAX_CPUS || !mp_is_cpu_active(cpu))
+        cpu = arch_curr_cpu_num();
 
-status_t dpc_queue(dpc_callback cb, void *arg, uint flags)
+    struct dpc_queue *q = &dpc_queues[cpu];
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->lock, state);
+    list_add_tail(&q->list, &dpc->node);
+    spin_unlock_irqrestore(&q->lock, state);
+
+    event_signal(&q->event, (flags & DPC_FLAG_NORESCHED) ? false : true);
+
+    return NO_ERROR;
+}
+
+status_t dpc_queue_entry(dpc_t *dpc, uint flags)
 {
-    struct dpc *dpc;
+    return dpc_queue_entry_on(dpc, arch_curr_cpu_num(), flags);
+}
 
-    dpc = malloc(sizeof(struct dpc));
+static void dpc_alloc_callback(void *arg)
+{
+    struct dpc_alloc *a = arg;
+
+    a->cb(a->arg);
+
+    free(a);
+}
 
-    if (dpc == NULL)
+status_t dpc_queue(dpc_callback cb, void *arg, uint flags)
+{
+    struct dpc_alloc *a = malloc(sizeof(struct dpc_alloc));
+    if (a == NULL)
         return ERR_NO_MEMORY;
 
-    dpc->cb = cb;
-    dpc->arg = arg;
-    enter_critical_section();
-    list_add_tail(&dpc_list, &dpc->node);
-    event_signal(&dpc_event, (flags & DPC_FLAG_NORESCHED) ? false : true);
-    exit_critical_section();
+    a->cb = cb;
+    a->arg = arg;
+    dpc_initialize(&a->dpc, &dpc_alloc_callback, a);
 
-    return NO_ERROR;
+    return dpc_queue_entry(&a->dpc, flags);
 }
 
 static int dpc_thread_routine(void *arg)
 {
+    struct dpc_queue *q = arg;
+
     for (;;) {
-        event_wait(&dpc_event);
+        event_wait(&q->event);
+
+        /* take everything queued so far in one go */
+        struct list_node batch = LIST_INITIAL_VALUE(batch);
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&q->lock, state);
+        if (!list_is_empty(&q->list)) {
+            batch.next = q->list.next;
+            batch.prev = q->list.prev;
+            batch.next->prev = &batch;
+            batch.prev->next = &batch;
+            list_initialize(&q->list);
+        }
+        event_unsignal(&q->event);
+        spin_unlock_irqrestore(&q->lock, state);
 
-        enter_critical_section();
-        struct dpc *dpc = list_remove_head_type(&dpc_list, struct dpc, node);
-        if (!dpc)
-            event_unsignal(&dpc_event);
-        exit_critical_section();
+        dpc_t *dpc;
+        while ((dpc = list_remove_head_type(&batch, dpc_t, node)) != NULL) {
+            dpc_callback cb = dpc->cb;
+            void *cb_arg = dpc->arg;
 
-        if (dpc) {
-//          dprintf("dpc calling %p, arg %p\n", dpc->cb, dpc->arg);
-            dpc->cb(dpc->arg);
+            /* from here on the callback may requeue or free it */
+            atomic_swap(&dpc->queued, 0);
 
-            free(dpc);
+//          dprintf("dpc calling %p, arg %p\n", cb, cb_arg);
+            cb(cb_arg);
         }
     }
 
@@ -85,11 +150,22 @@ static int dpc_thread_routine(void *arg)
 
 static void dpc_init(uint level)
 {
-    event_init(&dpc_event, false, 0);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct dpc_queue *q = &dpc_queues[i];
+        char name[16];
 
-    thread_detach_and_resume(thread_create("dpc", &dpc_thread_routine, NULL, DPC_PRIORITY, DEFAULT_STACK_SIZE));
-}
+        q->lock = SPIN_LOCK_INITIAL_VALUE;
+        list_initialize(&q->list);
+        event_init(&q->event, false, 0);
 
-LK_INIT_HOOK(libdpc, &dpc_init, LK_INIT_LEVEL_THREADING);
+        snprintf(name, sizeof(name), "dpc%u", i);
+        q->thread = thread_create(name, &dpc_thread_routine, q, DPC_PRIORITY, DEFAULT_STACK_SIZE);
+        DEBUG_ASSERT(q->thread);
 
+        /* secondary cpus pick up their worker once they come online */
+        thread_set_pinned_cpu(q->thread, i);
+        thread_detach_and_resume(q->thread);
+    }
+}
 
+LK_INIT_HOOK(libdpc, &dpc_init, LK_INIT_LEVEL_THREADING);
@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <debug.h>
+#include <trace.h>
+#include <list.h>
+#include <err.h>
+#include <string.h>
+#include <stdlib.h>
+#include <kernel/mutex.h>
+#include <lib/fs.h>
+
+#include "fs_priv.h"
+
+#define LOCAL_TRACE 0
+
+/* Page granular cache of file data shared by every block device backed mount.
+ * Pages are keyed by (file, page index), where a file is a path on a mount so
+ * the cached data outlives the open handles. A single LRU list covers all
+ * pages. Device reads happen outside the lock; a fill that races with an
+ * invalidate is detected through the file's generation and dropped.
+ */
+
+#ifndef FS_CACHE_MAX_PAGES
+#define FS_CACHE_MAX_PAGES 256
+#endif
+
+#define FS_CACHE_HASH_SIZE 256
+
+/* readahead window in pages, doubled on each sequential read */
+#define FS_CACHE_RA_INITIAL 4
+#define FS_CACHE_RA_MAX 32
+
+struct fs_cache_file {
+    struct list_node node; /* on the mount's list */
+    char *path;
+    int ref;
+
+    struct list_node pages;
+    uint page_count;
+    uint generation;
+};
+
+struct fs_cache_page {
+    struct list_node lru_node;
+    struct list_node file_node;
+    struct fs_cache_page *hash_next;
+
+    struct fs_cache_file *file;
+    uint64_t index;
+    size_t valid; /* bytes of data, less than a page at the end of the file */
+
+    uint8_t data[FS_CACHE_PAGE_SIZE];
+};
+
+static mutex_t cache_lock = MUTEX_INITIAL_VALUE(cache_lock);
+static struct list_node lru = LIST_INITIAL_VALUE(lru);
+static struct fs_cache_page *hash[FS_CACHE_HASH_SIZE];
+static uint page_count;
+
+static struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead;
+    uint64_t bypass;
+    uint64_t evictions;
+} stats;
+
+static inline uint hash_index(const struct fs_cache_file *cf, uint64_t index)
+{
+    uint64_t key = ((uintptr_t)cf >> 4) * 0x9e3779b97f4a7c15ULL + index;
+    return (key ^ (key >> 29)) % FS_CACHE_HASH_SIZE;
+}
+
+static struct fs_cache_page *page_lookup(const struct fs_cache_file *cf, uint64_t index)
+{
+    DEBUG_ASSERT(is_mutex_held(&cache_lock));
+
+    for (struct fs_cache_page *page = hash[hash_index(cf, index)]; page; page = page->hash_next) {
+        if (page->file == cf && page->index == index)
+            return page;
+    }
+    return NULL;
+}
+
+static void file_release(struct fs_cache_file *cf)
+{
+    if (cf->ref == 0 && cf->page_count == 0) {
+        LTRACEF("freeing '%s'\n", cf->path);
+        list_delete(&cf->node);
+        free(cf->path);
+        free(cf);
+    }
+}
+
+static void page_remove(struct fs_cache_page *page)
+{
+    DEBUG_ASSERT(is_mutex_held(&cache_lock));
+
+    struct fs_cache_page **prev = &hash[hash_index(page->file, page->index)];
+    while (*prev != page)
+        prev = &(*prev)->hash_next;
+    *prev = page->hash_next;
+
+    list_delete(&page->lru_node);
+    list_delete(&page->file_node);
+    page->file->page_count--;
+    page_count--;
+
+    free(page);
+}
+
+static bool evict_one(void)
+{
+    struct fs_cache_page *page = list_peek_tail_type(&lru, struct fs_cache_page, lru_node);
+    if (!page)
+        return false;
+
+    struct fs_cache_file *cf = page->file;
+    page_remove(page);
+    file_release(cf);
+    stats.evictions++;
+
+    return true;
+}
+
+/* called with the lock held */
+static void page_insert(struct fs_cache_file *cf, uint64_t index, const void *data, size_t valid)
+{
+    DEBUG_ASSERT(is_mutex_held(&cache_lock));
+
+    if (page_lookup(cf, index))
+        return;
+
+    if (page_count >= FS_CACHE_MAX_PAGES)
+        evict_one();
+
+    /* make room if the heap is short on memory */
+    struct fs_cache_page *page;
+    while ((page = malloc(sizeof(struct fs_cache_page))) == NULL) {
+        if (!evict_one())
+            return;
+    }
+
+    page->file = cf;
+    page->index = index;
+    page->valid = valid;
+    memcpy(page->data, data, valid);
+
+    uint h = hash_index(cf, index);
+    page->hash_next = hash[h];
+    hash[h] = page;
+
+    list_add_head(&lru, &page->lru_node);
+    list_add_tail(&cf->pages, &page->file_node);
+    cf->page_count++;
+    page_count++;
+}
+
+static void drop_pages(struct fs_cache_file *cf, uint64_t first)
+{
+    struct fs_cache_page *page, *temp;
+    list_for_every_entry_safe(&cf->pages, page, temp, struct fs_cache_page, file_node) {
+        if (page->index >= first || page->valid < FS_CACHE_PAGE_SIZE)
+            page_remove(page);
+    }
+    cf->generation++;
+}
+
+struct fs_cache_file *fs_cache_open(struct list_node *mount_files, const char *path)
+{
+    mutex_acquire(&cache_lock);
+
+    struct fs_cache_file *cf;
+    list_for_every_entry(mount_files, cf, struct fs_cache_file, node) {
+        if (!strcmp(cf->path, path)) {
+            cf->ref++;
+            goto done;
+        }
+    }
+
+    cf = calloc(1, sizeof(struct fs_cache_file));
+    if (cf) {
+        cf->path = strdup(path);
+        if (!cf->path) {
+            free(cf);
+            cf = NULL;
+            goto done;
+        }
+        cf->ref = 1;
+        list_initialize(&cf->pages);
+        list_add_head(mount_files, &cf->node);
+    }
+
+done:
+    mutex_release(&cache_lock);
+
+    LTRACEF("path '%s', cf %p\n", path, cf);
+
+    return cf;
+}
+
+void fs_cache_close(struct fs_cache_file *cf)
+{
+    mutex_acquire(&cache_lock);
+
+    DEBUG_ASSERT(cf->ref > 0);
+    cf->ref--;
+    file_release(cf);
+
+    mutex_release(&cache_lock);
+}
+
+ssize_t fs_cache_read(struct fs_cache_file *cf, struct fs_readahead *ra, const struct fs_api *api,
+                      filecookie *cookie, void *_buf, off_t offset, size_t len)
+{
+    uint8_t *buf = _buf;
+
+    LTRACEF("cf %p, offset %lld, len %zu\n", cf, offset, len);
+
+    if (offset < 0 || len == 0)
+        return api->read(cookie, buf, offset, len);
+
+    /* grow the readahead window while the handle reads sequentially, drop it on a seek */
+    if (offset == ra->next) {
+        ra->window = ra->window ? MIN(ra->window * 2, FS_CACHE_RA_MAX) : FS_CACHE_RA_INITIAL;
+    } else {
+        ra->window = 0;
+    }
+    ra->next = offset + len;
+
+    /* large reads would only churn the cache */
+    if (len > FS_CACHE_BYPASS_LEN) {
+        mutex_acquire(&cache_lock);
+        stats.bypass++;
+        mutex_release(&cache_lock);
+
+        return api->read(cookie, buf, offset, len);
+    }
+
+    ssize_t total = 0;
+    while (len > 0) {
+        uint64_t index = offset / FS_CACHE_PAGE_SIZE;
+        size_t page_offset = offset % FS_CACHE_PAGE_SIZE;
+        size_t tocopy;
+        bool eof;
+
+        mutex_acquire(&cache_lock);
+
+        struct fs_cache_page *page = page_lookup(cf, index);
+        if (page) {
+            stats.hits++;
+
+            /* move to the head of the lru */
+            list_delete(&page->lru_node);
+            list_add_head(&lru, &page->lru_node);
+
+            tocopy = (page->valid > page_offset) ? MIN(len, page->valid - page_offset) : 0;
+            memcpy(buf, page->data + page_offset, tocopy);
+            eof = page->valid < FS_CACHE_PAGE_SIZE;
+
+            mutex_release(&cache_lock);
+        } else {
+            stats.misses++;
+
+            /* the pages this read still needs plus the readahead window, up to the next cached page */
+            uint want = (page_offset + len + FS_CACHE_PAGE_SIZE - 1) / FS_CACHE_PAGE_SIZE + ra->window;
+            uint count = 1;
+            while (count < want && !page_lookup(cf, index + count))
+                count++;
+            uint generation = cf->generation;
+
+            mutex_release(&cache_lock);
+
+            size_t fill_len = (size_t)count * FS_CACHE_PAGE_SIZE;
+            uint8_t *fill = malloc(fill_len);
+            if (!fill) {
+                /* no memory for a fill buffer, read around the cache */
+                ssize_t err = api->read(cookie, buf, offset, len);
+                if (err < 0)
+                    return total ? total : err;
+                return total + err;
+            }
+
+            ssize_t err = api->read(cookie, fill, index * FS_CACHE_PAGE_SIZE, fill_len);
+            if (err < 0) {
+                free(fill);
+                return total ? total : err;
+            }
+            size_t got = err;
+
+            tocopy = (got > page_offset) ? MIN(len, got - page_offset) : 0;
+            memcpy(buf, fill + page_offset, tocopy);
+            eof = got < fill_len;
+
+            /* keep what we read unless the file changed underneath us */
+            mutex_acquire(&cache_lock);
+            if (cf->generation == generation) {
+                uint needed = (page_offset + tocopy + FS_CACHE_PAGE_SIZE - 1) / FS_CACHE_PAGE_SIZE;
+                for (uint i = 0; i < count && (size_t)i * FS_CACHE_PAGE_SIZE < got; i++) {
+                    page_insert(cf, index + i, fill + i * FS_CACHE_PAGE_SIZE,
+                                MIN(FS_CACHE_PAGE_SIZE, got - i * FS_CACHE_PAGE_SIZE));
+                    if (i >= needed)
+                        stats.readahead++;
+                }
+            }
+            mutex_release(&cache_lock);
+
+            free(fill);
+        }
+
+        buf += tocopy;
+        offset += tocopy;
+        len -= tocopy;
+        total += tocopy;
+
+        /* stop at the end of the file */
+        if (tocopy == 0 || (eof && len > 0))
+            break;
+    }
+
+    return total;
+}
+
+void fs_cache_invalidate(struct fs_cache_file *cf, off_t offset)
+{
+    LTRACEF("cf %p, offset %lld\n", cf, offset);
+
+    mutex_acquire(&cache_lock);
+    drop_pages(cf, (offset > 0) ? offset / FS_CACHE_PAGE_SIZE : 0);
+    mutex_release(&cache_lock);
+}
+
+void fs_cache_invalidate_path(struct list_node *mount_files, const char *path)
+{
+    mutex_acquire(&cache_lock);
+
+    struct fs_cache_file *cf;
+    list_for_every_entry(mount_files, cf, struct fs_cache_file, node) {
+        if (!strcmp(cf->path, path)) {
+            drop_pages(cf, 0);
+            file_release(cf);
+            break;
+        }
+    }
+
+    mutex_release(&cache_lock);
+}
+
+void fs_cache_unmount(struct list_node *mount_files)
+{
+    mutex_acquire(&cache_lock);
+
+    struct fs_cache_file *cf, *temp;
+    list_for_every_entry_safe(mount_files, cf, temp, struct fs_cache_file, node) {
+        DEBUG_ASSERT(cf->ref == 0);
+        drop_pages(cf, 0);
+        file_release(cf);
+    }
+
+    mutex_release(&cache_lock);
+}
+
+size_t fs_cache_trim(size_t pages)
+{
+    size_t evicted = 0;
+
+    mutex_acquire(&cache_lock);
+    while (evicted < pages && evict_one())
+        evicted++;
+    mutex_release(&cache_lock);
+
+    return evicted;
+}
+
+void fs_cache_dump(void)
+{
+    mutex_acquire(&cache_lock);
+
+    printf("fs cache: %u of %u pages (%u bytes each)\n", page_count, FS_CACHE_MAX_PAGES, FS_CACHE_PAGE_SIZE);
+    printf("\thits %llu, misses %llu, readahead pages %llu, bypassed reads %llu, evictions %llu\n",
+           stats.hits, stats.misses, stats.readahead, stats.bypass, stats.evictions);
+
+    mutex_release(&cache_lock);
+}
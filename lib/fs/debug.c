@@ -168,6 +168,7 @@ usage:
         printf("%s format <type> [device]\n", argv[0].str);
         printf("%s stat <path>\n", argv[0].str);
         printf("%s ioctl <request> [args...]\n", argv[0].str);
+        printf("%s cache [drop]\n", argv[0].str);
         return -1;
     }
 
@@ -236,6 +237,11 @@ usage:
 
     } else if (!strcmp(argv[1].str, "ioctl")) {
         return cmd_fs_ioctl(argc, argv);
+    } else if (!strcmp(argv[1].str, "cache")) {
+        if (argc >= 3 && !strcmp(argv[2].str, "drop")) {
+            printf("dropped %zu pages\n", fs_cache_trim(SIZE_MAX));
+        }
+        fs_cache_dump();
     } else if (!strcmp(argv[1].str, "write")) {
         int err;
         off_t off;
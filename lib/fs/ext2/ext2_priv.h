@@ -52,7 +52,7 @@ struct cache_block {
 typedef struct {
     ext2_t *ext2;
 
-    struct cache_block ind_cache[3]; // cache of indirect blocks as they're scanned
+    struct cache_block ind_cache[3]; // copies of the indirect tables of the last lookup, one per level
     struct ext2_inode inode;
 } ext2_file_t;
 
@@ -67,6 +67,8 @@ int ext2_put_block(ext2_t *ext2, blocknum_t bnum);
 
 off_t ext2_file_len(ext2_t *ext2, struct ext2_inode *inode);
 ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len);
+ssize_t ext2_read_inode_cached(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *ind_cache,
+                               void *buf, off_t offset, size_t len); // ind_cache is an open file's, NULL for none
 int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len);
 
 /* fs api */
@@ -23,6 +23,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <err.h>
 #include <debug.h>
 #include <trace.h>
 #include "ext2_priv.h"
@@ -48,8 +49,6 @@ static int ext2_calculate_block_pointer_pos(ext2_t *ext2, blocknum_t block_to_fi
 {
     uint32_t block_ptr_per_block, block_ptr_per_2nd_block;
 
-    // XXX optimize this
-
     // See if it's in the direct blocks
     if (block_to_find < EXT2_NDIR_BLOCKS) {
         *level = 0;
@@ -94,6 +93,7 @@ static int ext2_calculate_block_pointer_pos(ext2_t *ext2, blocknum_t block_to_fi
 }
 
 // This function returns a pointer to the cache block that corresponds to the indirect block pointer.
+// If a table on the way down is a hole, it returns 0 with *cache_block set to NULL.
 int ext2_get_indirect_block_pointer_cache_block(ext2_t *ext2, struct ext2_inode *inode, blocknum_t **cache_block, uint32_t level, uint32_t pos[], uint *block_loaded)
 {
     uint32_t current_level = 0;
@@ -114,8 +114,9 @@ int ext2_get_indirect_block_pointer_cache_block(ext2_t *ext2, struct ext2_inode
         }
 
         if (current_block == 0) {
-            err = -1;
-            goto error;
+            *cache_block = NULL;
+            *block_loaded = 0;
+            return 0;
         }
 
         last_block = current_block;
@@ -142,29 +143,75 @@ error:
     return err;
 }
 
-/* translate a file block to a physical block */
-static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode, uint fileblock)
+/* return the indirect table in block bnum, using the private copy in cb if it's
+ * already loaded. The filesystem is read only, so the copy never goes stale. */
+static int ext2_get_cached_table(ext2_t *ext2, struct cache_block *cb, blocknum_t bnum, blocknum_t **table)
+{
+    if (cb->num == bnum) {
+        *table = cb->ptr;
+        return 0;
+    }
+
+    if (!cb->ptr) {
+        cb->ptr = malloc(EXT2_BLOCK_SIZE(ext2->sb));
+        if (!cb->ptr)
+            return ERR_NO_MEMORY;
+    }
+
+    cb->num = 0;
+    int err = ext2_read_block(ext2, cb->ptr, bnum);
+    if (err < 0)
+        return err;
+    cb->num = bnum;
+
+    *table = cb->ptr;
+    return 0;
+}
+
+/* translate a file block to a physical block, 0 for a hole. Returns an error if
+ * an indirect table on the way can't be read. */
+static int file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *ind_cache, uint fileblock,
+                                  blocknum_t *fs_block)
 {
     int err;
     blocknum_t block;
 
     LTRACEF("inode %p, fileblock %u\n", inode, fileblock);
 
+    *fs_block = 0;
+
     uint32_t pos[4];
     uint32_t level = 0;
-    ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos);
+    if (ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos) < 0)
+        return ERR_OUT_OF_RANGE;
 
     LTRACEF("level %d, pos 0x%x 0x%x 0x%x 0x%x\n", level, pos[0], pos[1], pos[2], pos[3]);
 
     if (level == 0) {
         /* direct block, just return it directly */
         block = LE32(inode->i_block[fileblock]);
+    } else if (ind_cache) {
+        /* walk the memoized tables, only the levels that changed since the last lookup are read */
+        block = LE32(inode->i_block[pos[0]]);
+        for (uint32_t i = 0; i < level; i++) {
+            if (block == 0)
+                return 0;
+
+            blocknum_t *table;
+            err = ext2_get_cached_table(ext2, &ind_cache[i], block, &table);
+            if (err < 0)
+                return err;
+
+            block = LE32(table[pos[i + 1]]);
+        }
     } else {
         /* at least one level of indirection, get a pointer to the final indirect block table and dereference it */
         blocknum_t *ind_table;
         blocknum_t phys_block;
         err = ext2_get_indirect_block_pointer_cache_block(ext2, inode, &ind_table, level, pos, &phys_block);
         if (err < 0)
+            return err;
+        if (!ind_table)
             return 0;
 
         /* dereference the final entry in the final table */
@@ -177,14 +224,74 @@ static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode,
 
     LTRACEF("returning %u\n", block);
 
-    return block;
+    *fs_block = block;
+    return 0;
+}
+
+/* Find the run of up to max_count file blocks starting at fileblock that are
+ * physically contiguous, or all holes. *start is the first physical block, 0 for a hole.
+ * A lookup failing past the first block just ends the run there.
+ */
+static int file_block_run_to_fs_block(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *ind_cache,
+                                      uint fileblock, uint max_count, blocknum_t *start, uint *count)
+{
+    int err = file_block_to_fs_block(ext2, inode, ind_cache, fileblock, start);
+    if (err < 0)
+        return err;
+
+    uint i;
+    for (i = 1; i < max_count; i++) {
+        blocknum_t block;
+        if (file_block_to_fs_block(ext2, inode, ind_cache, fileblock + i, &block) < 0)
+            break;
+        if (block != ((*start == 0) ? 0 : *start + i))
+            break;
+    }
+
+    LTRACEF("fileblock %u: block %u, count %u\n", fileblock, *start, i);
+
+    *count = i;
+    return 0;
 }
 
-ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t offset, size_t len)
+/* copy part of a single file block out of the block cache */
+static int ext2_read_partial_block(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *ind_cache,
+                                   uint fileblock, uint8_t *buf, size_t block_offset, size_t len)
+{
+    blocknum_t phys_block;
+    int err = file_block_to_fs_block(ext2, inode, ind_cache, fileblock, &phys_block);
+    if (err < 0)
+        return err;
+
+    if (phys_block == 0) {
+        memset(buf, 0, len);
+        return 0;
+    }
+
+    void *cache_ptr;
+    err = ext2_get_block(ext2, &cache_ptr, phys_block);
+    if (err < 0)
+        return err;
+
+    memcpy(buf, (uint8_t *)cache_ptr + block_offset, len);
+
+    ext2_put_block(ext2, phys_block);
+
+    return 0;
+}
+
+ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len)
+{
+    return ext2_read_inode_cached(ext2, inode, NULL, buf, offset, len);
+}
+
+ssize_t ext2_read_inode_cached(ext2_t *ext2, struct ext2_inode *inode, struct cache_block *ind_cache,
+                               void *_buf, off_t offset, size_t len)
 {
     int err = 0;
     size_t bytes_read = 0;
     uint8_t *buf = _buf;
+    const size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
 
     /* calculate the file size */
     off_t file_size = ext2_file_len(ext2, inode);
@@ -200,24 +307,16 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
         return 0;
 
     /* calculate the starting file block */
-    uint file_block = offset / EXT2_BLOCK_SIZE(ext2->sb);
+    uint file_block = offset / block_size;
 
     /* handle partial first block */
-    if ((offset % EXT2_BLOCK_SIZE(ext2->sb)) != 0) {
-        uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
-
-        /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-        if (phys_block == 0) {
-            memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
-        } else {
-            ext2_read_block(ext2, temp, phys_block);
-        }
+    if ((offset % block_size) != 0) {
+        size_t block_offset = offset % block_size;
+        size_t tocopy = MIN(len, block_size - block_offset);
 
-        /* copy out what we need */
-        size_t block_offset = offset % EXT2_BLOCK_SIZE(ext2->sb);
-        size_t tocopy = MIN(len, EXT2_BLOCK_SIZE(ext2->sb) - block_offset);
-        memcpy(buf, temp + block_offset, tocopy);
+        err = ext2_read_partial_block(ext2, inode, ind_cache, file_block, buf, block_offset, tocopy);
+        if (err < 0)
+            goto done;
 
         /* increment our stuff */
         file_block++;
@@ -226,44 +325,50 @@ ssize_t ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_
         buf += tocopy;
     }
 
-    /* handle middle blocks */
-    while (len >= EXT2_BLOCK_SIZE(ext2->sb)) {
-        /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
+    /* handle middle blocks, a physically contiguous run at a time */
+    while (len >= block_size) {
+        uint count;
+        blocknum_t phys_block;
+        err = file_block_run_to_fs_block(ext2, inode, ind_cache, file_block, len / block_size, &phys_block, &count);
+        if (err < 0)
+            goto done;
+
+        size_t run_len = count * block_size;
+
         if (phys_block == 0) {
-            memset(buf, 0, EXT2_BLOCK_SIZE(ext2->sb));
+            memset(buf, 0, run_len);
+        } else if (count == 1) {
+            err = ext2_read_block(ext2, buf, phys_block);
+            if (err < 0)
+                goto done;
         } else {
-            ext2_read_block(ext2, buf, phys_block);
+            /* read the whole run straight into the caller's buffer, bypassing the cache */
+            ssize_t ret = bio_read(ext2->dev, buf, (off_t)phys_block * block_size, run_len);
+            if (ret != (ssize_t)run_len) {
+                err = (ret < 0) ? ret : ERR_IO;
+                goto done;
+            }
         }
 
         /* increment our stuff */
-        file_block++;
-        len -= EXT2_BLOCK_SIZE(ext2->sb);
-        bytes_read += EXT2_BLOCK_SIZE(ext2->sb);
-        buf += EXT2_BLOCK_SIZE(ext2->sb);
+        file_block += count;
+        len -= run_len;
+        bytes_read += run_len;
+        buf += run_len;
     }
 
     /* handle partial last block */
     if (len > 0) {
-        uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
-
-        /* calculate the block and read it */
-        blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
-        if (phys_block == 0) {
-            memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
-        } else {
-            ext2_read_block(ext2, temp, phys_block);
-        }
-
-        /* copy out what we need */
-        memcpy(buf, temp, len);
+        err = ext2_read_partial_block(ext2, inode, ind_cache, file_block, buf, 0, len);
+        if (err < 0)
+            goto done;
 
         /* increment our stuff */
         bytes_read += len;
     }
 
+done:
     LTRACEF("err %d, bytes_read %zu\n", err, bytes_read);
 
     return (err < 0) ? err : (ssize_t)bytes_read;
 }
-
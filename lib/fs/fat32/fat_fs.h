@@ -49,11 +49,25 @@ typedef struct {
     uint32_t root_start;
 } fat_fs_t;
 
+/* a run of physically contiguous clusters in a file */
+typedef struct {
+    uint32_t file_cluster; /* index of the first cluster of the run within the file */
+    uint32_t cluster;
+    uint32_t count;
+} fat_extent_t;
+
 typedef struct {
     fat_fs_t *fat_fs;
     uint32_t start_cluster;
     uint32_t length;
     uint8_t attributes;
+
+    /* extent map, sorted by file_cluster and extended lazily as the file is read */
+    fat_extent_t *extents;
+    uint32_t extent_count;
+    uint32_t extent_capacity;
+    uint32_t mapped_clusters; /* clusters covered by the map */
+    uint32_t next_cluster;    /* the cluster after the mapped ones, end of chain once complete */
 } fat_file_t;
 
 typedef enum {
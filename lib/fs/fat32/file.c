@@ -36,12 +36,47 @@
 #define DIR_ENTRY_LENGTH 32
 #define USE_CACHE 1
 
-uint32_t fat32_next_cluster_in_chain(fat_fs_t *fat, uint32_t cluster)
+static inline bool fat32_cluster_is_eoc(fat_fs_t *fat, uint32_t cluster)
+{
+    /* free, reserved, bad or end of chain markers, or past the end of the volume */
+    return (cluster < 2) || (cluster >= 0x0ffffff7) || (cluster >= fat->total_clusters + 2);
+}
+
+/* the block holding a cluster's FAT entry, in units of sectors */
+static inline uint32_t fat32_fat_block(fat_fs_t *fat, uint32_t cluster)
 {
-    uint32_t fat_sector = (cluster) >> 7;
-    uint32_t fat_index = (cluster ) & 127;
+    uint32_t entries_per_sector = fat->bytes_per_sector / (fat->fat_bits / 8);
 
-    uint32_t bnum = (fat->lba_start / fat->bytes_per_sector) + (fat->reserved_sectors + fat_sector);
+    return (fat->lba_start / fat->bytes_per_sector) + fat->reserved_sectors + (cluster / entries_per_sector);
+}
+
+/* pull a cluster's FAT entry out of the sector holding it */
+static uint32_t fat32_fat_entry(fat_fs_t *fat, const void *sector, uint32_t cluster)
+{
+    uint32_t entries_per_sector = fat->bytes_per_sector / (fat->fat_bits / 8);
+    uint32_t fat_index = cluster % entries_per_sector;
+    uint32_t next_cluster = 0x0fffffff;
+
+    if (fat->fat_bits == 32) {
+        const uint32_t *table = (const uint32_t *)sector;
+        next_cluster = table[fat_index];
+        LE32SWAP(next_cluster);
+        next_cluster &= 0x0fffffff;
+    } else if (fat->fat_bits == 16) {
+        const uint16_t *table = (const uint16_t *)sector;
+        next_cluster = table[fat_index];
+        LE16SWAP(next_cluster);
+        if (next_cluster > 0xfff0) {
+            next_cluster |= 0x0fff0000;
+        }
+    }
+
+    return next_cluster;
+}
+
+uint32_t fat32_next_cluster_in_chain(fat_fs_t *fat, uint32_t cluster)
+{
+    uint32_t bnum = fat32_fat_block(fat, cluster);
     uint32_t next_cluster = 0x0fffffff;
 
 #if USE_CACHE
@@ -50,24 +85,13 @@ uint32_t fat32_next_cluster_in_chain(fat_fs_t *fat, uint32_t cluster)
     if (err < 0) {
         printf("bcache_get_block returned: %i\n", err);
     } else {
-        if (fat->fat_bits == 32) {
-            uint32_t *table = (uint32_t *)cache_ptr;
-            next_cluster = table[fat_index];
-            LE32SWAP(next_cluster);
-        } else if (fat->fat_bits == 16) {
-            uint16_t *table = (uint16_t *)cache_ptr;
-            next_cluster = table[fat_index];
-            LE16SWAP(next_cluster);
-            if (next_cluster > 0xfff0) {
-                next_cluster |= 0x0fff0000;
-            }
-        }
+        next_cluster = fat32_fat_entry(fat, cache_ptr, cluster);
 
         bcache_put_block(fat->cache, bnum);
     }
 #else
-    uint32_t offset = (bnum * fat->bytes_per_sector) + (fat_index * (fat->fat_bits / 8));
-    bio_read(fat->dev, &next_cluster, offset, 4);
+    uint32_t offset = (bnum * fat->bytes_per_sector) + ((cluster % (fat->bytes_per_sector / (fat->fat_bits / 8))) * (fat->fat_bits / 8));
+    bio_read(fat->dev, &next_cluster, offset, fat->fat_bits / 8);
     LE32SWAP(next_cluster);
 #endif
     return next_cluster;
@@ -186,13 +210,17 @@ status_t fat32_open_file(fscookie *cookie, const char *path, filecookie **fcooki
             free(filename);
 
             if (matched) {
-                uint16_t target_cluster = fat_read16(dir, offset + 0x1a);
+                uint32_t target_cluster = fat_read16(dir, offset + 0x1a);
+                if (fat->fat_bits == 32) {
+                    target_cluster |= (uint32_t)fat_read16(dir, offset + 0x14) << 16;
+                }
                 if (done == true) {
-                    file = malloc(sizeof(fat_file_t));
+                    file = calloc(1, sizeof(fat_file_t));
                     file->fat_fs = fat;
                     file->start_cluster = target_cluster;
                     file->length = fat_read32(dir, offset + 0x1c);
                     file->attributes = dir[0x0B + offset];
+                    file->next_cluster = target_cluster;
                     result = NO_ERROR;
                 } else {
                     dir_cluster = target_cluster;
@@ -218,7 +246,7 @@ status_t fat32_open_file(fscookie *cookie, const char *path, filecookie **fcooki
         } else {
             // XXX: untested!!!
             dir_cluster = fat32_next_cluster_in_chain(fat, dir_cluster);
-            if (dir_cluster == 0x0fffffff) {
+            if (fat32_cluster_is_eoc(fat, dir_cluster)) {
                 // no more clusters in the chain
                 break;
             }
@@ -231,51 +259,126 @@ out:
     return result;
 }
 
-ssize_t fat32_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len)
+/* extend the file's extent map until it covers file cluster index or the chain ends */
+static status_t fat32_map_clusters(fat_file_t *file, uint32_t index)
 {
-    fat_file_t *file = (fat_file_t *)fcookie;
     fat_fs_t *fat = file->fat_fs;
-    bdev_t *dev = fat->dev;
+    status_t err = NO_ERROR;
+
+    /* keep the current FAT sector across lookups, consecutive entries usually share one */
+    void *table = NULL;
+    uint32_t table_bnum = 0;
+
+    while (file->mapped_clusters <= index && !fat32_cluster_is_eoc(fat, file->next_cluster)) {
+        uint32_t cluster = file->next_cluster;
+
+        uint32_t bnum = fat32_fat_block(fat, cluster);
+        if (!table || bnum != table_bnum) {
+            if (table)
+                bcache_put_block(fat->cache, table_bnum);
+            err = bcache_get_block(fat->cache, &table, bnum);
+            if (err < 0) {
+                table = NULL;
+                break;
+            }
+            table_bnum = bnum;
+        }
 
-    uint32_t cluster = 0;
-    if (offset <= fat->bytes_per_cluster) {
-        cluster = file->start_cluster;
-    } else {
-        // XXX: support non-0 offsets
-        TRACE;
-        return -1;
+        /* extend the last run or start a new one */
+        fat_extent_t *last = file->extent_count ? &file->extents[file->extent_count - 1] : NULL;
+        if (last && last->cluster + last->count == cluster) {
+            last->count++;
+        } else {
+            if (file->extent_count == file->extent_capacity) {
+                uint32_t capacity = file->extent_capacity ? file->extent_capacity * 2 : 8;
+                fat_extent_t *extents = realloc(file->extents, capacity * sizeof(fat_extent_t));
+                if (!extents) {
+                    err = ERR_NO_MEMORY;
+                    break;
+                }
+                file->extents = extents;
+                file->extent_capacity = capacity;
+            }
+
+            file->extents[file->extent_count++] = (fat_extent_t) {
+                .file_cluster = file->mapped_clusters,
+                .cluster = cluster,
+                .count = 1,
+            };
+        }
+
+        file->mapped_clusters++;
+        file->next_cluster = fat32_fat_entry(fat, table, cluster);
     }
 
-    uint32_t length = file->length;
-    uint32_t amount_read = 0;
+    if (table)
+        bcache_put_block(fat->cache, table_bnum);
 
-    do {
-        off_t lba_addr = fat32_offset_for_cluster(fat, cluster);
+    return err;
+}
 
-        uint32_t to_read = fat->bytes_per_cluster;
-        uint32_t next_cluster = 0;
-        while ((next_cluster = fat32_next_cluster_in_chain(fat, cluster)) == cluster + 1) {
-            cluster = next_cluster;
-            to_read += fat->bytes_per_cluster;
+/* find the extent holding file cluster index, which must be mapped */
+static const fat_extent_t *fat32_find_extent(fat_file_t *file, uint32_t index)
+{
+    DEBUG_ASSERT(index < file->mapped_clusters);
+
+    /* the last extent starting at or before index */
+    uint32_t lo = 0;
+    uint32_t hi = file->extent_count;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (file->extents[mid].file_cluster <= index) {
+            lo = mid;
+        } else {
+            hi = mid;
         }
-        cluster = next_cluster;
+    }
 
-        to_read = MIN(length - amount_read, to_read);
-        // XXX: support non-0 offsets
-        int err = bio_read(dev, buf+amount_read, lba_addr, to_read);
-        if (err < 0) {
-            return err;
+    return &file->extents[lo];
+}
+
+ssize_t fat32_read_file(filecookie *fcookie, void *_buf, off_t offset, size_t len)
+{
+    fat_file_t *file = (fat_file_t *)fcookie;
+    fat_fs_t *fat = file->fat_fs;
+    bdev_t *dev = fat->dev;
+    uint8_t *buf = _buf;
+
+    /* trim the read */
+    if (offset < 0 || offset >= file->length)
+        return 0;
+    len = MIN(len, (size_t)(file->length - offset));
+    if (len == 0)
+        return 0;
+
+    /* map everything this read touches */
+    status_t err = fat32_map_clusters(file, (offset + len - 1) / fat->bytes_per_cluster);
+    if (err < 0)
+        return err;
+
+    size_t amount_read = 0;
+    while (len > 0) {
+        uint32_t index = offset / fat->bytes_per_cluster;
+        if (index >= file->mapped_clusters) {
+            printf("no more clusters, amount_read=%zu\n", amount_read);
+            break;
         }
 
-        amount_read += to_read;
+        /* read as much of the run holding offset as we need in one go */
+        const fat_extent_t *extent = fat32_find_extent(file, index);
+        size_t run_offset = (size_t)(index - extent->file_cluster) * fat->bytes_per_cluster +
+                            (offset % fat->bytes_per_cluster);
+        size_t to_read = MIN(len, (size_t)extent->count * fat->bytes_per_cluster - run_offset);
 
-        if (amount_read < length) {
-            if (cluster == 0x0fffffff) {
-                printf("no more clusters, amount_read=%i, to_read=%i\n", amount_read, to_read);
-                break;
-            }
-        }
-    } while (amount_read < length);
+        ssize_t ret = bio_read(dev, buf, fat32_offset_for_cluster(fat, extent->cluster) + run_offset, to_read);
+        if (ret < 0)
+            return ret;
+
+        buf += to_read;
+        offset += to_read;
+        len -= to_read;
+        amount_read += to_read;
+    }
 
     return amount_read;
 }
@@ -283,6 +386,7 @@ ssize_t fat32_read_file(filecookie *fcookie, void *buf, off_t offset, size_t len
 status_t fat32_close_file(filecookie *fcookie)
 {
     fat_file_t *file = (fat_file_t *)fcookie;
+    free(file->extents);
     free(file);
     return NO_ERROR;
 }
@@ -31,6 +31,8 @@
 #include <lk/init.h>
 #include <kernel/mutex.h>
 
+#include "fs_priv.h"
+
 #define LOCAL_TRACE 0
 
 struct fs_mount {
@@ -41,11 +43,17 @@ struct fs_mount {
     fscookie *cookie;
     int ref;
     const struct fs_api *api;
+
+    /* page cache state of files on this mount, only block device backed mounts are cached */
+    struct list_node cache_files;
 };
 
 struct filehandle {
     filecookie *cookie;
     struct fs_mount *mount;
+
+    struct fs_cache_file *cache;
+    struct fs_readahead ra;
 };
 
 struct dirhandle {
@@ -108,6 +116,7 @@ static void put_mount(struct fs_mount *mount)
     mutex_acquire(&mount_lock);
     if ((--mount->ref) == 0) {
         list_delete(&mount->node);
+        fs_cache_unmount(&mount->cache_files);
         mount->api->unmount(mount->cookie);
         free(mount->path);
         if (mount->dev)
@@ -158,6 +167,7 @@ static status_t mount(const char *path, const char *device, const struct fs_api
     mount->cookie = cookie;
     mount->ref = 1;
     mount->api = api;
+    list_initialize(&mount->cache_files);
 
     list_add_head(&mounts, &mount->node);
 
@@ -237,9 +247,11 @@ status_t fs_open_file(const char *path, filehandle **handle)
         return err;
     }
 
-    filehandle *f = malloc(sizeof(*f));
+    filehandle *f = calloc(1, sizeof(*f));
     f->cookie = cookie;
     f->mount = mount;
+    if (mount->dev)
+        f->cache = fs_cache_open(&mount->cache_files, newpath);
     *handle = f;
 
     return 0;
@@ -281,9 +293,14 @@ status_t fs_create_file(const char *path, filehandle **handle, uint64_t len)
         return err;
     }
 
-    filehandle *f = malloc(sizeof(*f));
+    filehandle *f = calloc(1, sizeof(*f));
     f->cookie = cookie;
     f->mount = mount;
+    if (mount->dev) {
+        f->cache = fs_cache_open(&mount->cache_files, newpath);
+        if (f->cache)
+            fs_cache_invalidate(f->cache, 0);
+    }
     *handle = f;
 
     return 0;
@@ -296,7 +313,12 @@ status_t fs_truncate_file(filehandle *handle, uint64_t len)
     if (unlikely(!handle))
         return ERR_INVALID_ARGS;
 
-    return handle->mount->api->truncate(handle->cookie, len);
+    status_t err = handle->mount->api->truncate(handle->cookie, len);
+
+    if (handle->cache)
+        fs_cache_invalidate(handle->cache, 0);
+
+    return err;
 }
 
 status_t fs_remove_file(const char *path)
@@ -318,6 +340,8 @@ status_t fs_remove_file(const char *path)
 
     status_t err = mount->api->remove(mount->cookie, newpath);
 
+    fs_cache_invalidate_path(&mount->cache_files, newpath);
+
     put_mount(mount);
 
     return err;
@@ -325,6 +349,9 @@ status_t fs_remove_file(const char *path)
 
 ssize_t fs_read_file(filehandle *handle, void *buf, off_t offset, size_t len)
 {
+    if (handle->cache)
+        return fs_cache_read(handle->cache, &handle->ra, handle->mount->api, handle->cookie, buf, offset, len);
+
     return handle->mount->api->read(handle->cookie, buf, offset, len);
 }
 
@@ -333,7 +360,13 @@ ssize_t fs_write_file(filehandle *handle, const void *buf, off_t offset, size_t
     if (!handle->mount->api->write)
         return ERR_NOT_SUPPORTED;
 
-    return handle->mount->api->write(handle->cookie, buf, offset, len);
+    ssize_t err = handle->mount->api->write(handle->cookie, buf, offset, len);
+
+    /* the write went through to the filesystem, drop the pages it made stale */
+    if (handle->cache)
+        fs_cache_invalidate(handle->cache, offset);
+
+    return err;
 }
 
 status_t fs_close_file(filehandle *handle)
@@ -342,6 +375,9 @@ status_t fs_close_file(filehandle *handle)
     if (err < 0)
         return err;
 
+    if (handle->cache)
+        fs_cache_close(handle->cache);
+
     put_mount(handle->mount);
     free(handle);
     return 0;
@@ -474,7 +510,22 @@ ssize_t fs_load_file(const char *path, void *ptr, size_t maxlen)
     struct file_stat stat;
     fs_stat_file(handle, &stat);
 
-    ssize_t read_bytes = fs_read_file(handle, ptr, 0, MIN(maxlen, stat.size));
+    /* read it in pieces small enough to go through the page cache, so loading
+     * the same file again is served from it */
+    size_t len = MIN(maxlen, stat.size);
+    ssize_t read_bytes = 0;
+    while ((size_t)read_bytes < len) {
+        ssize_t err = fs_read_file(handle, (uint8_t *)ptr + read_bytes, read_bytes,
+                                   MIN(len - read_bytes, FS_CACHE_BYPASS_LEN));
+        if (err < 0) {
+            read_bytes = err;
+            break;
+        }
+        if (err == 0)
+            break;
+
+        read_bytes += err;
+    }
 
     fs_close_file(handle);
 
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <list.h>
+#include <sys/types.h>
+#include <lib/fs.h>
+
+/* per file state of the shared page cache, see cache.c */
+struct fs_cache_file;
+
+#define FS_CACHE_PAGE_SIZE 4096
+
+/* reads larger than this go straight to the filesystem */
+#define FS_CACHE_BYPASS_LEN (16 * FS_CACHE_PAGE_SIZE)
+
+/* per open file readahead state */
+struct fs_readahead {
+    off_t next;     /* where a sequential read would continue */
+    uint window;    /* pages to read ahead of the next miss */
+};
+
+/* find or create the cache state for path on a mount, the mount's list is
+ * protected by the cache. Returns NULL if it can't be allocated, the file is
+ * then read uncached. */
+struct fs_cache_file *fs_cache_open(struct list_node *mount_files, const char *path);
+void fs_cache_close(struct fs_cache_file *cf);
+
+/* read through the cache, filling misses with api->read */
+ssize_t fs_cache_read(struct fs_cache_file *cf, struct fs_readahead *ra, const struct fs_api *api,
+                      filecookie *cookie, void *buf, off_t offset, size_t len);
+
+/* drop pages at and after offset, along with a partial last page */
+void fs_cache_invalidate(struct fs_cache_file *cf, off_t offset);
+void fs_cache_invalidate_path(struct list_node *mount_files, const char *path);
+
+/* drop everything cached for a mount that is going away */
+void fs_cache_unmount(struct list_node *mount_files);
@@ -83,6 +83,10 @@ status_t fs_close_dir(dirhandle *handle) __NONNULL();
 
 status_t fs_stat_fs(const char *mountpoint, struct fs_stat *stat) __NONNULL((1)) __NONNULL((2));
 
+/* shared page cache in front of block device backed mounts */
+size_t fs_cache_trim(size_t pages); // evict up to pages least recently used pages, returns the number evicted
+void fs_cache_dump(void);
+
 /* convenience routines */
 ssize_t fs_load_file(const char *path, void *ptr, size_t maxlen) __NONNULL();
 
@@ -4,6 +4,7 @@ MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/fs.c \
+	$(LOCAL_DIR)/cache.c \
 	$(LOCAL_DIR)/debug.c \
 	$(LOCAL_DIR)/shell.c
 
@@ -38,6 +38,9 @@
 // Allocation strategy takes place with a global mutex.  Freelist entries are
 // kept in linked lists with 8 different sizes per binary order of magnitude
 // and the header size is two words with eager coalescing on free.
+//
+// Small allocations are served from per-cpu caches in front of the freelists,
+// which only take the mutex to refill or flush a batch of blocks at a time.
 
 #ifdef DEBUG
 #define CMPCT_DEBUG
@@ -100,7 +103,34 @@ struct heap {
 // Heap static vars.
 static struct heap theheap;
 
+// Per-cpu caches of small blocks.  Blocks in a cache still look allocated to
+// the rest of the heap, so they don't coalesce until they are flushed back.
+// Each cache bucket holds blocks of at least the bucket's size, linked through
+// their payloads and protected by a per-cpu spinlock, which is only contended
+// when a thread migrates or the caches are drained.
+#define CACHE_MAX_SIZE 256
+#define CACHE_BUCKETS 24    // Buckets up to and including CACHE_MAX_SIZE.
+#define CACHE_DEPTH 32      // Blocks per bucket before flushing.
+#define CACHE_BATCH 16      // Blocks moved per refill or flush.
+
+typedef struct cache_entry {
+    struct cache_entry *next;
+} cache_entry_t;
+
+struct cache {
+    spin_lock_t lock;
+    struct {
+        cache_entry_t *head;
+        unsigned count;
+    } buckets[CACHE_BUCKETS];
+};
+
+static struct cache caches[SMP_MAX_CPUS];
+static bool cache_enabled = true;
+
 static ssize_t heap_grow(size_t len, free_t **bucket);
+static void *alloc_locked(size_t size, int start_bucket, size_t rounded_up);
+static void free_locked(header_t *header);
 
 static void lock(void)
 {
@@ -139,6 +169,14 @@ void cmpct_dump(void)
         }
     }
     unlock();
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        unsigned count = 0;
+        for (int i = 0; i < CACHE_BUCKETS; i++) {
+            count += caches[cpu].buckets[i].count;
+        }
+        if (count != 0) dprintf(INFO, "\tcpu %u cache: %u blocks\n", cpu, count);
+    }
 }
 
 // Operates in sizes that don't include the allocation header.
@@ -325,6 +363,130 @@ static void FixLeftPointer(header_t *right, header_t *new_left)
     right->left = (header_t *)(((uintptr_t)new_left & ~1) | tag);
 }
 
+// Hand a list of cached blocks back to the freelists.
+static void cache_flush_list(cache_entry_t *entry)
+{
+    if (entry == NULL) return;
+    lock();
+    while (entry != NULL) {
+        cache_entry_t *next = entry->next;
+        free_locked((header_t *)entry - 1);
+        entry = next;
+    }
+    unlock();
+}
+
+// Empty every cpu's cache back into the freelists.
+static void cache_drain(void)
+{
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct cache *cache = &caches[cpu];
+        cache_entry_t *list = NULL;
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&cache->lock, state);
+        for (int i = 0; i < CACHE_BUCKETS; i++) {
+            cache_entry_t *entry = cache->buckets[i].head;
+            while (entry != NULL) {
+                cache_entry_t *next = entry->next;
+                entry->next = list;
+                list = entry;
+                entry = next;
+            }
+            cache->buckets[i].head = NULL;
+            cache->buckets[i].count = 0;
+        }
+        spin_unlock_irqrestore(&cache->lock, state);
+
+        cache_flush_list(list);
+    }
+}
+
+static void *cache_alloc(size_t size, int start_bucket, size_t rounded_up)
+{
+    int bucket = size_to_index_freeing(rounded_up);
+    DEBUG_ASSERT(bucket < CACHE_BUCKETS);
+
+    struct cache *cache = &caches[arch_curr_cpu_num()];
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cache->lock, state);
+    cache_entry_t *result = cache->buckets[bucket].head;
+    if (result != NULL) {
+        cache->buckets[bucket].head = result->next;
+        cache->buckets[bucket].count--;
+    }
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    if (result == NULL) {
+        // Refill the bucket with a batch of blocks carved out under one
+        // acquisition of the heap lock.  Every block is at least the bucket
+        // size, though some may be a little larger.
+        cache_entry_t *head = NULL;
+        cache_entry_t *tail = NULL;
+        unsigned count = 0;
+        lock();
+        result = alloc_locked(rounded_up, start_bucket, rounded_up);
+        while (result != NULL && count < CACHE_BATCH - 1) {
+            cache_entry_t *entry = alloc_locked(rounded_up, start_bucket, rounded_up);
+            if (entry == NULL) break;
+            entry->next = head;
+            head = entry;
+            if (tail == NULL) tail = entry;
+            count++;
+        }
+        unlock();
+
+        if (head != NULL) {
+            // We may have migrated while the lock was held, so use whichever
+            // cache we are on now.
+            cache = &caches[arch_curr_cpu_num()];
+            spin_lock_irqsave(&cache->lock, state);
+            tail->next = cache->buckets[bucket].head;
+            cache->buckets[bucket].head = head;
+            cache->buckets[bucket].count += count;
+            spin_unlock_irqrestore(&cache->lock, state);
+        }
+
+        if (result == NULL) return NULL;
+    }
+#ifdef CMPCT_DEBUG
+    memset(result, ALLOC_FILL, size);
+#endif
+    return result;
+}
+
+static void cache_free(void *payload, size_t payload_size)
+{
+    int bucket = size_to_index_freeing(payload_size);
+    DEBUG_ASSERT(bucket < CACHE_BUCKETS);
+
+    cache_entry_t *entry = (cache_entry_t *)payload;
+#ifdef CMPCT_DEBUG
+    memset(entry + 1, FREE_FILL, payload_size - sizeof(cache_entry_t));
+#endif
+
+    cache_entry_t *flush = NULL;
+    struct cache *cache = &caches[arch_curr_cpu_num()];
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cache->lock, state);
+    entry->next = cache->buckets[bucket].head;
+    cache->buckets[bucket].head = entry;
+    if (++cache->buckets[bucket].count > CACHE_DEPTH) {
+        // Keep the most recently freed blocks, which are likely still in the
+        // data cache, and flush the older ones.
+        cache_entry_t *last = entry;
+        for (int i = 1; i < CACHE_DEPTH - CACHE_BATCH; i++) {
+            last = last->next;
+        }
+        flush = last->next;
+        last->next = NULL;
+        cache->buckets[bucket].count = CACHE_DEPTH - CACHE_BATCH;
+    }
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    cache_flush_list(flush);
+}
+
 static void WasteFreeMemory(void)
 {
     while (theheap.remaining != 0) cmpct_alloc(1);
@@ -572,6 +734,11 @@ static void cmpct_test_return_to_os(void)
 
 void cmpct_test(void)
 {
+    // The tests below check exact freelist behavior, so keep the per-cpu
+    // caches out of the way while they run.
+    cache_drain();
+    cache_enabled = false;
+
     cmpct_test_buckets();
     cmpct_test_get_back_newly_freed();
     cmpct_test_return_to_os();
@@ -628,6 +795,8 @@ void cmpct_test(void)
     }
 
     cmpct_dump();
+
+    cache_enabled = true;
 }
 
 static void *large_alloc(size_t size)
@@ -639,6 +808,7 @@ static void *large_alloc(size_t size)
     free_t *free_area = NULL;
     lock();
     if (heap_grow(size, &free_area) < 0) {
+      unlock();
       return 0;
     }
     void *result =
@@ -660,6 +830,9 @@ static void *large_alloc(size_t size)
 
 void cmpct_trim(void)
 {
+    // Blocks sitting in the per-cpu caches can't be coalesced or returned.
+    cache_drain();
+
     // Look at free list entries that are at least as large as one page plus a
     // header. They might be at the start or the end of a block, so we can trim
     // them and free the page(s).
@@ -739,9 +912,21 @@ void *cmpct_alloc(size_t size)
     size_t rounded_up;
     int start_bucket = size_to_index_allocating(size, &rounded_up);
 
-    rounded_up += sizeof(header_t);
+    if (rounded_up <= CACHE_MAX_SIZE && cache_enabled) {
+        return cache_alloc(size, start_bucket, rounded_up);
+    }
 
     lock();
+    void *result = alloc_locked(size, start_bucket, rounded_up);
+    unlock();
+    return result;
+}
+
+// Carve an allocation out of the freelists.  Called with the lock.
+static void *alloc_locked(size_t size, int start_bucket, size_t rounded_up)
+{
+    rounded_up += sizeof(header_t);
+
     int bucket = find_nonempty_bucket(start_bucket);
     if (bucket == -1) {
         // Grow heap by at least 12% if we can.
@@ -750,7 +935,6 @@ void *cmpct_alloc(size_t size)
                                 MAX(HEAP_GROW_SIZE, rounded_up)));
         while (heap_grow(growby, NULL) < 0) {
             if (growby <= rounded_up) {
-                unlock();
                 return NULL;
             }
             growby = MAX(growby >> 1, rounded_up);
@@ -780,7 +964,6 @@ void *cmpct_alloc(size_t size)
     memset(result, ALLOC_FILL, size);
     memset(((char *)result) + size, PADDING_FILL, rounded_up - size - sizeof(header_t));
 #endif
-    unlock();
     return result;
 }
 
@@ -804,8 +987,10 @@ void *cmpct_memalign(size_t size, size_t alignment)
         header_t *right = right_header(unaligned_header);
         unaligned_header->size = left_over;
         FixLeftPointer(right, header);
+        // Return the alignment padding straight to the freelists rather than
+        // parking it in a cache.
+        free_locked(unaligned_header);
         unlock();
-        cmpct_free(unaligned);
     } else {
         unlock();
     }
@@ -818,8 +1003,21 @@ void cmpct_free(void *payload)
     if (payload == NULL) return;
     header_t *header = (header_t *)payload - 1;
     DEBUG_ASSERT(!is_tagged_as_free(header));  // Double free!
-    size_t size = header->size;
+    size_t payload_size = header->size - sizeof(header_t);
+    if (payload_size <= CACHE_MAX_SIZE && cache_enabled) {
+        cache_free(payload, payload_size);
+        return;
+    }
     lock();
+    free_locked(header);
+    unlock();
+}
+
+// Return an allocation to the freelists, coalescing with its neighbors.
+// Called with the lock.
+static void free_locked(header_t *header)
+{
+    size_t size = header->size;
     header_t *left = header->left;
     if (left != NULL && is_tagged_as_free(left)) {
         // Coalesce with left free object.
@@ -848,7 +1046,6 @@ void cmpct_free(void *payload)
             free_memory(header, left, size);
         }
     }
-    unlock();
 }
 
 void *cmpct_realloc(void *payload, size_t size)
@@ -899,6 +1096,11 @@ void cmpct_init(void)
     // Create a mutex.
     mutex_init(&theheap.lock);
 
+    DEBUG_ASSERT(size_to_index_freeing(CACHE_MAX_SIZE) == CACHE_BUCKETS - 1);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        spin_lock_init(&caches[cpu].lock);
+    }
+
     // Initialize the free list.
     for (int i = 0; i < NUMBER_OF_BUCKETS; i++) {
         theheap.free_lists[i] = NULL;
@@ -1,11 +1,24 @@
 LOCAL_DIR := $(GET_LOCAL_DIR)
 
+ifeq ($(SUBARCH),x86-64)
+
+ASM_STRING_OPS := bcopy bzero memcmp memcpy memmove memset strlen
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/64/memcmp.S \
+	$(LOCAL_DIR)/64/memcpy.S \
+	$(LOCAL_DIR)/64/memset.S \
+	$(LOCAL_DIR)/64/strlen.S
+
+else
+
 ASM_STRING_OPS := #bcopy bzero memcpy memmove memset
 
 MODULE_SRCS += \
 	#$(LOCAL_DIR)/memcpy.S \
 	#$(LOCAL_DIR)/memset.S
 
+endif
+
 # filter out the C implementation
 C_STRING_OPS := $(filter-out $(ASM_STRING_OPS),$(C_STRING_OPS))
-
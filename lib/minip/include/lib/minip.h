@@ -50,6 +50,14 @@ void minip_init_dhcp(tx_func_t tx_func, void *tx_arg);
 /* packet rx hook to hand to ethernet driver */
 void minip_rx_driver_callback(pktbuf_t *p);
 
+/* tx offloads a driver's tx_func can do, for minip_set_tx_offloads */
+#define MINIP_TX_OFFLOAD_CSUM  (1<<0) // finishes tcp checksums of PKTBUF_FLAG_CKSUM_PARTIAL packets
+#define MINIP_TX_OFFLOAD_TSO4  (1<<1) // segments PKTBUF_FLAG_TSO packets, needs MINIP_TX_OFFLOAD_CSUM
+
+/* tell minip what the driver can do for it. tso_max_parts is the most pktbufs
+ * a packet handed over for segmentation may be made of. */
+void minip_set_tx_offloads(uint32_t offloads, uint tso_max_parts);
+
 /* global configuration state */
 void minip_get_macaddr(uint8_t *addr);
 void minip_set_macaddr(const uint8_t *addr);
@@ -73,11 +81,46 @@ status_t udp_close(udp_socket_t *handle);
 /* tcp */
 typedef struct tcp_socket tcp_socket_t;
 
+typedef struct tcp_socket_stats {
+    const char *state;
+    uint32_t local_ip;
+    uint32_t remote_ip;
+    uint16_t local_port;
+    uint16_t remote_port;
+
+    uint32_t cwnd;          // congestion window, in bytes
+    uint32_t ssthresh;
+    uint32_t in_flight;     // bytes sent but not acked
+    uint32_t srtt;          // smoothed round trip time, in ms
+    uint32_t rttvar;
+    uint32_t rto;           // current retransmit timeout, in ms
+    uint32_t retransmits;   // segments retransmitted for any reason
+    uint32_t fast_retransmits;
+    uint32_t timeouts;
+
+    uint32_t rx_buffer_size; // current buffer sizes, which grow as needed
+    uint32_t tx_buffer_size;
+    uint8_t snd_wscale;      // window scale shifts, 0 if not agreed on
+    uint8_t rcv_wscale;
+} tcp_socket_stats_t;
+
 status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port);
 status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket, lk_time_t timeout);
 status_t tcp_close(tcp_socket_t *socket);
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len);
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len);
+status_t tcp_get_stats(tcp_socket_t *socket, tcp_socket_stats_t *stats);
+
+/* the most buffering a socket grows to in each direction, 0 leaves one as it is. Set it on a
+ * listening socket to have it apply to the sockets it accepts, the window scale is settled
+ * when a connection opens. */
+status_t tcp_set_buffer_sizes(tcp_socket_t *socket, size_t rx_size, size_t tx_size);
+
+/* zero copy variants of tcp_write and tcp_read. tcp_send_pktbuf takes ownership of a single
+ * part pktbuf and sends straight out of it, freeing it once it is acked. tcp_recv_pktbuf hands
+ * back a pktbuf of received data, which the caller frees. */
+status_t tcp_send_pktbuf(tcp_socket_t *socket, pktbuf_t *p);
+status_t tcp_recv_pktbuf(tcp_socket_t *socket, pktbuf_t **p);
 
 static inline status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket)
 {
@@ -52,6 +52,13 @@ typedef struct pktbuf {
     pktbuf_free_callback cb;
     void *cb_args;
     u8 *buffer;
+    u32 seq;    // for use by the protocol layer holding the packet
+    struct pktbuf *next; // rest of a multi part packet, every part but the last lacks PKTBUF_FLAG_EOF
+    volatile int ref;    // holders of the buffer besides this pktbuf, see pktbuf_clone
+    u16 csum_start;      // offset from buffer where a PKTBUF_FLAG_CKSUM_PARTIAL checksum starts
+    u16 csum_offset;     // offset from csum_start where it is stored
+    u16 gso_size;        // payload per segment of a PKTBUF_FLAG_TSO packet
+    volatile int *outstanding; // if set, decremented when this pktbuf goes back to the pool
 } pktbuf_t;
 
 typedef struct pktbuf_pool_object {
@@ -66,6 +73,18 @@ typedef struct pktbuf_pool_object {
 #define PKTBUF_FLAG_CKSUM_UDP_GOOD (1<<2)
 #define PKTBUF_FLAG_EOF            (1<<3)
 #define PKTBUF_FLAG_CACHED         (1<<4)
+/* tx offloads, for drivers that told minip they can do them */
+#define PKTBUF_FLAG_CKSUM_PARTIAL  (1<<5) // the checksum field holds the pseudo header sum, the nic finishes it
+#define PKTBUF_FLAG_TSO            (1<<6) // the nic cuts the tcp payload into gso_size segments
+
+/* Return the total length of a multi part packet */
+static inline u32 pktbuf_chain_len(pktbuf_t *p)
+{
+    u32 len = 0;
+    for (; p; p = p->next)
+        len += p->dlen;
+    return len;
+}
 
 /* Return the physical address offset of data in the packet */
 static inline u32 pktbuf_data_phys(pktbuf_t *p)
@@ -87,15 +106,37 @@ static inline u32 pktbuf_avail_tail(pktbuf_t *p)
 
 // allocate packet buffer from buffer pool
 pktbuf_t *pktbuf_alloc(void);
+// same, but return NULL instead of blocking if the pool is empty
+pktbuf_t *pktbuf_alloc_nowait(void);
 pktbuf_t *pktbuf_alloc_empty(void);
 
 /* Add a buffer to an existing packet buffer */
 void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz,
                        uint32_t flags, pktbuf_free_callback cb, void *cb_args);
-// return packet buffer to buffer pool
+// return packet buffer to buffer pool, along with the
+// rest of the packet if it has multiple parts
 // returns number of threads woken up
 int pktbuf_free(pktbuf_t *p, bool reschedule);
 
+// add p to the end of the multi part packet starting at head
+void pktbuf_chain_append(pktbuf_t *head, pktbuf_t *p);
+
+// copy the rest of a multi part packet into its first part and
+// free the rest, for drivers that can't gather
+status_t pktbuf_linearize(pktbuf_t *p);
+
+// return a new pktbuf pointing at the same data as p, without
+// copying it. The buffer is freed once both have been.
+pktbuf_t *pktbuf_clone(pktbuf_t *p);
+// same, but return NULL instead of blocking if the pool is empty
+pktbuf_t *pktbuf_clone_nowait(pktbuf_t *p);
+
+// move the buffer out of p into a new pktbuf, giving p a fresh
+// one from the pool. Lets the stack keep a received buffer
+// while the driver that owns p reuses it. Returns NULL rather
+// than blocking, or if p's buffer isn't from the pool.
+pktbuf_t *pktbuf_steal(pktbuf_t *p);
+
 // extend buffer by sz bytes, copied from data
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz);
 
@@ -83,12 +83,25 @@ static int cmd_arp(int argc, const cmd_args *argv)
     return 0;
 }
 
+static void print_tcp_stats(const tcp_socket_stats_t *stats, void *arg)
+{
+    printf("%u.%u.%u.%u:%-5u %u.%u.%u.%u:%-5u %-11s",
+           IPV4_SPLIT(stats->local_ip), stats->local_port,
+           IPV4_SPLIT(stats->remote_ip), stats->remote_port, stats->state);
+    printf(" cwnd %6u ssthresh %10u flight %6u srtt %4u rttvar %4u rto %5u rexmit %u (fast %u) timeouts %u\n",
+           stats->cwnd, stats->ssthresh, stats->in_flight, stats->srtt, stats->rttvar, stats->rto,
+           stats->retransmits, stats->fast_retransmits, stats->timeouts);
+    printf("\trxbuf %u txbuf %u wscale %u/%u\n",
+           stats->rx_buffer_size, stats->tx_buffer_size, stats->snd_wscale, stats->rcv_wscale);
+}
+
 static int cmd_minip(int argc, const cmd_args *argv)
 {
     if (argc == 1) {
 minip_usage:
         printf("minip commands\n");
         printf("mi [a]rp                        dump arp table\n");
+        printf("mi [c]onnections                print tcp connection counters\n");
         printf("mi [s]tatus                     print ip status\n");
         printf("mi [t]est [dest] [port] [cnt]   send <cnt> test packets to the dest:port\n");
     } else {
@@ -98,6 +111,10 @@ minip_usage:
                 arp_cache_dump();
                 break;
 
+            case 'c':
+                tcp_for_every_socket_stats(&print_tcp_stats, NULL);
+                break;
+
             case 's': {
                 uint32_t ipaddr = minip_get_ipaddr();
 
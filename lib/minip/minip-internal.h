@@ -101,6 +101,8 @@ enum {
 };
 
 extern tx_func_t minip_tx_handler;
+extern uint32_t minip_tx_offloads;
+extern uint minip_tso_max_parts;
 typedef struct udp_hdr udp_hdr_t;
 static const uint8_t bcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
@@ -122,6 +124,8 @@ void minip_build_ipv4_hdr(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, ui
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto);
 
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip);
+/* hand a snapshot of each tcp socket's counters to cb, taken without the socket locks */
+void tcp_for_every_socket_stats(void (*cb)(const tcp_socket_stats_t *stats, void *arg), void *arg);
 void udp_input(pktbuf_t *p, uint32_t src_ip);
 
 const uint8_t *get_dest_mac(uint32_t host);
@@ -106,6 +106,10 @@ void gen_random_mac_address(uint8_t *mac_addr)
 tx_func_t minip_tx_handler;
 void *minip_tx_arg;
 
+/* what the driver behind minip_tx_handler offloads */
+uint32_t minip_tx_offloads;
+uint minip_tso_max_parts;
+
 void minip_init(tx_func_t tx_handler, void *tx_arg,
                 uint32_t ip, uint32_t mask, uint32_t gateway)
 {
@@ -121,6 +125,15 @@ void minip_init(tx_func_t tx_handler, void *tx_arg,
     net_timer_init();
 }
 
+void minip_set_tx_offloads(uint32_t offloads, uint tso_max_parts)
+{
+    if (!(offloads & MINIP_TX_OFFLOAD_CSUM))
+        offloads &= ~MINIP_TX_OFFLOAD_TSO4;
+
+    minip_tso_max_parts = tso_max_parts;
+    minip_tx_offloads = offloads;
+}
+
 uint16_t ipv4_payload_len(struct ipv4_hdr *pkt)
 {
     return (pkt->len - ((pkt->ver_ihl >> 4) * 5));
@@ -213,7 +226,7 @@ const uint8_t *get_dest_mac(uint32_t host)
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto)
 {
     status_t ret = 0;
-    size_t data_len = p->dlen;
+    size_t data_len = pktbuf_chain_len(p);
     const uint8_t *dst_mac;
 
     struct ipv4_hdr *ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
@@ -321,8 +334,8 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
         return;
     }
 
-    /* compute checksum */
-    if (rfc1701_chksum((void *)ip, header_len) != 0) {
+    /* compute checksum, unless the nic already did */
+    if (!(p->flags & PKTBUF_FLAG_CKSUM_IP_GOOD) && rfc1701_chksum((void *)ip, header_len) != 0) {
         /* bad checksum */
         LTRACEF("REJECT: bad checksum\n");
         return;
@@ -24,11 +24,13 @@
 
 #include <assert.h>
 #include <debug.h>
+#include <err.h>
 #include <trace.h>
 #include <printf.h>
 #include <string.h>
 #include <malloc.h>
 
+#include <arch/ops.h>
 #include <kernel/thread.h>
 #include <kernel/semaphore.h>
 #include <kernel/spinlock.h>
@@ -47,13 +49,18 @@ static semaphore_t pktbuf_sem;
 static spin_lock_t lock;
 
 
-/* Take an object from the pool of pktbuf objects to act as a header or buffer.  */
-static void *get_pool_object(void)
+/* Take an object from the pool of pktbuf objects to act as a header or buffer.
+ * Blocks until one is available, unless wait is false. */
+static void *get_pool_object(bool wait)
 {
     pool_t *entry;
     spin_lock_saved_state_t state;
 
-    sem_wait(&pktbuf_sem);
+    if (wait)
+        sem_wait(&pktbuf_sem);
+    else if (sem_trywait(&pktbuf_sem) != NO_ERROR)
+        return NULL;
+
     spin_lock_irqsave(&lock, state);
     entry = pool_alloc(&pktbuf_pool);
     spin_unlock_irqrestore(&lock, state);
@@ -116,17 +123,17 @@ void pktbuf_add_buffer(pktbuf_t *p, u8 *buf, u32 len, uint32_t header_sz, uint32
 #endif
 }
 
-pktbuf_t *pktbuf_alloc(void)
+static pktbuf_t *_pktbuf_alloc(bool wait)
 {
     pktbuf_t *p = NULL;
     void *buf = NULL;
 
-    p = get_pool_object();
+    p = get_pool_object(wait);
     if (!p) {
         return NULL;
     }
 
-    buf = get_pool_object();
+    buf = get_pool_object(wait);
     if (!buf) {
         free_pool_object((pktbuf_pool_object_t *)p, false);
         return NULL;
@@ -137,26 +144,158 @@ pktbuf_t *pktbuf_alloc(void)
     return p;
 }
 
+pktbuf_t *pktbuf_alloc(void)
+{
+    return _pktbuf_alloc(true);
+}
+
+pktbuf_t *pktbuf_alloc_nowait(void)
+{
+    return _pktbuf_alloc(false);
+}
+
 pktbuf_t *pktbuf_alloc_empty(void)
 {
-    pktbuf_t *p = (pktbuf_t *) get_pool_object();
+    pktbuf_t *p = (pktbuf_t *) get_pool_object(true);
 
     p->flags = PKTBUF_FLAG_EOF;
+    p->next = NULL;
+    p->ref = 0;
+    p->outstanding = NULL;
     return p;
 }
 
-int pktbuf_free(pktbuf_t *p, bool reschedule)
+/* Drop a holder of a single pktbuf, releasing the buffer and header when
+ * there are none left. */
+static void pktbuf_release(pktbuf_t *p)
 {
-    DEBUG_ASSERT(p);
+    if (atomic_add(&p->ref, -1) > 0)
+        return;
 
     if (p->cb) {
         p->cb(p->buffer, p->cb_args);
     }
+    if (p->outstanding) {
+        atomic_add(p->outstanding, -1);
+    }
     free_pool_object((pktbuf_pool_object_t *)p, false);
+}
+
+int pktbuf_free(pktbuf_t *p, bool reschedule)
+{
+    DEBUG_ASSERT(p);
+
+    while (p) {
+        pktbuf_t *next = p->next;
+        pktbuf_release(p);
+        p = next;
+    }
 
     return 1;
 }
 
+void pktbuf_chain_append(pktbuf_t *head, pktbuf_t *p)
+{
+    DEBUG_ASSERT(head && p);
+
+    while (head->next)
+        head = head->next;
+    head->flags &= ~PKTBUF_FLAG_EOF;
+    head->next = p;
+}
+
+status_t pktbuf_linearize(pktbuf_t *p)
+{
+    DEBUG_ASSERT(p);
+
+    if (!p->next)
+        return NO_ERROR;
+
+    u32 len = pktbuf_chain_len(p->next);
+    if (len > pktbuf_avail_tail(p))
+        return ERR_TOO_BIG;
+
+    for (pktbuf_t *q = p->next; q; q = q->next)
+        pktbuf_append_data(p, q->data, q->dlen);
+
+    pktbuf_free(p->next, false);
+    p->next = NULL;
+    p->flags |= PKTBUF_FLAG_EOF;
+
+    return NO_ERROR;
+}
+
+/* Callback for a clone, dropping its hold on the pktbuf it was made from */
+static void release_clone_cb(void *buf, void *arg)
+{
+    pktbuf_release((pktbuf_t *)arg);
+}
+
+static pktbuf_t *_pktbuf_clone(pktbuf_t *p, bool wait)
+{
+    DEBUG_ASSERT(p);
+
+    pktbuf_t *c = get_pool_object(wait);
+    if (!c) {
+        return NULL;
+    }
+
+    memset(c, 0, sizeof(pktbuf_t));
+    atomic_add(&p->ref, 1);
+    c->buffer = p->buffer;
+    c->blen = p->blen;
+    c->data = p->data;
+    c->dlen = p->dlen;
+    c->phys_base = p->phys_base;
+    c->flags = (p->flags & PKTBUF_FLAG_CACHED) | PKTBUF_FLAG_EOF;
+    c->cb = release_clone_cb;
+    c->cb_args = p;
+
+    return c;
+}
+
+pktbuf_t *pktbuf_clone(pktbuf_t *p)
+{
+    return _pktbuf_clone(p, true);
+}
+
+pktbuf_t *pktbuf_clone_nowait(pktbuf_t *p)
+{
+    return _pktbuf_clone(p, false);
+}
+
+pktbuf_t *pktbuf_steal(pktbuf_t *p)
+{
+    DEBUG_ASSERT(p);
+
+    if (p->cb != free_pktbuf_buf_cb || p->ref != 0)
+        return NULL;
+
+    pktbuf_t *s = get_pool_object(false);
+    if (!s)
+        return NULL;
+
+    void *buf = get_pool_object(false);
+    if (!buf) {
+        free_pool_object((pktbuf_pool_object_t *)s, false);
+        return NULL;
+    }
+
+    memset(s, 0, sizeof(pktbuf_t));
+    s->buffer = p->buffer;
+    s->blen = p->blen;
+    s->data = p->data;
+    s->dlen = p->dlen;
+    s->phys_base = p->phys_base;
+    s->flags = (p->flags & PKTBUF_FLAG_CACHED) | PKTBUF_FLAG_EOF;
+    s->cb = free_pktbuf_buf_cb;
+
+    pktbuf_add_buffer(p, buf, PKTBUF_SIZE, PKTBUF_MAX_HDR, p->flags & PKTBUF_FLAG_CACHED,
+                      free_pktbuf_buf_cb, NULL);
+
+    return s;
+}
+
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz)
 {
     if (pktbuf_avail_tail(p) < sz) {
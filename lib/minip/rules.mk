@@ -5,7 +5,8 @@ MODULE := $(LOCAL_DIR)
 MODULE_DEPS := \
 	lib/cbuf \
 	lib/iovec \
-	lib/pool
+	lib/pool \
+	lib/slab
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/arp.c \
@@ -29,13 +29,17 @@
 #include <stdlib.h>
 #include <err.h>
 #include <string.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <lib/console.h>
 #include <lib/cbuf.h>
+#include <lib/slab.h>
+#include <lk/init.h>
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <arch/ops.h>
 #include <platform.h>
+#include <pow2.h>
 
 #define LOCAL_TRACE 0
 
@@ -66,6 +70,31 @@ typedef struct tcp_mss_option {
     uint16_t mss;
 } __PACKED tcp_mss_option_t;
 
+/* option kinds */
+#define TCP_OPTION_EOL            0
+#define TCP_OPTION_NOP            1
+#define TCP_OPTION_MSS            2
+#define TCP_OPTION_WSCALE         3
+#define TCP_OPTION_SACK_PERMITTED 4
+#define TCP_OPTION_SACK           5
+#define TCP_OPTION_TIMESTAMP      8
+
+/* most option space a header can have */
+#define TCP_MAX_OPTIONS_LENGTH    40
+/* a timestamp option, padded out with two NOPs */
+#define TCP_TIMESTAMP_LENGTH      12
+
+/* the options we understand from an incoming segment */
+typedef struct tcp_options {
+    uint16_t mss; /* 0 if not present */
+    bool sack_permitted;
+    bool wscale_present;
+    uint8_t wscale;
+    bool ts_present;
+    uint32_t tsval;
+    uint32_t tsecr;
+} tcp_options_t;
+
 typedef enum tcp_state {
     STATE_CLOSED,
     STATE_LISTEN,
@@ -90,10 +119,15 @@ typedef enum tcp_flags {
 } tcp_flags_t;
 
 typedef struct tcp_socket {
+    /* read by lockless lookups, possibly after the socket has been freed and reused,
+     * so these are preserved across slab_free/slab_alloc (see create_tcp_socket) */
+    struct tcp_socket *hash_next;
+    volatile int ref;
+    uint8_t hash_table;
+
     struct list_node node;
 
     mutex_t lock;
-    volatile int ref;
 
     tcp_state_t state;
     ipv4_addr local_ip;
@@ -103,8 +137,19 @@ typedef struct tcp_socket {
 
     uint32_t mss;
 
+    /* RFC 7323 window scaling and timestamps, both only if they offered them in their SYN */
+    uint8_t  snd_wscale;  // shift for the windows they advertise
+    uint8_t  rcv_wscale;  // shift for the windows we advertise
+    bool     ts_ok;
+    uint32_t ts_recent;   // their latest timestamp, echoed back to them
+    uint32_t ts_last_ack_sent;
+
     /* rx */
-    uint32_t rx_win_size;
+    uint32_t rx_win_size; // size of rx_buffer, grows up to rx_buffer_max as the peer fills it
+    uint32_t rx_buffer_max;
+    uint32_t rx_grow_seq; // once rx_win_low gets here they've sent a buffer's worth since rx_grow_time
+    lk_time_t rx_grow_time;
+    uint32_t rx_rtt;      // round trip time from the timestamps on their data in ms, 0 if unknown
     uint32_t rx_win_low;
     uint32_t rx_win_high;
     uint8_t  *rx_buffer_raw;
@@ -112,17 +157,51 @@ typedef struct tcp_socket {
     event_t  rx_event;
     int      rx_full_mss_count; // number of packets we have received in a row with a full mss
     net_timer_t ack_delay_timer;
+    struct list_node rx_pktbuf_queue; // in order data kept in the pktbufs it came in, read ahead of rx_buffer
+    uint32_t rx_pktbuf_count;
+    uint32_t rx_pktbuf_bytes;
+    struct list_node rx_ooo_queue; // segments past a hole in the sequence, sorted, pktbuf->seq holds their sequence
+    uint32_t rx_ooo_count;
+    uint32_t rx_ooo_last_seq; // sequence of the most recently queued one, reported first in SACKs
+    bool     sack_ok;         // they sent SACK permitted in their SYN
 
     /* tx */
     uint32_t tx_win_low;  // low side of the acked window
     uint32_t tx_win_high; // tx_win_low + their advertised window size
-    uint32_t tx_highest_seq; // highest sequence we have txed them
+    uint32_t tx_highest_seq; // next sequence to tx, pulled back to tx_win_low on a retransmit timeout
+    uint32_t tx_max_seq;  // highest tx_highest_seq has ever been
     uint8_t  *tx_buffer;  // our outgoing buffer
-    uint32_t tx_buffer_size; // size of tx_buffer
-    uint32_t tx_buffer_offset; // offset into the buffer to append new data to
+    uint32_t tx_buffer_size; // size of tx_buffer, grows up to tx_buffer_max when it holds back the window
+    uint32_t tx_buffer_max;
+    uint32_t tx_buffer_offset; // offset into the buffer to append new data to, or bytes in tx_pktbuf_queue
+    struct list_node tx_pktbuf_queue; // data from tcp_send_pktbuf, holds everything in place of tx_buffer when not empty
+    uint32_t tx_pktbuf_count;
+    bool     fin_queued;  // tcp_close was called, a FIN follows the buffered data
+    uint32_t fin_seq;     // the sequence our FIN takes, once fin_queued
+    bool     probing;     // a byte is out past their shut window, its timeouts aren't loss
     event_t  tx_event;
     net_timer_t retransmit_timer;
 
+    /* rtt estimation (RFC 6298) */
+    uint32_t srtt;        // smoothed rtt in ms, scaled by 8
+    uint32_t rttvar;      // rtt variation in ms, scaled by 4
+    uint32_t rto;         // current retransmit timeout in ms, including backoff
+    uint32_t rtt_seq;     // the segment being timed is acked once this is
+    lk_time_t rtt_start;
+    bool     rtt_timing;
+
+    /* congestion control (RFC 5681 with NewReno recovery, RFC 6582) */
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t dup_acks;
+    uint32_t recover;     // tx_max_seq when we entered fast recovery
+    bool     in_recovery;
+
+    /* counters */
+    uint32_t retransmits;
+    uint32_t fast_retransmits;
+    uint32_t timeouts;
+
     /* listen accept */
     semaphore_t accept_sem;
     struct tcp_socket *accepted;
@@ -133,20 +212,81 @@ typedef struct tcp_socket {
 #define DEFAULT_MSS (1460)
 #define DEFAULT_RX_WINDOW_SIZE (8192)
 #define DEFAULT_TX_BUFFER_SIZE (8192)
-
-#define RETRANSMIT_TIMEOUT (50)
+#define DEFAULT_RX_BUFFER_MAX (256 * 1024)
+#define DEFAULT_TX_BUFFER_MAX (256 * 1024)
+#define TCP_MIN_BUFFER_SIZE (4096)
+#define TCP_MAX_BUFFER_SIZE (16 * 1024 * 1024)
+#define TCP_MAX_WSCALE (14)
+
+#define TCP_INITIAL_RTO (1000)
+#define TCP_MIN_RTO (200)
+#define TCP_MAX_RTO (60000)
+#define TCP_MAX_CWND (1U << 30)
+#define TCP_DUP_ACK_THRESHOLD (3)
 #define DELAYED_ACK_TIMEOUT (50)
 #define TIME_WAIT_TIMEOUT (60000) // 1 minute
 
 #define FORCE_TCP_CHECKSUM (false)
 
+/* the most data handed to a nic doing TSO in one packet, bounded by the ip length field */
+#define TCP_TSO_MAX_SIZE (0xffff - sizeof(struct ipv4_hdr) - sizeof(tcp_header_t) - TCP_MAX_OPTIONS_LENGTH)
+
+/* out of order segments held per socket, each holds a pktbuf */
+#define TCP_MAX_OOO_SEGMENTS (16)
+/* SACK blocks that fit in an ack's options */
+#define TCP_MAX_SACK_BLOCKS (4)
+
+/* pktbufs held per socket to send from or read out of in place, these come out of the
+ * pool shared with the drivers. Past this data is copied. */
+#define TCP_MAX_TX_PKTBUFS (16)
+#define TCP_MAX_RX_PKTBUFS (16)
+/* pktbufs held by all sockets together in those queues and the out of order ones. Each is two
+ * pool objects, so this leaves the drivers at least three quarters of the pool however many
+ * sockets are busy. */
+#define TCP_MAX_HELD_PKTBUFS (PKTBUF_POOL_SIZE / 8)
+/* pktbufs in TSO packets from all sockets that the driver hasn't freed yet. Each is at most two
+ * pool objects, so their tx ring can pin no more than a quarter of the pool. */
+#define TCP_MAX_TSO_PARTS (PKTBUF_POOL_SIZE / 8)
+
+/* demux tables, sized in powers of two */
+#define TCP_CONN_HASH_SIZE (256)
+#define TCP_LISTEN_HASH_SIZE (32)
+
+/* which table a socket is hashed into */
+enum {
+    TCP_HASH_NONE,
+    TCP_HASH_CONN,
+    TCP_HASH_LISTEN,
+};
+
+/* chains end in a marker naming the chain rather than NULL, so a lockless reader that
+ * followed a reused socket into another chain can tell and start over */
+#define HASH_NULLS(index) ((tcp_socket_t *)(((uintptr_t)(index) << 1) | 1))
+#define IS_HASH_NULLS(s) (((uintptr_t)(s) & 1) != 0)
+
+#define LOAD_ACQUIRE(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
 #define SEQUENCE_GTE(a, b) ((int32_t)((a) - (b)) >= 0)
 #define SEQUENCE_LTE(a, b) ((int32_t)((a) - (b)) <= 0)
 #define SEQUENCE_GT(a, b) ((int32_t)((a) - (b)) > 0)
 #define SEQUENCE_LT(a, b) ((int32_t)((a) - (b)) < 0)
 
+/* sockets are looked up through the hash tables without holding any lock. The list and
+ * the tables are only modified with tcp_socket_list_lock held. */
 static mutex_t tcp_socket_list_lock = MUTEX_INITIAL_VALUE(tcp_socket_list_lock);
 static struct list_node tcp_socket_list = LIST_INITIAL_VALUE(tcp_socket_list);
+static tcp_socket_t *tcp_conn_hash[TCP_CONN_HASH_SIZE];
+static tcp_socket_t *tcp_listen_hash[TCP_LISTEN_HASH_SIZE];
+static uint32_t tcp_hash_seed;
+
+/* type safe, so a socket's memory stays a socket even after it is freed */
+static slab_cache_t *tcp_socket_cache;
+
+/* pktbufs queued on any socket, against TCP_MAX_HELD_PKTBUFS */
+static volatile int tcp_held_pktbufs;
+/* against TCP_MAX_TSO_PARTS, dropped by the pool as the driver frees each part */
+static volatile int tcp_tso_parts;
 
 static bool tcp_debug = false;
 
@@ -154,25 +294,54 @@ static bool tcp_debug = false;
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port);
 static void add_socket_to_list(tcp_socket_t *s);
 static void remove_socket_from_list(tcp_socket_t *s);
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers);
+static tcp_socket_t *create_tcp_socket(void);
+static status_t tcp_alloc_buffers(tcp_socket_t *s);
 static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-                         size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size);
-static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence);
+                         size_t len, pktbuf_t *chain, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size,
+                         uint16_t gso_size);
+static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, pktbuf_t *chain, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
+static void handle_data(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence);
+static void tcp_rx_purge_ooo(tcp_socket_t *s);
+static void tcp_purge_pktbufs(tcp_socket_t *s);
 static void send_ack(tcp_socket_t *s);
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size);
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, bool has_data, uint32_t tsecr);
+static ssize_t tcp_write_pending_data(tcp_socket_t *s, bool probe);
 static void handle_retransmit_timeout(void *_s);
 static void handle_time_wait_timeout(void *_s);
 static void handle_delayed_ack_timeout(void *_s);
 static void tcp_remote_close(tcp_socket_t *s);
 static void tcp_wakeup_waiters(tcp_socket_t *s);
+static void tcp_queue_fin(tcp_socket_t *s);
+static ssize_t tcp_retransmit(tcp_socket_t *s);
 static void inc_socket_ref(tcp_socket_t *s);
 static bool dec_socket_ref(tcp_socket_t *s);
 
-static uint16_t cksum_pheader(const tcp_pseudo_header_t *pheader, const void *buf, size_t len)
+static uint16_t cksum_pheader(const tcp_pseudo_header_t *pheader, const pktbuf_t *p)
 {
     uint16_t checksum = ones_sum16(0, pheader, sizeof(*pheader));
-    return ~ones_sum16(checksum, buf, len);
+
+    /* a part starting at an odd offset has its bytes summed in the other halves of the words.
+     * Parts can start on any address, so a leading odd byte is summed on its own to keep
+     * the loads aligned. */
+    size_t offset = 0;
+    for (; p; p = p->next) {
+        const uint8_t *data = p->data;
+        size_t len = p->dlen;
+
+        while (len > 0) {
+            size_t chunk = ((uintptr_t)data & 1) ? 1 : len;
+            uint16_t sum = ones_sum16(0, data, chunk);
+            if (offset & 1)
+                sum = (sum >> 8) | (sum << 8);
+            checksum = ones_sum16((uint32_t)checksum + sum, NULL, 0);
+
+            offset += chunk;
+            data += chunk;
+            len -= chunk;
+        }
+    }
+
+    return ~checksum;
 }
 
 __NO_INLINE static void dump_tcp_header(const tcp_header_t *header)
@@ -223,70 +392,182 @@ static void dump_socket(tcp_socket_t *s)
            s, s->state, tcp_state_to_string(s->state),
            s->local_ip, s->local_port, s->remote_ip, s->remote_port, s->ref);
     if (s->state == STATE_ESTABLISHED || s->state == STATE_CLOSE_WAIT) {
-        printf("\trx: wsize %u wlo %u whi %u (%u)\n",
-               s->rx_win_size, s->rx_win_low, s->rx_win_high,
-               s->rx_win_high - s->rx_win_low);
-        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u bufoff %u\n",
-               s->tx_win_low, s->tx_win_high, s->tx_win_high - s->tx_win_low,
+        printf("\trx: wsize %u (max %u) wlo %u whi %u (%u) wscale %u ooo %u sack %d ts %d pktbufs %u (%u)\n",
+               s->rx_win_size, s->rx_buffer_max, s->rx_win_low, s->rx_win_high,
+               s->rx_win_high - s->rx_win_low, s->rcv_wscale, s->rx_ooo_count, s->sack_ok, s->ts_ok,
+               s->rx_pktbuf_count, s->rx_pktbuf_bytes);
+        printf("\ttx: wlo %u whi %u (%u) wscale %u highest_seq %u (%u) bufsize %u (max %u) bufoff %u pktbufs %u\n",
+               s->tx_win_low, s->tx_win_high, s->tx_win_high - s->tx_win_low, s->snd_wscale,
                s->tx_highest_seq, s->tx_highest_seq - s->tx_win_low,
-               s->tx_buffer_size, s->tx_buffer_offset);
+               s->tx_buffer_size, s->tx_buffer_max, s->tx_buffer_offset, s->tx_pktbuf_count);
+        printf("\tcc: cwnd %u ssthresh %u srtt %u rttvar %u rto %u%s retransmits %u (fast %u) timeouts %u\n",
+               s->cwnd, s->ssthresh, s->srtt >> 3, s->rttvar >> 2, s->rto,
+               s->in_recovery ? " recovering" : "", s->retransmits, s->fast_retransmits, s->timeouts);
     }
 }
 
-static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
+static uint tcp_conn_hash_index(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
 {
-    LTRACEF("remote ip 0x%x local ip 0x%x remote port %u local port %u\n", remote_ip, local_ip, remote_port, local_port);
+    uint32_t h = tcp_hash_seed;
 
-    mutex_acquire(&tcp_socket_list_lock);
+    h ^= remote_ip;
+    h = (h ^ (h >> 16)) * 0x45d9f3b;
+    h ^= local_ip;
+    h = (h ^ (h >> 16)) * 0x45d9f3b;
+    h ^= ((uint32_t)remote_port << 16) | local_port;
+    h = (h ^ (h >> 16)) * 0x45d9f3b;
+    h ^= h >> 16;
 
-    /* XXX replace with something faster, like a hash table */
-    tcp_socket_t *s = NULL;
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_CLOSED || s->state == STATE_LISTEN) {
-            continue;
-        } else {
-            /* full check */
-            if (s->remote_ip == remote_ip &&
-                    s->local_ip == local_ip &&
-                    s->remote_port == remote_port &&
-                    s->local_port == local_port) {
-                goto out;
-            }
+    return h & (TCP_CONN_HASH_SIZE - 1);
+}
+
+static uint tcp_listen_hash_index(uint16_t local_port)
+{
+    return (local_port ^ (local_port >> 8)) & (TCP_LISTEN_HASH_SIZE - 1);
+}
+
+static bool tcp_conn_match(tcp_socket_t *s, ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
+{
+    return s->remote_ip == remote_ip &&
+           s->local_ip == local_ip &&
+           s->remote_port == remote_port &&
+           s->local_port == local_port;
+}
+
+/* the states we still have data or a FIN out there to get acked in */
+static bool tcp_state_sends(tcp_state_t state)
+{
+    return state == STATE_ESTABLISHED ||
+           state == STATE_CLOSE_WAIT ||
+           state == STATE_FIN_WAIT_1 ||
+           state == STATE_CLOSING ||
+           state == STATE_LAST_ACK;
+}
+
+static bool tcp_fin_acked(tcp_socket_t *s)
+{
+    return s->fin_queued && SEQUENCE_GT(s->tx_win_low, s->fin_seq);
+}
+
+/* take a ref on a socket found without a lock, unless it is already on its way to being freed */
+static bool tcp_socket_tryget(tcp_socket_t *s)
+{
+    int ref = s->ref;
+    while (ref > 0) {
+        int old = atomic_cmpxchg(&s->ref, ref, ref + 1);
+        if (old == ref) {
+            /* order the revalidation of the socket after the ref */
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            return true;
         }
+        ref = old;
     }
 
-    /* walk the list again, looking only for listen matches */
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_LISTEN) {
-            /* sockets in listen state only care about local port */
-            if (s->local_port == local_port) {
-                goto out;
-            }
-        }
+    return false;
+}
+
+static tcp_socket_t *lookup_conn_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
+{
+    uint index = tcp_conn_hash_index(remote_ip, local_ip, remote_port, local_port);
+    tcp_socket_t *s;
+
+restart:
+    for (s = LOAD_ACQUIRE(&tcp_conn_hash[index]); !IS_HASH_NULLS(s); s = LOAD_ACQUIRE(&s->hash_next)) {
+        /* only a socket that was never hashed has a NULL link */
+        if (!s)
+            goto restart;
+
+        if (s->state == STATE_CLOSED || !tcp_conn_match(s, remote_ip, local_ip, remote_port, local_port))
+            continue;
+
+        if (!tcp_socket_tryget(s))
+            continue;
+
+        /* it may have been freed and reused between the match and the ref, check again */
+        if (LOAD_ACQUIRE(&s->hash_table) == TCP_HASH_CONN &&
+                tcp_conn_match(s, remote_ip, local_ip, remote_port, local_port))
+            return s;
+
+        dec_socket_ref(s);
+        goto restart;
     }
 
-    /* fall through case returns null */
-    s = NULL;
+    /* ended up on another chain by way of a reused socket */
+    if (s != HASH_NULLS(index))
+        goto restart;
 
-out:
-    /* bump the ref before returning it */
-    if (s)
-        inc_socket_ref(s);
+    return NULL;
+}
 
-    mutex_release(&tcp_socket_list_lock);
+static tcp_socket_t *lookup_listen_socket(uint16_t local_port)
+{
+    uint index = tcp_listen_hash_index(local_port);
+    tcp_socket_t *s;
+
+restart:
+    for (s = LOAD_ACQUIRE(&tcp_listen_hash[index]); !IS_HASH_NULLS(s); s = LOAD_ACQUIRE(&s->hash_next)) {
+        if (!s)
+            goto restart;
+
+        /* sockets in listen state only care about local port */
+        if (s->state != STATE_LISTEN || s->local_port != local_port)
+            continue;
+
+        if (!tcp_socket_tryget(s))
+            continue;
+
+        if (LOAD_ACQUIRE(&s->hash_table) == TCP_HASH_LISTEN && s->local_port == local_port)
+            return s;
 
+        dec_socket_ref(s);
+        goto restart;
+    }
+
+    if (s != HASH_NULLS(TCP_CONN_HASH_SIZE + index))
+        goto restart;
+
+    return NULL;
+}
+
+static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
+{
+    LTRACEF("remote ip 0x%x local ip 0x%x remote port %u local port %u\n", remote_ip, local_ip, remote_port, local_port);
+
+    /* connected sockets take precedence over a listener on the same port */
+    tcp_socket_t *s = lookup_conn_socket(remote_ip, local_ip, remote_port, local_port);
+    if (!s)
+        s = lookup_listen_socket(local_port);
+
+    /* the ref is already bumped */
     return s;
 }
 
+static tcp_socket_t **socket_hash_head(tcp_socket_t *s, uint table)
+{
+    if (table == TCP_HASH_LISTEN)
+        return &tcp_listen_hash[tcp_listen_hash_index(s->local_port)];
+    else
+        return &tcp_conn_hash[tcp_conn_hash_index(s->remote_ip, s->local_ip, s->remote_port, s->local_port)];
+}
+
 static void add_socket_to_list(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0); // we should have implicitly bumped the ref when creating the socket
+    DEBUG_ASSERT(s->hash_table == TCP_HASH_NONE);
 
     mutex_acquire(&tcp_socket_list_lock);
 
     list_add_head(&tcp_socket_list, &s->node);
 
+    /* the address is fixed from here until the socket is removed */
+    uint table = (s->state == STATE_LISTEN) ? TCP_HASH_LISTEN : TCP_HASH_CONN;
+    tcp_socket_t **head = socket_hash_head(s, table);
+
+    STORE_RELEASE(&s->hash_next, *head);
+    STORE_RELEASE(&s->hash_table, table);
+    STORE_RELEASE(head, s);
+
     mutex_release(&tcp_socket_list_lock);
 }
 
@@ -300,6 +581,16 @@ static void remove_socket_from_list(tcp_socket_t *s)
     DEBUG_ASSERT(list_in_list(&s->node));
     list_delete(&s->node);
 
+    /* unlink it, but leave its own link alone for any reader still standing on it */
+    DEBUG_ASSERT(s->hash_table != TCP_HASH_NONE);
+    tcp_socket_t **link = socket_hash_head(s, s->hash_table);
+    while (*link != s) {
+        DEBUG_ASSERT(!IS_HASH_NULLS(*link));
+        link = &(*link)->hash_next;
+    }
+    STORE_RELEASE(link, s->hash_next);
+    STORE_RELEASE(&s->hash_table, TCP_HASH_NONE);
+
     mutex_release(&tcp_socket_list_lock);
 }
 
@@ -321,13 +612,15 @@ static bool dec_socket_ref(tcp_socket_t *s)
 
     if (oldval == 1) {
         LTRACEF("destroying socket\n");
+        tcp_rx_purge_ooo(s);
+        tcp_purge_pktbufs(s);
         event_destroy(&s->tx_event);
         event_destroy(&s->rx_event);
 
         free(s->rx_buffer_raw);
         free(s->tx_buffer);
 
-        free(s);
+        slab_free(tcp_socket_cache, s);
     }
     return (oldval == 1);
 }
@@ -351,6 +644,53 @@ static void tcp_timer_cancel(tcp_socket_t *s, net_timer_t *timer)
         dec_socket_ref(s);
 }
 
+static void tcp_parse_options(const uint8_t *opt, size_t len, tcp_options_t *options)
+{
+    memset(options, 0, sizeof(*options));
+
+    while (len > 0) {
+        uint8_t kind = opt[0];
+        if (kind == TCP_OPTION_EOL)
+            break;
+        if (kind == TCP_OPTION_NOP) {
+            opt++;
+            len--;
+            continue;
+        }
+
+        /* everything else is kind, length, data */
+        if (len < 2 || opt[1] < 2 || opt[1] > len)
+            break;
+
+        switch (kind) {
+            case TCP_OPTION_MSS:
+                if (opt[1] == 4)
+                    options->mss = (opt[2] << 8) | opt[3];
+                break;
+            case TCP_OPTION_SACK_PERMITTED:
+                if (opt[1] == 2)
+                    options->sack_permitted = true;
+                break;
+            case TCP_OPTION_WSCALE:
+                if (opt[1] == 3) {
+                    options->wscale_present = true;
+                    options->wscale = MIN(opt[2], TCP_MAX_WSCALE);
+                }
+                break;
+            case TCP_OPTION_TIMESTAMP:
+                if (opt[1] == 10) {
+                    options->ts_present = true;
+                    options->tsval = ((uint32_t)opt[2] << 24) | (opt[3] << 16) | (opt[4] << 8) | opt[5];
+                    options->tsecr = ((uint32_t)opt[6] << 24) | (opt[7] << 16) | (opt[8] << 8) | opt[9];
+                }
+                break;
+        }
+
+        len -= opt[1];
+        opt += opt[1];
+    }
+}
+
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 {
     if (unlikely(tcp_debug))
@@ -372,6 +712,10 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         TRACEF("REJECT: packet too large for buffer\n");
         return;
     }
+    if (header_len < sizeof(tcp_header_t)) {
+        TRACEF("REJECT: bad header length %zu\n", header_len);
+        return;
+    }
 
     /* checksum */
     if (FORCE_TCP_CHECKSUM || (p->flags & PKTBUF_FLAG_CKSUM_TCP_GOOD) == 0) {
@@ -384,7 +728,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         pheader.protocol = IP_PROTO_TCP;
         pheader.tcp_length = htons(p->dlen);
 
-        uint16_t checksum = cksum_pheader(&pheader, p->data, p->dlen);
+        uint16_t checksum = cksum_pheader(&pheader, p);
         if (checksum != 0) {
             TRACEF("REJECT: failed checksum, header says 0x%x, we got 0x%x\n", header->checksum, checksum);
             return;
@@ -400,6 +744,10 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
     header->win_size = ntohs(header->win_size);
     header->urg_pointer = ntohs(header->urg_pointer);
 
+    /* most options only matter on a SYN, but timestamps come on everything once agreed on */
+    tcp_options_t options;
+    tcp_parse_options((const uint8_t *)(header + 1), header_len - sizeof(tcp_header_t), &options);
+
     /* get some data from the packet */
     uint8_t packet_flags = header->length_flags & 0x3f;
     size_t data_len = p->dlen - header_len;
@@ -420,6 +768,23 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 
     mutex_acquire(&s->lock);
 
+    /* the window in a SYN is never scaled */
+    uint32_t win_size = header->win_size;
+    if (!(packet_flags & PKT_SYN))
+        win_size <<= s->snd_wscale;
+
+    /* remember their timestamp to echo back, if it's new and this segment is one we've acked up to (RFC 7323) */
+    uint32_t tsecr = 0;
+    if (s->ts_ok && options.ts_present) {
+        tsecr = options.tsecr;
+        if (SEQUENCE_GTE(options.tsval, s->ts_recent) && SEQUENCE_LTE(header->seq_num, s->ts_last_ack_sent))
+            s->ts_recent = options.tsval;
+
+        /* data echoing our timestamp times the round trip from our side, for sizing the receive buffer */
+        if (data_len > 0 && tsecr != 0)
+            s->rx_rtt = current_time() - tsecr;
+    }
+
     /* check to see if they're resetting us */
     if (packet_flags & PKT_RST) {
         if (s->state != STATE_CLOSED && s->state != STATE_LISTEN) {
@@ -446,7 +811,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
                 goto done;
 
             /* make a new accept socket */
-            tcp_socket_t *accept_socket = create_tcp_socket(true);
+            tcp_socket_t *accept_socket = create_tcp_socket();
             if (!accept_socket)
                 goto done;
 
@@ -456,6 +821,33 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             accept_socket->remote_ip = src_ip;
             accept_socket->remote_port = header->source_port;
             accept_socket->state = STATE_SYN_RCVD;
+            if (options.mss)
+                accept_socket->mss = MIN(accept_socket->mss, options.mss);
+            accept_socket->sack_ok = options.sack_permitted;
+
+            /* it gets the buffer sizes set on the listener */
+            accept_socket->rx_buffer_max = s->rx_buffer_max;
+            accept_socket->tx_buffer_max = s->tx_buffer_max;
+
+            /* scale our window just enough to advertise all of the biggest receive buffer */
+            if (options.wscale_present) {
+                accept_socket->snd_wscale = options.wscale;
+                while (accept_socket->rcv_wscale < TCP_MAX_WSCALE &&
+                        ((accept_socket->rx_buffer_max - 1) >> accept_socket->rcv_wscale) > 0xffff)
+                    accept_socket->rcv_wscale++;
+            }
+
+            /* the timestamp option takes room in every segment */
+            if (options.ts_present) {
+                accept_socket->ts_ok = true;
+                accept_socket->ts_recent = options.tsval;
+                accept_socket->mss -= TCP_TIMESTAMP_LENGTH;
+            }
+
+            if (tcp_alloc_buffers(accept_socket) < 0) {
+                dec_socket_ref(accept_socket);
+                goto done;
+            }
 
             mutex_acquire(&accept_socket->lock);
 
@@ -464,23 +856,42 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             /* remember their sequence */
             accept_socket->rx_win_low = header->seq_num + 1;
             accept_socket->rx_win_high = accept_socket->rx_win_low + accept_socket->rx_win_size - 1;
+            accept_socket->rx_grow_seq = accept_socket->rx_win_high;
+            accept_socket->rx_grow_time = current_time();
 
             /* save this socket and wake anyone up that is waiting to accept */
             s->accepted = accept_socket;
             sem_post(&s->accept_sem, true);
 
-            /* set up a mss option for sending back */
-            tcp_mss_option_t mss_option;
-            mss_option.kind = 0x2;
-            mss_option.len = 0x4;
-            mss_option.mss = ntohs(s->mss); // XXX make sure we fit in their mss
+            /* set up a mss option for sending back, and say we take SACKs and scale windows if they do.
+             * tcp_socket_send adds the timestamp. */
+            uint8_t syn_options[sizeof(tcp_mss_option_t) + 8];
+            size_t syn_options_len = sizeof(tcp_mss_option_t);
+            tcp_mss_option_t *mss_option = (tcp_mss_option_t *)syn_options;
+            mss_option->kind = TCP_OPTION_MSS;
+            mss_option->len = 0x4;
+            mss_option->mss = htons(s->mss);
+            if (accept_socket->sack_ok) {
+                syn_options[syn_options_len++] = TCP_OPTION_NOP;
+                syn_options[syn_options_len++] = TCP_OPTION_NOP;
+                syn_options[syn_options_len++] = TCP_OPTION_SACK_PERMITTED;
+                syn_options[syn_options_len++] = 2;
+            }
+            if (options.wscale_present) {
+                syn_options[syn_options_len++] = TCP_OPTION_NOP;
+                syn_options[syn_options_len++] = TCP_OPTION_WSCALE;
+                syn_options[syn_options_len++] = 3;
+                syn_options[syn_options_len++] = accept_socket->rcv_wscale;
+            }
 
             /* send a response */
-            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, &mss_option, sizeof(mss_option),
+            tcp_socket_send(accept_socket, NULL, 0, NULL, PKT_ACK|PKT_SYN, syn_options, syn_options_len,
                             accept_socket->tx_win_low);
 
             /* SYN consumed a sequence */
             accept_socket->tx_win_low++;
+            accept_socket->tx_highest_seq = accept_socket->tx_win_low;
+            accept_socket->tx_max_seq = accept_socket->tx_win_low;
 
             mutex_release(&accept_socket->lock);
             break;
@@ -498,8 +909,12 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
                     goto send_reset;
                 }
 
-                s->tx_win_high = s->tx_win_low + header->win_size;
+                s->tx_win_high = s->tx_win_low + win_size;
                 s->tx_highest_seq = s->tx_win_low;
+                s->tx_max_seq = s->tx_win_low;
+
+                /* RFC 5681 initial window, now that the mss is settled */
+                s->cwnd = MIN(4 * s->mss, MAX(2 * s->mss, 4380U));
 
                 s->state = STATE_ESTABLISHED;
             } else {
@@ -511,12 +926,12 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         case STATE_ESTABLISHED:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, win_size, data_len > 0, tsecr);
             }
 
             if (data_len > 0) {
                 LTRACEF("new data, len %zu\n", data_len);
-                handle_data(s, p->data, p->dlen, header->seq_num);
+                handle_data(s, p, header->seq_num);
             }
 
             if ((packet_flags & PKT_FIN) && SEQUENCE_GTE(s->rx_win_low, highest_sequence)) {
@@ -537,7 +952,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         case STATE_CLOSE_WAIT:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, win_size, data_len > 0, tsecr);
             }
             if (packet_flags & PKT_FIN) {
                 /* they must have missed our ack, ack them again */
@@ -545,8 +960,11 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             }
             break;
         case STATE_LAST_ACK:
-            if (packet_flags & PKT_ACK) {
-                /* they're acking our FIN, probably */
+            if (packet_flags & PKT_ACK)
+                handle_ack(s, header->ack_num, win_size, data_len > 0, tsecr);
+
+            if (tcp_fin_acked(s)) {
+                /* they have everything, FIN included */
                 tcp_remote_close(s);
 
                 /* tcp_close() was already called on us, remove us from the list and drop the ref */
@@ -555,8 +973,10 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             }
             break;
         case STATE_FIN_WAIT_1:
-            if (packet_flags & PKT_ACK) {
-                /* they're acking our FIN, probably */
+            if (packet_flags & PKT_ACK)
+                handle_ack(s, header->ack_num, win_size, data_len > 0, tsecr);
+
+            if (tcp_fin_acked(s)) {
                 s->state = STATE_FIN_WAIT_2;
                 /* drop into fin_wait_2 state logic, in case they were FINning us too */
                 goto fin_wait_2;
@@ -580,8 +1000,10 @@ fin_wait_2:
             }
             break;
         case STATE_CLOSING:
-            if (packet_flags & PKT_ACK) {
-                /* they're acking our FIN, probably */
+            if (packet_flags & PKT_ACK)
+                handle_ack(s, header->ack_num, win_size, data_len > 0, tsecr);
+
+            if (tcp_fin_acked(s)) {
                 s->state = STATE_TIME_WAIT;
 
                 /* set timed wait timer */
@@ -610,12 +1032,285 @@ send_reset:
     LTRACEF("SEND RST\n");
     if (!(packet_flags & PKT_RST)) {
         tcp_send(src_ip, header->source_port, dst_ip, header->dest_port,
-                 NULL, 0, PKT_RST, NULL, 0, 0, header->ack_num, 0);
+                 NULL, 0, NULL, PKT_RST, NULL, 0, 0, header->ack_num, 0, 0);
+    }
+}
+
+/* received data waiting for the reader, in the pktbuf queue and the receive buffer */
+static uint32_t tcp_rx_used(tcp_socket_t *s)
+{
+    return cbuf_space_used(&s->rx_buffer) + s->rx_pktbuf_bytes;
+}
+
+/* append in order data to the receive buffer, returns how much fit. Anything in the
+ * pktbuf queue came before it, so it always lands in order. */
+static size_t tcp_rx_deliver(tcp_socket_t *s, const void *data, size_t len)
+{
+    LTRACEF("delivering len %zu at sequence %u\n", len, s->rx_win_low);
+
+    size_t written = cbuf_write(&s->rx_buffer, data, len, false);
+    s->rx_win_low += written;
+
+    return written;
+}
+
+/* whether tcp can hold on to another pktbuf without taking more than its share of the pool.
+ * Sockets check this under their own locks, so it can go a little over. */
+static bool tcp_pktbuf_budget_ok(void)
+{
+    return tcp_held_pktbufs < TCP_MAX_HELD_PKTBUFS;
+}
+
+static void tcp_pktbufs_held(int delta)
+{
+    atomic_add(&tcp_held_pktbufs, delta);
+}
+
+/* in order data can be left in its pktbuf as long as nothing is waiting in the receive
+ * buffer ahead of it */
+static bool tcp_rx_can_queue(tcp_socket_t *s)
+{
+    return s->rx_pktbuf_count < TCP_MAX_RX_PKTBUFS && cbuf_space_used(&s->rx_buffer) == 0 &&
+           tcp_pktbuf_budget_ok();
+}
+
+/* append in order data held in a pktbuf, keeping the pktbuf for the reader rather than
+ * copying out of it if it can. Takes ownership of p. */
+static void tcp_rx_deliver_pktbuf(tcp_socket_t *s, pktbuf_t *p)
+{
+    if (!tcp_rx_can_queue(s)) {
+        tcp_rx_deliver(s, p->data, p->dlen);
+        pktbuf_free(p, false);
+        return;
+    }
+
+    LTRACEF("queueing len %u at sequence %u\n", p->dlen, s->rx_win_low);
+
+    list_add_tail(&s->rx_pktbuf_queue, &p->list);
+    s->rx_pktbuf_count++;
+    tcp_pktbufs_held(1);
+    s->rx_pktbuf_bytes += p->dlen;
+    s->rx_win_low += p->dlen;
+}
+
+/* copy out received data, oldest first */
+static size_t tcp_rx_read(tcp_socket_t *s, uint8_t *buf, size_t len)
+{
+    size_t read = 0;
+
+    pktbuf_t *p;
+    while (read < len && (p = list_peek_head_type(&s->rx_pktbuf_queue, pktbuf_t, list)) != NULL) {
+        size_t n = MIN(p->dlen, len - read);
+        memcpy(buf + read, pktbuf_consume(p, n), n);
+        read += n;
+        s->rx_pktbuf_bytes -= n;
+
+        if (p->dlen == 0) {
+            list_delete(&p->list);
+            s->rx_pktbuf_count--;
+            tcp_pktbufs_held(-1);
+            pktbuf_free(p, true);
+        }
+    }
+
+    if (read < len)
+        read += cbuf_read(&s->rx_buffer, buf + read, len - read, false);
+
+    return read;
+}
+
+/* once the reader has taken something, see if the window opened enough to say so */
+static void tcp_rx_consumed(tcp_socket_t *s)
+{
+    /* if we've used up the last byte in the read buffer, unsignal the read event */
+    uint32_t remaining_bytes = tcp_rx_used(s);
+    if (s->state == STATE_ESTABLISHED && remaining_bytes == 0) {
+        event_unsignal(&s->rx_event);
+    }
+
+    /* we've read something, make sure the other end knows that our window is opening */
+    uint32_t new_rx_win_size = s->rx_win_size - MIN(remaining_bytes, s->rx_win_size);
+
+    /* if we've opened it enough, send an ack */
+    if (new_rx_win_size >= s->mss && s->rx_win_high - s->rx_win_low < s->mss)
+        send_ack(s);
+}
+
+static void tcp_purge_pktbufs(tcp_socket_t *s)
+{
+    tcp_pktbufs_held(-(int)(s->rx_pktbuf_count + s->tx_pktbuf_count));
+
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&s->rx_pktbuf_queue, pktbuf_t, list)) != NULL)
+        pktbuf_free(p, false);
+    s->rx_pktbuf_count = 0;
+    s->rx_pktbuf_bytes = 0;
+
+    while ((p = list_remove_head_type(&s->tx_pktbuf_queue, pktbuf_t, list)) != NULL)
+        pktbuf_free(p, false);
+    s->tx_pktbuf_count = 0;
+}
+
+/* hold on to a segment that arrived past a hole, until the hole fills */
+static void tcp_rx_queue_ooo(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence)
+{
+    DEBUG_ASSERT(SEQUENCE_GT(sequence, s->rx_win_low));
+
+    /* only hold on to what is inside the window we advertised */
+    if (SEQUENCE_GTE(sequence, s->rx_win_high))
+        return;
+    len = MIN(len, s->rx_win_high - sequence);
+
+    if (s->rx_ooo_count >= TCP_MAX_OOO_SEGMENTS || !tcp_pktbuf_budget_ok())
+        return;
+
+    /* find where it goes, dropping exact retransmits of something we already hold */
+    pktbuf_t *q;
+    list_for_every_entry(&s->rx_ooo_queue, q, pktbuf_t, list) {
+        if (q->seq == sequence && q->dlen >= len)
+            return;
+        if (SEQUENCE_GT(q->seq, sequence))
+            break;
+    }
+
+    /* we're in the receive path, drop it rather than wait for a buffer */
+    pktbuf_t *p = pktbuf_alloc_nowait();
+    if (!p)
+        return;
+
+    len = MIN(len, pktbuf_avail_tail(p));
+    pktbuf_append_data(p, data, len);
+    p->seq = sequence;
+
+    /* adding before the list head itself appends */
+    list_add_tail(&q->list, &p->list);
+    s->rx_ooo_count++;
+    tcp_pktbufs_held(1);
+    s->rx_ooo_last_seq = sequence;
+
+    LTRACEF("queued out of order sequence %u len %zu, %u queued\n", sequence, len, s->rx_ooo_count);
+}
+
+/* move everything the bottom of the window has caught up to into the receive buffer */
+static void tcp_rx_drain_ooo(tcp_socket_t *s)
+{
+    pktbuf_t *p;
+    while ((p = list_peek_head_type(&s->rx_ooo_queue, pktbuf_t, list)) != NULL) {
+        if (SEQUENCE_GT(p->seq, s->rx_win_low))
+            break;
+
+        list_delete(&p->list);
+        s->rx_ooo_count--;
+        tcp_pktbufs_held(-1);
+
+        /* deliver whatever part of it is new */
+        uint32_t top = p->seq + p->dlen;
+        if (SEQUENCE_GT(top, s->rx_win_low)) {
+            pktbuf_consume(p, s->rx_win_low - p->seq);
+            tcp_rx_deliver_pktbuf(s, p);
+        } else {
+            pktbuf_free(p, false);
+        }
+    }
+}
+
+static void tcp_rx_purge_ooo(tcp_socket_t *s)
+{
+    tcp_pktbufs_held(-(int)s->rx_ooo_count);
+
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&s->rx_ooo_queue, pktbuf_t, list)) != NULL)
+        pktbuf_free(p, false);
+    s->rx_ooo_count = 0;
+}
+
+/* build a SACK option describing the out of order queue, returns its length */
+static size_t tcp_build_sack_option(tcp_socket_t *s, uint32_t *option)
+{
+    if (!s->sack_ok || list_is_empty(&s->rx_ooo_queue))
+        return 0;
+
+    /* coalesce the queue into contiguous blocks */
+    uint32_t left[TCP_MAX_OOO_SEGMENTS];
+    uint32_t right[TCP_MAX_OOO_SEGMENTS];
+    uint count = 0;
+    uint first = 0;
+
+    pktbuf_t *p;
+    list_for_every_entry(&s->rx_ooo_queue, p, pktbuf_t, list) {
+        if (count > 0 && SEQUENCE_LTE(p->seq, right[count - 1])) {
+            if (SEQUENCE_GT(p->seq + p->dlen, right[count - 1]))
+                right[count - 1] = p->seq + p->dlen;
+        } else {
+            left[count] = p->seq;
+            right[count] = p->seq + p->dlen;
+            count++;
+        }
+        if (p->seq == s->rx_ooo_last_seq)
+            first = count - 1;
+    }
+
+    /* the block holding the latest segment goes first, the rest in sequence order. One less
+     * fits next to a timestamp. */
+    uint blocks = MIN(count, s->ts_ok ? TCP_MAX_SACK_BLOCKS - 1 : TCP_MAX_SACK_BLOCKS);
+    option[0] = htonl(TCP_OPTION_NOP << 24 | TCP_OPTION_NOP << 16 | TCP_OPTION_SACK << 8 | (2 + 8 * blocks));
+    option[1] = htonl(left[first]);
+    option[2] = htonl(right[first]);
+    for (uint i = 0, b = 1; b < blocks; i++) {
+        if (i == first)
+            continue;
+        option[1 + b * 2] = htonl(left[i]);
+        option[2 + b * 2] = htonl(right[i]);
+        b++;
+    }
+
+    return 4 + 8 * blocks;
+}
+
+/* the most receive buffer the window we advertise can describe */
+static uint32_t tcp_rx_buffer_limit(tcp_socket_t *s)
+{
+    return MIN(s->rx_buffer_max, 0x10000U << s->rcv_wscale);
+}
+
+/* double the receive buffer, moving over anything the reader hasn't picked up yet */
+static void tcp_rx_grow(tcp_socket_t *s)
+{
+    size_t used = tcp_rx_used(s);
+
+    /* if the reader isn't keeping up, a bigger window won't help */
+    if (used > s->rx_win_size / 2)
+        return;
+
+    uint32_t new_size = s->rx_win_size * 2;
+    if (new_size > tcp_rx_buffer_limit(s))
+        return;
+
+    uint8_t *raw = malloc(new_size);
+    if (!raw)
+        return;
+
+    iovec_t regions[2];
+    cbuf_peek(&s->rx_buffer, regions);
+
+    cbuf_initialize_spsc(&s->rx_buffer, new_size, raw);
+    for (uint i = 0; i < 2; i++) {
+        if (regions[i].iov_len > 0)
+            cbuf_write(&s->rx_buffer, regions[i].iov_base, regions[i].iov_len, false);
     }
+
+    free(s->rx_buffer_raw);
+    s->rx_buffer_raw = raw;
+    s->rx_win_size = new_size;
+
+    LTRACEF("s %p rx buffer now %u\n", s, new_size);
 }
 
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence)
+static void handle_data(tcp_socket_t *s, pktbuf_t *p, uint32_t sequence)
 {
+    const uint8_t *data = p->data;
+    size_t len = p->dlen;
+
     if (unlikely(tcp_debug))
         TRACEF("data %p, len %zu, sequence %u\n", data, len, sequence);
 
@@ -629,17 +1324,40 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
     if (SEQUENCE_LTE(sequence, s->rx_win_low) && SEQUENCE_GTE(sequence_top, s->rx_win_low)) {
         /* it intersects the bottom of our window, so it's in order */
 
-        /* copy the data we need to our cbuf */
-        size_t offset = sequence - s->rx_win_low;
+        /* take the data we need, keeping the driver's buffer if we can and copying it to our cbuf if not.
+         * Taking the buffer leaves the driver with a fresh one in p. */
+        size_t offset = s->rx_win_low - sequence;
         size_t copy_len = MIN(s->rx_win_high - s->rx_win_low, len - offset);
 
         DEBUG_ASSERT(offset < len);
 
-        LTRACEF("copying from offset %zu, len %zu\n", offset, copy_len);
+        LTRACEF("taking from offset %zu, len %zu\n", offset, copy_len);
+
+        pktbuf_t *stolen = tcp_rx_can_queue(s) ? pktbuf_steal(p) : NULL;
+        if (stolen) {
+            pktbuf_consume(stolen, offset);
+            pktbuf_consume_tail(stolen, stolen->dlen - copy_len);
+            tcp_rx_deliver_pktbuf(s, stolen);
+        } else {
+            tcp_rx_deliver(s, data + offset, copy_len);
+        }
+
+        /* a buffer's worth in about a round trip means our window is what's holding them back.
+         * With no idea of the rtt, assume it is. Our acks may be held back for a while too. */
+        if (SEQUENCE_GTE(s->rx_win_low, s->rx_grow_seq)) {
+            uint32_t rtt = s->rx_rtt ? s->rx_rtt : (s->srtt >> 3);
+            if (rtt == 0 || current_time() - s->rx_grow_time <= 2 * rtt + DELAYED_ACK_TIMEOUT)
+                tcp_rx_grow(s);
+
+            s->rx_grow_seq = s->rx_win_low + s->rx_win_size;
+            s->rx_grow_time = current_time();
+        }
 
-        s->rx_win_low += copy_len;
+        /* it may have filled a hole, pull in anything queued behind it */
+        bool filled_hole = !list_is_empty(&s->rx_ooo_queue);
+        if (filled_hole)
+            tcp_rx_drain_ooo(s);
 
-        cbuf_write(&s->rx_buffer, (uint8_t *)data + offset, copy_len, false);
         event_signal(&s->rx_event, true);
 
         /* keep a counter if they've been sending a full mss */
@@ -649,8 +1367,9 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
             s->rx_full_mss_count = 0;
         }
 
-        /* immediately ack if we're more than halfway into our buffer or they've sent 2 or more full packets */
-        if (s->rx_full_mss_count >= 2 ||
+        /* immediately ack if we're more than halfway into our buffer, they've sent 2 or more full packets,
+         * or this filled in a hole so they can stop retransmitting */
+        if (filled_hole || s->rx_full_mss_count >= 2 ||
                 (int)(s->rx_win_low + s->rx_win_size - s->rx_win_high) > (int)s->rx_win_size / 2) {
             send_ack(s);
             s->rx_full_mss_count = 0;
@@ -658,13 +1377,16 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
             tcp_timer_set(s, &s->ack_delay_timer, &handle_delayed_ack_timeout, DELAYED_ACK_TIMEOUT);
         }
     } else {
-        // either out of order or completely out of our window, drop
-        // duplicately ack the last thing we really got
+        // past a hole, keep it around until the hole is filled
+        if (SEQUENCE_GT(sequence, s->rx_win_low))
+            tcp_rx_queue_ooo(s, data, len, sequence);
+
+        // duplicately ack the last thing we got in order, along with what we're holding
         send_ack(s);
     }
 }
 
-static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags,
+static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, pktbuf_t *chain, tcp_flags_t flags,
                                 const void *options, size_t options_length, uint32_t sequence)
 {
     DEBUG_ASSERT(s);
@@ -673,54 +1395,135 @@ static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, t
     DEBUG_ASSERT(options_length == 0 || options);
     DEBUG_ASSERT((options_length % 4) == 0);
 
-    // calculate the new right edge of the rx window
-    uint32_t rx_win_high = s->rx_win_low + s->rx_win_size - cbuf_space_used(&s->rx_buffer) - 1;
+    // calculate the new size of the rx window. It goes out in 16 bits, scaled except on a SYN,
+    // so round it down to something that can be said that way.
+    uint32_t scale = (flags & PKT_SYN) ? 0 : s->rcv_wscale;
+    uint32_t used = tcp_rx_used(s);
+    uint32_t win = (used < s->rx_win_size) ? s->rx_win_size - used - 1 : 0;
+    win = MIN(win, 0xffffU << scale) & ~((1U << scale) - 1);
 
-    LTRACEF("rx_win_low %u rx_win_size %u read_buf_len %zu, new win high %u\n",
-            s->rx_win_low, s->rx_win_size, cbuf_space_used(&s->rx_buffer), rx_win_high);
+    LTRACEF("rx_win_low %u rx_win_size %u read_buf_len %u, new win %u\n",
+            s->rx_win_low, s->rx_win_size, used, win);
 
-    uint16_t win_size;
-    if (SEQUENCE_GTE(rx_win_high, s->rx_win_high)) {
-        s->rx_win_high = rx_win_high;
-        win_size = rx_win_high - s->rx_win_low;
-    } else {
+    if (SEQUENCE_LT(s->rx_win_low + win, s->rx_win_high)) {
         // the window size has shrunk, but we can't move the
         // right edge of the window backwards
-        win_size = s->rx_win_high - s->rx_win_low;
+        win = ROUNDUP(s->rx_win_high - s->rx_win_low, 1U << scale);
     }
+    s->rx_win_high = s->rx_win_low + win;
 
     // we are piggybacking a pending ACK, so clear the delayed ACK timer
     if (flags & PKT_ACK) {
         tcp_timer_cancel(s, &s->ack_delay_timer);
+        s->ts_last_ack_sent = s->rx_win_low;
     }
 
-    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, len, flags,
-                            options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
+    // once agreed on, every segment carries a timestamp
+    uint32_t ts_options[TCP_MAX_OPTIONS_LENGTH / 4];
+    if (s->ts_ok) {
+        DEBUG_ASSERT(options_length + TCP_TIMESTAMP_LENGTH <= TCP_MAX_OPTIONS_LENGTH);
 
-    return err;
-}
+        ts_options[0] = htonl(TCP_OPTION_NOP << 24 | TCP_OPTION_NOP << 16 | TCP_OPTION_TIMESTAMP << 8 | 10);
+        ts_options[1] = htonl(current_time());
+        ts_options[2] = htonl(s->ts_recent);
+        if (options_length > 0)
+            memcpy(&ts_options[3], options, options_length);
 
-static void send_ack(tcp_socket_t *s)
-{
-    DEBUG_ASSERT(s);
-    DEBUG_ASSERT(is_mutex_held(&s->lock));
+        options = ts_options;
+        options_length += TCP_TIMESTAMP_LENGTH;
+    }
 
-    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT && s->state != STATE_FIN_WAIT_2)
-        return;
+    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, len, chain, flags,
+                            options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win >> scale,
+                            s->mss);
 
-    tcp_socket_send(s, NULL, 0, PKT_ACK, NULL, 0, s->tx_win_low);
+    return err;
 }
 
-static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
-                         size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size)
+/* send len bytes of buffered data, offset bytes past tx_win_low. Data queued by tcp_send_pktbuf
+ * goes out as clones of the pktbufs holding it rather than being copied. */
+static status_t tcp_socket_send_data(tcp_socket_t *s, uint32_t offset, uint32_t len, tcp_flags_t flags, uint32_t sequence)
 {
-    DEBUG_ASSERT(len == 0 || buf);
-    DEBUG_ASSERT(options_length == 0 || options);
-    DEBUG_ASSERT((options_length % 4) == 0);
+    DEBUG_ASSERT(offset + len <= s->tx_buffer_offset);
 
-    pktbuf_t *p = pktbuf_alloc();
-    if (!p)
-        return ERR_NO_MEMORY;
+    if (list_is_empty(&s->tx_pktbuf_queue))
+        return tcp_socket_send(s, s->tx_buffer + offset, len, NULL, flags, NULL, 0, sequence);
+
+    pktbuf_t *chain = NULL;
+    pktbuf_t *q;
+    list_for_every_entry(&s->tx_pktbuf_queue, q, pktbuf_t, list) {
+        if (len == 0)
+            break;
+        if (offset >= q->dlen) {
+            offset -= q->dlen;
+            continue;
+        }
+
+        uint32_t part_len = MIN(q->dlen - offset, len);
+        pktbuf_t *c = pktbuf_clone_nowait(q);
+        if (!c) {
+            /* lost like any other segment, and resent the same way */
+            if (chain)
+                pktbuf_free(chain, true);
+            return ERR_NO_MEMORY;
+        }
+        pktbuf_consume(c, offset);
+        pktbuf_consume_tail(c, c->dlen - part_len);
+
+        if (chain)
+            pktbuf_chain_append(chain, c);
+        else
+            chain = c;
+
+        offset = 0;
+        len -= part_len;
+    }
+
+    return tcp_socket_send(s, NULL, 0, chain, flags, NULL, 0, sequence);
+}
+
+static void send_ack(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(s);
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT && s->state != STATE_FIN_WAIT_2)
+        return;
+
+    uint32_t sack_option[1 + 2 * TCP_MAX_SACK_BLOCKS];
+    size_t sack_len = tcp_build_sack_option(s, sack_option);
+
+    tcp_socket_send(s, NULL, 0, NULL, PKT_ACK, sack_len ? sack_option : NULL, sack_len, s->tx_win_low);
+}
+
+/* send a segment with data from buf, or from chain without copying it. Takes ownership of chain.
+ * If the nic does TSO, more than gso_size bytes of data go out as one packet for it to segment. */
+static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
+                         size_t len, pktbuf_t *chain, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size,
+                         uint16_t gso_size)
+{
+    DEBUG_ASSERT(len == 0 || buf);
+    DEBUG_ASSERT(options_length == 0 || options);
+    DEBUG_ASSERT((options_length % 4) == 0);
+
+    /* this runs with the socket locked, often from the receive path, so a segment we can't get
+     * a buffer for is dropped rather than waited on. Data in it gets resent, an ack gets sent
+     * with the next one. */
+    pktbuf_t *p = pktbuf_alloc_nowait();
+    if (!p) {
+        if (chain)
+            pktbuf_free(chain, true);
+        return ERR_NO_MEMORY;
+    }
+
+    /* options can outgrow the headroom pktbuf_alloc leaves for the tcp, ip and ethernet
+     * headers, so move the start of the packet up to make room */
+    size_t headroom = sizeof(tcp_header_t) + options_length + sizeof(struct ipv4_hdr) + sizeof(struct eth_hdr);
+    if (pktbuf_avail_head(p) < headroom) {
+        size_t shift = headroom - pktbuf_avail_head(p);
+        pktbuf_append(p, shift);
+        pktbuf_consume(p, shift);
+    }
 
     tcp_header_t *header = pktbuf_prepend(p, sizeof(tcp_header_t) + options_length);
     DEBUG_ASSERT(header);
@@ -737,21 +1540,56 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     if (options)
         memcpy(header + 1, options, options_length);
 
-    /* append the data */
-    if (len > 0)
-        pktbuf_append_data(p, buf, len);
-
-    /* compute the checksum */
-    /* XXX get the tx ckecksum capability from the nic */
-    if (FORCE_TCP_CHECKSUM || true) {
-        tcp_pseudo_header_t pheader;
-        pheader.source_addr = src_ip;
-        pheader.dest_addr = dest_ip;
-        pheader.zero = 0;
-        pheader.protocol = IP_PROTO_TCP;
-        pheader.tcp_length = htons(p->dlen);
+    /* append the data, spilling over into more pktbufs if it doesn't fit in this one */
+    const uint8_t *data = buf;
+    pktbuf_t *part = p;
+    while (len > 0) {
+        if (pktbuf_avail_tail(part) == 0) {
+            part = pktbuf_alloc_nowait();
+            if (!part) {
+                pktbuf_free(p, true);
+                if (chain)
+                    pktbuf_free(chain, true);
+                return ERR_NO_MEMORY;
+            }
+            pktbuf_chain_append(p, part);
+        }
 
-        header->checksum = cksum_pheader(&pheader, p->data, p->dlen);
+        size_t part_len = MIN(len, pktbuf_avail_tail(part));
+        pktbuf_append_data(part, data, part_len);
+        data += part_len;
+        len -= part_len;
+    }
+    if (chain)
+        pktbuf_chain_append(p, chain);
+
+    /* compute the checksum, or as much of it as the nic leaves to us */
+    tcp_pseudo_header_t pheader;
+    pheader.source_addr = src_ip;
+    pheader.dest_addr = dest_ip;
+    pheader.zero = 0;
+    pheader.protocol = IP_PROTO_TCP;
+    pheader.tcp_length = htons(pktbuf_chain_len(p));
+
+    if (FORCE_TCP_CHECKSUM || !(minip_tx_offloads & MINIP_TX_OFFLOAD_CSUM)) {
+        header->checksum = cksum_pheader(&pheader, p);
+    } else {
+        header->checksum = ~cksum_pheader(&pheader, NULL);
+        p->flags |= PKTBUF_FLAG_CKSUM_PARTIAL;
+        p->csum_start = (uint8_t *)header - p->buffer;
+        p->csum_offset = offsetof(tcp_header_t, checksum);
+
+        uint32_t payload_len = pktbuf_chain_len(p) - sizeof(tcp_header_t) - options_length;
+        if ((minip_tx_offloads & MINIP_TX_OFFLOAD_TSO4) && gso_size > 0 && payload_len > gso_size) {
+            p->flags |= PKTBUF_FLAG_TSO;
+            p->gso_size = gso_size;
+
+            /* charged against TCP_MAX_TSO_PARTS until the driver frees each part */
+            for (pktbuf_t *q = p; q; q = q->next) {
+                q->outstanding = &tcp_tso_parts;
+                atomic_add(&tcp_tso_parts, 1);
+            }
+        }
     }
 
     if (LOCAL_TRACE) {
@@ -764,7 +1602,82 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     return err;
 }
 
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size)
+/* fold a new rtt measurement into the estimate and recompute the rto, per RFC 6298 */
+static void tcp_rtt_sample(tcp_socket_t *s, uint32_t rtt)
+{
+    if (s->srtt == 0) {
+        s->srtt = rtt << 3;
+        s->rttvar = rtt << 1;
+    } else {
+        int32_t delta = (int32_t)rtt - (int32_t)(s->srtt >> 3);
+        if (delta < 0)
+            delta = -delta;
+        s->rttvar += delta - (s->rttvar >> 2);
+        s->srtt += rtt - (s->srtt >> 3);
+    }
+
+    /* a fresh sample also undoes any backoff */
+    s->rto = (s->srtt >> 3) + MAX(1U, s->rttvar);
+    s->rto = MIN(MAX(s->rto, (uint32_t)TCP_MIN_RTO), (uint32_t)TCP_MAX_RTO);
+
+    LTRACEF("s %p rtt %u srtt %u rttvar %u rto %u\n", s, rtt, s->srtt >> 3, s->rttvar >> 2, s->rto);
+}
+
+/* half the data in flight, but no less than two segments */
+static uint32_t tcp_loss_ssthresh(tcp_socket_t *s)
+{
+    uint32_t flight = s->tx_max_seq - s->tx_win_low;
+    return MAX(flight / 2, 2 * s->mss);
+}
+
+static void handle_dup_ack(tcp_socket_t *s)
+{
+    s->dup_acks++;
+
+    if (s->in_recovery) {
+        /* each dup ack means a segment has left the network, inflate to let a new one in */
+        s->cwnd = MIN(s->cwnd + s->mss, TCP_MAX_CWND);
+        tcp_write_pending_data(s, false);
+    } else if (s->dup_acks == TCP_DUP_ACK_THRESHOLD && SEQUENCE_GTE(s->tx_win_low, s->recover)) {
+        /* fast retransmit, and go into fast recovery */
+        LTRACEF("s %p fast retransmit at %u\n", s, s->tx_win_low);
+
+        s->ssthresh = tcp_loss_ssthresh(s);
+        s->cwnd = s->ssthresh + TCP_DUP_ACK_THRESHOLD * s->mss;
+        s->recover = s->tx_max_seq;
+        s->in_recovery = true;
+        s->fast_retransmits++;
+
+        tcp_retransmit(s);
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+    }
+}
+
+/* drop acked data from the front of the transmit buffer or pktbuf queue */
+static void tcp_tx_release(tcp_socket_t *s, uint32_t acked_len)
+{
+    if (list_is_empty(&s->tx_pktbuf_queue)) {
+        memmove(s->tx_buffer, s->tx_buffer + acked_len, s->tx_buffer_offset - acked_len);
+        return;
+    }
+
+    pktbuf_t *q;
+    while (acked_len > 0 && (q = list_peek_head_type(&s->tx_pktbuf_queue, pktbuf_t, list)) != NULL) {
+        if (q->dlen > acked_len) {
+            pktbuf_consume(q, acked_len);
+            break;
+        }
+
+        /* a retransmit may still hold a clone of it, in which case this only drops our hold */
+        acked_len -= q->dlen;
+        list_delete(&q->list);
+        s->tx_pktbuf_count--;
+        tcp_pktbufs_held(-1);
+        pktbuf_free(q, false);
+    }
+}
+
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, bool has_data, uint32_t tsecr)
 {
     LTRACEF("socket %p ack sequence %u, win_size %u\n", s, sequence, win_size);
 
@@ -773,42 +1686,160 @@ static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size)
 
     LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u offset %u\n",
             s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
-    if (SEQUENCE_LTE(sequence, s->tx_win_low)) {
+    if (SEQUENCE_LT(sequence, s->tx_win_low)) {
         /* they're acking stuff we've already received an ack for */
         return;
-    } else if (SEQUENCE_GT(sequence, s->tx_highest_seq)) {
+    } else if (SEQUENCE_GT(sequence, s->tx_max_seq)) {
         /* they're acking stuff we haven't sent */
         return;
-    } else {
-        /* their ack is somewhere in our window */
-        uint32_t acked_len;
+    }
+
+    /* any room at all makes a window probe plain data again */
+    if (win_size > 0)
+        s->probing = false;
+
+    if (sequence == s->tx_win_low) {
+        /* nothing new acked, see if it's a window update */
+        if (s->tx_win_high != s->tx_win_low + win_size) {
+            s->tx_win_high = s->tx_win_low + win_size;
+            tcp_write_pending_data(s, false);
+            return;
+        }
 
-        acked_len = (sequence - s->tx_win_low);
+        /* a bare ack of the same thing while we have data out there means they're missing something,
+         * unless it's only answering a probe of their shut window */
+        if (!has_data && s->tx_max_seq != s->tx_win_low && !s->probing)
+            handle_dup_ack(s);
+    } else {
+        /* their ack is somewhere in our window. Our FIN takes a sequence but no room in the buffer. */
+        uint32_t acked_len = (sequence - s->tx_win_low);
+        uint32_t acked_data = MIN(acked_len, s->tx_buffer_offset);
 
         LTRACEF("acked len %u\n", acked_len);
 
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_size);
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_offset);
+        DEBUG_ASSERT(acked_data <= s->tx_buffer_size);
+        DEBUG_ASSERT(acked_len == acked_data || (s->fin_queued && sequence == s->fin_seq + 1));
 
-        memmove(s->tx_buffer, s->tx_buffer + acked_len, s->tx_buffer_offset - acked_len);
+        if (s->ts_ok) {
+            /* the echoed timestamp says when whatever this acks was sent, retransmit or not.
+             * Take one sample a round trip. */
+            if (tsecr != 0 && SEQUENCE_GT(sequence, s->rtt_seq)) {
+                s->rtt_seq = s->tx_max_seq;
+                tcp_rtt_sample(s, current_time() - tsecr);
+            }
+        } else if (s->rtt_timing && SEQUENCE_GT(sequence, s->rtt_seq)) {
+            /* time it, unless it has been retransmitted since (Karn's algorithm) */
+            s->rtt_timing = false;
+            tcp_rtt_sample(s, current_time() - s->rtt_start);
+        }
 
-        s->tx_buffer_offset -= acked_len;
+        tcp_tx_release(s, acked_data);
+
+        s->tx_buffer_offset -= acked_data;
         s->tx_win_low += acked_len;
         s->tx_win_high = s->tx_win_low + win_size;
 
+        /* a retransmit timeout may have pulled the send point back behind what this acks */
+        if (SEQUENCE_GT(s->tx_win_low, s->tx_highest_seq))
+            s->tx_highest_seq = s->tx_win_low;
+
+        if (s->in_recovery) {
+            if (SEQUENCE_GTE(sequence, s->recover)) {
+                /* everything outstanding when we went into recovery is acked, deflate */
+                s->cwnd = s->ssthresh;
+                s->in_recovery = false;
+            } else {
+                /* partial ack, the next hole is right behind it */
+                s->cwnd -= MIN(s->cwnd, acked_len);
+                s->cwnd += s->mss;
+                tcp_retransmit(s);
+            }
+        } else if (s->cwnd < s->ssthresh) {
+            /* slow start */
+            s->cwnd += MIN(acked_len, s->mss);
+        } else {
+            /* congestion avoidance, about a segment per rtt */
+            s->cwnd += MAX(s->mss * s->mss / s->cwnd, 1U);
+        }
+        s->cwnd = MIN(s->cwnd, TCP_MAX_CWND);
+        s->dup_acks = 0;
+
         /* cancel or reset our retransmit timer */
-        if (s->tx_win_low == s->tx_highest_seq) {
+        if (s->tx_win_low == s->tx_max_seq) {
             tcp_timer_cancel(s, &s->retransmit_timer);
         } else {
-            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
         }
 
+        /* the window moved, send what it lets us */
+        tcp_write_pending_data(s, false);
+
         /* we have opened the transmit buffer */
         event_signal(&s->tx_event, true);
     }
 }
 
-static ssize_t tcp_write_pending_data(tcp_socket_t *s)
+/* grow the transmit buffer if it, rather than the congestion and receive windows, is what
+ * limits how much we can have out */
+static bool tcp_tx_grow(tcp_socket_t *s)
+{
+    uint32_t window = MIN(s->cwnd, s->tx_win_high - s->tx_win_low);
+    if (window < s->tx_buffer_size || s->tx_buffer_size >= s->tx_buffer_max)
+        return false;
+
+    uint32_t new_size = MIN(s->tx_buffer_size * 2, s->tx_buffer_max);
+    uint8_t *buf = realloc(s->tx_buffer, new_size);
+    if (!buf)
+        return false;
+
+    s->tx_buffer = buf;
+    s->tx_buffer_size = new_size;
+
+    LTRACEF("s %p tx buffer now %u\n", s, new_size);
+
+    return true;
+}
+
+/* how much of len bytes of buffered data, offset bytes past tx_win_low, can go out as one packet
+ * for the nic to segment without being made of more pktbufs than it takes, or than the pool can
+ * spare. A multiple of the mss. */
+static uint32_t tcp_tso_len(tcp_socket_t *s, uint32_t offset, uint32_t len)
+{
+    uint max_parts = MIN(minip_tso_max_parts, (uint)MAX(TCP_MAX_TSO_PARTS - tcp_tso_parts, 0));
+    if (max_parts < 2)
+        return 0;
+
+    len = MIN(len, TCP_TSO_MAX_SIZE);
+
+    if (list_is_empty(&s->tx_pktbuf_queue)) {
+        /* copied in behind the headers and on into more pktbufs */
+        len = MIN(len, (max_parts - 1) * PKTBUF_MAX_DATA);
+    } else {
+        /* a pktbuf for the headers, then a clone of each queued one the data is in */
+        uint32_t fits = 0;
+        uint parts = 1;
+        pktbuf_t *q;
+        list_for_every_entry(&s->tx_pktbuf_queue, q, pktbuf_t, list) {
+            if (fits == len || parts == max_parts)
+                break;
+            if (offset >= q->dlen) {
+                offset -= q->dlen;
+                continue;
+            }
+
+            fits += MIN(q->dlen - offset, len - fits);
+            offset = 0;
+            parts++;
+        }
+        len = fits;
+    }
+
+    return len - len % s->mss;
+}
+
+/* send as much of the unsent data as the congestion and receive windows allow. A probe sends a byte
+ * even if the window is shut, so we hear about it opening up again */
+static ssize_t tcp_write_pending_data(tcp_socket_t *s, bool probe)
 {
     LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u offset %u\n",
             s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
@@ -818,26 +1849,77 @@ static ssize_t tcp_write_pending_data(tcp_socket_t *s)
     DEBUG_ASSERT(s->tx_buffer_size > 0);
     DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
 
-    /* do we have any new data to send? */
-    uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
+    /* do we have any new data to send? A FIN already out is past the end of the buffer. */
+    uint32_t in_flight = (s->tx_max_seq - s->tx_win_low);
+    uint32_t outstanding = MIN(s->tx_highest_seq - s->tx_win_low, s->tx_buffer_offset);
     uint32_t pending = s->tx_buffer_offset - outstanding;
     LTRACEF("outstanding %u, pending %u\n", outstanding, pending);
 
+    /* how far past tx_win_low we're allowed to go */
+    uint32_t window = MIN(s->cwnd, s->tx_win_high - s->tx_win_low);
+    uint32_t allowed = (window > outstanding) ? window - outstanding : 0;
+    if (probe && allowed == 0 && pending > 0) {
+        allowed = 1;
+        s->probing = true;
+    }
+    pending = MIN(pending, allowed);
+
     /* send packets that cover the pending area of the window */
     uint32_t offset = 0;
     while (offset < pending) {
         uint32_t tosend = MIN(s->mss, pending - offset);
 
-        tcp_socket_send(s, s->tx_buffer + outstanding + offset, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_highest_seq);
-        s->tx_highest_seq += tosend;
+        /* a nic doing TSO takes several segments' worth at once */
+        if ((minip_tx_offloads & MINIP_TX_OFFLOAD_TSO4) && pending - offset > s->mss)
+            tosend = MAX(tcp_tso_len(s, outstanding + offset, pending - offset), s->mss);
+
+        /* don't dribble out small segments just because the window only opened a little */
+        if (tosend < s->mss && !probe && s->tx_highest_seq != s->tx_win_low &&
+                outstanding + offset + tosend < s->tx_buffer_offset)
+            break;
+
+        /* time one segment per rtt, never one that went out before. Timestamps time themselves. */
+        if (!s->ts_ok && !s->rtt_timing && SEQUENCE_GTE(s->tx_highest_seq, s->tx_max_seq)) {
+            s->rtt_timing = true;
+            s->rtt_seq = s->tx_highest_seq;
+            s->rtt_start = current_time();
+        }
+
+        /* the FIN rides along with the last of the data, unless the nic is splitting it up */
+        tcp_flags_t flags = PKT_ACK|PKT_PSH;
+        uint32_t seq_len = tosend;
+        if (s->fin_queued && s->tx_highest_seq + tosend == s->fin_seq && tosend <= s->mss) {
+            flags |= PKT_FIN;
+            seq_len++;
+        }
+
+        status_t err = tcp_socket_send_data(s, outstanding + offset, tosend, flags, s->tx_highest_seq);
+        if (tosend > s->mss && err == ERR_NO_MEMORY) {
+            /* the pool couldn't spare the parts right now, send a plain segment instead */
+            tosend = seq_len = s->mss;
+            tcp_socket_send_data(s, outstanding + offset, tosend, flags, s->tx_highest_seq);
+        }
+        s->tx_highest_seq += seq_len;
+        if (SEQUENCE_GT(s->tx_highest_seq, s->tx_max_seq))
+            s->tx_max_seq = s->tx_highest_seq;
         offset += tosend;
     }
 
-    /* reset the retransmit timer if we sent anything */
-    if (offset > 0) {
-        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    /* once all the data is out the FIN can follow it */
+    if (s->fin_queued && s->tx_highest_seq == s->fin_seq) {
+        tcp_socket_send(s, NULL, 0, NULL, PKT_ACK|PKT_FIN, NULL, 0, s->tx_highest_seq);
+
+        /* FIN consumed a sequence */
+        s->tx_highest_seq++;
+        if (SEQUENCE_GT(s->tx_highest_seq, s->tx_max_seq))
+            s->tx_max_seq = s->tx_highest_seq;
     }
 
+    /* start the retransmit timer if it isn't already running for earlier data. If we couldn't send
+     * anything it times the window probe. */
+    if (in_flight == 0 && (s->tx_buffer_offset > 0 || s->tx_max_seq != s->tx_win_low))
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+
     return offset;
 }
 
@@ -846,18 +1928,33 @@ static ssize_t tcp_retransmit(tcp_socket_t *s)
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
 
-    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT)
+    if (!tcp_state_sends(s->state))
         return 0;
 
     /* how much data have we sent but not gotten an ack for? */
-    uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
+    uint32_t outstanding = (s->tx_max_seq - s->tx_win_low);
     if (outstanding == 0)
         return 0;
 
-    uint32_t tosend = MIN(s->mss, outstanding);
+    uint32_t tosend = MIN(s->mss, MIN(outstanding, s->tx_buffer_offset));
+
+    /* our FIN goes again with the last of the data, or alone if that's all that's left */
+    tcp_flags_t flags = PKT_ACK|PKT_PSH;
+    uint32_t seq_len = tosend;
+    if (s->fin_queued && s->tx_win_low + tosend == s->fin_seq && SEQUENCE_GT(s->tx_max_seq, s->fin_seq)) {
+        flags |= PKT_FIN;
+        seq_len++;
+    }
+
+    /* whatever is being timed is ambiguous now */
+    s->rtt_timing = false;
+    s->retransmits++;
 
     LTRACEF("s %p, tosend %u seq %u\n", s, tosend, s->tx_win_low);
-    tcp_socket_send(s, s->tx_buffer, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_win_low);
+    tcp_socket_send_data(s, 0, tosend, flags, s->tx_win_low);
+
+    if (SEQUENCE_LT(s->tx_highest_seq, s->tx_win_low + seq_len))
+        s->tx_highest_seq = s->tx_win_low + seq_len;
 
     return tosend;
 }
@@ -872,16 +1969,61 @@ static void handle_retransmit_timeout(void *_s)
 
     mutex_acquire(&s->lock);
 
-    if (tcp_retransmit(s) == 0)
+    if (!tcp_state_sends(s->state))
         goto done;
 
-    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    /* back off */
+    s->rto = MIN(s->rto * 2, (uint32_t)TCP_MAX_RTO);
+
+    if (s->tx_max_seq == s->tx_win_low) {
+        /* nothing in flight, so the window must be shut with data waiting, poke at it */
+        if (s->tx_buffer_offset > 0)
+            tcp_write_pending_data(s, true);
+        goto done;
+    }
+
+    LTRACEF("s %p timeout, rto now %u\n", s, s->rto);
+
+    if (s->probing) {
+        /* the probe of their shut window went unanswered, which says nothing about congestion.
+         * Keep at it at the backed off rto (RFC 1122 4.2.2.17). */
+        s->tx_highest_seq = s->tx_win_low;
+        tcp_write_pending_data(s, true);
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+        goto done;
+    }
+
+    /* assume everything out there is lost, start over from the bottom of the window in slow start */
+    s->ssthresh = tcp_loss_ssthresh(s);
+    s->cwnd = s->mss;
+    s->dup_acks = 0;
+    s->in_recovery = false;
+    s->recover = s->tx_max_seq;
+    s->timeouts++;
+
+    s->tx_highest_seq = s->tx_win_low;
+    tcp_retransmit(s);
+
+    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
 
 done:
     mutex_release(&s->lock);
     dec_socket_ref(s);
 }
 
+/* queue our FIN behind whatever is still buffered. The data keeps going out as the windows allow,
+ * and the FIN right after it. */
+static void tcp_queue_fin(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(s);
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    s->fin_queued = true;
+    s->fin_seq = s->tx_win_low + s->tx_buffer_offset;
+
+    tcp_write_pending_data(s, false);
+}
+
 static void handle_delayed_ack_timeout(void *_s)
 {
     tcp_socket_t *s = _s;
@@ -942,45 +2084,102 @@ static void tcp_remote_close(tcp_socket_t *s)
     tcp_timer_cancel(s, &s->retransmit_timer);
     tcp_timer_cancel(s, &s->ack_delay_timer);
 
+    /* nothing will ever fill the hole now */
+    tcp_rx_purge_ooo(s);
+
     tcp_wakeup_waiters(s);
 }
 
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
+static tcp_socket_t *create_tcp_socket(void)
 {
     tcp_socket_t *s;
 
-    s = calloc(1, sizeof(tcp_socket_t));
+    s = slab_alloc(tcp_socket_cache);
     if (!s)
         return NULL;
 
+    /* a lockless lookup may still be looking at the previous occupant of this slot, so
+     * leave its hash link intact. It is free, so its ref is already zero. */
+    memset(&s->node, 0, sizeof(*s) - offsetof(tcp_socket_t, node));
+    DEBUG_ASSERT(s->ref == 0);
+    DEBUG_ASSERT(s->hash_table == TCP_HASH_NONE);
+
     mutex_init(&s->lock);
     s->ref = 1; // start with the ref already bumped
 
     s->state = STATE_CLOSED;
-    s->rx_win_size = DEFAULT_RX_WINDOW_SIZE;
+    s->rx_buffer_max = DEFAULT_RX_BUFFER_MAX;
     event_init(&s->rx_event, false, 0);
+    list_initialize(&s->rx_pktbuf_queue);
+    list_initialize(&s->rx_ooo_queue);
 
     s->mss = DEFAULT_MSS;
 
     s->tx_win_low = rand();
     s->tx_win_high = s->tx_win_low;
     s->tx_highest_seq = s->tx_win_low;
+    s->tx_max_seq = s->tx_win_low;
+    s->recover = s->tx_win_low;
+    s->rtt_seq = s->tx_win_low;
+    s->tx_buffer_max = DEFAULT_TX_BUFFER_MAX;
+    list_initialize(&s->tx_pktbuf_queue);
     event_init(&s->tx_event, true, 0);
 
-    if (alloc_buffers) {
-        // XXX check for error
-        s->rx_buffer_raw = malloc(s->rx_win_size);
-        cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
-
-        s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
-        s->tx_buffer = malloc(s->tx_buffer_size);
-    }
+    s->rto = TCP_INITIAL_RTO;
+    s->cwnd = s->mss;
+    s->ssthresh = UINT32_MAX;
 
     sem_init(&s->accept_sem, 0);
 
     return s;
 }
 
+/* buffers start out small and grow as the connection shows it needs them */
+static status_t tcp_alloc_buffers(tcp_socket_t *s)
+{
+    s->rx_win_size = MIN(DEFAULT_RX_WINDOW_SIZE, s->rx_buffer_max);
+    s->rx_buffer_raw = malloc(s->rx_win_size);
+    if (!s->rx_buffer_raw)
+        return ERR_NO_MEMORY;
+
+    /* one receive path and one reader, both under the socket lock */
+    cbuf_initialize_spsc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
+
+    s->tx_buffer_size = MIN(DEFAULT_TX_BUFFER_SIZE, s->tx_buffer_max);
+    s->tx_buffer = malloc(s->tx_buffer_size);
+    if (!s->tx_buffer)
+        return ERR_NO_MEMORY;
+
+    return NO_ERROR;
+}
+
+/* zero the fields lockless lookups depend on once, when the socket's slab is created. Having
+ * a constructor also keeps the slab's free list link outside the socket. */
+static void tcp_socket_ctor(void *object)
+{
+    tcp_socket_t *s = object;
+
+    s->hash_next = NULL;
+    s->ref = 0;
+    s->hash_table = TCP_HASH_NONE;
+}
+
+static void tcp_init(uint level)
+{
+    tcp_socket_cache = slab_cache_create_etc("tcp_socket", sizeof(tcp_socket_t), __alignof(tcp_socket_t),
+                                             &tcp_socket_ctor, SLAB_TYPESAFE);
+    ASSERT(tcp_socket_cache);
+
+    for (uint i = 0; i < TCP_CONN_HASH_SIZE; i++)
+        tcp_conn_hash[i] = HASH_NULLS(i);
+    for (uint i = 0; i < TCP_LISTEN_HASH_SIZE; i++)
+        tcp_listen_hash[i] = HASH_NULLS(TCP_CONN_HASH_SIZE + i);
+
+    tcp_hash_seed = rand();
+}
+
+LK_INIT_HOOK(tcp, &tcp_init, LK_INIT_LEVEL_THREADING);
+
 /* user api */
 
 status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port)
@@ -990,7 +2189,7 @@ status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port)
     if (!handle)
         return ERR_INVALID_ARGS;
 
-    s = create_tcp_socket(false);
+    s = create_tcp_socket();
     if (!s)
         return ERR_NO_MEMORY;
 
@@ -1056,7 +2255,7 @@ retry:
     mutex_acquire(&s->lock);
 
     /* try to read some data from the receive buffer, even if we're closed */
-    ret = cbuf_read(&s->rx_buffer, buf, len, false);
+    ret = tcp_rx_read(s, buf, len);
     if (ret == 0) {
         /* check to see if we've closed */
         if (s->state != STATE_ESTABLISHED) {
@@ -1070,24 +2269,73 @@ retry:
         goto retry;
     }
 
-    /* if we've used up the last byte in the read buffer, unsignal the read event */
-    size_t remaining_bytes = cbuf_space_used(&s->rx_buffer);
-    if (s->state == STATE_ESTABLISHED && remaining_bytes == 0) {
+    tcp_rx_consumed(s);
+
+out:
+    mutex_release(&s->lock);
+    dec_socket_ref(s);
+
+    return ret;
+}
+
+status_t tcp_recv_pktbuf(tcp_socket_t *socket, pktbuf_t **pkt)
+{
+    LTRACEF("socket %p\n", socket);
+    if (!socket || !pkt)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    pktbuf_t *spare = NULL;
+    status_t err = NO_ERROR;
+retry:
+    /* block on available data */
+    event_wait(&s->rx_event);
+
+    mutex_acquire(&s->lock);
+
+    /* hand over the oldest pktbuf we kept, or copy out of the receive buffer into one */
+    pktbuf_t *p = list_remove_head_type(&s->rx_pktbuf_queue, pktbuf_t, list);
+    if (p) {
+        s->rx_pktbuf_count--;
+        tcp_pktbufs_held(-1);
+        s->rx_pktbuf_bytes -= p->dlen;
+    } else if (cbuf_space_used(&s->rx_buffer) > 0) {
+        if (!spare) {
+            /* don't wait for a pktbuf with the lock held */
+            mutex_release(&s->lock);
+            spare = pktbuf_alloc();
+            goto retry;
+        }
+
+        p = spare;
+        spare = NULL;
+        p->dlen = cbuf_read(&s->rx_buffer, p->data, pktbuf_avail_tail(p), false);
+    } else {
+        /* check to see if we've closed */
+        if (s->state != STATE_ESTABLISHED) {
+            err = ERR_CHANNEL_CLOSED;
+            goto out;
+        }
+
+        /* we must have raced with another thread */
         event_unsignal(&s->rx_event);
+        mutex_release(&s->lock);
+        goto retry;
     }
 
-    /* we've read something, make sure the other end knows that our window is opening */
-    uint32_t new_rx_win_size = s->rx_win_size - remaining_bytes;
-
-    /* if we've opened it enough, send an ack */
-    if (new_rx_win_size >= s->mss && s->rx_win_high - s->rx_win_low < s->mss)
-        send_ack(s);
+    *pkt = p;
+    tcp_rx_consumed(s);
 
 out:
     mutex_release(&s->lock);
     dec_socket_ref(s);
 
-    return ret;
+    if (spare)
+        pktbuf_free(spare, true);
+
+    return err;
 }
 
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
@@ -1120,6 +2368,24 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
             return ERR_CHANNEL_CLOSED;
         }
 
+        /* data handed over by tcp_send_pktbuf is still queued, so this has to go in line behind it */
+        if (!list_is_empty(&s->tx_pktbuf_queue)) {
+            mutex_release(&s->lock);
+
+            pktbuf_t *p = pktbuf_alloc();
+            size_t to_copy = MIN(pktbuf_avail_tail(p), len - off);
+            pktbuf_append_data(p, (uint8_t *)buf + off, to_copy);
+
+            status_t err = tcp_send_pktbuf(s, p);
+            if (err < 0) {
+                dec_socket_ref(s);
+                return err;
+            }
+
+            off += to_copy;
+            continue;
+        }
+
         DEBUG_ASSERT(s->tx_buffer_size > 0);
         DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
 
@@ -1133,14 +2399,14 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
         memcpy(s->tx_buffer + s->tx_buffer_offset, (uint8_t *)buf + off, to_copy);
         s->tx_buffer_offset += to_copy;
 
-        /* if this has completely filled it, unsignal the event */
+        /* if this has completely filled it, and it can't grow, unsignal the event */
         DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
-        if (s->tx_buffer_offset == s->tx_buffer_size) {
+        if (s->tx_buffer_offset == s->tx_buffer_size && !tcp_tx_grow(s)) {
             event_unsignal(&s->tx_event);
         }
 
         /* send as much data as we can */
-        tcp_write_pending_data(s);
+        tcp_write_pending_data(s, false);
 
         off += to_copy;
 
@@ -1151,6 +2417,159 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
     return len;
 }
 
+status_t tcp_send_pktbuf(tcp_socket_t *socket, pktbuf_t *p)
+{
+    LTRACEF("socket %p, p %p\n", socket, p);
+    if (!p)
+        return ERR_INVALID_ARGS;
+    if (!socket || p->next) {
+        pktbuf_free(p, true);
+        return ERR_INVALID_ARGS;
+    }
+
+    tcp_socket_t *s = socket;
+    inc_socket_ref(s);
+
+    status_t err = NO_ERROR;
+    while (p->dlen > 0) {
+        /* wait for the tx buffer to open up */
+        event_wait(&s->tx_event);
+
+        mutex_acquire(&s->lock);
+
+        /* check to see if we've closed */
+        if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT) {
+            mutex_release(&s->lock);
+            err = ERR_CHANNEL_CLOSED;
+            break;
+        }
+
+        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
+        size_t space = s->tx_buffer_size - s->tx_buffer_offset;
+        bool out_of_pktbufs = false;
+
+        if (list_is_empty(&s->tx_pktbuf_queue) && (s->tx_buffer_offset > 0 || !tcp_pktbuf_budget_ok())) {
+            /* earlier writes are still in the transmit buffer, so it goes in there after them. Or tcp
+             * already holds its share of the pool, and nothing of ours is out to be acked and free some. */
+            size_t to_copy = MIN(space, p->dlen);
+            memcpy(s->tx_buffer + s->tx_buffer_offset, pktbuf_consume(p, to_copy), to_copy);
+            s->tx_buffer_offset += to_copy;
+        } else if (p->dlen <= space) {
+            /* a small one gets copied onto the end of the last one, saving a pktbuf */
+            pktbuf_t *tail = list_peek_tail_type(&s->tx_pktbuf_queue, pktbuf_t, list);
+            if (tail && p->dlen <= pktbuf_avail_tail(tail)) {
+                pktbuf_append_data(tail, p->data, p->dlen);
+                s->tx_buffer_offset += p->dlen;
+                pktbuf_consume(p, p->dlen);
+            } else if (s->tx_pktbuf_count < TCP_MAX_TX_PKTBUFS && tcp_pktbuf_budget_ok()) {
+                list_add_tail(&s->tx_pktbuf_queue, &p->list);
+                s->tx_pktbuf_count++;
+                tcp_pktbufs_held(1);
+                s->tx_buffer_offset += p->dlen;
+                p = NULL;
+            } else {
+                out_of_pktbufs = true;
+            }
+        }
+
+        /* if it didn't all fit, and there's no room to be made, wait for an ack */
+        if (p && p->dlen > 0 && (out_of_pktbufs || !tcp_tx_grow(s))) {
+            event_unsignal(&s->tx_event);
+        }
+
+        /* send as much data as we can */
+        tcp_write_pending_data(s, false);
+
+        mutex_release(&s->lock);
+
+        if (!p)
+            break;
+    }
+
+    dec_socket_ref(s);
+
+    if (p)
+        pktbuf_free(p, true);
+
+    return err;
+}
+
+status_t tcp_set_buffer_sizes(tcp_socket_t *socket, size_t rx_size, size_t tx_size)
+{
+    if (!socket)
+        return ERR_INVALID_ARGS;
+    if (rx_size != 0 && (rx_size < TCP_MIN_BUFFER_SIZE || rx_size > TCP_MAX_BUFFER_SIZE))
+        return ERR_INVALID_ARGS;
+    if (tx_size != 0 && (tx_size < TCP_MIN_BUFFER_SIZE || tx_size > TCP_MAX_BUFFER_SIZE))
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+
+    mutex_acquire(&s->lock);
+
+    /* the receive buffer is a cbuf, which wants a power of two */
+    if (rx_size != 0)
+        s->rx_buffer_max = round_up_pow2_u32(rx_size);
+    if (tx_size != 0)
+        s->tx_buffer_max = tx_size;
+
+    mutex_release(&s->lock);
+
+    return NO_ERROR;
+}
+
+static void tcp_fill_stats(tcp_socket_t *s, tcp_socket_stats_t *stats)
+{
+    stats->state = tcp_state_to_string(s->state);
+    stats->local_ip = s->local_ip;
+    stats->remote_ip = s->remote_ip;
+    stats->local_port = s->local_port;
+    stats->remote_port = s->remote_port;
+
+    stats->cwnd = s->cwnd;
+    stats->ssthresh = s->ssthresh;
+    stats->in_flight = s->tx_max_seq - s->tx_win_low;
+    stats->srtt = s->srtt >> 3;
+    stats->rttvar = s->rttvar >> 2;
+    stats->rto = s->rto;
+    stats->retransmits = s->retransmits;
+    stats->fast_retransmits = s->fast_retransmits;
+    stats->timeouts = s->timeouts;
+
+    stats->rx_buffer_size = s->rx_win_size;
+    stats->tx_buffer_size = s->tx_buffer_size;
+    stats->snd_wscale = s->snd_wscale;
+    stats->rcv_wscale = s->rcv_wscale;
+}
+
+status_t tcp_get_stats(tcp_socket_t *socket, tcp_socket_stats_t *stats)
+{
+    if (!socket || !stats)
+        return ERR_INVALID_ARGS;
+
+    tcp_socket_t *s = socket;
+
+    mutex_acquire(&s->lock);
+    tcp_fill_stats(s, stats);
+    mutex_release(&s->lock);
+
+    return NO_ERROR;
+}
+
+void tcp_for_every_socket_stats(void (*cb)(const tcp_socket_stats_t *stats, void *arg), void *arg)
+{
+    tcp_socket_stats_t stats;
+
+    /* the receive path takes the list lock with a socket lock held, so don't take them the other way */
+    mutex_acquire(&tcp_socket_list_lock);
+    tcp_socket_t *s = NULL;
+    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
+        tcp_fill_stats(s, &stats);
+        cb(&stats, arg);
+    }
+    mutex_release(&tcp_socket_list_lock);
+}
+
 status_t tcp_close(tcp_socket_t *socket)
 {
     if (!socket)
@@ -1182,17 +2601,13 @@ status_t tcp_close(tcp_socket_t *socket)
         case STATE_SYN_RCVD:
         case STATE_ESTABLISHED:
             s->state = STATE_FIN_WAIT_1;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
-            s->tx_win_low++;
+            tcp_queue_fin(s);
 
             /* stick around and wait for them to FIN us */
             break;
         case STATE_CLOSE_WAIT:
             s->state = STATE_LAST_ACK;
-            tcp_socket_send(s, NULL, 0, PKT_ACK|PKT_FIN, NULL, 0, s->tx_win_low);
-            s->tx_win_low++;
-
-            // XXX set up fin retransmit timer here
+            tcp_queue_fin(s);
             break;
         case STATE_FIN_WAIT_1:
         case STATE_FIN_WAIT_2:
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * An object cache allocator for fixed size kernel objects.
+ *
+ * Each cache carves naturally aligned runs of pages from the page allocator into
+ * slabs of equally sized objects. Freed objects go onto a small per-cpu free list,
+ * and move between it and the slabs in batches, so the common case touches only
+ * cpu local state and never fragments the general purpose heap.
+ *
+ * Typical usage:
+ *
+ * static slab_cache_t *foo_cache;
+ *
+ * foo_cache = slab_cache_create("foo", sizeof(foo_t), __alignof(foo_t), NULL);
+ *
+ * foo_t *foo = slab_alloc(foo_cache);
+ * ...
+ * slab_free(foo_cache, foo);
+ */
+
+__BEGIN_CDECLS
+
+typedef struct slab_cache slab_cache_t;
+
+/**
+ * Optional constructor, run once on every object when its slab is created.
+ * Objects must be freed back in their constructed state.
+ */
+typedef void (*slab_ctor_t)(void *object);
+
+/**
+ * Flags for slab_cache_create_etc.
+ *
+ * SLAB_TYPESAFE: the cache never gives its pages back, so a freed object's memory
+ * stays an object of this type. Lets lockless readers look at an object that may be
+ * freed under them, as long as they check its identity again once they hold it.
+ */
+#define SLAB_TYPESAFE (1 << 0)
+
+/**
+ * Create a cache of objects of the given size and alignment.
+ * Returns NULL if out of memory or if an object does not fit in the largest slab.
+ */
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align, slab_ctor_t ctor);
+slab_cache_t *slab_cache_create_etc(const char *name, size_t size, size_t align, slab_ctor_t ctor, uint32_t flags);
+
+/**
+ * Destroy a cache and return all of its pages. Every object must have been freed.
+ * The pages of a SLAB_TYPESAFE cache are leaked instead.
+ */
+void slab_cache_destroy(slab_cache_t *cache);
+
+/**
+ * Return the pages of any completely free slabs to the page allocator.
+ * Returns the number of pages released, always 0 for a SLAB_TYPESAFE cache.
+ */
+size_t slab_cache_shrink(slab_cache_t *cache);
+
+/**
+ * Allocate an object. May block in the page allocator if the cache needs to grow,
+ * so it must be called from thread context. Returns NULL if out of memory.
+ */
+void *slab_alloc(slab_cache_t *cache);
+
+/**
+ * Free an object previously allocated from the same cache. Does not block.
+ */
+void slab_free(slab_cache_t *cache, void *object);
+
+__END_CDECLS
@@ -0,0 +1,498 @@
+/*
+ * Copyright (c) 2016 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/slab.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <list.h>
+#include <malloc.h>
+#include <pow2.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <lib/page_alloc.h>
+
+#define LOCAL_TRACE 0
+
+/* slabs grow in powers of two pages until they hold at least this many objects */
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_MAX_PAGES 16
+
+/* free objects kept on each cpu, and how many move to or from the slabs at once */
+#define SLAB_CPU_DEPTH 16
+#define SLAB_CPU_BATCH 8
+
+/* header at the start of every slab, which is aligned to its own size */
+struct slab {
+    struct list_node node;
+    void *free;
+    uint in_use;
+};
+
+struct slab_cpu {
+    spin_lock_t lock;
+    void *free;
+    uint count;
+} __CPU_ALIGN;
+
+struct slab_cache {
+    struct list_node node;
+    char name[32];
+
+    size_t size;
+    size_t stride;          /* distance between objects in a slab */
+    size_t link_offset;     /* where a free object keeps its free list link */
+    size_t first_offset;    /* offset of the first object past the slab header */
+    uint slab_pages;
+    uint objs_per_slab;
+    slab_ctor_t ctor;
+    uint32_t flags;
+
+    /* protects the slab lists and counts */
+    spin_lock_t lock;
+    struct list_node partial;
+    struct list_node full;
+    struct list_node empty;
+    uint slab_count;
+    uint slab_free_count;   /* free objects sitting in slabs */
+
+    struct slab_cpu cpu[SMP_MAX_CPUS];
+};
+
+static struct list_node cache_list = LIST_INITIAL_VALUE(cache_list);
+static mutex_t cache_list_lock = MUTEX_INITIAL_VALUE(cache_list_lock);
+
+static inline void **obj_link(slab_cache_t *cache, void *obj)
+{
+    return (void **)((uint8_t *)obj + cache->link_offset);
+}
+
+static inline struct slab *obj_to_slab(slab_cache_t *cache, void *obj)
+{
+    return (struct slab *)ROUNDDOWN((uintptr_t)obj, (uintptr_t)cache->slab_pages * PAGE_SIZE);
+}
+
+/* allocate a naturally aligned run of pages, so objects can find their slab header */
+static void *slab_alloc_pages(uint pages)
+{
+    if (pages == 1)
+        return page_alloc(1, PAGE_ALLOC_ANY_ARENA);
+
+    /* over allocate and give back the misaligned ends */
+    uint8_t *ptr = page_alloc(pages * 2 - 1, PAGE_ALLOC_ANY_ARENA);
+    if (!ptr)
+        return NULL;
+
+    uint8_t *aligned = (uint8_t *)ROUNDUP((uintptr_t)ptr, (uintptr_t)pages * PAGE_SIZE);
+    uint head = (aligned - ptr) / PAGE_SIZE;
+    uint tail = pages - 1 - head;
+
+    if (head > 0)
+        page_free(ptr, head);
+    if (tail > 0)
+        page_free(aligned + pages * PAGE_SIZE, tail);
+
+    return aligned;
+}
+
+static struct slab *slab_create(slab_cache_t *cache)
+{
+    struct slab *slab = slab_alloc_pages(cache->slab_pages);
+    if (!slab)
+        return NULL;
+
+    LTRACEF("cache %s, slab %p\n", cache->name, slab);
+
+    slab->free = NULL;
+    slab->in_use = 0;
+
+    /* thread the free list in address order */
+    for (uint i = cache->objs_per_slab; i > 0; i--) {
+        void *obj = (uint8_t *)slab + cache->first_offset + (i - 1) * cache->stride;
+        if (cache->ctor)
+            cache->ctor(obj);
+        *obj_link(cache, obj) = slab->free;
+        slab->free = obj;
+    }
+
+    return slab;
+}
+
+/* pull a free object out of the fullest non full slab */
+static void *slab_take_locked(slab_cache_t *cache)
+{
+    struct slab *slab = list_peek_head_type(&cache->partial, struct slab, node);
+    if (!slab)
+        slab = list_peek_head_type(&cache->empty, struct slab, node);
+    if (!slab)
+        return NULL;
+
+    void *obj = slab->free;
+    slab->free = *obj_link(cache, obj);
+    slab->in_use++;
+    cache->slab_free_count--;
+
+    list_delete(&slab->node);
+    if (slab->in_use == cache->objs_per_slab)
+        list_add_head(&cache->full, &slab->node);
+    else
+        list_add_head(&cache->partial, &slab->node);
+
+    return obj;
+}
+
+static void slab_release_locked(slab_cache_t *cache, void *obj)
+{
+    struct slab *slab = obj_to_slab(cache, obj);
+
+    DEBUG_ASSERT(slab->in_use > 0);
+    DEBUG_ASSERT(((uintptr_t)obj - (uintptr_t)slab - cache->first_offset) % cache->stride == 0);
+
+    *obj_link(cache, obj) = slab->free;
+    slab->free = obj;
+    slab->in_use--;
+    cache->slab_free_count++;
+
+    list_delete(&slab->node);
+    if (slab->in_use == 0)
+        list_add_head(&cache->empty, &slab->node);
+    else
+        list_add_head(&cache->partial, &slab->node);
+}
+
+/* hand a chain of objects linked through their free list links back to their slabs */
+static void slab_release_chain(slab_cache_t *cache, void *obj)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cache->lock, state);
+    while (obj) {
+        void *next = *obj_link(cache, obj);
+        slab_release_locked(cache, obj);
+        obj = next;
+    }
+    spin_unlock_irqrestore(&cache->lock, state);
+}
+
+/* empty every cpu's free list back into the slabs */
+static void slab_cache_drain_cpus(slab_cache_t *cache)
+{
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct slab_cpu *cpu = &cache->cpu[i];
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&cpu->lock, state);
+        void *chain = cpu->free;
+        cpu->free = NULL;
+        cpu->count = 0;
+        spin_unlock_irqrestore(&cpu->lock, state);
+
+        slab_release_chain(cache, chain);
+    }
+}
+
+slab_cache_t *slab_cache_create(const char *name, size_t size, size_t align, slab_ctor_t ctor)
+{
+    return slab_cache_create_etc(name, size, align, ctor, 0);
+}
+
+slab_cache_t *slab_cache_create_etc(const char *name, size_t size, size_t align, slab_ctor_t ctor, uint32_t flags)
+{
+    LTRACEF("name %s, size %zu, align %zu, ctor %p, flags 0x%x\n", name, size, align, ctor, flags);
+
+    DEBUG_ASSERT(name);
+    DEBUG_ASSERT(size > 0);
+    DEBUG_ASSERT(align == 0 || ispow2(align));
+    DEBUG_ASSERT(align <= PAGE_SIZE);
+
+    align = MAX(align, sizeof(void *));
+
+    /* the per-cpu state is cache line aligned */
+    slab_cache_t *cache = memalign(CACHE_LINE, sizeof(slab_cache_t));
+    if (!cache)
+        return NULL;
+    memset(cache, 0, sizeof(*cache));
+
+    strlcpy(cache->name, name, sizeof(cache->name));
+    cache->size = size;
+    cache->ctor = ctor;
+    cache->flags = flags;
+
+    /* objects with a constructor keep their free list link past the end of the object,
+     * so their constructed state survives a trip through the free list */
+    if (ctor) {
+        cache->link_offset = ROUNDUP(size, sizeof(void *));
+        cache->stride = ROUNDUP(cache->link_offset + sizeof(void *), align);
+    } else {
+        cache->link_offset = 0;
+        cache->stride = ROUNDUP(MAX(size, sizeof(void *)), align);
+    }
+    cache->first_offset = ROUNDUP(sizeof(struct slab), align);
+
+    uint pages;
+    for (pages = 1; pages < SLAB_MAX_PAGES; pages *= 2) {
+        if ((pages * PAGE_SIZE - cache->first_offset) / cache->stride >= SLAB_MIN_OBJECTS)
+            break;
+    }
+    cache->slab_pages = pages;
+    cache->objs_per_slab = (pages * PAGE_SIZE - cache->first_offset) / cache->stride;
+    if (cache->objs_per_slab == 0) {
+        free(cache);
+        return NULL;
+    }
+
+    spin_lock_init(&cache->lock);
+    list_initialize(&cache->partial);
+    list_initialize(&cache->full);
+    list_initialize(&cache->empty);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        spin_lock_init(&cache->cpu[i].lock);
+
+    mutex_acquire(&cache_list_lock);
+    list_add_tail(&cache_list, &cache->node);
+    mutex_release(&cache_list_lock);
+
+    return cache;
+}
+
+size_t slab_cache_shrink(slab_cache_t *cache)
+{
+    struct list_node list = LIST_INITIAL_VALUE(list);
+
+    /* lockless readers may still be looking at freed objects */
+    if (cache->flags & SLAB_TYPESAFE)
+        return 0;
+
+    slab_cache_drain_cpus(cache);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cache->lock, state);
+    struct slab *slab;
+    while ((slab = list_remove_head_type(&cache->empty, struct slab, node))) {
+        cache->slab_count--;
+        cache->slab_free_count -= cache->objs_per_slab;
+        list_add_tail(&list, &slab->node);
+    }
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    size_t pages = 0;
+    while ((slab = list_remove_head_type(&list, struct slab, node))) {
+        page_free(slab, cache->slab_pages);
+        pages += cache->slab_pages;
+    }
+
+    return pages;
+}
+
+void slab_cache_destroy(slab_cache_t *cache)
+{
+    if (!cache)
+        return;
+
+    mutex_acquire(&cache_list_lock);
+    list_delete(&cache->node);
+    mutex_release(&cache_list_lock);
+
+    slab_cache_shrink(cache);
+
+    if (cache->slab_count > 0 && !(cache->flags & SLAB_TYPESAFE)) {
+        /* leak the slabs rather than hand out pages that are still in use */
+        printf("slab: destroying cache %s with %u slabs still in use\n", cache->name, cache->slab_count);
+    }
+
+    free(cache);
+}
+
+static void *slab_alloc_slow(slab_cache_t *cache)
+{
+    spin_lock_saved_state_t state;
+
+    for (;;) {
+        void *chain = NULL;
+        void *chain_tail = NULL;
+        uint count = 0;
+
+        /* take one object for the caller and a batch for this cpu */
+        spin_lock_irqsave(&cache->lock, state);
+        void *obj = slab_take_locked(cache);
+        while (obj && count < SLAB_CPU_BATCH) {
+            void *extra = slab_take_locked(cache);
+            if (!extra)
+                break;
+            *obj_link(cache, extra) = chain;
+            chain = extra;
+            if (!chain_tail)
+                chain_tail = extra;
+            count++;
+        }
+        spin_unlock_irqrestore(&cache->lock, state);
+
+        if (obj) {
+            if (chain) {
+                struct slab_cpu *cpu = &cache->cpu[arch_curr_cpu_num()];
+                spin_lock_irqsave(&cpu->lock, state);
+                *obj_link(cache, chain_tail) = cpu->free;
+                cpu->free = chain;
+                cpu->count += count;
+                spin_unlock_irqrestore(&cpu->lock, state);
+            }
+            return obj;
+        }
+
+        /* out of objects, grow by a slab */
+        struct slab *slab = slab_create(cache);
+        if (!slab)
+            return NULL;
+
+        spin_lock_irqsave(&cache->lock, state);
+        list_add_head(&cache->empty, &slab->node);
+        cache->slab_count++;
+        cache->slab_free_count += cache->objs_per_slab;
+        spin_unlock_irqrestore(&cache->lock, state);
+    }
+}
+
+void *slab_alloc(slab_cache_t *cache)
+{
+    DEBUG_ASSERT(cache);
+
+    struct slab_cpu *cpu = &cache->cpu[arch_curr_cpu_num()];
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cpu->lock, state);
+    void *obj = cpu->free;
+    if (likely(obj)) {
+        cpu->free = *obj_link(cache, obj);
+        cpu->count--;
+    }
+    spin_unlock_irqrestore(&cpu->lock, state);
+
+    if (unlikely(!obj))
+        obj = slab_alloc_slow(cache);
+
+    LTRACEF("cache %s, obj %p\n", cache->name, obj);
+
+    return obj;
+}
+
+void slab_free(slab_cache_t *cache, void *obj)
+{
+    LTRACEF("cache %s, obj %p\n", cache->name, obj);
+
+    DEBUG_ASSERT(cache);
+    DEBUG_ASSERT(obj);
+
+    struct slab_cpu *cpu = &cache->cpu[arch_curr_cpu_num()];
+    void *flush = NULL;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cpu->lock, state);
+    *obj_link(cache, obj) = cpu->free;
+    cpu->free = obj;
+    if (++cpu->count > SLAB_CPU_DEPTH) {
+        /* keep the most recently freed objects, which are likely still cache hot */
+        void *last = obj;
+        for (uint i = 1; i < SLAB_CPU_DEPTH - SLAB_CPU_BATCH; i++)
+            last = *obj_link(cache, last);
+        flush = *obj_link(cache, last);
+        *obj_link(cache, last) = NULL;
+        cpu->count = SLAB_CPU_DEPTH - SLAB_CPU_BATCH;
+    }
+    spin_unlock_irqrestore(&cpu->lock, state);
+
+    if (flush)
+        slab_release_chain(cache, flush);
+}
+
+#if LK_DEBUGLEVEL > 1
+#if WITH_LIB_CONSOLE
+
+#include <lib/console.h>
+
+static int cmd_slab(int argc, const cmd_args *argv);
+
+STATIC_COMMAND_START
+STATIC_COMMAND("slab", "slab allocator debug commands", &cmd_slab)
+STATIC_COMMAND_END(slab);
+
+static void slab_dump(void)
+{
+    printf("%-20s %6s %5s %6s %6s %8s %8s %8s %5s\n",
+           "name", "size", "pages", "objs", "slabs", "in use", "cpu", "free", "util");
+
+    mutex_acquire(&cache_list_lock);
+    slab_cache_t *cache;
+    list_for_every_entry(&cache_list, cache, slab_cache_t, node) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&cache->lock, state);
+        uint slabs = cache->slab_count;
+        uint slab_free = cache->slab_free_count;
+        spin_unlock_irqrestore(&cache->lock, state);
+
+        uint cpu_free = 0;
+        for (uint i = 0; i < SMP_MAX_CPUS; i++)
+            cpu_free += cache->cpu[i].count;
+
+        uint total = slabs * cache->objs_per_slab;
+        uint in_use = total - slab_free - MIN(cpu_free, total - slab_free);
+
+        printf("%-20s %6zu %5u %6u %6u %8u %8u %8u %4u%%\n",
+               cache->name, cache->size, cache->slab_pages, cache->objs_per_slab, slabs,
+               in_use, cpu_free, slab_free, total ? in_use * 100 / total : 0);
+    }
+    mutex_release(&cache_list_lock);
+}
+
+static int cmd_slab(int argc, const cmd_args *argv)
+{
+    if (argc < 2) {
+usage:
+        printf("usage:\n");
+        printf("\t%s info\n", argv[0].str);
+        printf("\t%s shrink\n", argv[0].str);
+        return -1;
+    }
+
+    if (strcmp(argv[1].str, "info") == 0) {
+        slab_dump();
+    } else if (strcmp(argv[1].str, "shrink") == 0) {
+        size_t pages = 0;
+        mutex_acquire(&cache_list_lock);
+        slab_cache_t *cache;
+        list_for_every_entry(&cache_list, cache, slab_cache_t, node) {
+            pages += slab_cache_shrink(cache);
+        }
+        mutex_release(&cache_list_lock);
+        printf("released %zu pages\n", pages);
+    } else {
+        printf("unrecognized command\n");
+        goto usage;
+    }
+
+    return 0;
+}
+
+#endif
+#endif
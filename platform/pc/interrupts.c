@@ -31,6 +31,7 @@
 #include <arch/ops.h>
 #include <arch/x86.h>
 #include <kernel/spinlock.h>
+#include <kernel/debug.h>
 #include "platform_p.h"
 #include <platform/pc.h>
 
@@ -213,6 +214,8 @@ enum handler_return platform_irq(x86_iframe_t *frame)
 
     DEBUG_ASSERT(vector >= 0x20);
 
+    KEVLOG_IRQ_ENTER(vector);
+
     // deliver the interrupt
     enum handler_return ret = INT_NO_RESCHEDULE;
 
@@ -222,6 +225,8 @@ enum handler_return platform_irq(x86_iframe_t *frame)
     // ack the interrupt
     issueEOI(vector);
 
+    KEVLOG_IRQ_EXIT(vector);
+
     return ret;
 }
 
@@ -348,14 +348,14 @@ status_t stm32_eth_send_minip_pkt(pktbuf_t *p)
 
     DEBUG_ASSERT(p && p->dlen);
 
-    if (!(p->flags & PKTBUF_FLAG_EOF)) {
-        /* can't handle multi part packets yet */
-        PANIC_UNIMPLEMENTED;
-
-        return ERR_NOT_IMPLEMENTED;
+    /* eth_send takes a single contiguous frame */
+    status_t err = pktbuf_linearize(p);
+    if (err < 0) {
+        pktbuf_free(p, true);
+        return err;
     }
 
-    status_t err = eth_send(p->data, p->dlen);
+    err = eth_send(p->data, p->dlen);
 
     pktbuf_free(p, true);
 
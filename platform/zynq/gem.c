@@ -196,10 +196,16 @@ int gem_send_raw_pkt(struct pktbuf *p)
         goto err;
     }
 
+    /* multi part packets get copied into their first part, parts going to
+     * separate descriptors would race with the hardware */
+    if (p->next) {
+        ret = pktbuf_linearize(p);
+        if (ret < 0)
+            goto err;
+    }
+
     /* make sure the output buffer is fully written to memory before
      * placing on the outgoing list. */
-
-    // XXX handle multi part buffers
     arch_clean_cache_range((vaddr_t)p->data, p->dlen);
 
     spin_lock_saved_state_t irqstate;
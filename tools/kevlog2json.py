@@ -0,0 +1,183 @@
+#!/usr/bin/env python
+# vim: set expandtab ts=4 sw=4 tw=100:
+#
+# Convert a kernel event log export (see kernel_evlog_export() in include/kernel/debug.h)
+# into the Chrome trace event JSON format, loadable by chrome://tracing or Perfetto.
+#
+# The input is either the raw binary stream, as served by app/inetsrv on port 5555:
+#   nc <target> 5555 > trace.bin
+# or a console capture containing the output of 'kevlog export'.
+
+import json
+import struct
+import sys
+from optparse import OptionParser
+
+MAGIC = 0x4c56454b
+VERSION = 1
+
+EV_CONTEXT_SWITCH = 1
+EV_PREEMPT = 2
+EV_TIMER_TICK = 3
+EV_TIMER_CALL = 4
+EV_IRQ_ENTER = 5
+EV_IRQ_EXIT = 6
+EV_MUTEX_WAIT = 7
+EV_MUTEX_ACQUIRE = 8
+EV_BIO_SUBMIT = 9
+EV_BIO_COMPLETE = 10
+
+# trace viewer process ids for the two groups of tracks
+PID_CPU = 0
+PID_THREAD = 1
+
+
+def extract_binary(data):
+    """Return the binary export, decoding a hex console capture if that is what was given."""
+    begin = data.find(b"KEVLOG BEGIN")
+    if begin < 0:
+        return data
+    end = data.find(b"KEVLOG END", begin)
+    if end < 0:
+        end = len(data)
+    out = bytearray()
+    for line in data[begin:end].splitlines()[1:]:
+        line = line.strip()
+        try:
+            out += bytearray.fromhex(line.decode("ascii"))
+        except ValueError:
+            # interleaved console noise
+            pass
+    return bytes(out)
+
+
+def parse(data):
+    for endian in ("<", ">"):
+        magic, version, word_size, cpu_count, thread_count = struct.unpack_from(endian + "IHBBI", data)
+        if magic == MAGIC:
+            break
+    else:
+        raise ValueError("bad magic, not a kernel event log export")
+    if version != VERSION:
+        raise ValueError("unsupported export version %d" % version)
+
+    offset = 12
+    threads = {}
+    for i in range(thread_count):
+        ptr, name = struct.unpack_from(endian + "Q32s", data, offset)
+        threads[ptr] = name.split(b"\0")[0].decode("ascii", "replace")
+        offset += 40
+
+    word = endian + ("Q" if word_size == 8 else "I")
+    rec_fmt = endian + (word[1] * 4)
+    rec_len = word_size * 4
+    records = []
+    while offset + rec_len <= len(data):
+        records.append(struct.unpack_from(rec_fmt, data, offset))
+        offset += rec_len
+
+    return word_size, cpu_count, threads, records
+
+
+def signed(val, word_size):
+    bits = word_size * 8
+    if val & (1 << (bits - 1)):
+        return val - (1 << bits)
+    return val
+
+
+def convert(word_size, cpu_count, threads, records):
+    events = []
+    tids = {}
+
+    def thread_tid(ptr):
+        if ptr not in tids:
+            tids[ptr] = len(tids) + 1
+            name = threads.get(ptr, "thread %#x" % ptr)
+            events.append({"ph": "M", "name": "thread_name", "pid": PID_THREAD, "tid": tids[ptr],
+                           "args": {"name": name}})
+        return tids[ptr]
+
+    events.append({"ph": "M", "name": "process_name", "pid": PID_CPU, "args": {"name": "cpus"}})
+    events.append({"ph": "M", "name": "process_name", "pid": PID_THREAD, "args": {"name": "threads"}})
+    for cpu in range(cpu_count):
+        events.append({"ph": "M", "name": "thread_name", "pid": PID_CPU, "tid": cpu,
+                       "args": {"name": "cpu %d" % cpu}})
+
+    # the rings are exported per cpu, merge them into one timeline
+    records.sort(key=lambda r: r[0])
+
+    running = {}        # cpu -> (thread, start)
+    mutex_wait = {}     # cpu -> (thread, mutex, holder, start)
+    for ts, idword, arg0, arg1 in records:
+        cpu = idword >> 16
+        ev = idword & 0xffff
+
+        if ev == EV_CONTEXT_SWITCH:
+            if cpu in running:
+                thread, start = running[cpu]
+                events.append({"ph": "X", "name": threads.get(thread, "%#x" % thread), "cat": "sched",
+                               "pid": PID_CPU, "tid": cpu, "ts": start, "dur": ts - start})
+            running[cpu] = (arg1, ts)
+            thread_tid(arg1)
+        elif ev == EV_PREEMPT:
+            events.append({"ph": "i", "s": "t", "name": "preempt", "cat": "sched",
+                           "pid": PID_CPU, "tid": cpu, "ts": ts})
+        elif ev == EV_TIMER_TICK:
+            events.append({"ph": "i", "s": "t", "name": "tick", "cat": "timer",
+                           "pid": PID_CPU, "tid": cpu, "ts": ts})
+        elif ev == EV_TIMER_CALL:
+            events.append({"ph": "i", "s": "t", "name": "timer %#x" % arg0, "cat": "timer",
+                           "pid": PID_CPU, "tid": cpu, "ts": ts, "args": {"arg": "%#x" % arg1}})
+        elif ev == EV_IRQ_ENTER:
+            events.append({"ph": "B", "name": "irq %d" % arg0, "cat": "irq",
+                           "pid": PID_CPU, "tid": cpu, "ts": ts})
+        elif ev == EV_IRQ_EXIT:
+            events.append({"ph": "E", "name": "irq %d" % arg0, "cat": "irq",
+                           "pid": PID_CPU, "tid": cpu, "ts": ts})
+        elif ev == EV_MUTEX_WAIT:
+            thread = running.get(cpu, (0, 0))[0]
+            mutex_wait[cpu] = (thread, arg0, arg1, ts)
+        elif ev == EV_MUTEX_ACQUIRE:
+            # the waiter may have migrated, find it by mutex
+            for wcpu, (thread, mutex, holder, start) in list(mutex_wait.items()):
+                if mutex == arg0:
+                    events.append({"ph": "X", "name": "mutex wait", "cat": "mutex",
+                                   "pid": PID_THREAD, "tid": thread_tid(thread), "ts": start,
+                                   "dur": ts - start,
+                                   "args": {"mutex": "%#x" % mutex, "holder": threads.get(holder, "%#x" % holder),
+                                            "err": signed(arg1, word_size)}})
+                    del mutex_wait[wcpu]
+                    break
+        elif ev == EV_BIO_SUBMIT:
+            events.append({"ph": "b", "name": "bio", "cat": "bio", "id": "%#x" % arg0,
+                           "pid": PID_CPU, "tid": cpu, "ts": ts, "args": {"block": arg1}})
+        elif ev == EV_BIO_COMPLETE:
+            events.append({"ph": "e", "name": "bio", "cat": "bio", "id": "%#x" % arg0,
+                           "pid": PID_CPU, "tid": cpu, "ts": ts, "args": {"result": signed(arg1, word_size)}})
+
+    return {"traceEvents": events}
+
+
+def main():
+    parser = OptionParser(usage="usage: %prog [options] <export file>")
+    parser.add_option("-o", "--output", dest="output", help="write the json here instead of stdout")
+    (options, args) = parser.parse_args()
+
+    if len(args) != 1:
+        parser.error("need exactly one input file")
+
+    with open(args[0], "rb") as f:
+        data = extract_binary(f.read())
+
+    trace = convert(*parse(data))
+
+    if options.output:
+        with open(options.output, "w") as f:
+            json.dump(trace, f)
+    else:
+        json.dump(trace, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()